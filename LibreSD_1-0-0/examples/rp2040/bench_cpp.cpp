@@ -0,0 +1,196 @@
+/**
+ * @file bench_cpp.cpp
+ * @brief C vs C++ wrapper benchmark for RP2040
+ *
+ * Runs the same write/read/list workload through the C API and through
+ * libresd.hpp, and prints the time for each. The wrapper is expected to
+ * be within measurement noise of the C path.
+ *
+ * Wiring and build are the same as the demo (see main.c / CMakeLists.txt).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+
+#include "libresd.hpp"
+
+extern "C" void libresd_hal_rp2040_init(void);
+
+/*============================================================================
+ * CONFIGURATION
+ *============================================================================*/
+
+#define SD_FAST_SPEED_HZ    (12 * 1000 * 1000)
+#define BENCH_FILE_SIZE     (256 * 1024)
+#define BENCH_CHUNK         512
+#define BENCH_ROUNDS        3
+
+static libresd_sd_t sd;
+static uint8_t chunk[BENCH_CHUNK];
+
+/*============================================================================
+ * C API WORKLOAD
+ *============================================================================*/
+
+static uint64_t bench_c_write(libresd_fat_t *fat) {
+    libresd_file_t file;
+    uint64_t start = time_us_64();
+
+    if (libresd_fat_open(fat, &file, "/bench_c.bin",
+                         LIBRESD_WRITE | LIBRESD_CREATE | LIBRESD_TRUNCATE) != LIBRESD_OK) {
+        return 0;
+    }
+    for (uint32_t done = 0; done < BENCH_FILE_SIZE; done += BENCH_CHUNK) {
+        libresd_fat_write(fat, &file, chunk, BENCH_CHUNK, NULL);
+    }
+    libresd_fat_close(fat, &file);
+
+    return time_us_64() - start;
+}
+
+static uint64_t bench_c_read(libresd_fat_t *fat) {
+    libresd_file_t file;
+    uint32_t n;
+    uint64_t start = time_us_64();
+
+    if (libresd_fat_open(fat, &file, "/bench_c.bin", LIBRESD_READ) != LIBRESD_OK) {
+        return 0;
+    }
+    while (libresd_fat_read(fat, &file, chunk, BENCH_CHUNK, &n) == LIBRESD_OK && n > 0) {
+    }
+    libresd_fat_close(fat, &file);
+
+    return time_us_64() - start;
+}
+
+static uint64_t bench_c_list(libresd_fat_t *fat, uint32_t *count) {
+    libresd_dir_t dir;
+    libresd_fileinfo_t info;
+    uint64_t start = time_us_64();
+
+    *count = 0;
+    if (libresd_fat_opendir(fat, &dir, "/") != LIBRESD_OK) return 0;
+    while (libresd_fat_readdir(fat, &dir, &info) == LIBRESD_OK) {
+        (*count)++;
+    }
+    libresd_fat_closedir(&dir);
+
+    return time_us_64() - start;
+}
+
+/*============================================================================
+ * C++ WRAPPER WORKLOAD
+ *============================================================================*/
+
+static uint64_t bench_cpp_write(libresd::Volume &vol) {
+    uint64_t start = time_us_64();
+    {
+        libresd::File file;
+        if (file.open(vol, "/bench_cp.bin",
+                      LIBRESD_WRITE | LIBRESD_CREATE | LIBRESD_TRUNCATE) != LIBRESD_OK) {
+            return 0;
+        }
+        for (uint32_t done = 0; done < BENCH_FILE_SIZE; done += BENCH_CHUNK) {
+            file.write(libresd::span<const uint8_t>(chunk));
+        }
+    }
+    return time_us_64() - start;
+}
+
+static uint64_t bench_cpp_read(libresd::Volume &vol) {
+    uint32_t n;
+    uint64_t start = time_us_64();
+    {
+        libresd::File file;
+        if (file.open(vol, "/bench_cp.bin") != LIBRESD_OK) return 0;
+        while (file.read(libresd::span<uint8_t>(chunk), &n) == LIBRESD_OK && n > 0) {
+        }
+    }
+    return time_us_64() - start;
+}
+
+static uint64_t bench_cpp_list(libresd::Volume &vol, uint32_t *count) {
+    uint64_t start = time_us_64();
+
+    *count = 0;
+    libresd::Dir dir;
+    if (dir.open(vol, "/") != LIBRESD_OK) return 0;
+    for (const libresd_fileinfo_t &e : dir) {
+        (void)e;
+        (*count)++;
+    }
+
+    return time_us_64() - start;
+}
+
+/*============================================================================
+ * MAIN
+ *============================================================================*/
+
+static void report(const char *what, uint64_t c_us, uint64_t cpp_us, uint32_t bytes) {
+    long delta = (long)cpp_us - (long)c_us;
+    if (bytes) {
+        printf("%-6s  C %8llu us (%5lu KB/s)   C++ %8llu us (%5lu KB/s)   delta %+ld us\n",
+               what, c_us, c_us ? (unsigned long)(bytes * 1000ULL / c_us) : 0UL,
+               cpp_us, cpp_us ? (unsigned long)(bytes * 1000ULL / cpp_us) : 0UL, delta);
+    } else {
+        printf("%-6s  C %8llu us                C++ %8llu us                delta %+ld us\n",
+               what, c_us, cpp_us, delta);
+    }
+}
+
+int main(void) {
+    stdio_init_all();
+    sleep_ms(2000);
+
+    printf("\n=== LibreSD C vs C++ Benchmark ===\n");
+    printf("Version: %s\n", libresd_version());
+    printf("sizeof: fat_t %u / Volume %u, file_t %u / File %u, dir_t %u / Dir %u\n\n",
+           (unsigned)sizeof(libresd_fat_t), (unsigned)sizeof(libresd::Volume),
+           (unsigned)sizeof(libresd_file_t), (unsigned)sizeof(libresd::File),
+           (unsigned)sizeof(libresd_dir_t), (unsigned)sizeof(libresd::Dir));
+
+    libresd_hal_rp2040_init();
+    if (libresd_sd_init(&sd, SD_FAST_SPEED_HZ) != LIBRESD_OK) {
+        printf("SD init failed\n");
+        while (1) tight_loop_contents();
+    }
+
+    for (uint32_t i = 0; i < BENCH_CHUNK; i++) {
+        chunk[i] = (uint8_t)i;
+    }
+
+    /* The wrapper owns the volume; the C path uses the same state */
+    libresd::Volume vol;
+    if (vol.mount(sd) != LIBRESD_OK) {
+        printf("Mount failed\n");
+        while (1) tight_loop_contents();
+    }
+    libresd_fat_t *fat = vol.native();
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint32_t c_count, cpp_count;
+
+        printf("Round %d (%u KB, %u-byte chunks)\n", round + 1,
+               BENCH_FILE_SIZE / 1024, BENCH_CHUNK);
+
+        uint64_t cw = bench_c_write(fat);
+        uint64_t pw = bench_cpp_write(vol);
+        report("write", cw, pw, BENCH_FILE_SIZE);
+
+        uint64_t cr = bench_c_read(fat);
+        uint64_t pr = bench_cpp_read(vol);
+        report("read", cr, pr, BENCH_FILE_SIZE);
+
+        uint64_t cl = bench_c_list(fat, &c_count);
+        uint64_t pl = bench_cpp_list(vol, &cpp_count);
+        report("list", cl, pl, 0);
+        printf("        (%lu / %lu entries)\n\n", (unsigned long)c_count, (unsigned long)cpp_count);
+    }
+
+    vol.unmount();
+    printf("Done.\n");
+
+    while (1) tight_loop_contents();
+}
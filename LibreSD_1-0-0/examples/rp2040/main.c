@@ -66,7 +66,7 @@ static bool init_sd(void) {
         return false;
     }
     
-    printf("Card type: %s\n", libresd_sd_type_str(sd.card_type));
+    printf("Card type: %s\n", libresd_sd_type_str(sd.type));
     printf("Capacity: %llu MB\n", sd.capacity / (1024 * 1024));
     
     /* Mount filesystem */
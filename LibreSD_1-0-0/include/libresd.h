@@ -93,6 +93,46 @@
 #include "libresd_shell.h"
 #endif
 
+/* POSIX descriptor layer for newlib/picolibc stdio */
+#if LIBRESD_ENABLE_STDIO
+#include "libresd_stdio.h"
+#endif
+
+/* Fixed-capacity circular log files */
+#if LIBRESD_ENABLE_RINGFILE
+#include "libresd_ringfile.h"
+#endif
+
+/* Time-indexed append logs */
+#if LIBRESD_ENABLE_TLOG
+#include "libresd_tlog.h"
+#endif
+
+/* Packed key-value store */
+#if LIBRESD_ENABLE_KV
+#include "libresd_kv.h"
+#endif
+
+/* Compressed stream files */
+#if LIBRESD_ENABLE_ZFILE
+#include "libresd_zfile.h"
+#endif
+
+/* Persisted mount state */
+#if LIBRESD_ENABLE_ACCEL
+#include "libresd_accel.h"
+#endif
+
+/* Prioritised I/O scheduler */
+#if LIBRESD_ENABLE_SCHED
+#include "libresd_sched.h"
+#endif
+
+/* Pre-created segment files */
+#if LIBRESD_ENABLE_SEGPOOL && LIBRESD_ENABLE_WRITE
+#include "libresd_segpool.h"
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
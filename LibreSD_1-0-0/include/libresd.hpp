@@ -0,0 +1,526 @@
+/**
+ * @file libresd.hpp
+ * @brief LibreSD C++17 Wrapper (header-only)
+ *
+ * Thin RAII layer over the C API for C++ firmware:
+ *   - Move-only Volume, File and Dir handles that sync/close on destruction
+ *   - span-based read/write (std::span when available, minimal fallback otherwise)
+ *   - Range-for directory iteration without copying entries
+ *   - constexpr geometry traits so sector/cluster math folds at compile time
+ *
+ * No exceptions, no heap. Every call is inline and forwards directly to
+ * the C function, so the generated code matches hand-written C.
+ *
+ * Example:
+ *
+ *   libresd::Volume vol;
+ *   if (vol.mount(sd) != LIBRESD_OK) return;
+ *
+ *   libresd::File f;
+ *   if (f.open(vol, "/log.bin", LIBRESD_WRITE | LIBRESD_CREATE) == LIBRESD_OK) {
+ *       uint8_t data[64] = {0};
+ *       f.write(libresd::span<const uint8_t>(data));
+ *   }                                   // closed and synced here
+ *
+ *   libresd::Dir d;
+ *   if (d.open(vol, "/") == LIBRESD_OK) {
+ *       for (const libresd_fileinfo_t &e : d) {
+ *           printf("%s\n", e.name);
+ *       }
+ *   }
+ */
+
+#ifndef LIBRESD_HPP
+#define LIBRESD_HPP
+
+#include "libresd.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#if defined(__has_include)
+#if __has_include(<span>) && __cplusplus > 201703L
+#include <span>
+#endif
+#endif
+
+namespace libresd {
+
+/*============================================================================
+ * SPAN
+ *============================================================================*/
+
+#if defined(__cpp_lib_span)
+
+template <typename T>
+using span = std::span<T>;
+
+#else
+
+/**
+ * @brief Minimal C++17 stand-in for std::span
+ *
+ * Only what read/write need: pointer + length, built from arrays,
+ * pointer/size pairs and containers exposing data()/size().
+ */
+template <typename T>
+class span {
+public:
+    using element_type = T;
+    using size_type = std::size_t;
+
+    constexpr span() noexcept : ptr_(nullptr), len_(0) {}
+    constexpr span(T *ptr, size_type len) noexcept : ptr_(ptr), len_(len) {}
+
+    template <std::size_t N>
+    constexpr span(T (&arr)[N]) noexcept : ptr_(arr), len_(N) {}
+
+    template <typename C,
+              typename = decltype(std::declval<C &>().data()),
+              typename = decltype(std::declval<C &>().size())>
+    constexpr span(C &c) noexcept : ptr_(c.data()), len_(c.size()) {}
+
+    template <typename U,
+              typename = std::enable_if_t<std::is_convertible<U (*)[], T (*)[]>::value>>
+    constexpr span(const span<U> &other) noexcept : ptr_(other.data()), len_(other.size()) {}
+
+    constexpr T *data() const noexcept { return ptr_; }
+    constexpr size_type size() const noexcept { return len_; }
+    constexpr size_type size_bytes() const noexcept { return len_ * sizeof(T); }
+    constexpr bool empty() const noexcept { return len_ == 0; }
+    constexpr T *begin() const noexcept { return ptr_; }
+    constexpr T *end() const noexcept { return ptr_ + len_; }
+    constexpr T &operator[](size_type i) const noexcept { return ptr_[i]; }
+
+    constexpr span first(size_type n) const noexcept { return span(ptr_, n); }
+    constexpr span subspan(size_type off) const noexcept { return span(ptr_ + off, len_ - off); }
+
+private:
+    T *ptr_;
+    size_type len_;
+};
+
+#endif
+
+/*============================================================================
+ * GEOMETRY TRAITS
+ *============================================================================*/
+
+namespace detail {
+
+constexpr bool is_pow2(uint32_t v) { return v != 0 && (v & (v - 1)) == 0; }
+
+constexpr uint32_t log2(uint32_t v) { return (v <= 1) ? 0 : 1 + log2(v >> 1); }
+
+} // namespace detail
+
+/**
+ * @brief Compile-time volume geometry
+ *
+ * SectorSize is fixed by the build and is the unit of the sector helpers.
+ * SectorsPerCluster may be fixed for products that always format their
+ * cards the same way; it then counts logical sectors as in the boot
+ * sector, and the volume must have SectorSize logical sectors. Leave it
+ * at 0 to take the cluster size from the mounted volume at run time, with
+ * any logical sector size the library mounts (512-4096).
+ *
+ * When a value is a compile-time power of two, divisions and modulos
+ * become shifts and masks.
+ */
+template <uint32_t SectorSize = LIBRESD_SECTOR_SIZE, uint32_t SectorsPerCluster = 0>
+struct geometry {
+    static_assert(detail::is_pow2(SectorSize), "Sector size must be a power of two");
+    static_assert(SectorsPerCluster == 0 || detail::is_pow2(SectorsPerCluster),
+                  "Sectors per cluster must be a power of two");
+
+    static constexpr uint32_t sector_size = SectorSize;
+    static constexpr uint32_t sector_shift = detail::log2(SectorSize);
+    static constexpr uint32_t sectors_per_cluster = SectorsPerCluster;
+    static constexpr bool fixed_cluster = SectorsPerCluster != 0;
+    static constexpr uint32_t cluster_size = SectorSize * SectorsPerCluster;
+
+    static constexpr uint32_t sector_of(uint32_t pos) { return pos >> sector_shift; }
+    static constexpr uint32_t sector_offset(uint32_t pos) { return pos & (SectorSize - 1); }
+    static constexpr uint32_t sectors_for(uint32_t bytes) {
+        return (bytes + SectorSize - 1) >> sector_shift;
+    }
+    static constexpr bool sector_aligned(uint32_t pos) { return sector_offset(pos) == 0; }
+
+    /** Cluster size in bytes (constant when fixed, else from the volume) */
+    static constexpr uint32_t cluster_bytes(const libresd_fat_t &fat) {
+        return fixed_cluster ? cluster_size : fat.cluster_size;
+    }
+
+    static constexpr uint32_t cluster_of(const libresd_fat_t &fat, uint32_t pos) {
+        return fixed_cluster ? (pos >> detail::log2(cluster_size)) : pos / fat.cluster_size;
+    }
+
+    static constexpr uint32_t cluster_offset(const libresd_fat_t &fat, uint32_t pos) {
+        return fixed_cluster ? (pos & (cluster_size - 1)) : pos % fat.cluster_size;
+    }
+
+    static constexpr uint32_t clusters_for(const libresd_fat_t &fat, uint32_t bytes) {
+        return fixed_cluster ? ((bytes + cluster_size - 1) >> detail::log2(cluster_size))
+                             : (bytes + fat.cluster_size - 1) / fat.cluster_size;
+    }
+
+    /** Check a mounted volume against the compile-time assumptions (the
+     *  library keeps sectors_per_cluster in 512-byte card blocks) */
+    static constexpr bool matches(const libresd_fat_t &fat) {
+        return !fixed_cluster ||
+               (fat.bytes_per_sector == SectorSize &&
+                fat.sectors_per_cluster / fat.sector_blocks == SectorsPerCluster);
+    }
+};
+
+using default_geometry = geometry<>;
+
+/*============================================================================
+ * VOLUME
+ *============================================================================*/
+
+/**
+ * @brief Mounted FAT volume (move-only)
+ *
+ * Unmounts (flushing the FAT) on destruction.
+ */
+template <typename Geometry = default_geometry>
+class basic_volume {
+public:
+    using geometry_type = Geometry;
+
+    basic_volume() noexcept { fat_.mounted = false; }
+    ~basic_volume() { unmount(); }
+
+    basic_volume(const basic_volume &) = delete;
+    basic_volume &operator=(const basic_volume &) = delete;
+
+    /* Files and directories keep a pointer to the volume state, so moving
+     * a mounted volume would leave them dangling. A mounted source stays
+     * mounted where it is and the new volume starts out unmounted. */
+    basic_volume(basic_volume &&other) noexcept {
+        fat_.mounted = false;
+        if (!other.fat_.mounted) fat_ = other.fat_;
+    }
+
+    /**
+     * @brief Mount the filesystem on an initialized card
+     *
+     * Fails with LIBRESD_ERR_INVALID_FS if the volume does not match
+     * the compile-time geometry.
+     */
+    libresd_err_t mount(libresd_sd_t &sd) noexcept {
+        unmount();
+        libresd_err_t err = libresd_fat_mount(&fat_, &sd);
+        if (err != LIBRESD_OK) return err;
+        if (!Geometry::matches(fat_)) {
+            libresd_fat_unmount(&fat_);
+            return LIBRESD_ERR_INVALID_FS;
+        }
+        return LIBRESD_OK;
+    }
+
+    libresd_err_t unmount() noexcept {
+        if (!fat_.mounted) return LIBRESD_OK;
+        return libresd_fat_unmount(&fat_);
+    }
+
+    libresd_err_t sync() noexcept { return libresd_fat_sync(&fat_); }
+
+    bool mounted() const noexcept { return fat_.mounted; }
+    explicit operator bool() const noexcept { return fat_.mounted; }
+
+    libresd_err_t stat(const char *path, libresd_fileinfo_t &info) noexcept {
+        return libresd_fat_stat(&fat_, path, &info);
+    }
+
+    bool exists(const char *path) noexcept { return libresd_fat_exists(&fat_, path); }
+
+    libresd_err_t chdir(const char *path) noexcept { return libresd_fat_chdir(&fat_, path); }
+
+#if LIBRESD_ENABLE_WRITE
+    libresd_err_t unlink(const char *path) noexcept { return libresd_fat_unlink(&fat_, path); }
+
+    libresd_err_t rename(const char *from, const char *to) noexcept {
+        return libresd_fat_rename(&fat_, from, to);
+    }
+
+#if LIBRESD_ENABLE_DIRS
+    libresd_err_t mkdir(const char *path) noexcept { return libresd_fat_mkdir(&fat_, path); }
+    libresd_err_t rmdir(const char *path) noexcept { return libresd_fat_rmdir(&fat_, path); }
+#endif
+#endif
+
+    uint32_t cluster_size() const noexcept { return Geometry::cluster_bytes(fat_); }
+
+    /** Access to the C state for calls not wrapped here */
+    libresd_fat_t *native() noexcept { return &fat_; }
+    const libresd_fat_t *native() const noexcept { return &fat_; }
+
+private:
+    libresd_fat_t fat_;
+};
+
+/*============================================================================
+ * FILE
+ *============================================================================*/
+
+/**
+ * @brief Open file (move-only)
+ *
+ * Closes on destruction, which flushes the sector buffer and
+ * updates the directory entry for files opened for writing.
+ */
+template <typename Geometry = default_geometry>
+class basic_file {
+public:
+    using volume_type = basic_volume<Geometry>;
+
+    basic_file() noexcept : fat_(nullptr) { file_.is_open = false; }
+    ~basic_file() { close(); }
+
+    basic_file(const basic_file &) = delete;
+    basic_file &operator=(const basic_file &) = delete;
+
+    basic_file(basic_file &&other) noexcept : fat_(other.fat_), file_(other.file_) {
+        other.file_.is_open = false;
+    }
+
+    basic_file &operator=(basic_file &&other) noexcept {
+        if (this != &other) {
+            close();
+            fat_ = other.fat_;
+            file_ = other.file_;
+            other.file_.is_open = false;
+        }
+        return *this;
+    }
+
+    libresd_err_t open(volume_type &vol, const char *path, uint8_t mode = LIBRESD_READ) noexcept {
+        close();
+        fat_ = vol.native();
+        return libresd_fat_open(fat_, &file_, path, mode);
+    }
+
+    libresd_err_t close() noexcept {
+        if (!file_.is_open) return LIBRESD_OK;
+        return libresd_fat_close(fat_, &file_);
+    }
+
+    bool is_open() const noexcept { return file_.is_open; }
+    explicit operator bool() const noexcept { return file_.is_open; }
+
+    /**
+     * @brief Read into a span
+     * @param dst Destination bytes
+     * @param bytes_read Actual bytes read (optional)
+     */
+    libresd_err_t read(span<uint8_t> dst, uint32_t *bytes_read = nullptr) noexcept {
+        return libresd_fat_read(fat_, &file_, dst.data(), static_cast<uint32_t>(dst.size()),
+                                bytes_read);
+    }
+
+    /**
+     * @brief Read trivially-copyable objects (e.g. a record array)
+     */
+    template <typename T, typename = std::enable_if_t<std::is_trivially_copyable<T>::value &&
+                                                      !std::is_same<T, uint8_t>::value>>
+    libresd_err_t read(span<T> dst, uint32_t *bytes_read = nullptr) noexcept {
+        return libresd_fat_read(fat_, &file_, dst.data(),
+                                static_cast<uint32_t>(dst.size() * sizeof(T)), bytes_read);
+    }
+
+#if LIBRESD_ENABLE_WRITE
+    libresd_err_t write(span<const uint8_t> src, uint32_t *bytes_written = nullptr) noexcept {
+        return libresd_fat_write(fat_, &file_, src.data(), static_cast<uint32_t>(src.size()),
+                                 bytes_written);
+    }
+
+    template <typename T, typename = std::enable_if_t<std::is_trivially_copyable<T>::value &&
+                                                      !std::is_same<T, uint8_t>::value>>
+    libresd_err_t write(span<const T> src, uint32_t *bytes_written = nullptr) noexcept {
+        return libresd_fat_write(fat_, &file_, src.data(),
+                                 static_cast<uint32_t>(src.size() * sizeof(T)), bytes_written);
+    }
+
+    libresd_err_t flush() noexcept { return libresd_fat_flush(fat_, &file_); }
+    libresd_err_t checkpoint() noexcept { return libresd_fat_checkpoint(fat_, &file_); }
+    libresd_err_t truncate() noexcept { return libresd_fat_truncate(fat_, &file_); }
+#endif
+
+    libresd_err_t seek(int32_t offset, libresd_seek_t whence = LIBRESD_SEEK_SET) noexcept {
+        return libresd_fat_seek(fat_, &file_, offset, whence);
+    }
+
+    uint32_t tell() const noexcept { return libresd_fat_tell(&file_); }
+    uint32_t size() const noexcept { return file_.file_size; }
+    bool eof() const noexcept { return libresd_fat_eof(&file_); }
+
+#if LIBRESD_STREAM_BUFFER
+    /**
+     * @brief Attach a stream buffer (whole sectors) for line reads and printf
+     */
+    libresd_err_t setvbuf(span<uint8_t> buf) noexcept {
+        return libresd_fat_setvbuf(fat_, &file_, buf.data(), static_cast<uint32_t>(buf.size()));
+    }
+#endif
+
+#if LIBRESD_ENABLE_PRINTF && LIBRESD_ENABLE_WRITE
+    /**
+     * @brief Formatted write straight into the file buffer
+     */
+    template <typename... Args>
+    libresd_err_t printf(const char *fmt, Args... args) noexcept {
+        return libresd_fat_printf(fat_, &file_, fmt, args...);
+    }
+#endif
+
+#if LIBRESD_ENABLE_GETLINE
+    /**
+     * @brief Read one line into dst, NUL-terminated, line ending stripped
+     */
+    libresd_err_t getline(span<char> dst, uint32_t *len = nullptr) noexcept {
+        return libresd_fat_getline(fat_, &file_, dst.data(), static_cast<uint32_t>(dst.size()),
+                                   len);
+    }
+
+    /**
+     * @brief Zero-copy line view; valid until the next operation on this file
+     */
+    libresd_err_t getline_ref(span<const char> &line) noexcept {
+        const char *p = nullptr;
+        uint32_t n = 0;
+        libresd_err_t err = libresd_fat_getline_ref(fat_, &file_, &p, &n);
+        if (err == LIBRESD_OK) line = span<const char>(p, n);
+        return err;
+    }
+#endif
+
+    /* Geometry helpers - fold to shifts when the geometry is fixed */
+    uint32_t sector_offset() const noexcept { return Geometry::sector_offset(tell()); }
+    uint32_t cluster_index() const noexcept { return Geometry::cluster_of(*fat_, tell()); }
+    uint32_t size_in_clusters() const noexcept {
+        return Geometry::clusters_for(*fat_, file_.file_size);
+    }
+
+    libresd_file_t *native() noexcept { return &file_; }
+    const libresd_file_t *native() const noexcept { return &file_; }
+
+private:
+    libresd_fat_t *fat_;
+    libresd_file_t file_;
+};
+
+/*============================================================================
+ * DIRECTORY
+ *============================================================================*/
+
+/**
+ * @brief Open directory with range-for iteration (move-only)
+ *
+ * Entries are decoded into storage owned by the Dir; the iterator hands
+ * out references to it, so nothing is copied per step. A reference is
+ * only valid until the iterator advances.
+ */
+template <typename Geometry = default_geometry>
+class basic_dir {
+public:
+    using volume_type = basic_volume<Geometry>;
+
+    class iterator {
+    public:
+        using value_type = libresd_fileinfo_t;
+        using reference = const libresd_fileinfo_t &;
+        using pointer = const libresd_fileinfo_t *;
+        using difference_type = std::ptrdiff_t;
+        using iterator_category = std::input_iterator_tag;
+
+        iterator() noexcept : dir_(nullptr) {}
+        explicit iterator(basic_dir *dir) noexcept : dir_(dir) { advance(); }
+
+        reference operator*() const noexcept { return dir_->entry_; }
+        pointer operator->() const noexcept { return &dir_->entry_; }
+
+        iterator &operator++() noexcept {
+            advance();
+            return *this;
+        }
+
+        bool operator==(const iterator &o) const noexcept { return dir_ == o.dir_; }
+        bool operator!=(const iterator &o) const noexcept { return dir_ != o.dir_; }
+
+    private:
+        void advance() noexcept {
+            if (dir_ && libresd_fat_readdir(dir_->fat_, &dir_->dir_, &dir_->entry_) != LIBRESD_OK) {
+                dir_ = nullptr;
+            }
+        }
+
+        basic_dir *dir_;
+    };
+
+    basic_dir() noexcept : fat_(nullptr) { dir_.is_open = false; }
+    ~basic_dir() { close(); }
+
+    basic_dir(const basic_dir &) = delete;
+    basic_dir &operator=(const basic_dir &) = delete;
+
+    basic_dir(basic_dir &&other) noexcept : fat_(other.fat_), dir_(other.dir_) {
+        other.dir_.is_open = false;
+    }
+
+    basic_dir &operator=(basic_dir &&other) noexcept {
+        if (this != &other) {
+            close();
+            fat_ = other.fat_;
+            dir_ = other.dir_;
+            other.dir_.is_open = false;
+        }
+        return *this;
+    }
+
+    libresd_err_t open(volume_type &vol, const char *path = nullptr) noexcept {
+        close();
+        fat_ = vol.native();
+        return libresd_fat_opendir(fat_, &dir_, path);
+    }
+
+    void close() noexcept {
+        if (dir_.is_open) libresd_fat_closedir(&dir_);
+    }
+
+    bool is_open() const noexcept { return dir_.is_open; }
+    explicit operator bool() const noexcept { return dir_.is_open; }
+
+    /** Read the next entry; LIBRESD_ERR_EOF when done */
+    libresd_err_t next(libresd_fileinfo_t &info) noexcept {
+        return libresd_fat_readdir(fat_, &dir_, &info);
+    }
+
+    /**
+     * @brief Begin iteration
+     *
+     * Single pass: iteration continues from the handle's current
+     * position. Reopen the directory to start over.
+     */
+    iterator begin() noexcept { return iterator(dir_.is_open ? this : nullptr); }
+    iterator end() noexcept { return iterator(); }
+
+    libresd_dir_t *native() noexcept { return &dir_; }
+
+private:
+    libresd_fat_t *fat_;
+    libresd_dir_t dir_;
+    libresd_fileinfo_t entry_;
+};
+
+using Volume = basic_volume<>;
+using File = basic_file<>;
+using Dir = basic_dir<>;
+
+} // namespace libresd
+
+#endif /* LIBRESD_HPP */
@@ -0,0 +1,88 @@
+/**
+ * @file libresd_accel.h
+ * @brief LibreSD persisted mount state
+ *
+ * A fresh mount knows nothing about the volume: the free cluster count
+ * takes a scan of the whole FAT (tens of thousands of sector reads on a
+ * large card), the allocator starts searching from cluster 2, and a
+ * metadata snapshot has to read every directory again.
+ *
+ * libresd_accel_save() writes that state to a hidden system file just
+ * before unmount; libresd_accel_load() brings it back after the next mount
+ * with one header read and one multi-block read per file extent:
+ *
+ *   sector 0    header: volume identity, generation, free count, hint
+ *   sector 1..  snapshot table, as libresd_fat_snapshot() built it
+ *
+ * The state is only trusted if all of these hold:
+ *
+ *   - volume serial, cluster count and FAT size match
+ *   - the generation matches: a hash of the FSInfo sector, the first root
+ *     directory sector and LIBRESD_ACCEL_SAMPLES FAT sectors spread over
+ *     the table, so a volume written by another host is rejected
+ *   - the dirty flag is clear: load sets it on the card, save clears it,
+ *     so a session that ended in a reset is never replayed
+ *
+ * The file data is addressed through its sector runs, so neither load nor
+ * save touches the FAT or the directory once the file exists.
+ */
+
+#ifndef LIBRESD_ACCEL_H
+#define LIBRESD_ACCEL_H
+
+#include "libresd_fat.h"
+
+#if LIBRESD_ENABLE_ACCEL && LIBRESD_ENABLE_WRITE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*============================================================================
+ * PERSISTED MOUNT STATE
+ *============================================================================*/
+
+/**
+ * @brief Restore the state saved at the last clean unmount
+ *
+ * Call right after mounting, before anything is written. Creates the
+ * state file (LIBRESD_ACCEL_RESERVE bytes) if there is none, so a
+ * snapshot taken afterwards already lists it.
+ *
+ * A saved snapshot is adopted if it fits in buf; otherwise only the free
+ * count and allocation hint are restored. buf must then stay untouched
+ * until unmount, as with libresd_fat_snapshot().
+ *
+ * @param fat Mounted FAT volume
+ * @param path State file (NULL = LIBRESD_ACCEL_PATH)
+ * @param buf Snapshot table memory (can be NULL)
+ * @param size Size of buf in bytes
+ * @return LIBRESD_OK if the state was restored, LIBRESD_ERR_NOT_FOUND if
+ *         there was nothing valid to restore (rebuild it), or error
+ */
+libresd_err_t libresd_accel_load(libresd_fat_t *fat, const char *path,
+                                  void *buf, uint32_t size);
+
+/**
+ * @brief Save the mount state, to be called just before unmount
+ *
+ * Commits the FAT, then writes the snapshot table (if one is active and
+ * no directory went stale) and finally the header. If the table no longer
+ * fits, the file is grown; since that changes the root directory, the
+ * table is then saved from the next session on.
+ *
+ * The volume must not be written between save and unmount.
+ *
+ * @param fat Mounted FAT volume
+ * @param path State file (NULL = LIBRESD_ACCEL_PATH)
+ * @return LIBRESD_OK, LIBRESD_ERR_FULL, or error
+ */
+libresd_err_t libresd_accel_save(libresd_fat_t *fat, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRESD_ENABLE_ACCEL && LIBRESD_ENABLE_WRITE */
+
+#endif /* LIBRESD_ACCEL_H */
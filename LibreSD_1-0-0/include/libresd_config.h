@@ -20,13 +20,26 @@ extern "C" {
  *============================================================================*/
 
 /**
- * @brief Sector buffer size (must be 512 for SD cards)
- * Don't change unless you know what you're doing
+ * @brief Card block and file buffer size (must be 512 for SD cards)
+ * Don't change unless you know what you're doing. Volumes with larger
+ * logical sectors are described by LIBRESD_MAX_SECTOR_SIZE.
  */
 #ifndef LIBRESD_SECTOR_SIZE
 #define LIBRESD_SECTOR_SIZE         512
 #endif
 
+/**
+ * @brief Largest logical sector the FAT cache holds whole (512-4096)
+ * 
+ * Volumes formatted with 1K-4K logical sectors (host images, eMMC, USB
+ * media) mount at any setting; raising this to their sector size lets one
+ * multi-block read fill the FAT cache with a whole sector of entries.
+ * Costs this many bytes in every libresd_fat_t.
+ */
+#ifndef LIBRESD_MAX_SECTOR_SIZE
+#define LIBRESD_MAX_SECTOR_SIZE     512
+#endif
+
 /**
  * @brief Maximum path length for file operations
  * Reduce to save RAM on tiny MCUs
@@ -42,6 +55,13 @@ extern "C" {
 #define LIBRESD_MAX_FILENAME        128
 #endif
 
+/**
+ * @brief Maximum length of a compiled name pattern (libresd_fat_glob_t)
+ */
+#ifndef LIBRESD_MAX_GLOB
+#define LIBRESD_MAX_GLOB            32
+#endif
+
 /**
  * @brief Maximum open files simultaneously
  * Each open file uses ~32 bytes + sector buffer if buffered
@@ -74,6 +94,257 @@ extern "C" {
 #define LIBRESD_ENABLE_FORMAT       1
 #endif
 
+/**
+ * @brief Enable buffered line reader (libresd_fat_getline)
+ * Adds 20 bytes to each file handle (shared with printf)
+ */
+#ifndef LIBRESD_ENABLE_GETLINE
+#define LIBRESD_ENABLE_GETLINE      0
+#endif
+
+/**
+ * @brief Enable formatted writer (libresd_fat_printf, checkpoint)
+ * Needs LIBRESD_ENABLE_WRITE; adds ~1.5KB flash
+ */
+#ifndef LIBRESD_ENABLE_PRINTF
+#define LIBRESD_ENABLE_PRINTF       0
+#endif
+
+/* Caller-attached stream buffers (libresd_fat_setvbuf) back both of the above */
+#define LIBRESD_STREAM_BUFFER       (LIBRESD_ENABLE_GETLINE || \
+                                     (LIBRESD_ENABLE_PRINTF && LIBRESD_ENABLE_WRITE))
+
+/**
+ * @brief Enable fixed-size circular log files (libresd_ringfile_*)
+ * Needs LIBRESD_ENABLE_WRITE; each open ring holds a ~560 byte handle
+ */
+#ifndef LIBRESD_ENABLE_RINGFILE
+#define LIBRESD_ENABLE_RINGFILE     0
+#endif
+
+/**
+ * @brief Cluster runs a ring file may be split into
+ * Creation asks for a single run; each extra slot costs 8 bytes per handle
+ */
+#ifndef LIBRESD_RINGFILE_MAX_EXTENTS
+#define LIBRESD_RINGFILE_MAX_EXTENTS 4
+#endif
+
+/**
+ * @brief Enable time-indexed logs with range queries (libresd_tlog_*)
+ * Needs LIBRESD_ENABLE_WRITE; a log handle holds two files and one block
+ */
+#ifndef LIBRESD_ENABLE_TLOG
+#define LIBRESD_ENABLE_TLOG         0
+#endif
+
+/**
+ * @brief Time-log block size in bytes
+ * Power of two, 512 up to the smallest cluster size you format with
+ */
+#ifndef LIBRESD_TLOG_BLOCK_SIZE
+#define LIBRESD_TLOG_BLOCK_SIZE     512
+#endif
+
+/**
+ * @brief Enable the packed key-value store (libresd_kv_*)
+ * Needs LIBRESD_ENABLE_WRITE; the index and write batch live in caller memory
+ */
+#ifndef LIBRESD_ENABLE_KV
+#define LIBRESD_ENABLE_KV           0
+#endif
+
+/**
+ * @brief Largest value libresd_kv_put() accepts, in bytes
+ * The store keeps this much (plus a sector) free so compaction never stalls
+ */
+#ifndef LIBRESD_KV_MAX_VALUE
+#define LIBRESD_KV_MAX_VALUE        4096
+#endif
+
+/**
+ * @brief Cluster runs a store file may be split into
+ */
+#ifndef LIBRESD_KV_MAX_EXTENTS
+#define LIBRESD_KV_MAX_EXTENTS      4
+#endif
+
+/**
+ * @brief Enable compressed stream files (libresd_zfile_*)
+ * Each open handle holds a block buffer, its compressed copy and a hash table
+ */
+#ifndef LIBRESD_ENABLE_ZFILE
+#define LIBRESD_ENABLE_ZFILE        0
+#endif
+
+/**
+ * @brief Uncompressed bytes per compressed block (multiple of 4, max 32768)
+ * Larger blocks compress better; seeking decodes one whole block
+ */
+#ifndef LIBRESD_ZFILE_BLOCK_SIZE
+#define LIBRESD_ZFILE_BLOCK_SIZE    4096
+#endif
+
+/**
+ * @brief log2 of the compressor's match table entries (2 bytes each)
+ */
+#ifndef LIBRESD_ZFILE_HASH_BITS
+#define LIBRESD_ZFILE_HASH_BITS     10
+#endif
+
+/**
+ * @brief Enable metadata snapshots (libresd_fat_snapshot)
+ * Path lookups and readdir on read-mostly volumes are served from RAM
+ */
+#ifndef LIBRESD_ENABLE_SNAPSHOT
+#define LIBRESD_ENABLE_SNAPSHOT     0
+#endif
+
+/**
+ * @brief Directory sectors fetched per read while building a snapshot
+ * Taken from the snapshot buffer during the build only
+ */
+#ifndef LIBRESD_SNAPSHOT_READ_SECTORS
+#define LIBRESD_SNAPSHOT_READ_SECTORS 8
+#endif
+
+/**
+ * @brief Enable persisted mount state (libresd_accel_*)
+ * Free count, allocation hint and snapshot survive a clean unmount
+ */
+#ifndef LIBRESD_ENABLE_ACCEL
+#define LIBRESD_ENABLE_ACCEL        0
+#endif
+
+/**
+ * @brief Enable the prioritised I/O scheduler (libresd_sched_*)
+ * Requests and the queue live in caller memory
+ */
+#ifndef LIBRESD_ENABLE_SCHED
+#define LIBRESD_ENABLE_SCHED        0
+#endif
+
+/**
+ * @brief Default scheduler slice in bytes (whole sectors)
+ * The longest a queued interactive read waits behind other work is one slice
+ */
+#ifndef LIBRESD_SCHED_SLICE
+#define LIBRESD_SCHED_SLICE         4096
+#endif
+
+/**
+ * @brief Default deadline of interactive scheduler requests, in ms
+ */
+#ifndef LIBRESD_SCHED_MAX_WAIT_MS
+#define LIBRESD_SCHED_MAX_WAIT_MS   20
+#endif
+
+/**
+ * @brief Default deadlines of normal and background scheduler requests, in ms
+ * Past it a request competes as interactive, so no class starves
+ */
+#ifndef LIBRESD_SCHED_NORMAL_WAIT_MS
+#define LIBRESD_SCHED_NORMAL_WAIT_MS 250
+#endif
+#ifndef LIBRESD_SCHED_BACKGROUND_WAIT_MS
+#define LIBRESD_SCHED_BACKGROUND_WAIT_MS 2000
+#endif
+
+/**
+ * @brief Enable the segment file pool (libresd_segpool_*)
+ * Needs LIBRESD_ENABLE_WRITE
+ */
+#ifndef LIBRESD_ENABLE_SEGPOOL
+#define LIBRESD_ENABLE_SEGPOOL      0
+#endif
+
+/**
+ * @brief Most files a segment pool keeps ready (12 bytes each)
+ */
+#ifndef LIBRESD_SEGPOOL_MAX
+#define LIBRESD_SEGPOOL_MAX         4
+#endif
+
+/**
+ * @brief Hidden file holding the persisted mount state
+ */
+#ifndef LIBRESD_ACCEL_PATH
+#define LIBRESD_ACCEL_PATH          "/LIBRESD.SYS"
+#endif
+
+/**
+ * @brief Bytes reserved for the state file when it is created
+ * Enough for the header and a snapshot of ~300 entries
+ */
+#ifndef LIBRESD_ACCEL_RESERVE
+#define LIBRESD_ACCEL_RESERVE       16384
+#endif
+
+/**
+ * @brief FAT sectors sampled for the volume generation check
+ */
+#ifndef LIBRESD_ACCEL_SAMPLES
+#define LIBRESD_ACCEL_SAMPLES       16
+#endif
+
+/**
+ * @brief Enable media change handling (libresd_fat_media_poll)
+ * Needs a card-detect switch; the same card put back keeps the volume state
+ */
+#ifndef LIBRESD_ENABLE_MEDIA
+#define LIBRESD_ENABLE_MEDIA        0
+#endif
+
+/**
+ * @brief FAT sectors sampled into the media fingerprint
+ */
+#ifndef LIBRESD_MEDIA_SAMPLES
+#define LIBRESD_MEDIA_SAMPLES       8
+#endif
+
+/**
+ * @brief Enable the consistency checker (libresd_fat_check, shell fsck)
+ */
+#ifndef LIBRESD_ENABLE_CHECK
+#define LIBRESD_ENABLE_CHECK        0
+#endif
+
+/**
+ * @brief Deepest directory nesting the checker follows (16 bytes per level)
+ */
+#ifndef LIBRESD_CHECK_MAX_DEPTH
+#define LIBRESD_CHECK_MAX_DEPTH     16
+#endif
+
+/**
+ * @brief FAT sectors the checker streams per multi-block read
+ */
+#ifndef LIBRESD_CHECK_READ_SECTORS
+#define LIBRESD_CHECK_READ_SECTORS  8
+#endif
+
+/**
+ * @brief Work buffer of the shell fsck command (static, bytes)
+ * Covers (size - 4 KB) * 8 clusters per pass
+ */
+#ifndef LIBRESD_SHELL_FSCK_WORK
+#define LIBRESD_SHELL_FSCK_WORK     8192
+#endif
+
+/**
+ * @brief Enable the online defragmenter (libresd_fat_defrag)
+ */
+#ifndef LIBRESD_ENABLE_DEFRAG
+#define LIBRESD_ENABLE_DEFRAG       0
+#endif
+
+/**
+ * @brief Deepest directory nesting the defragmenter walks (12 bytes per level)
+ */
+#ifndef LIBRESD_DEFRAG_MAX_DEPTH
+#define LIBRESD_DEFRAG_MAX_DEPTH    8
+#endif
+
 /**
  * @brief Enable directory operations (mkdir, rmdir)
  */
@@ -88,6 +359,14 @@ extern "C" {
 #define LIBRESD_ENABLE_SHELL        1
 #endif
 
+/**
+ * @brief Stack read chunk of the shell cat, head and hexdump commands
+ * With an output sink, cat and head read into the sink buffer instead
+ */
+#ifndef LIBRESD_SHELL_IO_SIZE
+#define LIBRESD_SHELL_IO_SIZE       128
+#endif
+
 /**
  * @brief Number of directory entries to cache
  * More = faster directory traversal, more RAM
@@ -111,6 +390,50 @@ extern "C" {
 #define LIBRESD_ENABLE_EXFAT        0
 #endif
 
+/*============================================================================
+ * STDIO ADAPTER CONFIGURATION
+ *============================================================================*/
+
+/**
+ * @brief Enable the POSIX descriptor layer for newlib/picolibc stdio
+ * Needs <fcntl.h>, <sys/stat.h> and <errno.h> from the C library
+ */
+#ifndef LIBRESD_ENABLE_STDIO
+#define LIBRESD_ENABLE_STDIO        0
+#endif
+
+/**
+ * @brief Emit the _open/_read/_write/... syscall shims
+ * Leave at 0 if your SDK already provides them and forward from there
+ */
+#ifndef LIBRESD_STDIO_SYSCALLS
+#define LIBRESD_STDIO_SYSCALLS      0
+#endif
+
+/**
+ * @brief Name mangling for the syscall shims
+ * newlib wants _read etc.; picolibc's POSIX layer wants plain read etc.
+ */
+#ifndef LIBRESD_STDIO_SYSCALL
+#define LIBRESD_STDIO_SYSCALL(name) _##name
+#endif
+
+/**
+ * @brief Descriptor table size (fds start at 3, after stdin/out/err)
+ * Each slot holds a libresd_file_t (~560 bytes)
+ */
+#ifndef LIBRESD_STDIO_MAX_FDS
+#define LIBRESD_STDIO_MAX_FDS       LIBRESD_MAX_OPEN_FILES
+#endif
+
+/**
+ * @brief Upper bound for the st_blksize hint reported by fstat
+ * The C library sizes each FILE buffer from it, so this caps RAM per stream
+ */
+#ifndef LIBRESD_STDIO_MAX_BLKSIZE
+#define LIBRESD_STDIO_MAX_BLKSIZE   4096
+#endif
+
 /*============================================================================
  * SPI SPEED CONFIGURATION
  *============================================================================*/
@@ -11,6 +11,7 @@
 
 #include "libresd_types.h"
 #include "libresd_sd.h"
+#include <stdarg.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,6 +21,65 @@ extern "C" {
  * FAT FILESYSTEM STRUCTURES
  *============================================================================*/
 
+#if LIBRESD_ENABLE_SNAPSHOT
+
+/** @brief Snapshot entry flags */
+#define LIBRESD_SNAP_CONTIGUOUS 0x01    /**< File data is one run of clusters */
+#define LIBRESD_SNAP_STALE      0x02    /**< Directory changed since the snapshot */
+
+/**
+ * @brief One file or directory in a metadata snapshot
+ */
+typedef struct {
+    uint32_t        name;               /**< Name offset from the table start */
+    uint32_t        parent;             /**< Parent entry (0xFFFFFFFF = root) */
+    uint32_t        first_cluster;      /**< First cluster */
+    uint32_t        size;               /**< File size in bytes */
+    uint32_t        dir_sector;         /**< Sector holding the directory entry */
+    uint32_t        children;           /**< First child entry (directories) */
+    uint32_t        child_count;        /**< Entries in the directory */
+    uint16_t        dir_offset;         /**< Offset in dir_sector */
+    uint16_t        create_date;        /**< FAT creation date */
+    uint16_t        create_time;        /**< FAT creation time */
+    uint16_t        modify_date;        /**< FAT modification date */
+    uint16_t        modify_time;        /**< FAT modification time */
+    uint8_t         attr;               /**< Attributes */
+    uint8_t         flags;              /**< LIBRESD_SNAP_* */
+} libresd_snap_entry_t;
+
+/**
+ * @brief Metadata snapshot of a whole volume
+ *
+ * Every directory's entries sit together in the table, sorted by name
+ * (case-insensitive), so each path component is one binary search.
+ */
+typedef struct {
+    libresd_snap_entry_t *entries;      /**< Table (NULL = no snapshot) */
+    uint32_t        count;              /**< Entries in the table */
+    uint32_t        root_count;         /**< Root entries (they come first) */
+    uint32_t        bytes;              /**< Table size, entries and names */
+    bool            root_stale;         /**< Root changed since the snapshot */
+    uint32_t        cwd_cluster;        /**< Directory cached in cwd_index */
+    uint32_t        cwd_index;          /**< Its entry */
+} libresd_snapshot_t;
+
+#endif /* LIBRESD_ENABLE_SNAPSHOT */
+
+#if LIBRESD_ENABLE_MEDIA
+
+/**
+ * @brief What the card looked like when last seen, to recognise it again
+ */
+typedef struct {
+    uint8_t         cid[16];            /**< CID register of the mounted card */
+    uint32_t        hash;               /**< Fingerprint of FSInfo, root and FAT samples */
+    uint32_t        writes;             /**< sd->write_count when hash was taken */
+    bool            valid;              /**< hash describes the card */
+    bool            removed;            /**< Card out, state held for its return */
+} libresd_media_t;
+
+#endif /* LIBRESD_ENABLE_MEDIA */
+
 /**
  * @brief FAT volume state
  */
@@ -28,8 +88,10 @@ typedef struct {
     bool            mounted;            /**< Volume is mounted */
     libresd_fs_type_t fs_type;          /**< Filesystem type */
     
-    /* BPB (BIOS Parameter Block) info */
-    uint16_t        bytes_per_sector;   /**< Bytes per sector (512) */
+    /* BPB (BIOS Parameter Block) info. Sector counts and numbers are in
+     * 512-byte card blocks whatever the volume's logical sector size. */
+    uint16_t        bytes_per_sector;   /**< Logical sector size (512-4096) */
+    uint8_t         sector_blocks;      /**< Card blocks per logical sector */
     uint8_t         sectors_per_cluster;/**< Sectors per cluster */
     uint16_t        reserved_sectors;   /**< Reserved sector count */
     uint8_t         num_fats;           /**< Number of FAT copies */
@@ -37,6 +99,7 @@ typedef struct {
     uint32_t        total_sectors;      /**< Total sectors on volume */
     uint32_t        sectors_per_fat;    /**< Sectors per FAT */
     uint32_t        root_cluster;       /**< Root dir cluster (FAT32) */
+    uint32_t        fsinfo_sector;      /**< FAT32 FSInfo sector (0 = none) */
     
     /* Calculated values */
     uint32_t        fat_start_sector;   /**< First FAT sector */
@@ -57,10 +120,25 @@ typedef struct {
     uint32_t        free_clusters;      /**< Free cluster count (-1 = unknown) */
     uint32_t        last_alloc_cluster; /**< Last allocated cluster (hint) */
     
-    /* Sector buffer for FAT operations */
-    uint8_t         fat_buffer[LIBRESD_SECTOR_SIZE];
-    uint32_t        fat_buffer_sector;  /**< Sector currently in buffer */
+    /* FAT cache: one logical sector, up to LIBRESD_MAX_SECTOR_SIZE */
+    uint8_t         fat_buffer[LIBRESD_MAX_SECTOR_SIZE];
+    uint32_t        fat_buffer_sector;  /**< First sector in buffer */
+    uint8_t         fat_buffer_blocks;  /**< Card blocks the buffer holds */
     bool            fat_buffer_dirty;   /**< Buffer modified? */
+    
+    /* Directory sector scratch for path lookups and entry updates, so
+     * they need no sector buffer on the stack. Contents are only good
+     * until the next library call. */
+    uint8_t         dir_buffer[LIBRESD_SECTOR_SIZE];
+    uint32_t        lookup_dir;         /**< First cluster of the directory fat_lookup()
+                                             last found an entry in (0 = fixed root) */
+    
+#if LIBRESD_ENABLE_SNAPSHOT
+    libresd_snapshot_t snapshot;        /**< Metadata snapshot */
+#endif
+#if LIBRESD_ENABLE_MEDIA
+    libresd_media_t media;              /**< Card identity for media changes */
+#endif
 } libresd_fat_t;
 
 /*============================================================================
@@ -115,6 +193,90 @@ bool libresd_fat_is_mounted(libresd_fat_t *fat);
  */
 libresd_err_t libresd_fat_sync(libresd_fat_t *fat);
 
+#if LIBRESD_ENABLE_MEDIA
+
+/*============================================================================
+ * MEDIA CHANGE
+ *============================================================================*/
+
+/**
+ * @brief What libresd_fat_media_poll() saw
+ */
+typedef enum {
+    LIBRESD_MEDIA_NONE = 0,             /**< Nothing new */
+    LIBRESD_MEDIA_REMOVED,              /**< Card pulled; state held for its return */
+    LIBRESD_MEDIA_SAME,                 /**< Same card back, volume state kept */
+    LIBRESD_MEDIA_CHANGED               /**< Different card (or written elsewhere), remounted */
+} libresd_media_event_t;
+
+/**
+ * @brief Follow card removal and insertion
+ *
+ * Call from the main loop, often enough that no swap fits between two
+ * calls. Needs libresd_hal_card_detect() wired to a card-detect switch.
+ *
+ * While the card is in and in use, the poll keeps a fingerprint of it:
+ * a hash of the FSInfo sector, the first root directory sector and
+ * LIBRESD_MEDIA_SAMPLES FAT sectors. It is taken again by the first poll
+ * after anything was written to the card (LIBRESD_MEDIA_SAMPLES + 2
+ * sector reads).
+ *
+ * When the card goes, the card layer is marked uninitialised (I/O fails
+ * with LIBRESD_ERR_NOT_MOUNTED) and everything else stays as it was. When
+ * a card comes back, only the card handshake is repeated; the volume
+ * state is kept if the CID, the volume serial and layout and the
+ * fingerprint all match. Open files, the FAT cache (with any unwritten
+ * change), the free count, the current directory and the snapshot then
+ * carry on as if the card had never left.
+ *
+ * Anything else - another card, a card reformatted or written by another
+ * host, or a card pulled after writes the poll had not yet seen - gets a
+ * fresh mount: open files and the snapshot are dropped (their memory is
+ * the caller's again) and unwritten FAT changes are lost. A new card that
+ * does not mount leaves the volume unmounted, to be mounted (or formatted)
+ * by the caller.
+ *
+ * @param fat Mounted FAT volume
+ * @param event Output: what happened (can be NULL)
+ * @return LIBRESD_OK, LIBRESD_ERR_NO_CARD while the card is out, a
+ *         handshake error (retried by the next poll), or the mount error
+ */
+libresd_err_t libresd_fat_media_poll(libresd_fat_t *fat, libresd_media_event_t *event);
+
+#endif /* LIBRESD_ENABLE_MEDIA */
+
+#if LIBRESD_ENABLE_SNAPSHOT
+
+/**
+ * @brief Load the whole directory tree into RAM
+ *
+ * Meant to be called right after mounting a volume that is written once
+ * and then only read. Every directory is read with multi-block reads and
+ * its entries are stored in buf (RAM or PSRAM), 40 bytes each plus the
+ * name. From then on, path lookups (open, stat, chdir, exists) and readdir
+ * do not touch the card, and libresd_fat_get_extents() answers from the
+ * snapshot for contiguous files.
+ *
+ * Any change to a directory entry marks its directory stale. Lookups into
+ * a stale directory, and everything below it, go back to the card.
+ *
+ * @param fat Mounted FAT volume
+ * @param buf Table memory, kept until unmount or the next snapshot
+ * @param size Size of buf in bytes
+ * @param used Bytes of buf the table takes (can be NULL)
+ * @return LIBRESD_OK, LIBRESD_ERR_NO_MEM if the tree does not fit (no
+ *         snapshot is active then), or error
+ */
+libresd_err_t libresd_fat_snapshot(libresd_fat_t *fat, void *buf, uint32_t size,
+                                    uint32_t *used);
+
+/**
+ * @brief Drop the snapshot and go back to reading directories from the card
+ */
+void libresd_fat_snapshot_drop(libresd_fat_t *fat);
+
+#endif /* LIBRESD_ENABLE_SNAPSHOT */
+
 /*============================================================================
  * DIRECTORY OPERATIONS
  *============================================================================*/
@@ -146,6 +308,58 @@ libresd_err_t libresd_fat_readdir(libresd_fat_t *fat, libresd_dir_t *dir,
  */
 void libresd_fat_closedir(libresd_dir_t *dir);
 
+/**
+ * @brief Compiled name pattern ('*' and '?', case-insensitive)
+ *
+ * Runs of '*' are folded and the pattern is kept as the literal segments
+ * between them, so a match is one left-to-right pass without backtracking.
+ * The literal prefix and suffix and the shortest name that can match are
+ * precomputed for checks against raw 8.3 entries.
+ */
+typedef struct {
+    char        text[LIBRESD_MAX_GLOB];     /**< Upper case, single '*' between segments */
+    uint8_t     len;                        /**< Characters in text */
+    uint8_t     min_len;                    /**< Shortest matching name */
+    uint8_t     prefix_len;                 /**< Literal characters names start with */
+    uint8_t     suffix_len;                 /**< Literal characters names end with */
+} libresd_fat_glob_t;
+
+/** Return directories whether or not they match (for recursive walks) */
+#define LIBRESD_GLOB_DIRS           0x01
+
+/**
+ * @brief Compile a name pattern
+ *
+ * @param glob Compiled pattern to fill
+ * @param pattern Pattern, e.g. "*.BIN" or "LOG??.TXT"
+ * @return LIBRESD_OK, or LIBRESD_ERR_INVALID_PARAM if it is empty or longer
+ *         than LIBRESD_MAX_GLOB
+ */
+libresd_err_t libresd_fat_glob_compile(libresd_fat_glob_t *glob, const char *pattern);
+
+/**
+ * @brief Match a name against a compiled pattern
+ */
+bool libresd_fat_glob_match(const libresd_fat_glob_t *glob, const char *name);
+
+/**
+ * @brief Read the next directory entry whose name matches a pattern
+ *
+ * Short entries are tested on their raw 8.3 bytes before anything is
+ * decoded, and long names as soon as they are assembled, so entries that
+ * do not match cost no info decode. "." and ".." are never returned.
+ *
+ * @param fat FAT volume
+ * @param dir Directory handle
+ * @param glob Compiled pattern
+ * @param flags 0 or LIBRESD_GLOB_DIRS
+ * @param info File info structure to fill
+ * @return LIBRESD_OK, LIBRESD_ERR_EOF when done, or error
+ */
+libresd_err_t libresd_fat_readdir_glob(libresd_fat_t *fat, libresd_dir_t *dir,
+                                        const libresd_fat_glob_t *glob, uint8_t flags,
+                                        libresd_fileinfo_t *info);
+
 /**
  * @brief Change current working directory
  * 
@@ -176,6 +390,24 @@ char* libresd_fat_getcwd(libresd_fat_t *fat, char *buffer, size_t size);
  */
 libresd_err_t libresd_fat_mkdir(libresd_fat_t *fat, const char *path);
 
+/**
+ * @brief Create a directory presized for its entries
+ * 
+ * Allocates one contiguous run big enough for expected_entries (plus "."
+ * and "..") and zero-fills it with a single multi-block write, so listing
+ * it is one read burst. Entries created later fill the run before the
+ * directory grows by single clusters again. Long names take one entry per
+ * 13 characters plus the short entry.
+ * 
+ * @param fat FAT volume
+ * @param path Directory path to create
+ * @param expected_entries Entries to reserve room for (0 = one cluster)
+ * @return LIBRESD_OK, LIBRESD_ERR_FULL (no free run that long),
+ *         LIBRESD_ERR_INVALID_PARAM (more than 65534 entries) or error code
+ */
+libresd_err_t libresd_fat_mkdir_ex(libresd_fat_t *fat, const char *path,
+                                   uint32_t expected_entries);
+
 /**
  * @brief Remove an empty directory
  * 
@@ -244,11 +476,37 @@ libresd_err_t libresd_fat_write(libresd_fat_t *fat, libresd_file_t *file,
  */
 libresd_err_t libresd_fat_flush(libresd_fat_t *fat, libresd_file_t *file);
 
+/**
+ * @brief Make everything written so far durable
+ * 
+ * Writes out pending output, the sector buffer and the FAT, then updates
+ * the directory entry (size, first cluster, time) - what close does,
+ * without closing.
+ */
+libresd_err_t libresd_fat_checkpoint(libresd_fat_t *fat, libresd_file_t *file);
+
 /**
  * @brief Truncate file at current position
  */
 libresd_err_t libresd_fat_truncate(libresd_fat_t *fat, libresd_file_t *file);
 
+/**
+ * @brief Grow a file to size bytes without writing its data
+ *
+ * Allocates the missing clusters as one adjacent run when the volume has
+ * one (falling back to the usual one-at-a-time search), sets the file size
+ * and commits the FAT and directory entry. The new bytes hold whatever the
+ * card held before. The position is unchanged; a file already that large
+ * is left alone.
+ *
+ * @param fat FAT volume
+ * @param file File handle (opened for writing)
+ * @param size New file size in bytes
+ * @return LIBRESD_OK, LIBRESD_ERR_FULL, or error
+ */
+libresd_err_t libresd_fat_preallocate(libresd_fat_t *fat, libresd_file_t *file,
+                                       uint32_t size);
+
 /**
  * @brief Delete a file
  * 
@@ -261,6 +519,10 @@ libresd_err_t libresd_fat_unlink(libresd_fat_t *fat, const char *path);
 /**
  * @brief Rename/move a file or directory
  * 
+ * The entry is recreated under the new name (with long name entries if
+ * needed) before the old one is deleted, so it can move to another
+ * directory. An interruption in between leaves both names.
+ * 
  * @param fat FAT volume
  * @param old_path Current path
  * @param new_path New path
@@ -283,20 +545,140 @@ libresd_err_t libresd_fat_rename(libresd_fat_t *fat, const char *old_path,
 libresd_err_t libresd_fat_seek(libresd_fat_t *fat, libresd_file_t *file,
                                 int32_t offset, libresd_seek_t whence);
 
+/**
+ * @brief Seek to a position whose cluster is already known
+ * 
+ * Skips the chain walk libresd_fat_seek() does from the first cluster,
+ * which dominates on large files. Record the cluster while writing (the
+ * file's current_cluster right after a write that ended inside it) and
+ * pass it back here. Offsets past 2 GiB are reachable this way too.
+ * 
+ * @param fat FAT volume
+ * @param file File handle
+ * @param offset Absolute position
+ * @param cluster Cluster holding the byte at offset
+ * @return LIBRESD_OK or error
+ */
+libresd_err_t libresd_fat_seek_cluster(libresd_fat_t *fat, libresd_file_t *file,
+                                        uint32_t offset, uint32_t cluster);
+
 /**
  * @brief Get current file position
  */
-uint32_t libresd_fat_tell(libresd_file_t *file);
+uint32_t libresd_fat_tell(const libresd_file_t *file);
 
 /**
  * @brief Check if at end of file
  */
-bool libresd_fat_eof(libresd_file_t *file);
+bool libresd_fat_eof(const libresd_file_t *file);
 
 /**
  * @brief Get file size
  */
-uint32_t libresd_fat_size(libresd_file_t *file);
+uint32_t libresd_fat_size(const libresd_file_t *file);
+
+#if LIBRESD_STREAM_BUFFER
+
+/**
+ * @brief Attach a stream buffer to an open file
+ * 
+ * The line reader then refills the whole buffer with one multi-block
+ * transfer instead of going sector by sector, and libresd_fat_printf()
+ * batches output in it and writes it out a buffer at a time. The buffer
+ * belongs to the caller and must outlive the file (or be detached).
+ * Call after libresd_fat_open(); open clears it.
+ * 
+ * @param fat FAT volume
+ * @param file File handle
+ * @param buf Buffer memory (NULL = detach, use the sector buffer)
+ * @param size Buffer size, a non-zero multiple of 512
+ * @return LIBRESD_OK or error
+ */
+libresd_err_t libresd_fat_setvbuf(libresd_fat_t *fat, libresd_file_t *file,
+                                   void *buf, uint32_t size);
+
+#endif /* LIBRESD_STREAM_BUFFER */
+
+#if LIBRESD_ENABLE_GETLINE
+
+/*============================================================================
+ * BUFFERED LINE READER
+ *============================================================================*/
+
+/**
+ * @brief Read one line into a caller buffer
+ * 
+ * Copies up to cap-1 bytes and NUL-terminates. The '\n' and a preceding
+ * '\r' are stripped. A line longer than cap-1 returns LIBRESD_ERR_TOO_LONG
+ * with the first part in buf; the next call continues with the rest.
+ * 
+ * @param fat FAT volume
+ * @param file File handle (opened with LIBRESD_READ)
+ * @param buf Destination
+ * @param cap Size of buf, including the terminator
+ * @param len Line length without terminator (can be NULL)
+ * @return LIBRESD_OK, LIBRESD_ERR_TOO_LONG, LIBRESD_ERR_EOF, or error
+ */
+libresd_err_t libresd_fat_getline(libresd_fat_t *fat, libresd_file_t *file,
+                                   char *buf, uint32_t cap, uint32_t *len);
+
+/**
+ * @brief Get the next line without copying
+ * 
+ * Points *line into the file's buffer. The text is not NUL-terminated and
+ * stays valid until the next read, seek or write on this file. Line ending
+ * handling matches libresd_fat_getline().
+ * 
+ * Returns LIBRESD_ERR_TOO_LONG, consuming nothing, when the line does not
+ * fit in one buffer window (a sector without setvbuf); fall back to
+ * libresd_fat_getline() for that line.
+ * 
+ * @param fat FAT volume
+ * @param file File handle (opened with LIBRESD_READ)
+ * @param line Receives a pointer to the line text
+ * @param len Receives the line length
+ * @return LIBRESD_OK, LIBRESD_ERR_TOO_LONG, LIBRESD_ERR_EOF, or error
+ */
+libresd_err_t libresd_fat_getline_ref(libresd_fat_t *fat, libresd_file_t *file,
+                                       const char **line, uint32_t *len);
+
+#endif /* LIBRESD_ENABLE_GETLINE */
+
+#if LIBRESD_ENABLE_PRINTF && LIBRESD_ENABLE_WRITE
+
+/*============================================================================
+ * FORMATTED WRITER
+ *============================================================================*/
+
+/**
+ * @brief Formatted write at the current position
+ * 
+ * Formats straight into the file's write buffer - the attached stream
+ * buffer if there is one, else the sector buffer - with no intermediate
+ * string. Data reaches the card a sector (or a whole stream buffer) at a
+ * time; call libresd_fat_checkpoint() to make it durable.
+ * 
+ * Conversions (32-bit): %d %i %u %x %X %c %s %% with flags '-' and '0',
+ * width and precision ('*' allowed) and the 'l' modifier. Precision is the
+ * minimum digit count for integers ("%.5d" with 21 gives "00021") and the
+ * maximum length for %s. %k prints a fixed-point value: "%.3k" with 12345
+ * gives "12.345".
+ * 
+ * @param fat FAT volume
+ * @param file File handle (opened for writing)
+ * @param fmt Format string
+ * @return LIBRESD_OK or error
+ */
+libresd_err_t libresd_fat_printf(libresd_fat_t *fat, libresd_file_t *file,
+                                  const char *fmt, ...);
+
+/**
+ * @brief libresd_fat_printf() with a va_list
+ */
+libresd_err_t libresd_fat_vprintf(libresd_fat_t *fat, libresd_file_t *file,
+                                   const char *fmt, va_list ap);
+
+#endif /* LIBRESD_ENABLE_PRINTF && LIBRESD_ENABLE_WRITE */
 
 /**
  * @brief Get file/directory info by path
@@ -314,6 +696,54 @@ libresd_err_t libresd_fat_stat(libresd_fat_t *fat, const char *path,
  */
 bool libresd_fat_exists(libresd_fat_t *fat, const char *path);
 
+/*============================================================================
+ * PHYSICAL LAYOUT
+ *============================================================================*/
+
+/**
+ * @brief Get the card sector runs holding a file
+ *
+ * Walks the cluster chain once and merges adjacent clusters, so a
+ * contiguous file comes back as a single run that a bootloader or DMA
+ * engine can read with one multi-block command. The last run ends at the
+ * last sector the file size reaches. The layout is taken from the
+ * directory entry, so close or checkpoint a file being written first.
+ *
+ * @param fat FAT volume
+ * @param path File path
+ * @param extents Runs to fill (can be NULL if max is 0)
+ * @param max Entries in extents
+ * @param n Runs the file has, even when more than max
+ * @return LIBRESD_OK, LIBRESD_ERR_NO_MEM if the file has more than max
+ *         runs (the first max are filled in), or error
+ */
+libresd_err_t libresd_fat_get_extents(libresd_fat_t *fat, const char *path,
+                                       libresd_extent_t *extents, uint32_t max,
+                                       uint32_t *n);
+
+#if LIBRESD_ENABLE_WRITE
+
+/**
+ * @brief Move a fragmented file into one run of adjacent clusters
+ *
+ * Copies the data into a freshly allocated run, points the directory
+ * entry at it and only then frees the old chain, so a reset part-way
+ * leaves the old file intact (at worst with the new run lost to a scan).
+ * Does nothing for a file that is already contiguous. The file must not
+ * be open.
+ *
+ * @param fat FAT volume
+ * @param path File path
+ * @param buf Copy buffer, a multiple of LIBRESD_SECTOR_SIZE (NULL = one
+ *            sector on the stack)
+ * @param buf_size Size of buf in bytes
+ * @return LIBRESD_OK, LIBRESD_ERR_FULL if no free run is long enough, or error
+ */
+libresd_err_t libresd_fat_make_contiguous(libresd_fat_t *fat, const char *path,
+                                           void *buf, uint32_t buf_size);
+
+#endif /* LIBRESD_ENABLE_WRITE */
+
 /*============================================================================
  * VOLUME OPERATIONS
  *============================================================================*/
@@ -333,8 +763,42 @@ uint64_t libresd_fat_get_free(libresd_fat_t *fat);
  */
 const char* libresd_fat_get_label(libresd_fat_t *fat);
 
+#if LIBRESD_ENABLE_WRITE
+
+/**
+ * @brief Write the free count and allocation hint to the FAT32 FSInfo sector
+ * 
+ * Other hosts start from these instead of scanning the FAT. An unknown
+ * free count is written as unknown. Does nothing on FAT12/16.
+ * 
+ * @param fat Mounted FAT volume
+ * @return LIBRESD_OK or error
+ */
+libresd_err_t libresd_fat_update_fsinfo(libresd_fat_t *fat);
+
+#endif /* LIBRESD_ENABLE_WRITE */
+
 #if LIBRESD_ENABLE_FORMAT
 
+/**
+ * @brief Volume layout for libresd_fat_format_ex()
+ * 
+ * Zero fields select the SD Association defaults: cluster size by
+ * capacity (8 KB up to 8 MB, 16 KB up to 1 GB, 32 KB above), data area
+ * aligned to a 4 MB allocation unit (less on cards under 32 MB) and an
+ * MBR partition that starts on the same boundary.
+ */
+typedef struct {
+    const char     *label;              /**< Volume label (NULL = "NO NAME") */
+    uint32_t        cluster_size;       /**< Bytes per cluster, power of two */
+    uint32_t        align;              /**< Data area alignment in bytes (the AU) */
+    uint16_t        root_entries;       /**< FAT12/16 root directory entries */
+    libresd_fs_type_t fs_type;          /**< Required FAT type (NONE = by cluster count) */
+    bool            no_partition;       /**< Put the volume at sector 0, without an MBR */
+    uint32_t        serial;             /**< Volume serial (0 = from the clock) */
+    uint16_t        sector_size;        /**< Logical sector, 512-4096 (0 = 512) */
+} libresd_format_t;
+
 /**
  * @brief Format SD card with FAT filesystem
  * 
@@ -344,8 +808,165 @@ const char* libresd_fat_get_label(libresd_fat_t *fat);
  */
 libresd_err_t libresd_fat_format(libresd_sd_t *sd, const char *label);
 
+/**
+ * @brief Format with an explicit layout
+ * 
+ * The old boot sector (and MBR) is cleared first and the new one written
+ * last, so an interrupted format leaves no mountable half-volume behind.
+ * 
+ * @param sd SD card (must be initialized)
+ * @param opt Layout (NULL = defaults)
+ * @return LIBRESD_OK, LIBRESD_ERR_INVALID_PARAM if the layout cannot be
+ *         met (e.g. FAT32 on too small a card), or error
+ */
+libresd_err_t libresd_fat_format_ex(libresd_sd_t *sd, const libresd_format_t *opt);
+
 #endif /* LIBRESD_ENABLE_FORMAT */
 
+#if LIBRESD_ENABLE_CHECK
+
+/*============================================================================
+ * CONSISTENCY CHECK
+ *============================================================================*/
+
+/** @brief libresd_fat_check() flags */
+#define LIBRESD_CHECK_REPAIR    0x01    /**< Fix what is found */
+
+/**
+ * @brief What libresd_fat_check() found
+ */
+typedef struct {
+    uint32_t        files;              /**< Files seen */
+    uint32_t        dirs;               /**< Directories seen */
+    uint32_t        used_clusters;      /**< Clusters owned by a file or directory */
+    uint32_t        free_clusters;      /**< Free clusters in the FAT (after repair) */
+    uint32_t        lost_clusters;      /**< Allocated but owned by nothing */
+    uint32_t        cross_links;        /**< Chains running into another chain */
+    uint32_t        bad_chains;         /**< Chains linking to a free or invalid cluster */
+    uint32_t        size_mismatches;    /**< File size disagrees with chain length */
+    uint32_t        preallocated;       /**< Empty files holding a chain (kept) */
+    uint32_t        free_count_was;     /**< Cached free count before (-1 = unknown) */
+    uint32_t        fsinfo_free;        /**< FSInfo free count (-1 = none or unknown) */
+    uint32_t        passes;             /**< Tree walks the bitmap size needed */
+    uint32_t        repaired;           /**< Fixes written (LIBRESD_CHECK_REPAIR) */
+} libresd_check_t;
+
+/**
+ * @brief Check the volume for lost, cross-linked and broken cluster chains
+ *
+ * Walks the directory tree by cluster, marking every cluster a file or
+ * directory owns in a bitmap, then streams the FAT with multi-block reads
+ * to find allocated clusters nobody owns. work holds the bitmap (one bit
+ * per cluster) and the FAT read buffer; when it is too small for the whole
+ * volume the check runs in several passes over cluster windows.
+ *
+ * With LIBRESD_CHECK_REPAIR:
+ *   - lost clusters are freed
+ *   - a broken or cross-linked chain is cut before the bad link
+ *   - a chain longer than its file is cut, a shorter one shrinks the size
+ *   - the FAT32 FSInfo free count is corrected
+ *
+ * A file of size 0 that owns a sound chain is taken as preallocated (a
+ * segment pool file) and its chain is left alone. The volume must not be
+ * modified during the check, and files open for writing should be synced.
+ *
+ * @param fat Mounted FAT volume
+ * @param flags LIBRESD_CHECK_* flags
+ * @param work Bitmap and read buffer (at least 1 KB)
+ * @param work_size Size of work in bytes
+ * @param report Findings
+ * @return LIBRESD_OK (see report), LIBRESD_ERR_NOT_SUPPORTED if the tree is
+ *         deeper than LIBRESD_CHECK_MAX_DEPTH (nothing is repaired), or error
+ */
+libresd_err_t libresd_fat_check(libresd_fat_t *fat, uint8_t flags, void *work,
+                                 uint32_t work_size, libresd_check_t *report);
+
+#endif /* LIBRESD_ENABLE_CHECK */
+
+#if LIBRESD_ENABLE_DEFRAG && LIBRESD_ENABLE_WRITE
+
+/*============================================================================
+ * DEFRAGMENTER
+ *============================================================================*/
+
+/**
+ * @brief Directory being walked by the defragmenter
+ */
+typedef struct {
+    uint32_t        first;              /**< First cluster (0 = FAT12/16 root) */
+    uint32_t        cluster;            /**< Cluster holding entry index (0 = end) */
+    uint32_t        index;              /**< Next entry */
+} libresd_defrag_level_t;
+
+/**
+ * @brief Defragmenter progress and statistics
+ *
+ * Zero it (or call with a fresh one) to start a new run. The extent
+ * counts give the fragmentation metric: extents_before / items before,
+ * extents_after / items after, 1.0 being fully contiguous.
+ */
+typedef struct {
+    libresd_defrag_level_t level[LIBRESD_DEFRAG_MAX_DEPTH]; /**< Walk stack */
+    uint32_t        depth;              /**< Levels in use */
+    bool            started;            /**< path has been resolved */
+    bool            done;               /**< Nothing left to do */
+    
+    /* Chain being moved */
+    bool            moving;             /**< A copy is in progress */
+    bool            moving_dir;         /**< It is a directory */
+    uint16_t        dir_offset;         /**< Its entry, in dir_sector */
+    uint32_t        dir_sector;         /**< Sector holding its entry */
+    uint32_t        old_first;          /**< Chain being replaced */
+    uint32_t        size;               /**< File size at the start */
+    uint16_t        modify_date;        /**< Modification stamp at the start */
+    uint16_t        modify_time;
+    uint32_t        runs;               /**< Extents of the old chain */
+    uint32_t        new_first;          /**< Run being filled */
+    uint32_t        src_cluster;        /**< Old cluster being copied */
+    uint32_t        copied;             /**< Sectors copied */
+    uint32_t        total;              /**< Sectors to copy */
+    
+    /* Fragmentation metric */
+    uint32_t        files;              /**< Files seen */
+    uint32_t        dirs;               /**< Directories seen */
+    uint32_t        extents_before;     /**< Extents of all items seen, before */
+    uint32_t        extents_after;      /**< The same, after */
+    uint32_t        moved;              /**< Items made contiguous */
+    uint32_t        skipped;            /**< Fragmented but left (no free run, changed) */
+} libresd_defrag_t;
+
+/**
+ * @brief Make fragmented files and directories contiguous, a bit at a time
+ *
+ * Each fragmented chain is copied into a freshly allocated run with
+ * multi-block transfers; then the directory entry is switched to the run
+ * and only then is the old chain freed, so a reset leaves the old chain in
+ * use (the new run is lost to libresd_fat_check()). A moved directory has
+ * its "." entry and its subdirectories' ".." entries updated.
+ *
+ * Each call copies at most budget sectors (directory sectors read during
+ * the walk count too) and returns, so it fits in idle time. The position
+ * is kept in df; an item that changed between calls is dropped and
+ * counted as skipped. Items being moved must not be open. The FAT32 root
+ * directory and directories nested deeper than LIBRESD_DEFRAG_MAX_DEPTH
+ * are left alone.
+ *
+ * @param fat Mounted FAT volume
+ * @param df Progress (zeroed for a new run)
+ * @param path File or directory tree to work on (NULL = whole volume);
+ *             only read by the first call
+ * @param budget Sectors this call may move
+ * @param buf Copy buffer, a multiple of LIBRESD_SECTOR_SIZE (NULL = one
+ *            sector on the stack)
+ * @param buf_size Size of buf in bytes
+ * @return LIBRESD_OK with work left, LIBRESD_ERR_EOF when done, or error
+ */
+libresd_err_t libresd_fat_defrag(libresd_fat_t *fat, libresd_defrag_t *df,
+                                  const char *path, uint32_t budget,
+                                  void *buf, uint32_t buf_size);
+
+#endif /* LIBRESD_ENABLE_DEFRAG && LIBRESD_ENABLE_WRITE */
+
 /*============================================================================
  * INTERNAL FUNCTIONS (exposed for advanced use)
  *============================================================================*/
@@ -354,6 +975,7 @@ libresd_err_t libresd_fat_format(libresd_sd_t *sd, const char *label);
 #define FAT_DIRENT_SIZE         32
 #define DIRENT_FREE             0xE5
 #define DIRENT_END              0x00
+#define FAT_LFN_ENTRY_CHARS     13      /* Name characters per long name entry */
 
 /**
  * @brief Read FAT entry
@@ -365,6 +987,27 @@ uint32_t libresd_fat_read_entry(libresd_fat_t *fat, uint32_t cluster);
  */
 uint32_t libresd_fat_next_cluster(libresd_fat_t *fat, uint32_t cluster);
 
+/**
+ * @brief Length of the contiguous run of a chain starting at a cluster
+ *
+ * Counts clusters while each entry points at the cluster right after it
+ * (entry == cluster + 1), comparing entries straight in the cached FAT
+ * window - two FAT16 entries per 32-bit compare - and moving to the next
+ * window when the run crosses one. Callers size multi-block transfers
+ * from it instead of following the chain a cluster at a time.
+ *
+ * @param fat FAT volume
+ * @param cluster First cluster of the run
+ * @param max Clusters to count at most (0 = no limit)
+ * @param next Output: where the chain goes after the run, as
+ *        libresd_fat_next_cluster() would return it for the run's last
+ *        cluster (0 = end of chain; can be NULL)
+ * @return Clusters in the run (1 or more), or 0 if cluster is out of range
+ *         or the FAT could not be read
+ */
+uint32_t libresd_fat_get_run(libresd_fat_t *fat, uint32_t cluster, uint32_t max,
+                             uint32_t *next);
+
 /**
  * @brief Convert cluster number to sector
  */
@@ -375,6 +1018,22 @@ uint32_t libresd_fat_cluster_to_sector(libresd_fat_t *fat, uint32_t cluster);
  */
 bool libresd_fat_is_eoc(libresd_fat_t *fat, uint32_t cluster);
 
+/**
+ * @brief Map the first sectors of a cluster chain to card sector runs
+ *
+ * @param fat FAT volume
+ * @param cluster First cluster of the chain
+ * @param sectors Sectors to map from the start of the chain
+ * @param extents Runs to fill (can be NULL if max is 0)
+ * @param max Entries in extents
+ * @param n Runs needed, even when more than max
+ * @return LIBRESD_OK, LIBRESD_ERR_NO_MEM if more than max runs are needed,
+ *         LIBRESD_ERR_FAT_CORRUPT if the chain ends early
+ */
+libresd_err_t libresd_fat_chain_extents(libresd_fat_t *fat, uint32_t cluster,
+                                         uint32_t sectors, libresd_extent_t *extents,
+                                         uint32_t max, uint32_t *n);
+
 /**
  * @brief Convert string filename to 8.3 FAT format
  * @param str Input filename string
@@ -383,6 +1042,67 @@ bool libresd_fat_is_eoc(libresd_fat_t *fat, uint32_t cluster);
  */
 bool str_to_fat_name(const char *str, uint8_t *name);
 
+/**
+ * @brief Checksum of an 11-byte short name, as its long name entries carry it
+ */
+uint8_t fat_lfn_checksum(const uint8_t *name);
+
+#if LIBRESD_ENABLE_LFN
+/**
+ * @brief Fill one long name entry with its 13-character slice of name
+ *
+ * @param raw 32-byte entry to fill
+ * @param name Long name, ASCII
+ * @param len Bytes in name
+ * @param seq Ordinal of the piece (1 = first 13 characters); the piece
+ *        that holds the end of name gets the last-piece flag
+ * @param sum fat_lfn_checksum() of the short entry that follows the pieces
+ */
+void fat_lfn_pack(uint8_t *raw, const char *name, uint32_t len, uint8_t seq, uint8_t sum);
+#endif
+
+/**
+ * @brief First cluster a directory entry points at
+ */
+static inline uint32_t fat_dirent_cluster(const fat_dirent_t *entry) {
+    return ((uint32_t)entry->cluster_hi << 16) | entry->cluster_lo;
+}
+
+/**
+ * @brief Step a directory scan to its next sector (no card read)
+ *
+ * @param fat FAT volume
+ * @param first_cluster First cluster of the directory (0 = FAT12/16 root)
+ * @param cluster In/out: cluster holding sector
+ * @param sector In/out: current sector
+ * @return LIBRESD_OK, or LIBRESD_ERR_EOF past the last sector
+ */
+libresd_err_t fat_dir_next_sector(libresd_fat_t *fat, uint32_t first_cluster,
+                                  uint32_t *cluster, uint32_t *sector);
+
+/**
+ * @brief Find the directory entry of the first len bytes of path
+ *
+ * Streams each directory through fat->dir_buffer and compares names as
+ * the entries go by, so it needs no path or name copies on the stack. A
+ * component matches the name readdir reports (the long name if there is
+ * one, else the 8.3 name), ignoring case. The root (and a path that ends
+ * up there through "..") gives a made-up directory entry with no location.
+ *
+ * @param fat FAT volume
+ * @param path Path, need not be NUL terminated
+ * @param len Bytes of path to resolve
+ * @param entry Output: copy of the 32-byte entry
+ * @param dir_sector Output: sector containing directory entry (can be NULL)
+ * @param dir_offset Output: offset within sector (can be NULL)
+ * @param name Output: stored name of the last component,
+ *        LIBRESD_MAX_FILENAME bytes (can be NULL)
+ * @return LIBRESD_OK, LIBRESD_ERR_NOT_FOUND, LIBRESD_ERR_NOT_DIR or error
+ */
+libresd_err_t fat_lookup(libresd_fat_t *fat, const char *path, size_t len,
+                         fat_dirent_t *entry, uint32_t *dir_sector,
+                         uint16_t *dir_offset, char *name);
+
 /**
  * @brief Resolve a path to its directory entry location
  * @param fat FAT volume
@@ -397,6 +1117,34 @@ libresd_err_t fat_resolve_path(libresd_fat_t *fat, const char *path,
                                uint32_t *parent_cluster, uint32_t *dir_sector,
                                uint16_t *dir_offset, libresd_fileinfo_t *info);
 
+#if LIBRESD_ENABLE_SNAPSHOT
+
+/**
+ * @brief Mark stale the directory whose entry at dir_sector changed
+ */
+void fat_snapshot_touch(libresd_fat_t *fat, uint32_t dir_sector);
+
+/**
+ * @brief Mark stale the directory starting at cluster (entries added)
+ */
+void fat_snapshot_touch_dir(libresd_fat_t *fat, uint32_t cluster);
+
+/**
+ * @brief Use a table saved from an earlier snapshot of the same volume
+ */
+void fat_snapshot_adopt(libresd_fat_t *fat, void *table, uint32_t count,
+                        uint32_t root_count, uint32_t bytes);
+
+/**
+ * @brief Snapshot active with no stale directory
+ */
+bool fat_snapshot_fresh(const libresd_fat_t *fat);
+
+#else
+#define fat_snapshot_touch(fat, dir_sector)     ((void)0)
+#define fat_snapshot_touch_dir(fat, cluster)    ((void)0)
+#endif
+
 #if LIBRESD_ENABLE_WRITE
 
 /**
@@ -410,6 +1158,33 @@ libresd_err_t libresd_fat_write_entry(libresd_fat_t *fat, uint32_t cluster,
  */
 uint32_t libresd_fat_alloc_cluster(libresd_fat_t *fat, uint32_t prev_cluster);
 
+/**
+ * @brief Allocate a run of adjacent clusters as one chain
+ *
+ * @param fat FAT volume
+ * @param prev_cluster Cluster to link the run after (0 = new chain)
+ * @param count Clusters in the run
+ * @return First cluster of the run, or 0 if no free run that long exists
+ */
+uint32_t libresd_fat_alloc_contiguous(libresd_fat_t *fat, uint32_t prev_cluster,
+                                      uint32_t count);
+
+/**
+ * @brief Delete a directory entry and the long name pieces in front of it
+ *
+ * The short entry goes first, so an interruption leaves at most orphaned
+ * pieces, which readers skip by their checksum. Pieces are followed back
+ * through the entry's sector, cluster (or the fixed root) and, for sets
+ * other systems wrote across a cluster boundary, into the cluster before
+ * it in the directory fat_lookup() last found an entry in.
+ *
+ * @param fat FAT volume
+ * @param dir_sector Sector holding the short entry
+ * @param dir_offset Offset of the short entry in that sector
+ * @return LIBRESD_OK or error code
+ */
+libresd_err_t fat_dirent_remove(libresd_fat_t *fat, uint32_t dir_sector, uint16_t dir_offset);
+
 /**
  * @brief Free cluster chain
  */
@@ -417,12 +1192,18 @@ libresd_err_t libresd_fat_free_chain(libresd_fat_t *fat, uint32_t cluster);
 
 /**
  * @brief Create a new file entry in a directory
+ *
+ * A name that is not 8.3 gets long name entries, written in one run within
+ * a cluster, and a short alias of two name characters, four hex digits of
+ * a name hash and ~1. The aliases already taken are collected in the same
+ * scan that finds the run, so the tail only goes past ~1 on a collision.
+ *
  * @param fat FAT volume
  * @param path Full path for new file
  * @param attr File attributes
  * @param dir_sector Output: sector containing new entry
  * @param dir_offset Output: offset within sector
- * @return LIBRESD_OK or error
+ * @return LIBRESD_OK, LIBRESD_ERR_INVALID_NAME, LIBRESD_ERR_ROOT_FULL or error
  */
 libresd_err_t libresd_fat_create_file(libresd_fat_t *fat, const char *path,
                                        uint8_t attr, uint32_t *dir_sector,
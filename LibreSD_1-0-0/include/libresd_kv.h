@@ -0,0 +1,232 @@
+/**
+ * @file libresd_kv.h
+ * @brief LibreSD packed key-value store
+ *
+ * Thousands of small objects (settings, calibration blobs, thumbnails)
+ * stored as one file each pay a directory entry, a FAT chain and at least
+ * a cluster apiece. The key-value store packs them into a single
+ * preallocated file instead and addresses its sectors directly, so after
+ * creation the FAT and the directory are never touched again.
+ *
+ * Layout (file sectors):
+ *
+ *   0, 1        superblocks for even / odd checkpoints
+ *   2 ...       two checkpoint areas of max_keys index entries each
+ *   rest        circular record log, 16-byte sector header + 496 bytes
+ *
+ *   record      [type][key length][u16 value length][key][value]
+ *
+ * Records are packed back to back and may straddle sectors. Writes go to
+ * the head of the log; a caller-provided batch buffer collects full sectors
+ * so they reach the card as one multi-block write.
+ *
+ * The index is an open-addressing hash table in caller memory, 8 bytes per
+ * slot: the key hash and where the newest record for that key starts. A
+ * lookup therefore costs one sector read, two if the record straddles a
+ * sector boundary. Keys themselves stay on the card and are compared
+ * there, so hash collisions are harmless.
+ *
+ * libresd_kv_checkpoint() writes the live index entries to the spare
+ * checkpoint area and then flips the superblock. Mounting loads the newest
+ * checkpoint and replays only the records written after it. Space taken
+ * by overwritten and deleted records is reclaimed by
+ * libresd_kv_compact(), which copies live records from the oldest end of
+ * the log to the head a few at a time; put() falls back to it when the log
+ * runs out of room.
+ */
+
+#ifndef LIBRESD_KV_H
+#define LIBRESD_KV_H
+
+#include "libresd_fat.h"
+
+#if LIBRESD_ENABLE_KV && LIBRESD_ENABLE_WRITE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Bytes of record stream carried by each log sector */
+#define LIBRESD_KV_PAYLOAD          (LIBRESD_SECTOR_SIZE - 16)
+
+/** @brief Longest key, in bytes */
+#define LIBRESD_KV_MAX_KEY          255
+
+/*============================================================================
+ * KEY-VALUE STRUCTURES
+ *============================================================================*/
+
+/**
+ * @brief Index slot (hash 0 = empty)
+ */
+typedef struct {
+    uint32_t        hash;               /**< Key hash */
+    uint32_t        loc;                /**< Log byte address of the record */
+} libresd_kv_slot_t;
+
+/**
+ * @brief Iteration callback
+ *
+ * The store must not be modified from inside the callback; reading values
+ * with libresd_kv_get() is fine.
+ *
+ * @param ctx Caller context
+ * @param key Key bytes (valid during the call only)
+ * @param klen Key length
+ * @param vlen Value length
+ * @return true to continue, false to stop
+ */
+typedef bool (*libresd_kv_fn)(void *ctx, const void *key, uint8_t klen, uint16_t vlen);
+
+/**
+ * @brief Open key-value store
+ */
+typedef struct {
+    libresd_fat_t      *fat;            /**< Volume the store lives on */
+    libresd_kv_slot_t  *slots;          /**< Caller's index table */
+    uint32_t            slot_count;     /**< Entries in slots */
+    uint8_t            *batch;          /**< Caller's write batch */
+    uint32_t            batch_sectors;  /**< Sectors in batch */
+    uint32_t            id;             /**< Tags this store's sectors */
+    uint32_t            max_keys;       /**< Checkpoint area capacity */
+    uint32_t            count;          /**< Live keys */
+    uint32_t            ckpt_sectors;   /**< Sectors per checkpoint area */
+    uint32_t            log_sectors;    /**< Sectors in the log */
+    uint32_t            head_seq;       /**< Sequence of the sector being filled */
+    uint32_t            tail_seq;       /**< Sequence of the oldest needed sector */
+    uint32_t            batch_seq;      /**< Sequence held in batch[0] */
+    uint32_t            ckpt_seq;       /**< Last checkpoint written */
+    uint32_t            ckpt_tail_seq;  /**< Tail sector at the last checkpoint */
+    uint16_t            head_off;       /**< Stream bytes used in the head sector */
+    uint16_t            tail_off;       /**< Oldest record still to compact */
+    uint32_t            garbage;        /**< Dead record bytes in the log */
+    uint32_t            scratch_seq;    /**< Sequence cached in scratch (0 = none) */
+    uint32_t            extent_count;   /**< Used entries in extent[] */
+    libresd_extent_t    extent[LIBRESD_KV_MAX_EXTENTS]; /**< Card sector runs */
+    uint8_t             scratch[LIBRESD_SECTOR_SIZE]; /**< Read cache */
+} libresd_kv_t;
+
+/*============================================================================
+ * KEY-VALUE OPERATIONS
+ *============================================================================*/
+
+/**
+ * @brief Create an empty store, replacing any file at path
+ *
+ * @param fat Mounted FAT volume
+ * @param kv Store handle to fill
+ * @param path File path
+ * @param log_size Record log bytes (rounded up to whole clusters)
+ * @param max_keys Most keys the store will hold
+ * @param slots Index table (at least max_keys + max_keys / 4 slots)
+ * @param slot_count Entries in slots
+ * @param batch Write batch, a multiple of LIBRESD_SECTOR_SIZE
+ * @param batch_size Size of batch in bytes
+ * @return LIBRESD_OK, LIBRESD_ERR_FULL, or error
+ */
+libresd_err_t libresd_kv_create(libresd_fat_t *fat, libresd_kv_t *kv,
+                                 const char *path, uint32_t log_size,
+                                 uint32_t max_keys,
+                                 libresd_kv_slot_t *slots, uint32_t slot_count,
+                                 void *batch, uint32_t batch_size);
+
+/**
+ * @brief Open a store: load the newest checkpoint and replay the log after it
+ *
+ * @param fat Mounted FAT volume
+ * @param kv Store handle to fill
+ * @param path File path
+ * @param slots Index table (at least max_keys + max_keys / 4 slots)
+ * @param slot_count Entries in slots
+ * @param batch Write batch, a multiple of LIBRESD_SECTOR_SIZE
+ * @param batch_size Size of batch in bytes
+ * @return LIBRESD_OK, LIBRESD_ERR_INVALID_FS if the file is not a store,
+ *         LIBRESD_ERR_NO_MEM if slots is too small, or error
+ */
+libresd_err_t libresd_kv_open(libresd_fat_t *fat, libresd_kv_t *kv,
+                               const char *path,
+                               libresd_kv_slot_t *slots, uint32_t slot_count,
+                               void *batch, uint32_t batch_size);
+
+/**
+ * @brief Look up a key
+ *
+ * A value longer than cap is truncated to cap bytes; *vlen still reports
+ * its full length.
+ *
+ * @param kv Open store
+ * @param key Key bytes
+ * @param klen Key length (1..LIBRESD_KV_MAX_KEY)
+ * @param val Destination
+ * @param cap Size of val
+ * @param vlen Value length (can be NULL)
+ * @return LIBRESD_OK, LIBRESD_ERR_NOT_FOUND, or error
+ */
+libresd_err_t libresd_kv_get(libresd_kv_t *kv, const void *key, uint8_t klen,
+                              void *val, uint16_t cap, uint16_t *vlen);
+
+/**
+ * @brief Insert or replace a value
+ *
+ * The record sits in the write batch until the batch fills or the store is
+ * checkpointed.
+ *
+ * @param kv Open store
+ * @param key Key bytes
+ * @param klen Key length (1..LIBRESD_KV_MAX_KEY)
+ * @param val Value bytes
+ * @param vlen Value length (at most LIBRESD_KV_MAX_VALUE)
+ * @return LIBRESD_OK, LIBRESD_ERR_FULL if max_keys is reached or
+ *         compaction cannot free enough log, or error
+ */
+libresd_err_t libresd_kv_put(libresd_kv_t *kv, const void *key, uint8_t klen,
+                              const void *val, uint16_t vlen);
+
+/**
+ * @brief Remove a key
+ *
+ * @return LIBRESD_OK, LIBRESD_ERR_NOT_FOUND, or error
+ */
+libresd_err_t libresd_kv_delete(libresd_kv_t *kv, const void *key, uint8_t klen);
+
+/**
+ * @brief Call fn once for every live key, in index order
+ *
+ * Costs one sector read per key.
+ */
+libresd_err_t libresd_kv_iterate(libresd_kv_t *kv, libresd_kv_fn fn, void *ctx);
+
+/**
+ * @brief Reclaim dead log space, a bounded amount at a time
+ *
+ * Meant for idle time: each call examines at most max_records records at
+ * the old end of the log, copying live ones to the head and dropping the
+ * rest. The space becomes reusable at the next checkpoint.
+ *
+ * @param kv Open store
+ * @param max_records Work budget for this call
+ * @return LIBRESD_OK, LIBRESD_ERR_EOF when there is nothing left to
+ *         reclaim, or error
+ */
+libresd_err_t libresd_kv_compact(libresd_kv_t *kv, uint32_t max_records);
+
+/**
+ * @brief Write the batch, then the index, then flip the superblock
+ *
+ * Everything put or deleted so far survives a reset. Costs one write per
+ * 64 live keys plus two.
+ */
+libresd_err_t libresd_kv_checkpoint(libresd_kv_t *kv);
+
+/**
+ * @brief Checkpoint and forget the store
+ */
+libresd_err_t libresd_kv_close(libresd_kv_t *kv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRESD_ENABLE_KV && LIBRESD_ENABLE_WRITE */
+
+#endif /* LIBRESD_KV_H */
@@ -0,0 +1,174 @@
+/**
+ * @file libresd_ringfile.h
+ * @brief LibreSD fixed-capacity circular log files
+ *
+ * A ring file is an ordinary FAT file whose size is fixed when it is
+ * created. Records are appended until the file is full, after which the
+ * oldest records are overwritten. Once created, appending never touches
+ * the FAT or the directory entry - every write is a plain data sector
+ * write - so a "last N hours" log costs no allocation, truncation or
+ * fragmentation however long it runs.
+ *
+ * Layout (sector 0 of the file is the ring header, the rest is data):
+ *
+ *   header  magic, ring id, capacity, head/tail sector and sequence
+ *   data    [16-byte sector header][496 payload bytes] per sector
+ *
+ * Records are stored as a 16-bit length followed by the payload and may
+ * straddle sectors. Each data sector carries the ring id, a running
+ * sequence number and the offset of the first record that starts in it,
+ * so the oldest sector can always be parsed after the sector before it
+ * has been overwritten.
+ *
+ * The header is rewritten every sync_interval data sectors and on
+ * libresd_ringfile_sync(). After a power loss, libresd_ringfile_open()
+ * starts from the recorded head and walks forward over sectors whose
+ * sequence numbers continue, so at most sync_interval sectors are scanned
+ * and nothing that reached the card is lost. Records still in the RAM
+ * head sector are lost unless synced; a record that had only partly
+ * reached the card is dropped too, so appends continue after the last
+ * complete record.
+ */
+
+#ifndef LIBRESD_RINGFILE_H
+#define LIBRESD_RINGFILE_H
+
+#include "libresd_fat.h"
+
+#if LIBRESD_ENABLE_RINGFILE && LIBRESD_ENABLE_WRITE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Bytes of record stream carried by each data sector */
+#define LIBRESD_RINGFILE_PAYLOAD    (LIBRESD_SECTOR_SIZE - 16)
+
+/*============================================================================
+ * RING FILE STRUCTURES
+ *============================================================================*/
+
+/**
+ * @brief Open ring file
+ */
+typedef struct {
+    libresd_fat_t  *fat;                /**< Volume the file lives on */
+    uint32_t        id;                 /**< Tags this ring's sectors */
+    uint32_t        data_sectors;       /**< Capacity in data sectors */
+    uint32_t        head;               /**< Data sector being filled */
+    uint32_t        head_seq;           /**< Sequence number of head */
+    uint16_t        head_fill;          /**< Payload bytes used in head */
+    bool            wrapped;            /**< Data has been overwritten */
+    bool            head_dirty;         /**< head_buf not on the card yet */
+    uint32_t        sync_interval;      /**< Sectors between header writes */
+    uint32_t        unsynced;           /**< Sectors since last header write */
+    uint32_t        extent_count;       /**< Used entries in extent[] */
+    libresd_extent_t extent[LIBRESD_RINGFILE_MAX_EXTENTS]; /**< Card sector runs */
+    uint8_t         head_buf[LIBRESD_SECTOR_SIZE]; /**< Head data sector */
+} libresd_ringfile_t;
+
+/**
+ * @brief Oldest-first record cursor
+ */
+typedef struct {
+    uint32_t        sector;             /**< Data sector in buf */
+    uint32_t        seq;                /**< Expected sequence of sector */
+    uint16_t        offset;             /**< Read offset in payload */
+    uint16_t        fill;               /**< Valid payload bytes in buf */
+    uint8_t         buf[LIBRESD_SECTOR_SIZE];
+} libresd_ringfile_iter_t;
+
+/*============================================================================
+ * RING FILE OPERATIONS
+ *============================================================================*/
+
+/**
+ * @brief Create a ring file, replacing any file at path
+ *
+ * Allocates the whole file up front (one contiguous run if the volume has
+ * one) and writes an empty header. This is the only call that touches the
+ * FAT or the directory.
+ *
+ * @param fat Mounted FAT volume
+ * @param ring Ring handle to fill
+ * @param path File path
+ * @param capacity Record bytes to keep (rounded up to whole sectors)
+ * @param sync_interval Data sectors between header updates (0 = only on sync)
+ * @return LIBRESD_OK, LIBRESD_ERR_FULL, or error
+ */
+libresd_err_t libresd_ringfile_create(libresd_fat_t *fat, libresd_ringfile_t *ring,
+                                       const char *path, uint32_t capacity,
+                                       uint32_t sync_interval);
+
+/**
+ * @brief Open an existing ring file and recover its head
+ *
+ * @param fat Mounted FAT volume
+ * @param ring Ring handle to fill
+ * @param path File path
+ * @param sync_interval Data sectors between header updates (0 = only on sync)
+ * @return LIBRESD_OK, LIBRESD_ERR_INVALID_FS if the file is not a ring,
+ *         LIBRESD_ERR_NOT_SUPPORTED if it has more than
+ *         LIBRESD_RINGFILE_MAX_EXTENTS cluster runs, or error
+ */
+libresd_err_t libresd_ringfile_open(libresd_fat_t *fat, libresd_ringfile_t *ring,
+                                     const char *path, uint32_t sync_interval);
+
+/**
+ * @brief Append one record, overwriting the oldest data when full
+ *
+ * @param ring Open ring
+ * @param data Record bytes
+ * @param len Record length (at most a quarter of the ring capacity)
+ * @return LIBRESD_OK or error
+ */
+libresd_err_t libresd_ringfile_append(libresd_ringfile_t *ring,
+                                       const void *data, uint16_t len);
+
+/**
+ * @brief Write the partial head sector and the header
+ *
+ * Two single-sector writes; everything appended so far survives a reset.
+ */
+libresd_err_t libresd_ringfile_sync(libresd_ringfile_t *ring);
+
+/**
+ * @brief Sync and forget the ring
+ */
+libresd_err_t libresd_ringfile_close(libresd_ringfile_t *ring);
+
+/**
+ * @brief Position a cursor on the oldest record
+ *
+ * @param ring Open ring
+ * @param it Cursor to fill
+ * @return LIBRESD_OK, LIBRESD_ERR_EOF if the ring is empty, or error
+ */
+libresd_err_t libresd_ringfile_first(libresd_ringfile_t *ring,
+                                      libresd_ringfile_iter_t *it);
+
+/**
+ * @brief Read the record under the cursor and step past it
+ *
+ * A record longer than cap is truncated to cap bytes; *len still reports
+ * its full length. Appending while iterating is allowed, but a cursor
+ * that falls behind the overwrite point ends with LIBRESD_ERR_EOF.
+ *
+ * @param ring Open ring
+ * @param it Cursor from libresd_ringfile_first()
+ * @param buf Destination
+ * @param cap Size of buf
+ * @param len Record length (can be NULL)
+ * @return LIBRESD_OK, LIBRESD_ERR_EOF after the newest record, or error
+ */
+libresd_err_t libresd_ringfile_next(libresd_ringfile_t *ring,
+                                     libresd_ringfile_iter_t *it,
+                                     void *buf, uint16_t cap, uint16_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRESD_ENABLE_RINGFILE && LIBRESD_ENABLE_WRITE */
+
+#endif /* LIBRESD_RINGFILE_H */
@@ -0,0 +1,182 @@
+/**
+ * @file libresd_sched.h
+ * @brief LibreSD prioritised I/O scheduler
+ *
+ * Without a scheduler, card access is first come, first served: an icon
+ * read issued while the logger flushes 64 KB waits for the whole flush.
+ * Here clients queue requests instead of calling the file or sector
+ * functions directly, and the main loop (or an idle task) calls
+ * libresd_sched_poll(), which moves one bounded slice of one request:
+ *
+ *   - transfers are cut into slices of at most slice_bytes, so a large
+ *     write yields the card between slices
+ *   - each slice goes to the most urgent eligible request: lowest class
+ *     first, earliest deadline within a class, then submission order
+ *   - every request has a deadline: its own deadline_ms, or max_wait_ms
+ *     for interactive, LIBRESD_SCHED_NORMAL_WAIT_MS for normal and
+ *     LIBRESD_SCHED_BACKGROUND_WAIT_MS for background requests; a request
+ *     whose deadline has passed competes as interactive, so lower classes
+ *     are delayed but never starved
+ *   - requests on the same open file run in submission order, since each
+ *     slice continues at the file position the previous one left
+ *
+ * An interactive request therefore waits for at most the slice in
+ * progress plus the interactive requests queued before it. Keep
+ * slice_bytes small enough that one slice, including the card's write
+ * busy time, fits in the wait you can accept.
+ *
+ * Requests live in caller memory and must stay untouched until they
+ * complete. Everything runs in the caller's context; nothing here needs
+ * threads or interrupts.
+ */
+
+#ifndef LIBRESD_SCHED_H
+#define LIBRESD_SCHED_H
+
+#include "libresd_fat.h"
+
+#if LIBRESD_ENABLE_SCHED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*============================================================================
+ * SCHEDULER STRUCTURES
+ *============================================================================*/
+
+/**
+ * @brief Priority classes, most urgent first
+ */
+typedef enum {
+    LIBRESD_SCHED_INTERACTIVE = 0,      /**< UI reads, deadline max_wait_ms */
+    LIBRESD_SCHED_NORMAL,               /**< Ordinary application I/O */
+    LIBRESD_SCHED_BACKGROUND,           /**< Log flushes, copies, scrubbing */
+    LIBRESD_SCHED_CLASSES
+} libresd_sched_class_t;
+
+/**
+ * @brief Queued transfer
+ *
+ * Fill the first block and submit; the scheduler owns the rest.
+ */
+typedef struct libresd_sched_req {
+    libresd_file_t *file;               /**< Open file (at its position), NULL = raw sectors */
+    uint32_t        sector;             /**< First card sector when file is NULL */
+    uint8_t        *buf;                /**< Data */
+    uint32_t        len;                /**< Bytes (whole sectors for raw requests) */
+    bool            write;              /**< Write instead of read */
+    uint8_t         cls;                /**< libresd_sched_class_t */
+    uint32_t        deadline_ms;        /**< Relative deadline, 0 = class default */
+    void          (*done)(struct libresd_sched_req *req); /**< Completion callback (can be NULL) */
+    void           *user;               /**< For the callback */
+    
+    /* Scheduler state */
+    struct libresd_sched_req *next;     /**< Queue link */
+    libresd_err_t   status;             /**< LIBRESD_ERR_BUSY while queued */
+    uint32_t        transferred;        /**< Bytes moved so far */
+    uint32_t        queued_at;          /**< libresd_hal_get_ms() at submit */
+    uint32_t        due;                /**< Absolute deadline */
+    bool            started;            /**< First slice has run */
+} libresd_sched_req_t;
+
+/**
+ * @brief Per-class counters
+ */
+typedef struct {
+    uint32_t        submitted;          /**< Requests queued */
+    uint32_t        completed;          /**< Requests finished (any status) */
+    uint32_t        slices;             /**< Slices run */
+    uint64_t        bytes;              /**< Bytes moved */
+    uint32_t        wait_max_ms;        /**< Longest wait for the first slice */
+    uint32_t        wait_total_ms;      /**< Sum of first-slice waits */
+    uint32_t        latency_max_ms;     /**< Longest submit-to-completion time */
+    uint32_t        missed;             /**< Completed after their deadline */
+} libresd_sched_class_stats_t;
+
+/**
+ * @brief Scheduler counters
+ */
+typedef struct {
+    libresd_sched_class_stats_t cls[LIBRESD_SCHED_CLASSES];
+    uint32_t        depth;              /**< Requests queued now */
+    uint32_t        depth_max;          /**< Deepest the queue has been */
+} libresd_sched_stats_t;
+
+/**
+ * @brief Scheduler instance (one per card)
+ */
+typedef struct {
+    libresd_fat_t  *fat;                /**< Volume (and its card) */
+    libresd_sched_req_t *head;          /**< Queue in submission order */
+    libresd_sched_req_t *tail;
+    uint32_t        slice_bytes;        /**< Largest transfer per poll */
+    uint32_t        max_wait_ms;        /**< Interactive deadline */
+    libresd_sched_stats_t stats;
+} libresd_sched_t;
+
+/*============================================================================
+ * SCHEDULER OPERATIONS
+ *============================================================================*/
+
+/**
+ * @brief Set up a scheduler
+ *
+ * @param sched Scheduler to fill
+ * @param fat Mounted FAT volume
+ * @param slice_bytes Largest transfer per slice, rounded down to whole
+ *        sectors (0 = LIBRESD_SCHED_SLICE)
+ * @param max_wait_ms Deadline of interactive requests (0 = LIBRESD_SCHED_MAX_WAIT_MS)
+ */
+void libresd_sched_init(libresd_sched_t *sched, libresd_fat_t *fat,
+                        uint32_t slice_bytes, uint32_t max_wait_ms);
+
+/**
+ * @brief Queue a request
+ *
+ * @param sched Scheduler
+ * @param req Filled request; status reads LIBRESD_ERR_BUSY until it is done
+ * @return LIBRESD_OK, LIBRESD_ERR_INVALID_PARAM (raw length not whole
+ *         sectors, bad class), or LIBRESD_ERR_NOT_SUPPORTED (write with
+ *         LIBRESD_ENABLE_WRITE off)
+ */
+libresd_err_t libresd_sched_submit(libresd_sched_t *sched, libresd_sched_req_t *req);
+
+/**
+ * @brief Run one slice of the most urgent request
+ *
+ * A request completes when all of len has moved, a file read reaches the
+ * end of the file (status LIBRESD_OK; transferred tells how much arrived),
+ * or a slice fails.
+ * Its done callback runs before this returns.
+ *
+ * @return LIBRESD_OK if a slice ran, LIBRESD_ERR_EOF if the queue is empty
+ */
+libresd_err_t libresd_sched_poll(libresd_sched_t *sched);
+
+/**
+ * @brief Poll until a request has completed
+ *
+ * Other queued requests keep getting slices by priority meanwhile.
+ *
+ * @return The request's final status
+ */
+libresd_err_t libresd_sched_wait(libresd_sched_t *sched, libresd_sched_req_t *req);
+
+/**
+ * @brief Copy the counters
+ */
+void libresd_sched_get_stats(const libresd_sched_t *sched, libresd_sched_stats_t *stats);
+
+/**
+ * @brief Zero the counters (depth keeps its current value)
+ */
+void libresd_sched_reset_stats(libresd_sched_t *sched);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRESD_ENABLE_SCHED */
+
+#endif /* LIBRESD_SCHED_H */
@@ -189,6 +189,21 @@ libresd_err_t libresd_sd_write_sector(libresd_sd_t *sd, uint32_t sector,
 libresd_err_t libresd_sd_write_sectors(libresd_sd_t *sd, uint32_t sector,
                                         const uint8_t *buffer, uint32_t count);
 
+/**
+ * @brief Write the same block to consecutive sectors
+ * 
+ * One multi-block command, without a count-sized buffer; used to zero-fill
+ * directory clusters.
+ * 
+ * @param sd SD card state
+ * @param sector Starting sector number
+ * @param block Data for every sector (512 bytes)
+ * @param count Number of sectors
+ * @return LIBRESD_OK or error code
+ */
+libresd_err_t libresd_sd_fill_sectors(libresd_sd_t *sd, uint32_t sector,
+                                       const uint8_t *block, uint32_t count);
+
 /**
  * @brief Erase sectors
  * 
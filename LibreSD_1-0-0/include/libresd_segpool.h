@@ -0,0 +1,132 @@
+/**
+ * @file libresd_segpool.h
+ * @brief LibreSD segment file pool
+ *
+ * Recorders that start a new segment file every minute pay for a directory
+ * scan, a cluster allocation and several directory and FAT writes right
+ * when the switch happens, while samples pile up in RAM. A segment pool
+ * does that work ahead of time: libresd_segpool_fill(), called from the
+ * idle loop, creates the next files of a numbered series (names from a
+ * printf pattern such as "/REC/SEG%05u.BIN") and gives each a contiguous
+ * run of segment_bytes. libresd_segpool_next() then hands the oldest one
+ * over as an open file without touching the card.
+ *
+ * Pool files have size 0 and their run hanging off the directory entry,
+ * so until data is written a pool file lists as empty and a file that was
+ * being written at a power loss shows exactly what reached the card.
+ * libresd_segpool_close() gives back the part of the run a segment did
+ * not use, and libresd_segpool_trim() deletes the unused pool files at
+ * shutdown. libresd_fat_check() knows an empty file with a chain as
+ * preallocated and leaves the run alone; close the open segment (or
+ * checkpoint it) before checking, or repair cuts its chain at the size the
+ * directory entry last recorded.
+ */
+
+#ifndef LIBRESD_SEGPOOL_H
+#define LIBRESD_SEGPOOL_H
+
+#include "libresd_fat.h"
+
+#if LIBRESD_ENABLE_SEGPOOL && LIBRESD_ENABLE_WRITE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*============================================================================
+ * SEGMENT POOL STRUCTURES
+ *============================================================================*/
+
+/**
+ * @brief Pre-created file waiting in the pool
+ */
+typedef struct {
+    uint32_t        seq;                /**< Number in the series */
+    uint32_t        first_cluster;      /**< Preallocated run */
+    uint32_t        dir_sector;         /**< Sector of its directory entry */
+    uint16_t        dir_offset;         /**< Entry offset in that sector */
+} libresd_segpool_slot_t;
+
+/**
+ * @brief Segment pool
+ */
+typedef struct {
+    libresd_fat_t  *fat;                /**< Volume the segments live on */
+    const char     *pattern;            /**< Name pattern (caller memory) */
+    uint32_t        segment_bytes;      /**< Space reserved per segment */
+    uint32_t        next_seq;           /**< Number the next pool file gets */
+    uint8_t         depth;              /**< Pool files to keep ready */
+    uint8_t         count;              /**< Pool files ready now */
+    uint8_t         head;               /**< Oldest ready slot */
+    libresd_segpool_slot_t slot[LIBRESD_SEGPOOL_MAX];
+    uint32_t        handoffs;           /**< Segments handed out */
+    uint32_t        misses;             /**< Handed out with the pool empty */
+} libresd_segpool_t;
+
+/*============================================================================
+ * SEGMENT POOL OPERATIONS
+ *============================================================================*/
+
+/**
+ * @brief Set up a pool (no card access)
+ *
+ * @param pool Pool to fill in
+ * @param fat Mounted FAT volume
+ * @param pattern Path with one %u conversion (flags 0 and a width are
+ *        allowed), e.g. "/REC/SEG%05u.BIN"; must stay valid
+ * @param first_seq Number of the first segment
+ * @param segment_bytes Space to preallocate per segment
+ * @param depth Files to keep ready, 1..LIBRESD_SEGPOOL_MAX
+ * @return LIBRESD_OK or LIBRESD_ERR_INVALID_PARAM
+ */
+libresd_err_t libresd_segpool_init(libresd_segpool_t *pool, libresd_fat_t *fat,
+                                   const char *pattern, uint32_t first_seq,
+                                   uint32_t segment_bytes, uint8_t depth);
+
+/**
+ * @brief Pre-create one pool file if the pool is below depth
+ *
+ * Call from idle time until it returns LIBRESD_ERR_EOF. A file of the
+ * series that already exists with size 0 (left by a run that did not trim)
+ * is taken over with whatever run it has.
+ *
+ * @return LIBRESD_OK if a file was added, LIBRESD_ERR_EOF if the pool is
+ *         full, LIBRESD_ERR_EXISTS if the next name holds data,
+ *         LIBRESD_ERR_FULL or error code
+ */
+libresd_err_t libresd_segpool_fill(libresd_segpool_t *pool);
+
+/**
+ * @brief Open the next segment for writing
+ *
+ * Takes the oldest pool file and sets up file from RAM alone. With the
+ * pool empty the file is created on the spot (counted in misses).
+ *
+ * @param pool Pool
+ * @param file File handle to open (LIBRESD_READ | LIBRESD_WRITE)
+ * @param seq Output: number of the segment (can be NULL)
+ * @return LIBRESD_OK or error code
+ */
+libresd_err_t libresd_segpool_next(libresd_segpool_t *pool, libresd_file_t *file,
+                                   uint32_t *seq);
+
+/**
+ * @brief Close a segment and free the preallocated space it did not use
+ */
+libresd_err_t libresd_segpool_close(libresd_segpool_t *pool, libresd_file_t *file);
+
+/**
+ * @brief Delete the unused pool files (at shutdown)
+ *
+ * The series continues with the first deleted number, so a later fill
+ * recreates it with no gap.
+ */
+libresd_err_t libresd_segpool_trim(libresd_segpool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRESD_ENABLE_SEGPOOL && LIBRESD_ENABLE_WRITE */
+
+#endif /* LIBRESD_SEGPOOL_H */
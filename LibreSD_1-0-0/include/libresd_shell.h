@@ -34,6 +34,12 @@ typedef struct {
     /* Error callback - set to NULL to use print */
     void (*error)(const char *str);
     
+    /* Output sink - set with libresd_shell_set_sink, NULL = use print */
+    void (*write)(const char *data, uint32_t len);
+    char *out_buf;              /**< Sink buffer */
+    uint32_t out_size;          /**< Sink buffer capacity */
+    uint32_t out_len;           /**< Bytes waiting for the next flush */
+    
     /* Options */
     bool show_hidden;           /**< Show hidden files in ls */
     bool long_format;           /**< Use long format in ls */
@@ -61,6 +67,29 @@ void libresd_shell_init(libresd_shell_t *shell, libresd_sd_t *sd, libresd_fat_t
  */
 void libresd_shell_set_output(libresd_shell_t *shell, void (*print)(const char *));
 
+/**
+ * @brief Collect output in a buffer and hand it over in chunks
+ * 
+ * Instead of one print call per formatted piece, output is appended to buf
+ * and passed to write whenever buf is full, so a USB CDC or UART driver
+ * sees few large transfers. cat and head read file data straight into buf.
+ * Output is binary-safe. libresd_shell_exec() flushes after each command;
+ * call libresd_shell_flush() after calling commands directly.
+ * 
+ * @param shell Shell context
+ * @param write Bulk output function (NULL = back to print)
+ * @param buf Chunk buffer, kept until the sink is removed
+ * @param size Size of buf (a few KB for full-speed USB)
+ */
+void libresd_shell_set_sink(libresd_shell_t *shell,
+                            void (*write)(const char *data, uint32_t len),
+                            char *buf, uint32_t size);
+
+/**
+ * @brief Pass buffered output to the sink
+ */
+void libresd_shell_flush(libresd_shell_t *shell);
+
 /*============================================================================
  * DIRECTORY COMMANDS
  *============================================================================*/
@@ -227,6 +256,32 @@ libresd_err_t libresd_shell_stat(libresd_shell_t *shell, const char *path);
  */
 libresd_err_t libresd_shell_df(libresd_shell_t *shell);
 
+#if LIBRESD_ENABLE_CHECK
+
+/**
+ * @brief Check the volume (fsck)
+ * 
+ * @param shell Shell context
+ * @param repair Fix what is found
+ * @return LIBRESD_OK or error
+ */
+libresd_err_t libresd_shell_fsck(libresd_shell_t *shell, bool repair);
+
+#endif
+
+#if LIBRESD_ENABLE_DEFRAG && LIBRESD_ENABLE_WRITE
+
+/**
+ * @brief Defragment the volume or one path (defrag)
+ * 
+ * @param shell Shell context
+ * @param path File or directory tree (NULL = whole volume)
+ * @return LIBRESD_OK or error
+ */
+libresd_err_t libresd_shell_defrag(libresd_shell_t *shell, const char *path);
+
+#endif
+
 /**
  * @brief Display SD card info (sdinfo)
  * 
@@ -238,7 +293,9 @@ libresd_err_t libresd_shell_sdinfo(libresd_shell_t *shell);
 /**
  * @brief Find files matching pattern (find)
  * 
- * Simple glob pattern: * matches anything
+ * The pattern ('*' and '?', case-insensitive) is compiled once and
+ * applied to raw directory entries, so non-matching names are never
+ * decoded.
  * 
  * @param shell Shell context
  * @param path Starting directory
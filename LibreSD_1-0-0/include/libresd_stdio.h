@@ -0,0 +1,160 @@
+/**
+ * @file libresd_stdio.h
+ * @brief LibreSD POSIX descriptor layer for newlib/picolibc stdio
+ *
+ * Maps small-integer file descriptors onto libresd_fat_* so that fopen(),
+ * fprintf(), fread() and libraries written against POSIX I/O (SQLite VFS,
+ * image decoders, ...) run unchanged on the card.
+ *
+ * Two ways to hook it up:
+ *
+ *   1. Set LIBRESD_STDIO_SYSCALLS=1 and the library provides _open, _read,
+ *      _write, _lseek, _close, _fstat, _isatty and _unlink itself. Console
+ *      descriptors (0-2) are passed to libresd_stdio_console_read/_write.
+ *
+ *   2. Keep your SDK's syscalls and forward any fd >= LIBRESD_STDIO_FD_BASE
+ *      to the libresd_stdio_* functions below.
+ *
+ * Buffering: fstat reports the cluster size (capped at
+ * LIBRESD_STDIO_MAX_BLKSIZE) as st_blksize, which newlib uses to size each
+ * FILE buffer. With picolibc, or to pick the size explicitly, call
+ * setvbuf(fp, NULL, _IOFBF, libresd_stdio_bufsize()) after fopen. Flushes of
+ * a full buffer reach libresd_fat_write as whole sectors and go out as a
+ * single multi-block write instead of one read-modify-write per sector.
+ */
+
+#ifndef LIBRESD_STDIO_H
+#define LIBRESD_STDIO_H
+
+#include "libresd_fat.h"
+
+#if LIBRESD_ENABLE_STDIO
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief First descriptor handed out (0-2 are the console) */
+#define LIBRESD_STDIO_FD_BASE       3
+
+/*============================================================================
+ * SETUP
+ *============================================================================*/
+
+/**
+ * @brief Attach the descriptor table to a mounted volume
+ *
+ * Call after libresd_fat_mount(). Any descriptors still in the table are
+ * forgotten without being flushed.
+ *
+ * @param fat Mounted FAT filesystem (NULL detaches)
+ * @return LIBRESD_OK or error
+ */
+libresd_err_t libresd_stdio_init(libresd_fat_t *fat);
+
+/**
+ * @brief Recommended stdio buffer size for the attached volume
+ *
+ * @return Cluster size capped at LIBRESD_STDIO_MAX_BLKSIZE (one sector
+ *         when no volume is attached)
+ */
+size_t libresd_stdio_bufsize(void);
+
+/**
+ * @brief Get the LibreSD file behind a descriptor
+ *
+ * @param fd Descriptor from libresd_stdio_open()
+ * @return File handle, or NULL if fd is not open
+ */
+libresd_file_t *libresd_stdio_file(int fd);
+
+/*============================================================================
+ * POSIX-STYLE I/O
+ *
+ * All return -1 and set errno on failure, like their POSIX counterparts.
+ *============================================================================*/
+
+/**
+ * @brief Open a file
+ *
+ * @param path File path
+ * @param flags O_RDONLY/O_WRONLY/O_RDWR plus O_CREAT, O_TRUNC, O_APPEND, O_EXCL
+ * @param mode Ignored (FAT has no permission bits)
+ * @return Descriptor >= LIBRESD_STDIO_FD_BASE, or -1
+ */
+int libresd_stdio_open(const char *path, int flags, int mode);
+
+/**
+ * @brief Close a descriptor, flushing data and the directory entry
+ */
+int libresd_stdio_close(int fd);
+
+/**
+ * @brief Read up to len bytes
+ * @return Bytes read (0 at EOF), or -1
+ */
+int libresd_stdio_read(int fd, void *buf, size_t len);
+
+/**
+ * @brief Write len bytes
+ *
+ * Descriptors opened with O_APPEND always write at the current end of file.
+ *
+ * @return Bytes written (short count when the volume fills up), or -1
+ */
+int libresd_stdio_write(int fd, const void *buf, size_t len);
+
+/**
+ * @brief Reposition a descriptor
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END
+ * @return New offset, or -1
+ */
+long libresd_stdio_lseek(int fd, long offset, int whence);
+
+/**
+ * @brief Describe an open descriptor
+ */
+int libresd_stdio_fstat(int fd, struct stat *st);
+
+/**
+ * @brief Describe a path
+ */
+int libresd_stdio_stat(const char *path, struct stat *st);
+
+/**
+ * @brief Delete a file
+ */
+int libresd_stdio_unlink(const char *path);
+
+/**
+ * @brief Report whether a descriptor is a terminal
+ * @return 1 for console descriptors, 0 for files (sets errno ENOTTY)
+ */
+int libresd_stdio_isatty(int fd);
+
+/*============================================================================
+ * CONSOLE HOOKS (weak - override in your port)
+ *============================================================================*/
+
+/**
+ * @brief Read from stdin when LIBRESD_STDIO_SYSCALLS owns the syscalls
+ * @return Bytes read, or -1 (default: -1, errno EBADF)
+ */
+int libresd_stdio_console_read(int fd, void *buf, size_t len);
+
+/**
+ * @brief Write to stdout/stderr when LIBRESD_STDIO_SYSCALLS owns the syscalls
+ * @return Bytes written (default: discards and returns len)
+ */
+int libresd_stdio_console_write(int fd, const void *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRESD_ENABLE_STDIO */
+
+#endif /* LIBRESD_STDIO_H */
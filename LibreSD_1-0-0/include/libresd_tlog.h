@@ -0,0 +1,136 @@
+/**
+ * @file libresd_tlog.h
+ * @brief LibreSD time-indexed append logs
+ *
+ * Samples are appended with a timestamp into fixed-size blocks:
+ *
+ *   block   [magic][t_first][t_last][count][used] then records
+ *   record  [u32 t][u16 len][payload]
+ *
+ * Every index_every-th block also gets an entry in a small side file:
+ *
+ *   entry   [t_first][block number][cluster holding the block][reserved]
+ *
+ * A range query binary-searches the side file, jumps straight to the
+ * recorded cluster with libresd_fat_seek_cluster() and reads only the
+ * blocks that can hold matching samples: about log2(entries) index reads
+ * plus at most index_every blocks of overscan, however large the log is.
+ *
+ * Timestamps are caller-defined 32-bit values (seconds, ticks, ...) and
+ * must not decrease. The block being filled lives in RAM until it is full
+ * or libresd_tlog_sync() writes it out.
+ */
+
+#ifndef LIBRESD_TLOG_H
+#define LIBRESD_TLOG_H
+
+#include "libresd_fat.h"
+
+#if LIBRESD_ENABLE_TLOG && LIBRESD_ENABLE_WRITE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*============================================================================
+ * TIME LOG STRUCTURES
+ *============================================================================*/
+
+/**
+ * @brief Query callback
+ *
+ * @param ctx Caller context
+ * @param t Sample timestamp
+ * @param data Sample payload (valid during the call only)
+ * @param len Payload length
+ * @return true to continue, false to stop the query
+ */
+typedef bool (*libresd_tlog_fn)(void *ctx, uint32_t t, const void *data, uint16_t len);
+
+/**
+ * @brief Open time log
+ */
+typedef struct {
+    libresd_fat_t  *fat;                /**< Volume the log lives on */
+    libresd_file_t  data;               /**< Block file */
+    libresd_file_t  index;              /**< Sparse index file */
+    uint32_t        index_every;        /**< Blocks per index entry */
+    uint32_t        blocks;             /**< Blocks before the RAM block */
+    uint32_t        cur_cluster;        /**< Cluster of the RAM block's slot (0 = none yet) */
+    uint32_t        tail_cluster;       /**< Cluster of block (blocks - 1) */
+    uint32_t        index_count;        /**< Entries in the index file */
+    uint32_t        t_last;             /**< Newest timestamp appended */
+    uint16_t        count;              /**< Records in the RAM block */
+    uint16_t        used;               /**< Bytes used in the RAM block */
+    uint8_t         block[LIBRESD_TLOG_BLOCK_SIZE]; /**< Block being filled */
+} libresd_tlog_t;
+
+/*============================================================================
+ * TIME LOG OPERATIONS
+ *============================================================================*/
+
+/**
+ * @brief Open a time log, creating its files if needed
+ *
+ * A block left partial by libresd_tlog_sync() is picked up again. Index
+ * entries pointing past the data (power loss between the two files) are
+ * dropped.
+ *
+ * @param fat Mounted FAT volume
+ * @param log Log handle to fill
+ * @param data_path Block file path
+ * @param index_path Index file path
+ * @param index_every Blocks per index entry (0 = 16)
+ * @return LIBRESD_OK, LIBRESD_ERR_NOT_SUPPORTED if clusters are smaller
+ *         than LIBRESD_TLOG_BLOCK_SIZE, or error
+ */
+libresd_err_t libresd_tlog_open(libresd_fat_t *fat, libresd_tlog_t *log,
+                                 const char *data_path, const char *index_path,
+                                 uint32_t index_every);
+
+/**
+ * @brief Append one sample
+ *
+ * @param log Open log
+ * @param t Timestamp (not older than the previous sample)
+ * @param data Payload
+ * @param len Payload length (at most LIBRESD_TLOG_BLOCK_SIZE - 22)
+ * @return LIBRESD_OK, LIBRESD_ERR_INVALID_PARAM, or error
+ */
+libresd_err_t libresd_tlog_append(libresd_tlog_t *log, uint32_t t,
+                                   const void *data, uint16_t len);
+
+/**
+ * @brief Write the partial block and commit both files
+ */
+libresd_err_t libresd_tlog_sync(libresd_tlog_t *log);
+
+/**
+ * @brief Sync and close both files
+ */
+libresd_err_t libresd_tlog_close(libresd_tlog_t *log);
+
+/**
+ * @brief Stream every sample with t1 <= t <= t2, oldest first
+ *
+ * Appending may continue after the query returns; the write position is
+ * restored without a chain walk.
+ *
+ * @param log Open log
+ * @param t1 First timestamp wanted
+ * @param t2 Last timestamp wanted
+ * @param fn Called once per matching sample
+ * @param ctx Passed to fn
+ * @param matched Samples delivered (can be NULL)
+ * @return LIBRESD_OK (also when fn stopped early), or error
+ */
+libresd_err_t libresd_tlog_query(libresd_tlog_t *log, uint32_t t1, uint32_t t2,
+                                  libresd_tlog_fn fn, void *ctx, uint32_t *matched);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRESD_ENABLE_TLOG && LIBRESD_ENABLE_WRITE */
+
+#endif /* LIBRESD_TLOG_H */
@@ -164,6 +164,14 @@ typedef struct {
     uint16_t    dir_offset;                     /**< Offset in directory sector */
 } libresd_fileinfo_t;
 
+/**
+ * @brief Run of adjacent card sectors holding part of a file
+ */
+typedef struct {
+    uint32_t    sector;                         /**< First card sector (LBA) */
+    uint32_t    count;                          /**< Sectors in the run */
+} libresd_extent_t;
+
 /*============================================================================
  * FILE HANDLE (opaque to user)
  *============================================================================*/
@@ -185,6 +193,15 @@ typedef struct {
     uint8_t     buffer[LIBRESD_SECTOR_SIZE];
     uint32_t    buffer_sector;                  /**< Sector currently in buffer */
     bool        buffer_dirty;                   /**< Buffer modified? */
+    
+#if LIBRESD_STREAM_BUFFER
+    /* Caller-attached stream buffer (libresd_fat_setvbuf) */
+    uint8_t    *rbuf;                           /**< Buffer memory, NULL = none */
+    uint32_t    rbuf_size;                      /**< Capacity (whole sectors) */
+    uint32_t    rbuf_pos;                       /**< Next unread byte */
+    uint32_t    rbuf_len;                       /**< Valid read-ahead bytes */
+    uint32_t    wbuf_len;                       /**< Pending formatted output */
+#endif
 } libresd_file_t;
 
 /*============================================================================
@@ -197,6 +214,11 @@ typedef struct {
     uint32_t    current_cluster;                /**< Current cluster */
     uint32_t    current_sector;                 /**< Current sector in cluster */
     uint16_t    entry_offset;                   /**< Entry offset in sector */
+#if LIBRESD_ENABLE_SNAPSHOT
+    bool        snapshot;                       /**< Listing comes from the snapshot */
+    uint32_t    snap_next;                      /**< Next snapshot entry */
+    uint32_t    snap_end;                       /**< End of the listing */
+#endif
     uint8_t     buffer[LIBRESD_SECTOR_SIZE];    /**< Sector buffer */
 } libresd_dir_t;
 
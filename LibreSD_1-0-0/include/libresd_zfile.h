@@ -0,0 +1,170 @@
+/**
+ * @file libresd_zfile.h
+ * @brief LibreSD compressed stream files
+ *
+ * A compressed file is a byte stream cut into LIBRESD_ZFILE_BLOCK_SIZE
+ * blocks, each compressed on its own and written with libresd_fat_write():
+ *
+ *   block   [16-byte header][payload][padding]
+ *   header  magic, flags, filter, raw length, payload length, span, check
+ *
+ * Payloads use the LZ4 block format, so a host can unpack them with any
+ * LZ4 library. A block that does not shrink is stored as is. Since fewer
+ * bytes cross the SPI bus, write throughput scales with the compression
+ * ratio.
+ *
+ * An optional prefilter helps integer sample streams: DELTA replaces each
+ * little-endian element by its difference to the previous one, SHUFFLE
+ * groups the n-th bytes of all elements together. Both work inside one
+ * block, so every block still decodes on its own.
+ *
+ * An optional index file holds one 8-byte entry (file offset, cluster) per
+ * full block, so libresd_zfile_seek() costs one index read and one block
+ * decode. Without it, seeking walks the block headers.
+ *
+ * libresd_zfile_sync() writes the partial last block; later writes replace
+ * it in place, so every block but the last is always full. The block that
+ * replaces a synced one is committed as soon as it is written, which keeps
+ * the synced bytes at risk only for the duration of that write.
+ */
+
+#ifndef LIBRESD_ZFILE_H
+#define LIBRESD_ZFILE_H
+
+#include "libresd_fat.h"
+
+#if LIBRESD_ENABLE_ZFILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief Worst-case payload size of one block */
+#define LIBRESD_ZFILE_BOUND     (LIBRESD_ZFILE_BLOCK_SIZE + LIBRESD_ZFILE_BLOCK_SIZE / 255 + 16)
+
+/** @brief Prefilter element width: 1, 2 or 4 bytes */
+#define LIBRESD_ZFILE_W8        0x01
+#define LIBRESD_ZFILE_W16       0x02
+#define LIBRESD_ZFILE_W32       0x04
+
+/** @brief Prefilter steps, OR-ed with a width */
+#define LIBRESD_ZFILE_DELTA     0x10
+#define LIBRESD_ZFILE_SHUFFLE   0x20
+
+/*============================================================================
+ * COMPRESSED FILE STRUCTURES
+ *============================================================================*/
+
+/**
+ * @brief Open compressed file
+ */
+typedef struct {
+    libresd_fat_t  *fat;                /**< Volume the file lives on */
+    libresd_file_t  data;               /**< Block file */
+    libresd_file_t  index;              /**< Index file (if has_index) */
+    bool            has_index;          /**< Index file is open */
+    bool            writing;            /**< Opened for writing */
+    bool            tail_lazy;          /**< tail_cluster ends at tail_off */
+    uint8_t         filter;             /**< Prefilter for new blocks */
+    uint32_t        blocks;             /**< Full blocks before raw */
+    uint32_t        index_count;        /**< Entries in the index file */
+    uint32_t        size;               /**< Uncompressed stream length */
+    uint16_t        raw_len;            /**< Valid bytes in raw */
+    uint16_t        raw_pos;            /**< Read position in raw */
+    uint32_t        tail_off;           /**< File offset of the block in raw */
+    uint32_t        tail_cluster;       /**< Cluster holding tail_off */
+    uint16_t        tail_span;          /**< Bytes it already takes on the card */
+    bool            loaded;             /**< raw holds block number blocks */
+    uint16_t        table[1 << LIBRESD_ZFILE_HASH_BITS]; /**< Match finder */
+    uint8_t         raw[LIBRESD_ZFILE_BLOCK_SIZE];       /**< Current block */
+    uint8_t         comp[LIBRESD_ZFILE_BOUND];           /**< Its payload */
+} libresd_zfile_t;
+
+/*============================================================================
+ * COMPRESSED FILE OPERATIONS
+ *============================================================================*/
+
+/**
+ * @brief Open a compressed file
+ *
+ * With LIBRESD_WRITE the file is appended to (or emptied with
+ * LIBRESD_TRUNCATE). A partial last block is picked up again, and index
+ * entries the data has outrun (power loss) are rebuilt. Reading and
+ * writing the same handle is not supported.
+ *
+ * @param fat Mounted FAT volume
+ * @param zf Handle to fill
+ * @param path Block file path
+ * @param index_path Index file path (NULL = no index)
+ * @param mode LIBRESD_READ, or LIBRESD_WRITE with LIBRESD_CREATE / LIBRESD_TRUNCATE
+ * @param filter Prefilter for blocks written through this handle (0 = none)
+ * @return LIBRESD_OK, LIBRESD_ERR_INVALID_FS on a damaged block, or error
+ */
+libresd_err_t libresd_zfile_open(libresd_fat_t *fat, libresd_zfile_t *zf,
+                                  const char *path, const char *index_path,
+                                  uint8_t mode, uint8_t filter);
+
+/**
+ * @brief Read uncompressed bytes
+ *
+ * @param zf File opened for reading
+ * @param buf Destination
+ * @param len Bytes wanted
+ * @param got Bytes delivered (can be NULL)
+ * @return LIBRESD_OK (got < len at the end of the stream), or error
+ */
+libresd_err_t libresd_zfile_read(libresd_zfile_t *zf, void *buf, uint32_t len,
+                                  uint32_t *got);
+
+/**
+ * @brief Move the read position
+ *
+ * @param zf File opened for reading
+ * @param pos Uncompressed offset (at most the stream length)
+ * @return LIBRESD_OK, LIBRESD_ERR_SEEK, or error
+ */
+libresd_err_t libresd_zfile_seek(libresd_zfile_t *zf, uint32_t pos);
+
+/**
+ * @brief Current uncompressed position
+ */
+uint32_t libresd_zfile_tell(const libresd_zfile_t *zf);
+
+/**
+ * @brief Uncompressed stream length
+ */
+uint32_t libresd_zfile_size(const libresd_zfile_t *zf);
+
+#if LIBRESD_ENABLE_WRITE
+
+/**
+ * @brief Append uncompressed bytes
+ *
+ * Each time a block fills it is compressed and written.
+ *
+ * @param zf File opened for writing
+ * @param data Bytes to append
+ * @param len Number of bytes
+ * @return LIBRESD_OK or error
+ */
+libresd_err_t libresd_zfile_write(libresd_zfile_t *zf, const void *data, uint32_t len);
+
+/**
+ * @brief Write the partial block and commit both files
+ */
+libresd_err_t libresd_zfile_sync(libresd_zfile_t *zf);
+
+#endif /* LIBRESD_ENABLE_WRITE */
+
+/**
+ * @brief Sync (when writing) and close both files
+ */
+libresd_err_t libresd_zfile_close(libresd_zfile_t *zf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRESD_ENABLE_ZFILE */
+
+#endif /* LIBRESD_ZFILE_H */
@@ -0,0 +1,399 @@
+/**
+ * @file libresd_accel.c
+ * @brief LibreSD Persisted Mount State Implementation
+ */
+
+#include "libresd_accel.h"
+#include <string.h>
+
+#if LIBRESD_ENABLE_ACCEL && LIBRESD_ENABLE_WRITE
+
+/*============================================================================
+ * ON-CARD FORMAT
+ *============================================================================*/
+
+#define ACCEL_MAGIC             0x4343414CUL    /* "LACC" */
+#define ACCEL_VERSION           1
+#define ACCEL_HASH_SEED         2166136261UL
+#define ACCEL_MAX_EXTENTS       8
+
+#define ACCEL_FLAG_DIRTY        0x0001
+#define ACCEL_FLAG_SNAPSHOT     0x0002
+
+/* Header sector (file sector 0) */
+#define AH_MAGIC                0
+#define AH_VERSION              4
+#define AH_FLAGS                6
+#define AH_SERIAL               8
+#define AH_CLUSTERS             12
+#define AH_FAT_SECTORS          16
+#define AH_GENERATION           20
+#define AH_FREE                 24
+#define AH_HINT                 28
+#define AH_SNAP_COUNT           32
+#define AH_SNAP_ROOT            36
+#define AH_SNAP_BYTES           40
+#define AH_SNAP_ENTRY           44
+#define AH_SNAP_CHECK           48
+#define AH_CHECK                52
+
+#define READ16(buf, off)    ((uint16_t)(buf)[off] | ((uint16_t)(buf)[(off)+1] << 8))
+#define READ32(buf, off)    ((uint32_t)(buf)[off] | ((uint32_t)(buf)[(off)+1] << 8) | \
+                             ((uint32_t)(buf)[(off)+2] << 16) | ((uint32_t)(buf)[(off)+3] << 24))
+
+#define WRITE16(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+} while(0)
+
+#define WRITE32(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+    (buf)[(off)+2] = ((v) >> 16) & 0xFF; \
+    (buf)[(off)+3] = ((v) >> 24) & 0xFF; \
+} while(0)
+
+/**
+ * @brief State file location
+ */
+typedef struct {
+    libresd_extent_t    extent[ACCEL_MAX_EXTENTS];
+    uint32_t            count;          /* Runs in extent[] */
+    uint32_t            sectors;        /* File size in sectors */
+} accel_map_t;
+
+/*============================================================================
+ * INTERNAL HELPERS
+ *============================================================================*/
+
+/**
+ * @brief FNV-1a
+ */
+static uint32_t accel_hash(uint32_t h, const uint8_t *p, uint32_t n) {
+    while (n--) {
+        h ^= *p++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+/**
+ * @brief Hash of what another host would change when writing the volume
+ *
+ * A full FAT hash would cost the very scan this module avoids, so only
+ * evenly spaced FAT sectors are read, along with the FSInfo sector (whose
+ * free count and next-free hint every desktop OS updates; LibreSD never
+ * writes it) and the first root directory sector.
+ */
+static libresd_err_t accel_generation(libresd_fat_t *fat, uint8_t *buf, uint32_t *gen) {
+    uint32_t h = ACCEL_HASH_SEED;
+    uint32_t sector, i;
+    libresd_err_t err;
+    
+    if (fat->fs_type == LIBRESD_FS_FAT32) {
+        if (fat->fsinfo_sector != 0) {
+            err = libresd_sd_read_sector(fat->sd, fat->fsinfo_sector, buf);
+            if (err != LIBRESD_OK) return err;
+            h = accel_hash(h, buf, LIBRESD_SECTOR_SIZE);
+        }
+        sector = libresd_fat_cluster_to_sector(fat, fat->root_cluster);
+    } else {
+        sector = fat->root_start_sector;
+    }
+    
+    err = libresd_sd_read_sector(fat->sd, sector, buf);
+    if (err != LIBRESD_OK) return err;
+    h = accel_hash(h, buf, LIBRESD_SECTOR_SIZE);
+    
+    for (i = 0; i < LIBRESD_ACCEL_SAMPLES; i++) {
+        sector = fat->fat_start_sector +
+                 (uint32_t)((uint64_t)fat->sectors_per_fat * i / LIBRESD_ACCEL_SAMPLES);
+        err = libresd_sd_read_sector(fat->sd, sector, buf);
+        if (err != LIBRESD_OK) return err;
+        h = accel_hash(h, buf, LIBRESD_SECTOR_SIZE);
+    }
+    
+    *gen = h;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Find the state file and its sector runs
+ */
+static libresd_err_t accel_map(libresd_fat_t *fat, const char *path, accel_map_t *map) {
+    libresd_fileinfo_t info;
+    libresd_err_t err;
+    
+    err = libresd_fat_stat(fat, path, &info);
+    if (err != LIBRESD_OK) return err;
+    if (info.attr & LIBRESD_ATTR_DIRECTORY) return LIBRESD_ERR_NOT_FILE;
+    
+    map->sectors = info.size / LIBRESD_SECTOR_SIZE;
+    if (map->sectors == 0) return LIBRESD_ERR_INVALID_FS;
+    
+    return libresd_fat_chain_extents(fat, info.first_cluster, map->sectors,
+                                     map->extent, ACCEL_MAX_EXTENTS, &map->count);
+}
+
+/**
+ * @brief Card sector of file sector n, and how many follow it in the run
+ */
+static uint32_t accel_sector(const accel_map_t *map, uint32_t n, uint32_t *run) {
+    uint32_t i;
+    
+    for (i = 0; i < map->count; i++) {
+        if (n < map->extent[i].count) {
+            *run = map->extent[i].count - n;
+            return map->extent[i].sector + n;
+        }
+        n -= map->extent[i].count;
+    }
+    *run = 0;
+    return 0;
+}
+
+#if LIBRESD_ENABLE_SNAPSHOT
+
+/**
+ * @brief Read or write bytes starting at file sector 1
+ *
+ * Whole sectors move with one multi-block transfer per run; a partial
+ * last sector goes through buf.
+ */
+static libresd_err_t accel_io(libresd_fat_t *fat, const accel_map_t *map, uint8_t *data,
+                              uint32_t bytes, bool write, uint8_t *buf) {
+    uint32_t whole = bytes / LIBRESD_SECTOR_SIZE;
+    uint32_t tail = bytes % LIBRESD_SECTOR_SIZE;
+    uint32_t n = 1, run, sector;
+    libresd_err_t err;
+
+    if (1 + whole + (tail ? 1 : 0) > map->sectors) return LIBRESD_ERR_FULL;
+
+    while (n < 1 + whole) {
+        sector = accel_sector(map, n, &run);
+        if (run > 1 + whole - n) run = 1 + whole - n;
+
+        if (write) {
+            err = libresd_sd_write_sectors(fat->sd, sector, data, run);
+        } else {
+            err = libresd_sd_read_sectors(fat->sd, sector, data, run);
+        }
+        if (err != LIBRESD_OK) return err;
+
+        data += run * LIBRESD_SECTOR_SIZE;
+        n += run;
+    }
+
+    if (tail) {
+        sector = accel_sector(map, n, &run);
+        if (write) {
+            memset(buf, 0, LIBRESD_SECTOR_SIZE);
+            memcpy(buf, data, tail);
+            return libresd_sd_write_sector(fat->sd, sector, buf);
+        }
+        err = libresd_sd_read_sector(fat->sd, sector, buf);
+        if (err != LIBRESD_OK) return err;
+        memcpy(data, buf, tail);
+    }
+    return LIBRESD_OK;
+}
+
+#endif /* LIBRESD_ENABLE_SNAPSHOT */
+
+static libresd_err_t accel_write_header(libresd_fat_t *fat, const accel_map_t *map,
+                                        uint8_t *hdr) {
+    uint32_t run;
+
+    WRITE32(hdr, AH_CHECK, accel_hash(ACCEL_HASH_SEED, hdr, AH_CHECK));
+    return libresd_sd_write_sector(fat->sd, accel_sector(map, 0, &run), hdr);
+}
+
+/**
+ * @brief Create the state file with a header that never validates
+ */
+static libresd_err_t accel_create(libresd_fat_t *fat, const char *path, uint32_t size,
+                                  uint8_t *buf) {
+    libresd_file_t file;
+    accel_map_t map;
+    libresd_err_t err;
+
+    err = libresd_fat_create_file(fat, path, LIBRESD_ATTR_HIDDEN | LIBRESD_ATTR_SYSTEM,
+                                  NULL, NULL);
+    if (err != LIBRESD_OK) return err;
+
+    err = libresd_fat_open(fat, &file, path, LIBRESD_WRITE);
+    if (err != LIBRESD_OK) return err;
+    err = libresd_fat_preallocate(fat, &file, size);
+    libresd_fat_close(fat, &file);
+    if (err != LIBRESD_OK) return err;
+
+    /* The clusters may hold an old state file's header */
+    err = accel_map(fat, path, &map);
+    if (err != LIBRESD_OK) return err;
+
+    memset(buf, 0, LIBRESD_SECTOR_SIZE);
+    return accel_write_header(fat, &map, buf);
+}
+
+/*============================================================================
+ * PERSISTED MOUNT STATE
+ *============================================================================*/
+
+libresd_err_t libresd_accel_load(libresd_fat_t *fat, const char *path,
+                                  void *buf, uint32_t size) {
+    uint8_t hdr[LIBRESD_SECTOR_SIZE];
+    uint8_t scratch[LIBRESD_SECTOR_SIZE];
+    accel_map_t map;
+    uint32_t gen, run;
+    uint16_t flags;
+    libresd_err_t err;
+
+    if (!fat) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+    if (!path) path = LIBRESD_ACCEL_PATH;
+
+    err = accel_map(fat, path, &map);
+    if (err == LIBRESD_ERR_NOT_FOUND) {
+        err = accel_create(fat, path, LIBRESD_ACCEL_RESERVE, hdr);
+        return (err == LIBRESD_OK) ? LIBRESD_ERR_NOT_FOUND : err;
+    }
+    if (err == LIBRESD_ERR_NO_MEM || err == LIBRESD_ERR_INVALID_FS) {
+        /* Too fragmented or too short: save() fixes it */
+        return LIBRESD_ERR_NOT_FOUND;
+    }
+    if (err != LIBRESD_OK) return err;
+
+    err = libresd_sd_read_sector(fat->sd, accel_sector(&map, 0, &run), hdr);
+    if (err != LIBRESD_OK) return err;
+
+    flags = READ16(hdr, AH_FLAGS);
+    if (READ32(hdr, AH_MAGIC) != ACCEL_MAGIC ||
+        READ16(hdr, AH_VERSION) != ACCEL_VERSION ||
+        READ32(hdr, AH_CHECK) != accel_hash(ACCEL_HASH_SEED, hdr, AH_CHECK) ||
+        (flags & ACCEL_FLAG_DIRTY) ||
+        READ32(hdr, AH_SERIAL) != fat->volume_serial ||
+        READ32(hdr, AH_CLUSTERS) != fat->cluster_count ||
+        READ32(hdr, AH_FAT_SECTORS) != fat->sectors_per_fat) {
+        return LIBRESD_ERR_NOT_FOUND;
+    }
+
+    err = accel_generation(fat, scratch, &gen);
+    if (err != LIBRESD_OK) return err;
+    if (READ32(hdr, AH_GENERATION) != gen) return LIBRESD_ERR_NOT_FOUND;
+
+#if LIBRESD_ENABLE_SNAPSHOT
+    if ((flags & ACCEL_FLAG_SNAPSHOT) && buf &&
+        READ16(hdr, AH_SNAP_ENTRY) == sizeof(libresd_snap_entry_t)) {
+        uint32_t pad = (uint32_t)(-(uintptr_t)buf & 3);
+        uint32_t bytes = READ32(hdr, AH_SNAP_BYTES);
+        uint8_t *table = (uint8_t *)buf + pad;
+
+        if (size >= pad && size - pad >= bytes) {
+            err = accel_io(fat, &map, table, bytes, false, scratch);
+            if (err != LIBRESD_OK) return err;
+
+            if (accel_hash(ACCEL_HASH_SEED, table, bytes) == READ32(hdr, AH_SNAP_CHECK)) {
+                fat_snapshot_adopt(fat, table, READ32(hdr, AH_SNAP_COUNT),
+                                   READ32(hdr, AH_SNAP_ROOT), bytes);
+            }
+        }
+    }
+#else
+    (void)buf;
+    (void)size;
+#endif
+
+    fat->free_clusters = READ32(hdr, AH_FREE);
+    fat->last_alloc_cluster = READ32(hdr, AH_HINT);
+
+    /* Until the next save, this state may go out of date */
+    WRITE16(hdr, AH_FLAGS, flags | ACCEL_FLAG_DIRTY);
+    return accel_write_header(fat, &map, hdr);
+}
+
+libresd_err_t libresd_accel_save(libresd_fat_t *fat, const char *path) {
+    uint8_t hdr[LIBRESD_SECTOR_SIZE];
+    uint8_t scratch[LIBRESD_SECTOR_SIZE];
+    accel_map_t map;
+    uint32_t need = LIBRESD_SECTOR_SIZE;
+    uint32_t gen;
+    uint16_t flags = 0;
+    libresd_err_t err;
+    
+    if (!fat) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+    if (!path) path = LIBRESD_ACCEL_PATH;
+    
+    err = libresd_fat_sync(fat);
+    if (err != LIBRESD_OK) return err;
+    
+#if LIBRESD_ENABLE_SNAPSHOT
+    if (fat_snapshot_fresh(fat)) {
+        need += (fat->snapshot.bytes + LIBRESD_SECTOR_SIZE - 1) &
+                ~(uint32_t)(LIBRESD_SECTOR_SIZE - 1);
+    }
+#endif
+    
+    err = accel_map(fat, path, &map);
+    if (err == LIBRESD_ERR_NOT_FOUND) {
+        err = accel_create(fat, path, (need > LIBRESD_ACCEL_RESERVE) ?
+                           need : LIBRESD_ACCEL_RESERVE, hdr);
+        if (err == LIBRESD_OK) err = accel_map(fat, path, &map);
+    } else if (err == LIBRESD_OK && map.sectors * LIBRESD_SECTOR_SIZE < need) {
+        libresd_file_t file;
+    
+        err = libresd_fat_open(fat, &file, path, LIBRESD_WRITE);
+        if (err == LIBRESD_OK) {
+            err = libresd_fat_preallocate(fat, &file, need);
+            libresd_fat_close(fat, &file);
+        }
+        if (err == LIBRESD_OK) err = accel_map(fat, path, &map);
+    }
+    if (err == LIBRESD_ERR_NO_MEM) {
+        err = libresd_fat_make_contiguous(fat, path, NULL, 0);
+        if (err == LIBRESD_OK) err = accel_map(fat, path, &map);
+    }
+    if (err != LIBRESD_OK) return err;
+    
+    /* Growing or moving the file wrote the directory: the generation is
+     * taken only now, after the last FAT and directory change */
+    err = libresd_fat_sync(fat);
+    if (err == LIBRESD_OK) err = accel_generation(fat, scratch, &gen);
+    if (err != LIBRESD_OK) return err;
+    
+    memset(hdr, 0, sizeof(hdr));
+    WRITE32(hdr, AH_MAGIC, ACCEL_MAGIC);
+    WRITE16(hdr, AH_VERSION, ACCEL_VERSION);
+    WRITE32(hdr, AH_SERIAL, fat->volume_serial);
+    WRITE32(hdr, AH_CLUSTERS, fat->cluster_count);
+    WRITE32(hdr, AH_FAT_SECTORS, fat->sectors_per_fat);
+    WRITE32(hdr, AH_GENERATION, gen);
+    WRITE32(hdr, AH_FREE, fat->free_clusters);
+    WRITE32(hdr, AH_HINT, fat->last_alloc_cluster);
+    
+#if LIBRESD_ENABLE_SNAPSHOT
+    if (fat_snapshot_fresh(fat)) {
+        const libresd_snapshot_t *snap = &fat->snapshot;
+    
+        err = accel_io(fat, &map, (uint8_t *)snap->entries, snap->bytes, true, scratch);
+        if (err == LIBRESD_OK) {
+            flags |= ACCEL_FLAG_SNAPSHOT;
+            WRITE32(hdr, AH_SNAP_COUNT, snap->count);
+            WRITE32(hdr, AH_SNAP_ROOT, snap->root_count);
+            WRITE32(hdr, AH_SNAP_BYTES, snap->bytes);
+            WRITE16(hdr, AH_SNAP_ENTRY, sizeof(libresd_snap_entry_t));
+            WRITE32(hdr, AH_SNAP_CHECK, accel_hash(ACCEL_HASH_SEED,
+                                                   (const uint8_t *)snap->entries,
+                                                   snap->bytes));
+        } else if (err != LIBRESD_ERR_FULL) {
+            return err;
+        }
+    }
+#endif
+    
+    /* Header last: a save cut short leaves the dirty header in place */
+    WRITE16(hdr, AH_FLAGS, flags);
+    return accel_write_header(fat, &map, hdr);
+}
+
+#endif /* LIBRESD_ENABLE_ACCEL && LIBRESD_ENABLE_WRITE */
@@ -0,0 +1,491 @@
+/**
+ * @file libresd_check.c
+ * @brief LibreSD Consistency Checker Implementation
+ *
+ * Each pass owns a window of clusters, one bitmap bit each. The tree walk
+ * marks the clusters files and directories own inside the window (a bit
+ * already set is a cross-link), then the FAT entries of the window are
+ * streamed in and every allocated cluster without a bit is lost. Chain
+ * errors and size mismatches are counted and repaired in the first pass
+ * only, so later passes see the repaired tree.
+ */
+
+#include "libresd_fat.h"
+#include <string.h>
+
+#if LIBRESD_ENABLE_CHECK
+
+#define READ16(buf, off)    ((uint16_t)(buf)[off] | ((uint16_t)(buf)[(off)+1] << 8))
+#define READ32(buf, off)    ((uint32_t)(buf)[off] | ((uint32_t)(buf)[(off)+1] << 8) | \
+                             ((uint32_t)(buf)[(off)+2] << 16) | ((uint32_t)(buf)[(off)+3] << 24))
+
+#define WRITE32(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+    (buf)[(off)+2] = ((v) >> 16) & 0xFF; \
+    (buf)[(off)+3] = ((v) >> 24) & 0xFF; \
+} while(0)
+
+#define FSINFO_LEAD_SIG         0x41615252UL
+#define FSINFO_STRUC_SIG        0x61417272UL
+#define FSINFO_FREE             488
+
+/* Why a chain walk stopped */
+#define CHAIN_OK                0       /* End of chain */
+#define CHAIN_CROSS             1       /* Ran into a cluster owned already */
+#define CHAIN_BAD               2       /* Free, reserved or out-of-range link, or a loop */
+
+/**
+ * @brief Directory being read, one per nesting level
+ */
+typedef struct {
+    uint32_t            first;          /* First cluster (0 = FAT12/16 root) */
+    uint32_t            cluster;        /* Cluster being read */
+    uint32_t            left;           /* Clusters of the chain still to read */
+    uint16_t            sector;         /* Sector in the cluster (or root) */
+    uint16_t            entry;          /* Next entry in the sector */
+} check_level_t;
+
+/**
+ * @brief One check run
+ */
+typedef struct {
+    libresd_fat_t      *fat;
+    libresd_check_t    *r;
+    uint8_t            *map;            /* One bit per cluster in [lo, hi) */
+    uint32_t            lo;
+    uint32_t            hi;
+    uint8_t            *io;             /* FAT read buffer */
+    uint32_t            io_sectors;
+    bool                repair;
+    bool                first_pass;
+    uint32_t            depth;
+    uint32_t            dir_lba;        /* Sector held in dir (0 = none) */
+    uint8_t             dir[LIBRESD_SECTOR_SIZE];
+    check_level_t       stack[LIBRESD_CHECK_MAX_DEPTH];
+} check_t;
+
+/*============================================================================
+ * INTERNAL HELPERS
+ *============================================================================*/
+
+static bool check_is_bad(const libresd_fat_t *fat, uint32_t value) {
+    switch (fat->fs_type) {
+        case LIBRESD_FS_FAT12: return value == 0x0FF7;
+        case LIBRESD_FS_FAT16: return value == 0xFFF7;
+        default:               return value == 0x0FFFFFF7;
+    }
+}
+
+/**
+ * @brief Follow a chain, claiming its first own clusters in the window
+ *
+ * @param last Last cluster reached before the chain ended or broke (0 = none)
+ * @param why CHAIN_*
+ * @return Clusters in the chain up to that point
+ */
+static uint32_t check_chain(check_t *c, uint32_t cluster, uint32_t own,
+                            uint32_t *last, int *why) {
+    libresd_fat_t *fat = c->fat;
+    uint32_t n = 0, next;
+
+    *last = 0;
+    *why = CHAIN_OK;
+
+    for (;;) {
+        if (cluster < 2 || cluster >= fat->cluster_count + 2) {
+            *why = CHAIN_BAD;
+            return n;
+        }
+
+        if (n < own && cluster >= c->lo && cluster < c->hi) {
+            uint32_t bit = cluster - c->lo;
+
+            if (c->map[bit >> 3] & (1 << (bit & 7))) {
+                *why = CHAIN_CROSS;
+                return n;
+            }
+            c->map[bit >> 3] |= 1 << (bit & 7);
+            c->r->used_clusters++;
+        }
+
+        *last = cluster;
+        if (++n > fat->cluster_count) {
+            *why = CHAIN_BAD;           /* Loops back on itself */
+            return n;
+        }
+
+        next = libresd_fat_read_entry(fat, cluster);
+        if (libresd_fat_is_eoc(fat, next)) return n;
+        if (next == 0 || check_is_bad(fat, next)) {
+            *why = CHAIN_BAD;
+            return n;
+        }
+        cluster = next;
+    }
+}
+
+#if LIBRESD_ENABLE_WRITE
+
+/**
+ * @brief End a chain at cluster (0 = nothing to keep)
+ */
+static libresd_err_t check_cut(check_t *c, uint32_t cluster) {
+    libresd_fat_t *fat = c->fat;
+    uint32_t eoc;
+    
+    if (cluster < 2) return LIBRESD_OK;
+    
+    switch (fat->fs_type) {
+        case LIBRESD_FS_FAT12: eoc = 0x0FFF; break;
+        case LIBRESD_FS_FAT16: eoc = 0xFFFF; break;
+        default:               eoc = 0x0FFFFFFF; break;
+    }
+    return libresd_fat_write_entry(fat, cluster, eoc);
+}
+
+/**
+ * @brief Write back a directory entry changed in c->dir
+ */
+static libresd_err_t check_put_entry(check_t *c, fat_dirent_t *e, uint32_t first,
+                                     uint32_t size) {
+    e->cluster_hi = (c->fat->fs_type == LIBRESD_FS_FAT32) ? (first >> 16) & 0xFFFF : 0;
+    e->cluster_lo = first & 0xFFFF;
+    e->file_size = size;
+
+    fat_snapshot_touch(c->fat, c->dir_lba);
+    return libresd_sd_write_sector(c->fat->sd, c->dir_lba, c->dir);
+}
+
+#endif /* LIBRESD_ENABLE_WRITE */
+
+/**
+ * @brief Check one directory entry's chain
+ *
+ * @param keep Clusters of the chain left to read (directories)
+ * @return LIBRESD_OK or error
+ */
+static libresd_err_t check_entry(check_t *c, fat_dirent_t *e, uint32_t *first,
+                                 uint32_t *keep) {
+    libresd_fat_t *fat = c->fat;
+    libresd_check_t *r = c->r;
+    bool dir = (e->attr & LIBRESD_ATTR_DIRECTORY) != 0;
+    uint32_t size = dir ? 0 : e->file_size;
+    bool held;
+    uint32_t own, n = 0, last = 0;
+    uint32_t new_first, new_size = size;
+    bool fix = false;
+    int why = CHAIN_OK;
+
+    *first = e->cluster_lo;
+    if (fat->fs_type == LIBRESD_FS_FAT32) *first |= (uint32_t)e->cluster_hi << 16;
+    new_first = *first;
+
+    /* An empty file holding a chain is preallocated (a segment pool file) */
+    held = !dir && size == 0 && *first != 0;
+    own = (dir || held) ? 0xFFFFFFFF :
+          size / fat->cluster_size + (size % fat->cluster_size ? 1 : 0);
+
+    if (c->first_pass) {
+        if (dir) r->dirs++;
+        else r->files++;
+        if (held) r->preallocated++;
+    }
+
+    if (*first != 0) n = check_chain(c, *first, own, &last, &why);
+
+    if (why == CHAIN_CROSS) {
+        r->cross_links++;
+        fix = true;
+    } else if (why == CHAIN_BAD) {
+        if (!c->first_pass) {
+            *keep = n;
+            return LIBRESD_OK;
+        }
+        r->bad_chains++;
+        fix = true;
+    } else if (!dir && !held && n != own && c->first_pass) {
+        r->size_mismatches++;
+        fix = true;
+    } else if (dir && *first == 0 && c->first_pass) {
+        r->bad_chains++;            /* A directory always owns a cluster */
+    }
+
+    *keep = n;
+
+#if LIBRESD_ENABLE_WRITE
+    if (fix && c->repair) {
+        libresd_err_t err;
+
+        if (n > own) {
+            /* Too long: keep what the size covers, the rest goes lost */
+            uint32_t k;
+
+            last = *first;
+            for (k = 1; k < own; k++) last = libresd_fat_read_entry(fat, last);
+            n = own;
+        }
+        if (n == 0) {
+            last = 0;
+            new_first = 0;
+        }
+        if (!dir && (uint64_t)n * fat->cluster_size < new_size) {
+            new_size = n * fat->cluster_size;
+        }
+
+        err = check_cut(c, last);
+        if (err == LIBRESD_OK && (new_first != *first || new_size != size)) {
+            err = check_put_entry(c, e, new_first, new_size);
+        }
+        if (err != LIBRESD_OK) return err;
+
+        r->repaired++;
+        *first = new_first;
+        *keep = n;
+    }
+#else
+    (void)fix;
+    (void)new_first;
+    (void)new_size;
+#endif
+
+    return LIBRESD_OK;
+}
+
+static libresd_err_t check_push(check_t *c, uint32_t first, uint32_t left) {
+    check_level_t *l;
+    
+    if (c->depth == LIBRESD_CHECK_MAX_DEPTH) return LIBRESD_ERR_NOT_SUPPORTED;
+    
+    l = &c->stack[c->depth++];
+    l->first = first;
+    l->cluster = first;
+    l->left = left;
+    l->sector = 0;
+    l->entry = 0;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Walk the whole tree once, claiming clusters in the window
+ */
+static libresd_err_t check_tree(check_t *c) {
+    libresd_fat_t *fat = c->fat;
+    uint32_t root_sectors = ((fat->root_entry_count * 32) + 511) / 512;
+    libresd_err_t err;
+    
+    c->depth = 0;
+    c->dir_lba = 0;
+    
+    if (fat->fs_type == LIBRESD_FS_FAT32) {
+        uint32_t n, last;
+        int why;
+    
+        n = check_chain(c, fat->root_cluster, 0xFFFFFFFF, &last, &why);
+        if (why != CHAIN_OK && c->first_pass) c->r->bad_chains++;
+        err = check_push(c, fat->root_cluster, n);
+    } else {
+        err = check_push(c, 0, root_sectors);
+    }
+    if (err != LIBRESD_OK) return err;
+    
+    while (c->depth > 0) {
+        check_level_t *l = &c->stack[c->depth - 1];
+        uint32_t lba, first, keep;
+        fat_dirent_t *e;
+    
+        if (l->entry == LIBRESD_SECTOR_SIZE / FAT_DIRENT_SIZE) {
+            l->entry = 0;
+            l->sector++;
+            if (l->first != 0 && l->sector == fat->sectors_per_cluster) {
+                l->sector = 0;
+                l->left--;
+                if (l->left > 0) l->cluster = libresd_fat_next_cluster(fat, l->cluster);
+            }
+        }
+        if (l->first == 0 ? l->sector >= root_sectors : l->left == 0) {
+            c->depth--;
+            continue;
+        }
+    
+        lba = (l->first == 0) ? fat->root_start_sector + l->sector :
+              libresd_fat_cluster_to_sector(fat, l->cluster) + l->sector;
+        if (lba != c->dir_lba) {
+            err = libresd_sd_read_sector(fat->sd, lba, c->dir);
+            if (err != LIBRESD_OK) return err;
+            c->dir_lba = lba;
+        }
+    
+        e = (fat_dirent_t *)(c->dir + l->entry++ * FAT_DIRENT_SIZE);
+        if (e->name[0] == DIRENT_END) {
+            c->depth--;
+            continue;
+        }
+        if (e->name[0] == DIRENT_FREE || e->name[0] == '.' ||
+            (e->attr & LIBRESD_ATTR_LFN) == LIBRESD_ATTR_LFN ||
+            (e->attr & LIBRESD_ATTR_VOLUME_ID)) {
+            continue;
+        }
+    
+        err = check_entry(c, e, &first, &keep);
+        if (err != LIBRESD_OK) return err;
+    
+        if ((e->attr & LIBRESD_ATTR_DIRECTORY) && first >= 2 && keep > 0) {
+            err = check_push(c, first, keep);
+            if (err != LIBRESD_OK) return err;
+        }
+    }
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Account for one FAT entry of the window
+ */
+static libresd_err_t check_lost(check_t *c, uint32_t cluster, uint32_t value) {
+    uint32_t bit = cluster - c->lo;
+    
+    if (value == 0) {
+        c->r->free_clusters++;
+        return LIBRESD_OK;
+    }
+    if ((c->map[bit >> 3] & (1 << (bit & 7))) || check_is_bad(c->fat, value)) {
+        return LIBRESD_OK;
+    }
+    
+    c->r->lost_clusters++;
+#if LIBRESD_ENABLE_WRITE
+    if (c->repair) {
+        libresd_err_t err = libresd_fat_write_entry(c->fat, cluster, 0);
+    
+        if (err != LIBRESD_OK) return err;
+        c->r->repaired++;
+        c->r->free_clusters++;
+    }
+#endif
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Stream the window's FAT entries: count free, find lost clusters
+ */
+static libresd_err_t check_window(check_t *c) {
+    libresd_fat_t *fat = c->fat;
+    uint32_t width = (fat->fs_type == LIBRESD_FS_FAT32) ? 4 : 2;
+    uint32_t per = LIBRESD_SECTOR_SIZE / width;
+    uint32_t cluster = c->lo;
+    libresd_err_t err;
+    
+    if (fat->fs_type == LIBRESD_FS_FAT12) {
+        /* Entries straddle sectors; FAT12 volumes are small anyway */
+        for (; cluster < c->hi; cluster++) {
+            err = check_lost(c, cluster, libresd_fat_read_entry(fat, cluster));
+            if (err != LIBRESD_OK) return err;
+        }
+        return LIBRESD_OK;
+    }
+    
+    while (cluster < c->hi) {
+        uint32_t base = cluster - cluster % per;
+        uint32_t n = (c->hi - 1) / per - cluster / per + 1;
+        uint32_t stop;
+    
+        if (n > c->io_sectors) n = c->io_sectors;
+        err = libresd_sd_read_sectors(fat->sd, fat->fat_start_sector + cluster / per, c->io, n);
+        if (err != LIBRESD_OK) return err;
+    
+        stop = base + n * per;
+        if (stop > c->hi) stop = c->hi;
+    
+        for (; cluster < stop; cluster++) {
+            uint32_t off = (cluster - base) * width;
+            uint32_t value = (width == 4) ? READ32(c->io, off) & 0x0FFFFFFF :
+                             (uint32_t)READ16(c->io, off);
+    
+            err = check_lost(c, cluster, value);
+            if (err != LIBRESD_OK) return err;
+        }
+    }
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Compare (and fix) the FAT32 FSInfo free count
+ */
+static libresd_err_t check_fsinfo(check_t *c) {
+    libresd_fat_t *fat = c->fat;
+    libresd_err_t err;
+    
+    if (fat->fsinfo_sector == 0) return LIBRESD_OK;
+    
+    err = libresd_sd_read_sector(fat->sd, fat->fsinfo_sector, c->dir);
+    if (err != LIBRESD_OK) return err;
+    if (READ32(c->dir, 0) != FSINFO_LEAD_SIG || READ32(c->dir, 484) != FSINFO_STRUC_SIG) {
+        return LIBRESD_OK;
+    }
+    
+    c->r->fsinfo_free = READ32(c->dir, FSINFO_FREE);
+    
+#if LIBRESD_ENABLE_WRITE
+    if (c->repair && c->r->fsinfo_free != c->r->free_clusters) {
+        WRITE32(c->dir, FSINFO_FREE, c->r->free_clusters);
+        err = libresd_sd_write_sector(fat->sd, fat->fsinfo_sector, c->dir);
+        if (err != LIBRESD_OK) return err;
+        c->r->repaired++;
+    }
+#endif
+    return LIBRESD_OK;
+}
+
+/*============================================================================
+ * CONSISTENCY CHECK
+ *============================================================================*/
+
+libresd_err_t libresd_fat_check(libresd_fat_t *fat, uint8_t flags, void *work,
+                                 uint32_t work_size, libresd_check_t *report) {
+    check_t c;
+    uint32_t end, bits;
+    libresd_err_t err;
+
+    if (!fat || !work || !report || work_size < 1024) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+#if !LIBRESD_ENABLE_WRITE
+    if (flags & LIBRESD_CHECK_REPAIR) return LIBRESD_ERR_READ_ONLY;
+#endif
+
+    memset(report, 0, sizeof(*report));
+    report->free_count_was = fat->free_clusters;
+    report->fsinfo_free = 0xFFFFFFFF;
+
+    memset(&c, 0, sizeof(c));
+    c.fat = fat;
+    c.r = report;
+    c.repair = (flags & LIBRESD_CHECK_REPAIR) != 0;
+    c.io_sectors = LIBRESD_CHECK_READ_SECTORS;
+    while (c.io_sectors > 1 && c.io_sectors * LIBRESD_SECTOR_SIZE > work_size / 2) {
+        c.io_sectors /= 2;
+    }
+    c.io = (uint8_t *)work;
+    c.map = c.io + c.io_sectors * LIBRESD_SECTOR_SIZE;
+    bits = (work_size - c.io_sectors * LIBRESD_SECTOR_SIZE) * 8;
+
+    end = fat->cluster_count + 2;
+    for (c.lo = 2; c.lo < end; c.lo = c.hi) {
+        c.hi = (end - c.lo > bits) ? c.lo + bits : end;
+        c.first_pass = (c.lo == 2);
+        memset(c.map, 0, (c.hi - c.lo + 7) / 8);
+
+        err = check_tree(&c);
+        /* Streaming reads the card, so pending FAT repairs go first */
+        if (err == LIBRESD_OK) err = libresd_fat_sync(fat);
+        if (err == LIBRESD_OK) err = check_window(&c);
+        if (err == LIBRESD_OK) err = libresd_fat_sync(fat);
+        if (err != LIBRESD_OK) return err;
+
+        report->passes++;
+    }
+
+    fat->free_clusters = report->free_clusters;
+    return check_fsinfo(&c);
+}
+
+#endif /* LIBRESD_ENABLE_CHECK */
@@ -0,0 +1,460 @@
+/**
+ * @file libresd_defrag.c
+ * @brief LibreSD Online Defragmenter Implementation
+ *
+ * The walk keeps its whole position in the caller's libresd_defrag_t, so
+ * a call can stop after any sector and the next one picks up there. Moving
+ * a chain takes three steps, which may span many calls:
+ *
+ *   1. allocate a contiguous run (it is owned by nothing yet)
+ *   2. copy the old chain into it, budget sectors at a time
+ *   3. switch the directory entry, then free the old chain
+ *
+ * Before each call resumes step 2, the entry is read back; if its first
+ * cluster, size or modification stamp changed, the run is freed again and
+ * the item counted as skipped.
+ */
+
+#include "libresd_fat.h"
+#include <string.h>
+
+#if LIBRESD_ENABLE_DEFRAG && LIBRESD_ENABLE_WRITE
+
+#define ENTRIES_PER_SECTOR      (LIBRESD_SECTOR_SIZE / FAT_DIRENT_SIZE)
+
+/**
+ * @brief One call's worth of work
+ */
+typedef struct {
+    libresd_fat_t      *fat;
+    libresd_defrag_t   *df;
+    uint8_t            *copy;           /* Copy buffer */
+    uint32_t            copy_sectors;
+    uint32_t            budget;         /* Sectors left this call */
+    uint32_t            dir_lba;        /* Sector held in dir (0 = none) */
+    uint8_t             dir[LIBRESD_SECTOR_SIZE];
+} defrag_t;
+
+/*============================================================================
+ * INTERNAL HELPERS
+ *============================================================================*/
+
+static uint32_t defrag_first(const libresd_fat_t *fat, const fat_dirent_t *e) {
+    uint32_t first = e->cluster_lo;
+    
+    if (fat->fs_type == LIBRESD_FS_FAT32) first |= (uint32_t)e->cluster_hi << 16;
+    return first;
+}
+
+static void defrag_set_first(const libresd_fat_t *fat, fat_dirent_t *e, uint32_t first) {
+    e->cluster_hi = (fat->fs_type == LIBRESD_FS_FAT32) ? (first >> 16) & 0xFFFF : 0;
+    e->cluster_lo = first & 0xFFFF;
+}
+
+/**
+ * @brief Count the clusters and runs of a chain
+ *
+ * @param limit Clusters to follow at most (0xFFFFFFFF = to the end)
+ */
+static void defrag_runs(libresd_fat_t *fat, uint32_t first, uint32_t limit,
+                        uint32_t *clusters, uint32_t *runs) {
+    uint32_t cluster = first, n = 0, r = 0, run;
+
+    /* Runs end where the chain jumps, so each one is a fragment */
+    while (cluster >= 2 && n < limit && n <= fat->cluster_count) {
+        run = libresd_fat_get_run(fat, cluster, limit - n, &cluster);
+        if (run == 0) break;
+        r++;
+        n += run;
+    }
+    *clusters = n;
+    *runs = r;
+}
+
+/**
+ * @brief Read a directory sector through the one-sector cache
+ */
+static libresd_err_t defrag_load(defrag_t *d, uint32_t lba) {
+    libresd_err_t err;
+    
+    if (lba == d->dir_lba) return LIBRESD_OK;
+    if (d->budget > 0) d->budget--;
+    d->dir_lba = 0;
+    err = libresd_sd_read_sector(d->fat->sd, lba, d->dir);
+    if (err == LIBRESD_OK) d->dir_lba = lba;
+    return err;
+}
+
+static libresd_err_t defrag_push(defrag_t *d, uint32_t first) {
+    libresd_defrag_level_t *l;
+    
+    if (d->df->depth == LIBRESD_DEFRAG_MAX_DEPTH) return LIBRESD_OK;
+    
+    l = &d->df->level[d->df->depth++];
+    l->first = first;
+    l->cluster = first;
+    l->index = 0;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Look at one file or directory; start moving it if fragmented
+ */
+static libresd_err_t defrag_consider(defrag_t *d, uint32_t lba, uint16_t offset) {
+    libresd_fat_t *fat = d->fat;
+    libresd_defrag_t *df = d->df;
+    fat_dirent_t *e;
+    bool is_dir;
+    uint32_t first, limit, clusters, runs, run;
+    libresd_err_t err;
+    
+    err = defrag_load(d, lba);
+    if (err != LIBRESD_OK) return err;
+    
+    e = (fat_dirent_t *)(d->dir + offset);
+    is_dir = (e->attr & LIBRESD_ATTR_DIRECTORY) != 0;
+    first = defrag_first(fat, e);
+    limit = is_dir ? 0xFFFFFFFF :
+            e->file_size / fat->cluster_size + (e->file_size % fat->cluster_size ? 1 : 0);
+    
+    if (is_dir) df->dirs++;
+    else df->files++;
+    
+    defrag_runs(fat, first, limit, &clusters, &runs);
+    df->extents_before += runs;
+    
+    run = (runs > 1) ? libresd_fat_alloc_contiguous(fat, 0, clusters) : 0;
+    if (run == 0) {
+        if (runs > 1) df->skipped++;
+        df->extents_after += runs;
+        if (is_dir && first >= 2) return defrag_push(d, first);
+        return LIBRESD_OK;
+    }
+    
+    df->moving = true;
+    df->moving_dir = is_dir;
+    df->dir_sector = lba;
+    df->dir_offset = offset;
+    df->old_first = first;
+    df->size = e->file_size;
+    df->modify_date = e->modify_date;
+    df->modify_time = e->modify_time;
+    df->runs = runs;
+    df->new_first = run;
+    df->src_cluster = first;
+    df->copied = 0;
+    df->total = clusters * fat->sectors_per_cluster;
+    /* A file's tail past its size is not worth copying */
+    if (!is_dir && df->total > (e->file_size + LIBRESD_SECTOR_SIZE - 1) / LIBRESD_SECTOR_SIZE) {
+        df->total = (e->file_size + LIBRESD_SECTOR_SIZE - 1) / LIBRESD_SECTOR_SIZE;
+    }
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Give up the move in progress
+ */
+static libresd_err_t defrag_abandon(defrag_t *d) {
+    libresd_defrag_t *df = d->df;
+    libresd_err_t err;
+    
+    df->moving = false;
+    df->skipped++;
+    df->extents_after += df->runs;
+    err = libresd_fat_free_chain(d->fat, df->new_first);
+    if (err == LIBRESD_OK) err = libresd_fat_sync(d->fat);
+    if (err == LIBRESD_OK && df->moving_dir) err = defrag_push(d, df->old_first);
+    return err;
+}
+
+/**
+ * @brief Check that the entry being moved still describes the same chain
+ */
+static libresd_err_t defrag_verify(defrag_t *d, bool *same) {
+    libresd_defrag_t *df = d->df;
+    fat_dirent_t *e;
+    libresd_err_t err;
+    
+    err = defrag_load(d, df->dir_sector);
+    if (err != LIBRESD_OK) return err;
+    
+    e = (fat_dirent_t *)(d->dir + df->dir_offset);
+    *same = e->name[0] != DIRENT_FREE && e->name[0] != DIRENT_END &&
+            defrag_first(d->fat, e) == df->old_first &&
+            e->file_size == df->size &&
+            e->modify_date == df->modify_date &&
+            e->modify_time == df->modify_time;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Copy as much of the chain as the budget allows
+ */
+static libresd_err_t defrag_copy(defrag_t *d) {
+    libresd_fat_t *fat = d->fat;
+    libresd_defrag_t *df = d->df;
+    uint32_t spc = fat->sectors_per_cluster;
+    libresd_err_t err = LIBRESD_OK;
+    
+    while (err == LIBRESD_OK && df->copied < df->total && d->budget > 0) {
+        uint32_t in = df->copied % spc;
+        uint32_t want = df->total - df->copied;
+        uint32_t n = spc - in;
+        uint32_t last, src, dst;
+    
+        if (want > d->copy_sectors) want = d->copy_sectors;
+        if (want > d->budget) want = d->budget;
+    
+        /* One transfer may span the adjacent clusters of a fragment */
+        if (n < want) {
+            uint32_t run = libresd_fat_get_run(fat, df->src_cluster,
+                                               1 + (want - n + spc - 1) / spc, NULL);
+            if (run > 1) n += (run - 1) * spc;
+        }
+        if (n > want) n = want;
+    
+        src = libresd_fat_cluster_to_sector(fat, df->src_cluster) + in;
+        dst = libresd_fat_cluster_to_sector(fat, df->new_first + df->copied / spc) + in;
+        err = libresd_sd_read_sectors(fat->sd, src, d->copy, n);
+        if (err == LIBRESD_OK) err = libresd_sd_write_sectors(fat->sd, dst, d->copy, n);
+        if (err != LIBRESD_OK) break;
+    
+        d->budget -= n;
+        df->copied += n;
+        last = df->src_cluster + (in + n - 1) / spc;
+        if (df->copied % spc != 0 || df->copied == df->total) {
+            df->src_cluster = last;
+        } else {
+            df->src_cluster = libresd_fat_next_cluster(fat, last);
+            if (df->src_cluster < 2) err = LIBRESD_ERR_FAT_CORRUPT;
+        }
+    }
+    return err;
+}
+
+/**
+ * @brief Point the ".." entries of a moved directory's children at it
+ */
+static libresd_err_t defrag_fix_children(defrag_t *d) {
+    libresd_fat_t *fat = d->fat;
+    libresd_defrag_t *df = d->df;
+    uint8_t *child = d->copy;
+    uint32_t s, i;
+    libresd_err_t err;
+    
+    for (s = 0; s < df->total; s++) {
+        err = defrag_load(d, libresd_fat_cluster_to_sector(fat, df->new_first) + s);
+        if (err != LIBRESD_OK) return err;
+    
+        for (i = 0; i < ENTRIES_PER_SECTOR; i++) {
+            fat_dirent_t *e = (fat_dirent_t *)(d->dir + i * FAT_DIRENT_SIZE);
+            fat_dirent_t *dots;
+            uint32_t lba;
+    
+            if (e->name[0] == DIRENT_END) return LIBRESD_OK;
+            if (e->name[0] == DIRENT_FREE || e->name[0] == '.' ||
+                (e->attr & LIBRESD_ATTR_LFN) == LIBRESD_ATTR_LFN ||
+                !(e->attr & LIBRESD_ATTR_DIRECTORY) || defrag_first(fat, e) < 2) {
+                continue;
+            }
+    
+            lba = libresd_fat_cluster_to_sector(fat, defrag_first(fat, e));
+            err = libresd_sd_read_sector(fat->sd, lba, child);
+            if (err != LIBRESD_OK) return err;
+    
+            dots = (fat_dirent_t *)(child + FAT_DIRENT_SIZE);
+            if (dots->name[0] != '.' || dots->name[1] != '.') continue;
+            defrag_set_first(fat, dots, df->new_first);
+            err = libresd_sd_write_sector(fat->sd, lba, child);
+            if (err != LIBRESD_OK) return err;
+        }
+    }
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Switch the entry to the new run and free the old chain
+ */
+static libresd_err_t defrag_switch(defrag_t *d) {
+    libresd_fat_t *fat = d->fat;
+    libresd_defrag_t *df = d->df;
+    uint32_t run = df->new_first;
+    fat_dirent_t *e;
+    libresd_err_t err;
+    
+    /* The run must be in the FAT before anything points at it */
+    err = libresd_fat_sync(fat);
+    if (err != LIBRESD_OK) return err;
+    
+    if (df->moving_dir) {
+        /* "." lives in the copy's first sector */
+        uint32_t lba = libresd_fat_cluster_to_sector(fat, run);
+    
+        err = defrag_load(d, lba);
+        if (err != LIBRESD_OK) return err;
+        e = (fat_dirent_t *)d->dir;
+        if (e->name[0] == '.' && e->name[1] == ' ') {
+            defrag_set_first(fat, e, run);
+            err = libresd_sd_write_sector(fat->sd, lba, d->dir);
+            if (err != LIBRESD_OK) return err;
+        }
+    }
+    
+    err = defrag_load(d, df->dir_sector);
+    if (err != LIBRESD_OK) return err;
+    e = (fat_dirent_t *)(d->dir + df->dir_offset);
+    defrag_set_first(fat, e, run);
+    fat_snapshot_touch(fat, df->dir_sector);
+    err = libresd_sd_write_sector(fat->sd, df->dir_sector, d->dir);
+    if (err != LIBRESD_OK) return err;
+    
+    /* From here on the run is in use; a failure only loses the old chain */
+    df->moving = false;
+    df->moved++;
+    df->extents_after++;
+    
+    if (df->moving_dir) {
+        fat_snapshot_touch_dir(fat, df->old_first);
+        if (fat->cwd_cluster == df->old_first) fat->cwd_cluster = run;
+        err = defrag_fix_children(d);
+        if (err == LIBRESD_OK) err = defrag_push(d, run);
+        if (err != LIBRESD_OK) return err;
+    }
+    
+    err = libresd_fat_free_chain(fat, df->old_first);
+    if (err == LIBRESD_OK) err = libresd_fat_sync(fat);
+    return err;
+}
+
+/**
+ * @brief Find the next entry of the walk and consider it
+ *
+ * @return LIBRESD_OK, LIBRESD_ERR_EOF once the walk is over, or error
+ */
+static libresd_err_t defrag_step(defrag_t *d) {
+    libresd_fat_t *fat = d->fat;
+    libresd_defrag_t *df = d->df;
+    uint32_t root_sectors = ((fat->root_entry_count * 32) + 511) / 512;
+    uint32_t per_cluster = ENTRIES_PER_SECTOR * fat->sectors_per_cluster;
+    
+    while (df->depth > 0 && d->budget > 0) {
+        libresd_defrag_level_t *l = &df->level[df->depth - 1];
+        uint32_t sector = l->index / ENTRIES_PER_SECTOR;
+        uint16_t offset = (l->index % ENTRIES_PER_SECTOR) * FAT_DIRENT_SIZE;
+        uint32_t lba;
+        fat_dirent_t *e;
+        libresd_err_t err;
+    
+        if (l->first == 0 ? sector >= root_sectors : l->cluster < 2) {
+            df->depth--;
+            continue;
+        }
+    
+        lba = (l->first == 0) ? fat->root_start_sector + sector :
+              libresd_fat_cluster_to_sector(fat, l->cluster) +
+              sector % fat->sectors_per_cluster;
+        err = defrag_load(d, lba);
+        if (err != LIBRESD_OK) return err;
+    
+        e = (fat_dirent_t *)(d->dir + offset);
+        if (e->name[0] == DIRENT_END) {
+            df->depth--;
+            continue;
+        }
+    
+        l->index++;
+        if (l->first != 0 && l->index % per_cluster == 0) {
+            l->cluster = libresd_fat_next_cluster(fat, l->cluster);
+        }
+    
+        if (e->name[0] == DIRENT_FREE || e->name[0] == '.' ||
+            (e->attr & LIBRESD_ATTR_LFN) == LIBRESD_ATTR_LFN ||
+            (e->attr & LIBRESD_ATTR_VOLUME_ID)) {
+            continue;
+        }
+        return defrag_consider(d, lba, offset);
+    }
+    return (df->depth == 0) ? LIBRESD_ERR_EOF : LIBRESD_OK;
+}
+
+/**
+ * @brief Resolve the starting path
+ */
+static libresd_err_t defrag_start(defrag_t *d, const char *path) {
+    libresd_fat_t *fat = d->fat;
+    fat_dirent_t entry;
+    uint32_t dir_sector = 0;
+    uint16_t dir_offset = 0;
+    libresd_err_t err;
+    
+    if (!path) path = "/";
+    err = fat_lookup(fat, path, strlen(path), &entry, &dir_sector, &dir_offset, NULL);
+    if (err != LIBRESD_OK) return err;
+    
+    d->df->started = true;
+    /* The root (or cwd) has no entry of its own: only walk beneath it */
+    if (dir_sector == 0) return defrag_push(d, fat_dirent_cluster(&entry));
+    return defrag_consider(d, dir_sector, dir_offset);
+}
+
+/*============================================================================
+ * DEFRAGMENTER
+ *============================================================================*/
+
+libresd_err_t libresd_fat_defrag(libresd_fat_t *fat, libresd_defrag_t *df,
+                                  const char *path, uint32_t budget,
+                                  void *buf, uint32_t buf_size) {
+    defrag_t d;
+    uint8_t sector_buf[LIBRESD_SECTOR_SIZE];
+    libresd_err_t err = LIBRESD_OK;
+    bool verified = false;
+
+    if (!fat || !df || budget == 0 || (buf && buf_size < LIBRESD_SECTOR_SIZE)) {
+        return LIBRESD_ERR_INVALID_PARAM;
+    }
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+    if (df->done) return LIBRESD_ERR_EOF;
+
+    d.fat = fat;
+    d.df = df;
+    d.copy = buf ? (uint8_t *)buf : sector_buf;
+    d.copy_sectors = buf ? buf_size / LIBRESD_SECTOR_SIZE : 1;
+    d.budget = budget;
+    d.dir_lba = 0;
+
+    if (!df->started) err = defrag_start(&d, path);
+
+    while (err == LIBRESD_OK && d.budget > 0) {
+        if (df->moving) {
+            if (!verified) {
+                bool same;
+
+                verified = true;
+                err = defrag_verify(&d, &same);
+                if (err != LIBRESD_OK) break;
+                if (!same) {
+                    err = defrag_abandon(&d);
+                    continue;
+                }
+            }
+            err = defrag_copy(&d);
+            if (err == LIBRESD_OK && df->copied == df->total) err = defrag_switch(&d);
+            continue;
+        }
+
+        err = defrag_step(&d);
+    }
+
+    if (err == LIBRESD_ERR_EOF && !df->moving) {
+        df->done = true;
+        return LIBRESD_ERR_EOF;
+    }
+    if (err != LIBRESD_OK && df->moving) {
+        /* Leave nothing half done behind: the old chain is still in use */
+        libresd_err_t again = defrag_abandon(&d);
+        (void)again;
+    }
+    return err;
+}
+
+#endif /* LIBRESD_ENABLE_DEFRAG && LIBRESD_ENABLE_WRITE */
@@ -8,14 +8,19 @@
 
 #include "libresd_fat.h"
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 
+#if LIBRESD_MAX_SECTOR_SIZE < 512 || LIBRESD_MAX_SECTOR_SIZE > 4096 || \
+    (LIBRESD_MAX_SECTOR_SIZE & (LIBRESD_MAX_SECTOR_SIZE - 1)) != 0
+#error "LIBRESD_MAX_SECTOR_SIZE must be a power of two from 512 to 4096"
+#endif
+
 /*============================================================================
  * FAT CONSTANTS
  *============================================================================*/
 
 #define FAT_BOOT_SIGNATURE      0xAA55
-#define FAT_LFN_ENTRY_CHARS     13
 
 /* End of chain markers */
 #define FAT12_EOC               0x0FF8
@@ -33,6 +38,10 @@
 /* Directory entry special characters */
 #define DIRENT_KANJI            0x05
 
+/* FAT32 FSInfo sector signatures */
+#define FSINFO_LEAD_SIG         0x41615252UL
+#define FSINFO_STRUC_SIG        0x61417272UL
+
 /*============================================================================
  * HELPER MACROS
  *============================================================================*/
@@ -147,6 +156,176 @@ static bool fat_name_match(const uint8_t *entry_name, const uint8_t *search_name
     return true;
 }
 
+/**
+ * @brief Long name pieces collected ahead of their short entry
+ *
+ * name points at the caller's libresd_fileinfo_t name, so the pieces land
+ * where the result goes and no second name buffer sits on the stack.
+ */
+typedef struct {
+    char   *name;
+    bool    valid;
+    uint8_t sum;        /* Checksum of the short name the pieces belong to */
+} fat_lfn_t;
+
+#if LIBRESD_ENABLE_LFN
+/* Byte offsets of the 13 UCS-2 characters in a long name entry */
+static const uint8_t fat_lfn_offset[FAT_LFN_ENTRY_CHARS] = {
+    1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+};
+#endif
+
+static void fat_unpack_times(libresd_fileinfo_t *info, uint16_t cdate, uint16_t ctime,
+                             uint16_t mdate, uint16_t mtime) {
+    info->created.year = LIBRESD_FAT_YEAR(cdate);
+    info->created.month = LIBRESD_FAT_MONTH(cdate);
+    info->created.day = LIBRESD_FAT_DAY(cdate);
+    info->created.hour = LIBRESD_FAT_HOUR(ctime);
+    info->created.minute = LIBRESD_FAT_MIN(ctime);
+    info->created.second = LIBRESD_FAT_SEC(ctime);
+
+    info->modified.year = LIBRESD_FAT_YEAR(mdate);
+    info->modified.month = LIBRESD_FAT_MONTH(mdate);
+    info->modified.day = LIBRESD_FAT_DAY(mdate);
+    info->modified.hour = LIBRESD_FAT_HOUR(mtime);
+    info->modified.minute = LIBRESD_FAT_MIN(mtime);
+    info->modified.second = LIBRESD_FAT_SEC(mtime);
+}
+
+/**
+ * @brief Fill everything but the name from a short entry
+ */
+static void fat_dirent_info(libresd_fileinfo_t *info, const fat_dirent_t *entry) {
+    info->attr = entry->attr;
+    info->size = entry->file_size;
+    info->first_cluster = fat_dirent_cluster(entry);
+    info->dir_sector = 0;
+    info->dir_offset = 0;
+    memset(&info->accessed, 0, sizeof(info->accessed));
+    fat_unpack_times(info, entry->create_date, entry->create_time,
+                     entry->modify_date, entry->modify_time);
+}
+
+/**
+ * @brief Made-up entry for a directory that has none (the root)
+ */
+static void fat_dir_entry(fat_dirent_t *entry, uint32_t cluster) {
+    memset(entry, 0, sizeof(fat_dirent_t));
+    entry->attr = LIBRESD_ATTR_DIRECTORY;
+    entry->cluster_hi = (cluster >> 16) & 0xFFFF;
+    entry->cluster_lo = cluster & 0xFFFF;
+}
+
+uint8_t fat_lfn_checksum(const uint8_t *name) {
+    uint8_t sum = 0;
+    
+    for (int i = 0; i < 11; i++) {
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + name[i]);
+    }
+    return sum;
+}
+
+#if LIBRESD_ENABLE_LFN
+/**
+ * @brief Copy the characters of one long name entry into name
+ */
+static void fat_lfn_piece(char *name, const uint8_t *raw) {
+    int idx = ((raw[0] & 0x1F) - 1) * FAT_LFN_ENTRY_CHARS;
+
+    if (raw[0] & 0x40) {
+        /* Last LFN entry - start fresh */
+        memset(name, 0, LIBRESD_MAX_FILENAME);
+    }
+
+    /* Extract Unicode characters (simplified - ASCII only) */
+    for (int i = 0; i < FAT_LFN_ENTRY_CHARS && idx >= 0 && idx < LIBRESD_MAX_FILENAME - 1; i++) {
+        uint16_t c = READ16(raw, fat_lfn_offset[i]);
+        if (c && c < 128) name[idx++] = c;
+    }
+}
+
+void fat_lfn_pack(uint8_t *raw, const char *name, uint32_t len, uint8_t seq, uint8_t sum) {
+    uint32_t pos = (uint32_t)(seq - 1) * FAT_LFN_ENTRY_CHARS;
+    
+    memset(raw, 0, FAT_DIRENT_SIZE);
+    raw[0] = seq;
+    if (pos + FAT_LFN_ENTRY_CHARS >= len) raw[0] |= 0x40;
+    raw[11] = LIBRESD_ATTR_LFN;
+    raw[13] = sum;
+    
+    /* NUL after the name, 0xFFFF padding after that */
+    for (int i = 0; i < FAT_LFN_ENTRY_CHARS; i++, pos++) {
+        uint16_t c = (pos < len) ? (uint8_t)name[pos] : (pos == len) ? 0 : 0xFFFF;
+        WRITE16(raw, fat_lfn_offset[i], c);
+    }
+}
+
+/**
+ * @brief Do the collected pieces name this short entry?
+ */
+static bool fat_lfn_owns(const fat_lfn_t *lfn, const fat_dirent_t *entry) {
+    return lfn->valid && lfn->name[0] && lfn->sum == fat_lfn_checksum(entry->name);
+}
+#endif
+
+/**
+ * @brief Decode one 32-byte directory entry
+ *
+ * Long name entries are collected in lfn (which must point at
+ * info->name) until their short entry arrives. dir_sector and dir_offset
+ * are left for the caller.
+ *
+ * @return LIBRESD_OK for a file or directory, LIBRESD_ERR_EOF at the end
+ *         marker, LIBRESD_ERR_NOT_FOUND for entries to skip
+ */
+static libresd_err_t fat_dirent_parse(fat_lfn_t *lfn, const fat_dirent_t *entry,
+                                      libresd_fileinfo_t *info) {
+    /* End of directory */
+    if (entry->name[0] == DIRENT_END) {
+        return LIBRESD_ERR_EOF;
+    }
+
+    /* Deleted entry */
+    if (entry->name[0] == DIRENT_FREE) {
+        lfn->valid = false;
+        return LIBRESD_ERR_NOT_FOUND;
+    }
+
+#if LIBRESD_ENABLE_LFN
+    /* Long filename entry */
+    if ((entry->attr & LIBRESD_ATTR_LFN) == LIBRESD_ATTR_LFN) {
+        const uint8_t *raw = (const uint8_t *)entry;
+    
+        if (raw[0] & 0x40) {
+            lfn->valid = true;
+            lfn->sum = raw[13];
+        } else if (raw[13] != lfn->sum) {
+            lfn->valid = false;
+        }
+        fat_lfn_piece(lfn->name, raw);
+        return LIBRESD_ERR_NOT_FOUND;
+    }
+#endif
+
+    /* Volume label - skip */
+    if (entry->attr & LIBRESD_ATTR_VOLUME_ID) {
+        lfn->valid = false;
+        return LIBRESD_ERR_NOT_FOUND;
+    }
+
+    /* Found a valid entry! The long name, if any, is already in place */
+#if LIBRESD_ENABLE_LFN
+    if (!fat_lfn_owns(lfn, entry))
+#endif
+    {
+        fat_name_to_str(entry->name, info->name);
+    }
+    lfn->valid = false;
+
+    fat_dirent_info(info, entry);
+    return LIBRESD_OK;
+}
+
 /**
  * @brief Parse path and resolve to cluster
  */
@@ -154,6 +333,17 @@ libresd_err_t fat_resolve_path(libresd_fat_t *fat, const char *path,
                                        uint32_t *cluster, uint32_t *dir_sector,
                                        uint16_t *dir_offset, libresd_fileinfo_t *info);
 
+#if LIBRESD_ENABLE_SNAPSHOT
+static bool snap_walk(libresd_fat_t *fat, const char *path, size_t len, const char **rest,
+                      uint32_t *rest_cluster, uint32_t *found, libresd_err_t *err);
+static void snap_entry(libresd_fat_t *fat, uint32_t idx, fat_dirent_t *entry,
+                       uint32_t *dir_sector, uint16_t *dir_offset, char *name);
+static bool snap_opendir(libresd_fat_t *fat, libresd_dir_t *dir, const char *path,
+                         libresd_err_t *err);
+static libresd_err_t snap_readdir(libresd_fat_t *fat, libresd_dir_t *dir,
+                                  libresd_fileinfo_t *info);
+#endif
+
 /*============================================================================
  * CLUSTER OPERATIONS
  *============================================================================*/
@@ -172,6 +362,55 @@ bool libresd_fat_is_eoc(libresd_fat_t *fat, uint32_t cluster) {
     }
 }
 
+/**
+ * @brief Cache window holding a byte of the first FAT
+ *
+ * Windows are fat_buffer_blocks card blocks (one logical sector, or as
+ * much of it as the buffer holds), counted from the start of the FAT.
+ *
+ * @param offset Set to the byte's offset in the window
+ * @return First card sector of the window
+ */
+static uint32_t fat_window(const libresd_fat_t *fat, uint32_t fat_offset, uint32_t *offset) {
+    uint32_t bytes = (uint32_t)fat->fat_buffer_blocks * 512;
+    
+    *offset = fat_offset % bytes;
+    return fat->fat_start_sector + (fat_offset / bytes) * fat->fat_buffer_blocks;
+}
+
+/**
+ * @brief Make the window at fat_sector the cached part of the FAT
+ * 
+ * A dirty cached sector is written back (to every FAT copy) first, so
+ * entries updated by alloc/free survive a lookup that lands elsewhere.
+ */
+static libresd_err_t fat_cache_sector(libresd_fat_t *fat, uint32_t fat_sector) {
+    libresd_err_t err;
+    
+    if (fat->fat_buffer_sector == fat_sector) return LIBRESD_OK;
+    
+#if LIBRESD_ENABLE_WRITE
+    if (fat->fat_buffer_dirty) {
+        err = libresd_fat_sync(fat);
+        if (err != LIBRESD_OK) return err;
+    }
+#endif
+    
+    if (fat->fat_buffer_blocks > 1) {
+        err = libresd_sd_read_sectors(fat->sd, fat_sector, fat->fat_buffer,
+                                      fat->fat_buffer_blocks);
+    } else {
+        err = libresd_sd_read_sector(fat->sd, fat_sector, fat->fat_buffer);
+    }
+    if (err != LIBRESD_OK) {
+        fat->fat_buffer_sector = 0xFFFFFFFF;
+        return err;
+    }
+    fat->fat_buffer_sector = fat_sector;
+    
+    return LIBRESD_OK;
+}
+
 uint32_t libresd_fat_read_entry(libresd_fat_t *fat, uint32_t cluster) {
     uint32_t fat_offset, fat_sector, offset;
     uint32_t value;
@@ -179,24 +418,18 @@ uint32_t libresd_fat_read_entry(libresd_fat_t *fat, uint32_t cluster) {
     switch (fat->fs_type) {
         case LIBRESD_FS_FAT12:
             fat_offset = cluster + (cluster / 2);
-            fat_sector = fat->fat_start_sector + (fat_offset / 512);
-            offset = fat_offset % 512;
+            fat_sector = fat_window(fat, fat_offset, &offset);
             
-            /* May span two sectors */
-            if (fat->fat_buffer_sector != fat_sector) {
-                if (libresd_sd_read_sector(fat->sd, fat_sector, fat->fat_buffer) != LIBRESD_OK) {
-                    return 0;
-                }
-                fat->fat_buffer_sector = fat_sector;
-            }
+            /* May span two windows */
+            if (fat_cache_sector(fat, fat_sector) != LIBRESD_OK) return 0;
             
             value = fat->fat_buffer[offset];
-            if (offset == 511) {
-                uint8_t tmp[512];
-                if (libresd_sd_read_sector(fat->sd, fat_sector + 1, tmp) != LIBRESD_OK) {
+            if (offset == (uint32_t)fat->fat_buffer_blocks * 512 - 1) {
+                /* High bits start the next window, as in write_entry */
+                if (fat_cache_sector(fat, fat_sector + fat->fat_buffer_blocks) != LIBRESD_OK) {
                     return 0;
                 }
-                value |= ((uint32_t)tmp[0] << 8);
+                value |= ((uint32_t)fat->fat_buffer[0] << 8);
             } else {
                 value |= ((uint32_t)fat->fat_buffer[offset + 1] << 8);
             }
@@ -210,29 +443,17 @@ uint32_t libresd_fat_read_entry(libresd_fat_t *fat, uint32_t cluster) {
             
         case LIBRESD_FS_FAT16:
             fat_offset = cluster * 2;
-            fat_sector = fat->fat_start_sector + (fat_offset / 512);
-            offset = fat_offset % 512;
+            fat_sector = fat_window(fat, fat_offset, &offset);
             
-            if (fat->fat_buffer_sector != fat_sector) {
-                if (libresd_sd_read_sector(fat->sd, fat_sector, fat->fat_buffer) != LIBRESD_OK) {
-                    return 0;
-                }
-                fat->fat_buffer_sector = fat_sector;
-            }
+            if (fat_cache_sector(fat, fat_sector) != LIBRESD_OK) return 0;
             
             return READ16(fat->fat_buffer, offset);
             
         case LIBRESD_FS_FAT32:
             fat_offset = cluster * 4;
-            fat_sector = fat->fat_start_sector + (fat_offset / 512);
-            offset = fat_offset % 512;
+            fat_sector = fat_window(fat, fat_offset, &offset);
             
-            if (fat->fat_buffer_sector != fat_sector) {
-                if (libresd_sd_read_sector(fat->sd, fat_sector, fat->fat_buffer) != LIBRESD_OK) {
-                    return 0;
-                }
-                fat->fat_buffer_sector = fat_sector;
-            }
+            if (fat_cache_sector(fat, fat_sector) != LIBRESD_OK) return 0;
             
             return READ32(fat->fat_buffer, offset) & 0x0FFFFFFF;
             
@@ -251,62 +472,145 @@ uint32_t libresd_fat_next_cluster(libresd_fat_t *fat, uint32_t cluster) {
     return next;
 }
 
+uint32_t libresd_fat_get_run(libresd_fat_t *fat, uint32_t cluster, uint32_t max,
+                             uint32_t *next) {
+    uint32_t end, last, entry, offset, bytes;
+    
+    if (next) *next = 0;
+    if (!fat || cluster < 2 || cluster >= fat->cluster_count + 2) return 0;
+    
+    /* Last cluster the run may reach */
+    end = fat->cluster_count + 1;
+    if (max != 0 && max - 1 < end - cluster) end = cluster + max - 1;
+    
+    last = cluster;
+    bytes = (uint32_t)fat->fat_buffer_blocks * 512;
+    
+    switch (fat->fs_type) {
+        case LIBRESD_FS_FAT16:
+            for (;;) {
+                if (fat_cache_sector(fat, fat_window(fat, last * 2, &offset)) != LIBRESD_OK) {
+                    return 0;
+                }
+                for (; offset < bytes; offset += 2, last++) {
+                    /* Aligned pairs in one compare */
+                    if ((offset & 3) == 0 && last + 2 <= end &&
+                        READ32(fat->fat_buffer, offset) == ((last + 1) | ((last + 2) << 16))) {
+                        offset += 2;
+                        last++;
+                        continue;
+                    }
+                    entry = READ16(fat->fat_buffer, offset);
+                    if (entry != last + 1 || last >= end) goto done;
+                }
+            }
+            
+        case LIBRESD_FS_FAT32:
+            for (;;) {
+                if (fat_cache_sector(fat, fat_window(fat, last * 4, &offset)) != LIBRESD_OK) {
+                    return 0;
+                }
+                for (; offset < bytes; offset += 4, last++) {
+                    entry = READ32(fat->fat_buffer, offset) & 0x0FFFFFFF;
+                    if (entry != last + 1 || last >= end) goto done;
+                }
+            }
+            
+        default:
+            /* FAT12 entries straddle bytes and windows: one at a time */
+            entry = libresd_fat_read_entry(fat, last);
+            while (entry == last + 1 && last < end) {
+                last++;
+                entry = libresd_fat_read_entry(fat, last);
+            }
+            break;
+    }
+    
+done:
+    if (next && !libresd_fat_is_eoc(fat, entry)) *next = entry;
+    return last - cluster + 1;
+}
+
+libresd_err_t libresd_fat_chain_extents(libresd_fat_t *fat, uint32_t cluster,
+                                         uint32_t sectors, libresd_extent_t *extents,
+                                         uint32_t max, uint32_t *n) {
+    uint32_t spc = fat->sectors_per_cluster;
+    uint32_t mapped = 0, runs = 0;
+
+    *n = 0;
+
+    while (mapped < sectors) {
+        uint32_t first = cluster;
+        uint32_t run = libresd_fat_get_run(fat, first, (sectors - mapped + spc - 1) / spc,
+                                           &cluster);
+        uint32_t count = run * spc;
+
+        if (run == 0) return LIBRESD_ERR_FAT_CORRUPT;
+        if (count > sectors - mapped) count = sectors - mapped;
+
+        /* Runs end where the chain jumps, so each one is a new extent */
+        if (runs < max) {
+            extents[runs].sector = libresd_fat_cluster_to_sector(fat, first);
+            extents[runs].count = count;
+        }
+        runs++;
+        mapped += count;
+        *n = runs;
+    }
+
+    return (runs > max) ? LIBRESD_ERR_NO_MEM : LIBRESD_OK;
+}
+
 #if LIBRESD_ENABLE_WRITE
 
 libresd_err_t libresd_fat_write_entry(libresd_fat_t *fat, uint32_t cluster, 
                                        uint32_t value) {
-    uint32_t fat_offset, fat_sector, offset;
+    uint32_t fat_offset, fat_sector, offset, last;
     libresd_err_t err;
     
     switch (fat->fs_type) {
         case LIBRESD_FS_FAT12:
             fat_offset = cluster + (cluster / 2);
-            fat_sector = fat->fat_start_sector + (fat_offset / 512);
-            offset = fat_offset % 512;
+            fat_sector = fat_window(fat, fat_offset, &offset);
+            last = (uint32_t)fat->fat_buffer_blocks * 512 - 1;
             
-            if (fat->fat_buffer_sector != fat_sector) {
-                if (fat->fat_buffer_dirty) {
-                    err = libresd_sd_write_sector(fat->sd, fat->fat_buffer_sector, 
-                                                   fat->fat_buffer);
-                    if (err != LIBRESD_OK) return err;
-                }
-                if (libresd_sd_read_sector(fat->sd, fat_sector, fat->fat_buffer) != LIBRESD_OK) {
-                    return LIBRESD_ERR_SPI;
-                }
-                fat->fat_buffer_sector = fat_sector;
-            }
+            err = fat_cache_sector(fat, fat_sector);
+            if (err != LIBRESD_OK) return err;
             
             if (cluster & 1) {
                 fat->fat_buffer[offset] = (fat->fat_buffer[offset] & 0x0F) | ((value << 4) & 0xF0);
-                if (offset < 511) {
+                if (offset < last) {
                     fat->fat_buffer[offset + 1] = (value >> 4) & 0xFF;
                 }
             } else {
                 fat->fat_buffer[offset] = value & 0xFF;
-                if (offset < 511) {
+                if (offset < last) {
                     fat->fat_buffer[offset + 1] = (fat->fat_buffer[offset + 1] & 0xF0) | 
                                                   ((value >> 8) & 0x0F);
                 }
             }
             fat->fat_buffer_dirty = true;
+            
+            /* Entry spans two windows: its high bits start the next one */
+            if (offset == last) {
+                err = fat_cache_sector(fat, fat_sector + fat->fat_buffer_blocks);
+                if (err != LIBRESD_OK) return err;
+                
+                if (cluster & 1) {
+                    fat->fat_buffer[0] = (value >> 4) & 0xFF;
+                } else {
+                    fat->fat_buffer[0] = (fat->fat_buffer[0] & 0xF0) | ((value >> 8) & 0x0F);
+                }
+                fat->fat_buffer_dirty = true;
+            }
             break;
             
         case LIBRESD_FS_FAT16:
             fat_offset = cluster * 2;
-            fat_sector = fat->fat_start_sector + (fat_offset / 512);
-            offset = fat_offset % 512;
+            fat_sector = fat_window(fat, fat_offset, &offset);
             
-            if (fat->fat_buffer_sector != fat_sector) {
-                if (fat->fat_buffer_dirty) {
-                    err = libresd_sd_write_sector(fat->sd, fat->fat_buffer_sector, 
-                                                   fat->fat_buffer);
-                    if (err != LIBRESD_OK) return err;
-                }
-                if (libresd_sd_read_sector(fat->sd, fat_sector, fat->fat_buffer) != LIBRESD_OK) {
-                    return LIBRESD_ERR_SPI;
-                }
-                fat->fat_buffer_sector = fat_sector;
-            }
+            err = fat_cache_sector(fat, fat_sector);
+            if (err != LIBRESD_OK) return err;
             
             WRITE16(fat->fat_buffer, offset, value);
             fat->fat_buffer_dirty = true;
@@ -314,20 +618,10 @@ libresd_err_t libresd_fat_write_entry(libresd_fat_t *fat, uint32_t cluster,
             
         case LIBRESD_FS_FAT32:
             fat_offset = cluster * 4;
-            fat_sector = fat->fat_start_sector + (fat_offset / 512);
-            offset = fat_offset % 512;
+            fat_sector = fat_window(fat, fat_offset, &offset);
             
-            if (fat->fat_buffer_sector != fat_sector) {
-                if (fat->fat_buffer_dirty) {
-                    err = libresd_sd_write_sector(fat->sd, fat->fat_buffer_sector, 
-                                                   fat->fat_buffer);
-                    if (err != LIBRESD_OK) return err;
-                }
-                if (libresd_sd_read_sector(fat->sd, fat_sector, fat->fat_buffer) != LIBRESD_OK) {
-                    return LIBRESD_ERR_SPI;
-                }
-                fat->fat_buffer_sector = fat_sector;
-            }
+            err = fat_cache_sector(fat, fat_sector);
+            if (err != LIBRESD_OK) return err;
             
             /* Preserve high 4 bits */
             value = (READ32(fat->fat_buffer, offset) & 0xF0000000) | (value & 0x0FFFFFFF);
@@ -386,6 +680,65 @@ uint32_t libresd_fat_alloc_cluster(libresd_fat_t *fat, uint32_t prev_cluster) {
     return cluster;
 }
 
+uint32_t libresd_fat_alloc_contiguous(libresd_fat_t *fat, uint32_t prev_cluster,
+                                      uint32_t count) {
+    uint32_t end = fat->cluster_count + 2;
+    uint32_t start = fat->last_alloc_cluster + 1;
+    uint32_t first = 0, run = 0;
+    uint32_t cluster, i;
+    uint32_t eoc;
+    
+    switch (fat->fs_type) {
+        case LIBRESD_FS_FAT12: eoc = 0x0FFF; break;
+        case LIBRESD_FS_FAT16: eoc = 0xFFFF; break;
+        case LIBRESD_FS_FAT32: eoc = 0x0FFFFFFF; break;
+        default: return 0;
+    }
+    
+    if (count == 0 || count > fat->cluster_count) return 0;
+    if (fat->free_clusters != 0xFFFFFFFF && fat->free_clusters < count) return 0;
+    if (start < 2 || start >= end) start = 2;
+    
+    /* Search from the hint to the end, then from the start of the volume.
+     * A run never wraps, so the second pass restarts the count. */
+    cluster = start;
+    for (i = 0; i < fat->cluster_count; i++) {
+        if (cluster >= end) {
+            cluster = 2;
+            run = 0;
+        }
+        if (libresd_fat_read_entry(fat, cluster) == FAT_FREE) {
+            if (run++ == 0) first = cluster;
+            if (run == count) break;
+        } else {
+            run = 0;
+        }
+        cluster++;
+    }
+    if (run < count) return 0;
+    
+    /* Link the run back to front so a failure leaves no half-chain
+     * hanging off prev_cluster */
+    for (i = count; i-- > 0; ) {
+        uint32_t value = (i == count - 1) ? eoc : first + i + 1;
+        if (libresd_fat_write_entry(fat, first + i, value) != LIBRESD_OK) {
+            return 0;
+        }
+    }
+    if (prev_cluster >= 2) {
+        if (libresd_fat_write_entry(fat, prev_cluster, first) != LIBRESD_OK) {
+            return 0;
+        }
+    }
+    
+    fat->last_alloc_cluster = first + count - 1;
+    if (fat->free_clusters != 0xFFFFFFFF) {
+        fat->free_clusters -= count;
+    }
+    
+    return first;
+}
+
 libresd_err_t libresd_fat_free_chain(libresd_fat_t *fat, uint32_t cluster) {
     uint32_t next;
     libresd_err_t err;
@@ -413,15 +766,17 @@ libresd_err_t libresd_fat_free_chain(libresd_fat_t *fat, uint32_t cluster) {
  *============================================================================*/
 
 libresd_err_t libresd_fat_mount(libresd_fat_t *fat, libresd_sd_t *sd) {
-    uint8_t buffer[512];
-    uint32_t root_sectors, data_sectors;
+    uint8_t *buffer;
+    uint32_t root_sectors, data_sectors, blocks;
     
     if (!fat || !sd) return LIBRESD_ERR_INVALID_PARAM;
     if (!sd->initialized) return LIBRESD_ERR_NOT_MOUNTED;
     
     memset(fat, 0, sizeof(libresd_fat_t));
+    buffer = fat->dir_buffer;
     fat->sd = sd;
     fat->fat_buffer_sector = 0xFFFFFFFF;
+    fat->fat_buffer_blocks = 1;
     fat->free_clusters = 0xFFFFFFFF;
     
     /* Read MBR/boot sector */
@@ -467,14 +822,31 @@ libresd_err_t libresd_fat_mount(libresd_fat_t *fat, libresd_sd_t *sd) {
     }
     
     /* Validate BPB */
-    if (fat->bytes_per_sector != 512 || fat->sectors_per_cluster == 0 ||
-        fat->num_fats == 0 || fat->reserved_sectors == 0) {
+    if (fat->bytes_per_sector < 512 || fat->bytes_per_sector > 4096 ||
+        (fat->bytes_per_sector & (fat->bytes_per_sector - 1)) ||
+        fat->sectors_per_cluster == 0 || fat->num_fats == 0 || fat->reserved_sectors == 0) {
+        return LIBRESD_ERR_INVALID_FS;
+    }
+    
+    /* Logical sectors to card blocks; clusters stay within 64 KB */
+    blocks = fat->bytes_per_sector / 512;
+    root_sectors = ((fat->root_entry_count * 32) + fat->bytes_per_sector - 1) /
+                   fat->bytes_per_sector * blocks;
+    if ((uint32_t)fat->sectors_per_cluster * blocks > 128 ||
+        (uint32_t)fat->reserved_sectors * blocks > 0xFFFF ||
+        fat->total_sectors > 0xFFFFFFFFUL / blocks) {
         return LIBRESD_ERR_INVALID_FS;
     }
+    fat->sector_blocks = (uint8_t)blocks;
+    fat->sectors_per_cluster *= blocks;
+    fat->reserved_sectors *= blocks;
+    fat->total_sectors *= blocks;
+    fat->sectors_per_fat *= blocks;
+    fat->fat_buffer_blocks = (uint8_t)(blocks < LIBRESD_MAX_SECTOR_SIZE / 512 ?
+                                       blocks : LIBRESD_MAX_SECTOR_SIZE / 512);
     
     /* Calculate layout */
     fat->fat_start_sector = partition_start + fat->reserved_sectors;
-    root_sectors = ((fat->root_entry_count * 32) + 511) / 512;
     fat->root_start_sector = fat->fat_start_sector + 
                              (fat->num_fats * fat->sectors_per_fat);
     fat->data_start_sector = fat->root_start_sector + root_sectors;
@@ -491,6 +863,11 @@ libresd_err_t libresd_fat_mount(libresd_fat_t *fat, libresd_sd_t *sd) {
         fat->fs_type = LIBRESD_FS_FAT32;
         fat->root_cluster = READ32(buffer, 44);
         fat->data_start_sector = fat->root_start_sector;  /* No fixed root */
+        
+        blocks = READ16(buffer, 48) * fat->sector_blocks;
+        if (blocks != 0 && blocks < fat->reserved_sectors) {
+            fat->fsinfo_sector = partition_start + blocks;
+        }
     }
     
     /* Read volume label */
@@ -524,16 +901,12 @@ libresd_err_t libresd_fat_unmount(libresd_fat_t *fat) {
     if (!fat) return LIBRESD_ERR_INVALID_PARAM;
     
 #if LIBRESD_ENABLE_WRITE
-    /* Flush FAT buffer */
-    if (fat->fat_buffer_dirty && fat->fat_buffer_sector != 0xFFFFFFFF) {
-        libresd_sd_write_sector(fat->sd, fat->fat_buffer_sector, fat->fat_buffer);
-        
-        /* Write to backup FAT */
-        if (fat->num_fats > 1) {
-            libresd_sd_write_sector(fat->sd, fat->fat_buffer_sector + fat->sectors_per_fat,
-                                    fat->fat_buffer);
-        }
-    }
+    /* Flush FAT buffer (to the backup FAT too) */
+    if (fat->mounted) libresd_fat_sync(fat);
+#endif
+    
+#if LIBRESD_ENABLE_SNAPSHOT
+    memset(&fat->snapshot, 0, sizeof(fat->snapshot));
 #endif
     
     fat->mounted = false;
@@ -549,14 +922,20 @@ libresd_err_t libresd_fat_sync(libresd_fat_t *fat) {
     if (!fat || !fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
     
     if (fat->fat_buffer_dirty && fat->fat_buffer_sector != 0xFFFFFFFF) {
-        libresd_err_t err = libresd_sd_write_sector(fat->sd, fat->fat_buffer_sector, 
-                                                     fat->fat_buffer);
-        if (err != LIBRESD_OK) return err;
+        uint32_t sector = fat->fat_buffer_sector;
+        uint8_t copy;
         
-        if (fat->num_fats > 1) {
-            err = libresd_sd_write_sector(fat->sd, fat->fat_buffer_sector + fat->sectors_per_fat,
-                                          fat->fat_buffer);
+        for (copy = 0; copy < fat->num_fats && copy < 2; copy++) {
+            libresd_err_t err;
+            
+            if (fat->fat_buffer_blocks > 1) {
+                err = libresd_sd_write_sectors(fat->sd, sector, fat->fat_buffer,
+                                               fat->fat_buffer_blocks);
+            } else {
+                err = libresd_sd_write_sector(fat->sd, sector, fat->fat_buffer);
+            }
             if (err != LIBRESD_OK) return err;
+            sector += fat->sectors_per_fat;     /* Backup FAT */
         }
         
         fat->fat_buffer_dirty = false;
@@ -565,212 +944,843 @@ libresd_err_t libresd_fat_sync(libresd_fat_t *fat) {
     return LIBRESD_OK;
 }
 
-/*============================================================================
- * DIRECTORY OPERATIONS
- *============================================================================*/
-
-libresd_err_t libresd_fat_opendir(libresd_fat_t *fat, libresd_dir_t *dir, 
-                                   const char *path) {
-    libresd_fileinfo_t info;
+#if LIBRESD_ENABLE_WRITE
+libresd_err_t libresd_fat_update_fsinfo(libresd_fat_t *fat) {
+    uint8_t *buffer;
     libresd_err_t err;
-    uint32_t cluster;
-    
-    if (!fat || !dir) return LIBRESD_ERR_INVALID_PARAM;
-    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
     
-    memset(dir, 0, sizeof(libresd_dir_t));
+    if (!fat || !fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+    if (fat->fsinfo_sector == 0) return LIBRESD_OK;
     
-    if (!path || path[0] == '\0' || (path[0] == '/' && path[1] == '\0')) {
-        /* Root directory */
-        cluster = (fat->fs_type == LIBRESD_FS_FAT32) ? fat->root_cluster : 0;
-    } else {
-        /* Resolve path */
-        err = fat_resolve_path(fat, path, &cluster, NULL, NULL, &info);
-        if (err != LIBRESD_OK) return err;
-        
-        if (!(info.attr & LIBRESD_ATTR_DIRECTORY)) {
-            return LIBRESD_ERR_NOT_DIR;
-        }
+    buffer = fat->dir_buffer;    
+    err = libresd_sd_read_sector(fat->sd, fat->fsinfo_sector, buffer);
+    if (err != LIBRESD_OK) return err;
+    if (READ32(buffer, 0) != FSINFO_LEAD_SIG || READ32(buffer, 484) != FSINFO_STRUC_SIG) {
+        return LIBRESD_ERR_INVALID_FS;
     }
     
-    dir->first_cluster = cluster;
-    dir->current_cluster = cluster;
-    
-    /* For FAT12/16 root, use fixed sectors */
-    if (cluster == 0) {
-        dir->current_sector = fat->root_start_sector;
+    WRITE32(buffer, 488, fat->free_clusters);
+    WRITE32(buffer, 492, fat->last_alloc_cluster >= 2 ? fat->last_alloc_cluster + 1 : 0xFFFFFFFF);
+    return libresd_sd_write_sector(fat->sd, fat->fsinfo_sector, buffer);
+}
+#endif
+
+/*============================================================================
+ * METADATA SNAPSHOT
+ *============================================================================*/
+
+#if LIBRESD_ENABLE_SNAPSHOT
+
+#define SNAP_ROOT               0xFFFFFFFF
+#define SNAP_NONE               0xFFFFFFFE
+
+/**
+ * @brief Snapshot under construction
+ *
+ * Entries grow up from the start of the buffer, names grow down from
+ * the read buffer at its end.
+ */
+typedef struct {
+    libresd_fat_t          *fat;
+    libresd_snap_entry_t   *entries;
+    uint32_t                count;
+    uint32_t                names;      /* Lowest name byte, from entries */
+    uint8_t                *io;
+    uint32_t                io_sectors;
+} snap_build_t;
+
+static inline uint32_t snap_root_cluster(const libresd_fat_t *fat) {
+    return (fat->fs_type == LIBRESD_FS_FAT32) ? fat->root_cluster : 0;
+}
+
+static inline const char *snap_name(const libresd_snapshot_t *snap, uint32_t i) {
+    return (const char *)snap->entries + snap->entries[i].name;
+}
+
+static bool snap_is_dot(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+static void snap_range(const libresd_snapshot_t *snap, uint32_t dir,
+                       uint32_t *first, uint32_t *count) {
+    if (dir == SNAP_ROOT) {
+        *first = 0;
+        *count = snap->root_count;
     } else {
-        dir->current_sector = libresd_fat_cluster_to_sector(fat, cluster);
+        *first = snap->entries[dir].children;
+        *count = snap->entries[dir].child_count;
     }
+}
+
+static bool snap_stale(const libresd_snapshot_t *snap, uint32_t dir) {
+    if (dir == SNAP_ROOT) return snap->root_stale;
+    return (snap->entries[dir].flags & LIBRESD_SNAP_STALE) != 0;
+}
+
+/**
+ * @brief Snapshot entry of the directory starting at cluster
+ */
+static uint32_t snap_dir_by_cluster(libresd_fat_t *fat, uint32_t cluster) {
+    libresd_snapshot_t *snap = &fat->snapshot;
+    uint32_t i;
     
-    dir->entry_offset = 0;
-    dir->is_open = true;
+    if (cluster == snap_root_cluster(fat)) return SNAP_ROOT;
+    if (snap->cwd_index != SNAP_NONE && snap->cwd_cluster == cluster) return snap->cwd_index;
     
-    /* Read first sector */
-    if (libresd_sd_read_sector(fat->sd, dir->current_sector, dir->buffer) != LIBRESD_OK) {
-        return LIBRESD_ERR_SPI;
-    }
+    for (i = 0; i < snap->count; i++) {
+        const libresd_snap_entry_t *e = &snap->entries[i];
     
-    return LIBRESD_OK;
-}
+        if ((e->attr & LIBRESD_ATTR_DIRECTORY) && e->first_cluster == cluster &&
+            !snap_is_dot(snap_name(snap, i))) {
+            snap->cwd_cluster = cluster;
+            snap->cwd_index = i;
+            return i;
+        }
+    }
+    return SNAP_NONE;
+}
 
-libresd_err_t libresd_fat_readdir(libresd_fat_t *fat, libresd_dir_t *dir,
-                                   libresd_fileinfo_t *info) {
-    fat_dirent_t *entry;
-    uint32_t sector_in_cluster = 0;
-    uint32_t max_sector;
+/**
+ * @brief Binary search a directory for the len bytes at name
+ */
+static uint32_t snap_find(const libresd_snapshot_t *snap, uint32_t dir, const char *name,
+                          size_t len) {
+    uint32_t lo, n;
+    
+    snap_range(snap, dir, &lo, &n);
+    while (n > 0) {
+        uint32_t half = n / 2;
+        const char *entry = snap_name(snap, lo + half);
+        int cmp = strncasecmp(entry, name, len);
+    
+        /* Same order as strcasecmp() against the NUL-terminated name */
+        if (cmp == 0 && entry[len] != '\0') cmp = 1;
+        if (cmp == 0) return lo + half;
+        if (cmp < 0) {
+            lo += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    return SNAP_NONE;
+}
+
+/**
+ * @brief Resolve the first len bytes of path in the snapshot
+ *
+ * Follows the same rules as the card walk in fat_lookup(). Stops with
+ * false at the first stale directory (or a working directory the
+ * snapshot does not know), leaving the rest of the path for the card.
+ *
+ * @return true when the answer is in err (and found on success)
+ */
+static bool snap_walk(libresd_fat_t *fat, const char *path, size_t len, const char **rest,
+                      uint32_t *rest_cluster, uint32_t *found, libresd_err_t *err) {
+    libresd_snapshot_t *snap = &fat->snapshot;
+    const char *p = path;
+    const char *end = path + len;
+    uint32_t cur;
+
+    if (p < end && *p == '/') {
+        cur = SNAP_ROOT;
+        p++;
+    } else {
+        cur = snap_dir_by_cluster(fat, fat->cwd_cluster);
+        if (cur == SNAP_NONE) return false;
+    }
+
+    while (p < end) {
+        const char *start = p;
+        uint32_t n, next;
+
+        while (p < end && *p != '/') p++;
+        n = p - start;
+        while (p < end && *p == '/') p++;
+
+        if (n == 0 || (n == 1 && start[0] == '.')) continue;
+        if (n == 2 && start[0] == '.' && start[1] == '.') {
+            cur = SNAP_ROOT;
+            continue;
+        }
+
+        if (snap_stale(snap, cur)) {
+            *rest = start;
+            *rest_cluster = (cur == SNAP_ROOT) ? snap_root_cluster(fat) :
+                            snap->entries[cur].first_cluster;
+            return false;
+        }
+
+        next = snap_find(snap, cur, start, n);
+        if (next == SNAP_NONE) {
+            *err = LIBRESD_ERR_NOT_FOUND;
+            return true;
+        }
+        if (p < end && !(snap->entries[next].attr & LIBRESD_ATTR_DIRECTORY)) {
+            *err = LIBRESD_ERR_NOT_DIR;
+            return true;
+        }
+        cur = next;
+    }
+
+    *found = cur;
+    *err = LIBRESD_OK;
+    return true;
+}
+
+/**
+ * @brief Rebuild the directory entry (and name) of a snapshot entry
+ */
+static void snap_entry(libresd_fat_t *fat, uint32_t idx, fat_dirent_t *entry,
+                       uint32_t *dir_sector, uint16_t *dir_offset, char *name) {
+    const libresd_snapshot_t *snap = &fat->snapshot;
+    const libresd_snap_entry_t *e;
+
+    if (idx == SNAP_ROOT) {
+        fat_dir_entry(entry, snap_root_cluster(fat));
+        *dir_sector = 0;
+        *dir_offset = 0;
+        if (name) name[0] = '\0';
+        return;
+    }
+
+    e = &snap->entries[idx];
+    memset(entry, 0, sizeof(fat_dirent_t));
+    entry->attr = e->attr;
+    entry->cluster_hi = (e->first_cluster >> 16) & 0xFFFF;
+    entry->cluster_lo = e->first_cluster & 0xFFFF;
+    entry->file_size = e->size;
+    entry->create_date = e->create_date;
+    entry->create_time = e->create_time;
+    entry->modify_date = e->modify_date;
+    entry->modify_time = e->modify_time;
+    *dir_sector = e->dir_sector;
+    *dir_offset = e->dir_offset;
+    if (name) {
+        strncpy(name, snap_name(snap, idx), LIBRESD_MAX_FILENAME - 1);
+        name[LIBRESD_MAX_FILENAME - 1] = '\0';
+    }
+}
+
+/**
+ * @brief Open a directory listing served from the snapshot
+ *
+ * @return true when handled (result in err)
+ */
+static bool snap_opendir(libresd_fat_t *fat, libresd_dir_t *dir, const char *path,
+                         libresd_err_t *err) {
+    libresd_snapshot_t *snap = &fat->snapshot;
+    const char *rest;
+    uint32_t rest_cluster, idx, first, count;
+
+    if (!snap_walk(fat, path, path ? strlen(path) : 0, &rest, &rest_cluster, &idx, err)) {
+        return false;
+    }
+    if (*err != LIBRESD_OK) return true;
+
+    if (idx != SNAP_ROOT && !(snap->entries[idx].attr & LIBRESD_ATTR_DIRECTORY)) {
+        *err = LIBRESD_ERR_NOT_DIR;
+        return true;
+    }
+    if (snap_stale(snap, idx)) return false;
+
+    snap_range(snap, idx, &first, &count);
+    dir->snapshot = true;
+    dir->snap_next = first;
+    dir->snap_end = first + count;
+    dir->first_cluster = (idx == SNAP_ROOT) ? snap_root_cluster(fat) :
+                         snap->entries[idx].first_cluster;
+    dir->current_cluster = dir->first_cluster;
+    dir->is_open = true;
+    return true;
+}
+
+static libresd_err_t snap_readdir(libresd_fat_t *fat, libresd_dir_t *dir,
+                                  libresd_fileinfo_t *info) {
+    fat_dirent_t entry;
+    uint32_t sector;
+    uint16_t offset;
+
+    if (!fat->snapshot.entries || dir->snap_next >= dir->snap_end) return LIBRESD_ERR_EOF;
+
+    snap_entry(fat, dir->snap_next++, &entry, &sector, &offset, info->name);
+    fat_dirent_info(info, &entry);
+    info->dir_sector = sector;
+    info->dir_offset = offset;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Append one entry and its name
+ */
+static libresd_err_t snap_add(snap_build_t *b, const libresd_fileinfo_t *info,
+                              const fat_dirent_t *raw, uint32_t sector, uint16_t offset,
+                              uint32_t parent) {
+    libresd_snap_entry_t *e;
+    uint32_t len = strlen(info->name) + 1;
+    uint32_t runs;
+    libresd_err_t err;
+
+    if ((b->count + 1) * sizeof(libresd_snap_entry_t) + len > b->names) {
+        return LIBRESD_ERR_NO_MEM;
+    }
+
+    b->names -= len;
+    memcpy((char *)b->entries + b->names, info->name, len);
+
+    e = &b->entries[b->count++];
+    memset(e, 0, sizeof(*e));
+    e->name = b->names;
+    e->parent = parent;
+    e->first_cluster = info->first_cluster;
+    e->size = info->size;
+    e->dir_sector = sector;
+    e->dir_offset = offset;
+    e->create_date = raw->create_date;
+    e->create_time = raw->create_time;
+    e->modify_date = raw->modify_date;
+    e->modify_time = raw->modify_time;
+    e->attr = info->attr;
+
+    if (!(info->attr & LIBRESD_ATTR_DIRECTORY) && info->size > 0) {
+        err = libresd_fat_chain_extents(b->fat, info->first_cluster, (info->size + 511) / 512,
+                                        NULL, 0, &runs);
+        if ((err == LIBRESD_OK || err == LIBRESD_ERR_NO_MEM) && runs == 1) {
+            e->flags |= LIBRESD_SNAP_CONTIGUOUS;
+        }
+    }
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Sort entries [first, first + n) by name
+ */
+static void snap_sort(snap_build_t *b, uint32_t first, uint32_t n) {
+    libresd_snap_entry_t *e = b->entries + first;
+    const char *base = (const char *)b->entries;
+    uint32_t gap, i, j;
+    
+    /* Shell sort: no recursion, no extra memory */
+    for (gap = n / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < n; i++) {
+            libresd_snap_entry_t tmp = e[i];
+    
+            for (j = i; j >= gap && strcasecmp(base + e[j - gap].name, base + tmp.name) > 0;
+                 j -= gap) {
+                e[j] = e[j - gap];
+            }
+            e[j] = tmp;
+        }
+    }
+}
+
+/**
+ * @brief Append the entries of one directory, sorted
+ */
+static libresd_err_t snap_scan(snap_build_t *b, uint32_t cluster, uint32_t parent) {
+    libresd_fat_t *fat = b->fat;
+    libresd_fileinfo_t info;
+    fat_lfn_t lfn;
+    uint32_t first = b->count;
+    uint32_t sector, left, n, k;
+    libresd_err_t err;
     
-    if (!fat || !dir || !info) return LIBRESD_ERR_INVALID_PARAM;
-    if (!dir->is_open) return LIBRESD_ERR_INVALID_HANDLE;
+    lfn.name = info.name;
+    lfn.valid = false;
     
-#if LIBRESD_ENABLE_LFN
-    char lfn_buffer[LIBRESD_MAX_FILENAME];
-    int lfn_index = 0;
-    bool has_lfn = false;
-    lfn_buffer[0] = '\0';
+    if (cluster == 0) {
+        /* Fixed FAT12/16 root */
+        sector = fat->root_start_sector;
+        left = ((fat->root_entry_count * 32) + 511) / 512;
+    } else {
+        /* cluster becomes the one after each run */
+        sector = libresd_fat_cluster_to_sector(fat, cluster);
+        left = libresd_fat_get_run(fat, cluster, 0, &cluster) * fat->sectors_per_cluster;
+    }
+    
+    while (left > 0) {
+        n = (left < b->io_sectors) ? left : b->io_sectors;
+        err = libresd_sd_read_sectors(fat->sd, sector, b->io, n);
+        if (err != LIBRESD_OK) return err;
+    
+        for (k = 0; k < n * 512; k += FAT_DIRENT_SIZE) {
+            err = fat_dirent_parse(&lfn, (const fat_dirent_t *)(b->io + k), &info);
+            if (err == LIBRESD_ERR_EOF) goto done;
+            if (err != LIBRESD_OK) continue;
+    
+            err = snap_add(b, &info, (const fat_dirent_t *)(b->io + k), sector + k / 512,
+                           k % 512, parent);
+            if (err != LIBRESD_OK) return err;
+        }
+    
+        sector += n;
+        left -= n;
+        if (left == 0 && cluster >= 2) {
+            sector = libresd_fat_cluster_to_sector(fat, cluster);
+            left = libresd_fat_get_run(fat, cluster, 0, &cluster) * fat->sectors_per_cluster;
+        }
+    }
+    
+done:
+    snap_sort(b, first, b->count - first);
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_fat_snapshot(libresd_fat_t *fat, void *buf, uint32_t size,
+                                    uint32_t *used) {
+    libresd_snapshot_t *snap;
+    snap_build_t b;
+    uint32_t pad, i, first, names;
+    libresd_err_t err;
+
+    if (used) *used = 0;
+    if (!fat || !buf) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+
+    snap = &fat->snapshot;
+    memset(snap, 0, sizeof(*snap));
+
+    /* Entries hold 32-bit fields */
+    pad = (uint32_t)(-(uintptr_t)buf & 3);
+    if (size < pad + 2 * 512) return LIBRESD_ERR_NO_MEM;
+    size -= pad;
+
+    b.fat = fat;
+    b.entries = (libresd_snap_entry_t *)((uint8_t *)buf + pad);
+    b.count = 0;
+    b.io_sectors = LIBRESD_SNAPSHOT_READ_SECTORS;
+    while (b.io_sectors > 1 && b.io_sectors * 512 > size / 2) b.io_sectors /= 2;
+    b.names = size - b.io_sectors * 512;
+    b.io = (uint8_t *)b.entries + b.names;
+
+    /* Breadth first: a directory's entries are sorted before any of them
+     * gets children of its own, so parent indices never move */
+    err = snap_scan(&b, snap_root_cluster(fat), SNAP_ROOT);
+    snap->root_count = b.count;
+
+    for (i = 0; err == LIBRESD_OK && i < b.count; i++) {
+        libresd_snap_entry_t *e = &b.entries[i];
+
+        if (!(e->attr & LIBRESD_ATTR_DIRECTORY) || e->first_cluster < 2 ||
+            snap_is_dot((const char *)b.entries + e->name)) {
+            continue;
+        }
+
+        first = b.count;
+        err = snap_scan(&b, e->first_cluster, i);
+        e->children = first;
+        e->child_count = b.count - first;
+    }
+
+    if (err != LIBRESD_OK) {
+        memset(snap, 0, sizeof(*snap));
+        return err;
+    }
+
+    /* Close the gap between entries and names */
+    first = b.count * sizeof(libresd_snap_entry_t);
+    names = b.io - ((uint8_t *)b.entries + b.names);
+    memmove((uint8_t *)b.entries + first, (uint8_t *)b.entries + b.names, names);
+    for (i = 0; i < b.count; i++) {
+        b.entries[i].name -= b.names - first;
+    }
+
+    snap->entries = b.entries;
+    snap->count = b.count;
+    snap->bytes = first + names;
+    snap->cwd_index = SNAP_NONE;
+    if (used) *used = pad + first + names;
+    return LIBRESD_OK;
+}
+
+void libresd_fat_snapshot_drop(libresd_fat_t *fat) {
+    if (fat) memset(&fat->snapshot, 0, sizeof(fat->snapshot));
+}
+
+void fat_snapshot_adopt(libresd_fat_t *fat, void *table, uint32_t count,
+                        uint32_t root_count, uint32_t bytes) {
+    libresd_snapshot_t *snap = &fat->snapshot;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->entries = (libresd_snap_entry_t *)table;
+    snap->count = count;
+    snap->root_count = root_count;
+    snap->bytes = bytes;
+    snap->cwd_index = SNAP_NONE;
+}
+
+bool fat_snapshot_fresh(const libresd_fat_t *fat) {
+    const libresd_snapshot_t *snap = &fat->snapshot;
+    uint32_t i;
+    
+    if (!snap->entries || snap->root_stale) return false;
+    for (i = 0; i < snap->count; i++) {
+        if (snap->entries[i].flags & LIBRESD_SNAP_STALE) return false;
+    }
+    return true;
+}
+
+void fat_snapshot_touch(libresd_fat_t *fat, uint32_t dir_sector) {
+    libresd_snapshot_t *snap = &fat->snapshot;
+    uint32_t i;
+    
+    for (i = 0; i < snap->count; i++) {
+        if (snap->entries[i].dir_sector != dir_sector) continue;
+    
+        if (snap->entries[i].parent == SNAP_ROOT) {
+            snap->root_stale = true;
+        } else {
+            snap->entries[snap->entries[i].parent].flags |= LIBRESD_SNAP_STALE;
+        }
+    }
+}
+
+void fat_snapshot_touch_dir(libresd_fat_t *fat, uint32_t cluster) {
+    libresd_snapshot_t *snap = &fat->snapshot;
+    uint32_t i;
+    
+    if (!snap->entries) return;
+    if (cluster == snap_root_cluster(fat)) {
+        snap->root_stale = true;
+        return;
+    }
+    
+    for (i = 0; i < snap->count; i++) {
+        if ((snap->entries[i].attr & LIBRESD_ATTR_DIRECTORY) &&
+            snap->entries[i].first_cluster == cluster) {
+            snap->entries[i].flags |= LIBRESD_SNAP_STALE;
+        }
+    }
+}
+
+#endif /* LIBRESD_ENABLE_SNAPSHOT */
+
+/*============================================================================
+ * NAME PATTERNS
+ *============================================================================*/
+
+static char glob_upper(char c) {
+    return (c >= 'a' && c <= 'z') ? (char)(c - 32) : c;
+}
+
+#if LIBRESD_ENABLE_SNAPSHOT
+static bool glob_is_dot(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
 #endif
+
+/**
+ * @brief Compare one segment ('?' matches any character) at str
+ */
+static bool glob_segment_at(const char *seg, uint32_t len, const char *str) {
+    uint32_t i;
     
-    /* Calculate max sectors for root dir */
-    if (dir->first_cluster == 0) {
-        max_sector = fat->root_start_sector + 
-                     ((fat->root_entry_count * 32) + 511) / 512;
-    } else {
-        max_sector = 0xFFFFFFFF;  /* Use cluster chain */
+    for (i = 0; i < len; i++) {
+        if (seg[i] != '?' && seg[i] != glob_upper(str[i])) return false;
     }
+    return true;
+}
+
+libresd_err_t libresd_fat_glob_compile(libresd_fat_glob_t *glob, const char *pattern) {
+    uint32_t i;
     
-    while (1) {
-        /* Check if we need next sector */
-        if (dir->entry_offset >= 512) {
-            dir->entry_offset = 0;
-            
-            if (dir->first_cluster == 0) {
-                /* Fixed root directory */
-                dir->current_sector++;
-                if (dir->current_sector >= max_sector) {
-                    return LIBRESD_ERR_EOF;
-                }
-            } else {
-                /* Cluster-based directory */
-                sector_in_cluster = dir->current_sector - 
-                                    libresd_fat_cluster_to_sector(fat, dir->current_cluster);
-                sector_in_cluster++;
-                
-                if (sector_in_cluster >= fat->sectors_per_cluster) {
-                    /* Next cluster */
-                    uint32_t next = libresd_fat_next_cluster(fat, dir->current_cluster);
-                    if (next == 0) {
-                        return LIBRESD_ERR_EOF;
-                    }
-                    dir->current_cluster = next;
-                    dir->current_sector = libresd_fat_cluster_to_sector(fat, next);
-                } else {
-                    dir->current_sector++;
-                }
-            }
-            
-            /* Read new sector */
-            if (libresd_sd_read_sector(fat->sd, dir->current_sector, dir->buffer) != LIBRESD_OK) {
-                return LIBRESD_ERR_SPI;
-            }
+    if (!glob || !pattern || !pattern[0]) return LIBRESD_ERR_INVALID_PARAM;
+    
+    memset(glob, 0, sizeof(libresd_fat_glob_t));
+    for (; *pattern; pattern++) {
+        if (*pattern == '*' && glob->len > 0 && glob->text[glob->len - 1] == '*') continue;
+        if (glob->len == sizeof(glob->text) - 1) return LIBRESD_ERR_INVALID_PARAM;
+        glob->text[glob->len++] = glob_upper(*pattern);
+        if (*pattern != '*') glob->min_len++;
+    }
+    
+    /* Literal ends, usable on raw 8.3 names without decoding them */
+    for (i = 0; i < glob->len && glob->text[i] != '*' && glob->text[i] != '?'; i++) {
+        glob->prefix_len++;
+    }
+    if (glob->prefix_len < glob->len) {
+        for (i = glob->len; i > 0 && glob->text[i - 1] != '*' && glob->text[i - 1] != '?'; i--) {
+            glob->suffix_len++;
         }
+    }
+    return LIBRESD_OK;
+}
+
+bool libresd_fat_glob_match(const libresd_fat_glob_t *glob, const char *name) {
+    const char *seg = glob->text;
+    const char *end = glob->text + glob->len;
+    uint32_t n = strlen(name);
+    uint32_t pos = 0, len;
+    const char *star;
+    
+    if (n < glob->min_len) return false;
+    
+    /* No '*': the whole name against the one segment */
+    star = memchr(seg, '*', glob->len);
+    if (!star) return n == glob->len && glob_segment_at(seg, glob->len, name);
+    
+    /* Anchored head */
+    len = (uint32_t)(star - seg);
+    if (!glob_segment_at(seg, len, name)) return false;
+    pos = len;
+    seg = star + 1;
+    
+    /* Anchored tail, then the middle segments leftmost-first in between */
+    star = end;
+    while (star > seg && star[-1] != '*') star--;
+    len = (uint32_t)(end - star);
+    if (!glob_segment_at(star, len, name + n - len)) return false;
+    n -= len;
+    end = (star > seg) ? star - 1 : seg;
+    
+    while (seg < end) {
+        const char *next = memchr(seg, '*', (size_t)(end - seg));
+    
+        len = (uint32_t)((next ? next : end) - seg);
+        while (pos + len <= n && !glob_segment_at(seg, len, name + pos)) pos++;
+        if (pos + len > n) return false;
+        pos += len;
+        seg = next ? next + 1 : end;
+    }
+    return true;
+}
+
+/**
+ * @brief Character i of a raw short name as fat_name_to_str would spell it
+ */
+static char glob_short_char(const uint8_t *raw, uint32_t base, uint32_t i) {
+    if (i < base) return (raw[i] == DIRENT_KANJI) ? (char)0xE5 : (char)raw[i];
+    if (i == base) return '.';
+    return (char)raw[8 + i - base - 1];
+}
+
+/**
+ * @brief Match a raw 11-byte short name, checking the literal ends first
+ */
+static bool glob_match_short(const libresd_fat_glob_t *glob, const uint8_t *raw) {
+    char name[13];
+    uint32_t base = 8, ext = 3, n, i;
+    
+    while (base > 0 && raw[base - 1] == ' ') base--;
+    while (ext > 0 && raw[8 + ext - 1] == ' ') ext--;
+    n = base + (ext ? ext + 1 : 0);
+    if (n < glob->min_len) return false;
+    
+    for (i = 0; i < glob->prefix_len; i++) {
+        if (glob_upper(glob_short_char(raw, base, i)) != glob->text[i]) return false;
+    }
+    for (i = n - glob->suffix_len; i < n; i++) {
+        if (glob_upper(glob_short_char(raw, base, i)) != glob->text[glob->len - (n - i)]) {
+            return false;
+        }
+    }
+    
+    fat_name_to_str(raw, name);
+    return libresd_fat_glob_match(glob, name);
+}
+
+/*============================================================================
+ * DIRECTORY OPERATIONS
+ *============================================================================*/
+
+libresd_err_t libresd_fat_opendir(libresd_fat_t *fat, libresd_dir_t *dir, 
+                                   const char *path) {
+    fat_dirent_t entry;
+    libresd_err_t err;
+    uint32_t cluster;
+    
+    if (!fat || !dir) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+    
+    memset(dir, 0, sizeof(libresd_dir_t));
+
+#if LIBRESD_ENABLE_SNAPSHOT
+    if (fat->snapshot.entries && snap_opendir(fat, dir, path, &err)) return err;
+#endif
+    
+    if (!path || path[0] == '\0' || (path[0] == '/' && path[1] == '\0')) {
+        /* Root directory */
+        cluster = (fat->fs_type == LIBRESD_FS_FAT32) ? fat->root_cluster : 0;
+    } else {
+        /* Resolve path */
+        err = fat_lookup(fat, path, strlen(path), &entry, NULL, NULL, NULL);
+        if (err != LIBRESD_OK) return err;
         
-        entry = (fat_dirent_t *)(dir->buffer + dir->entry_offset);
-        dir->entry_offset += FAT_DIRENT_SIZE;
-        
-        /* End of directory */
-        if (entry->name[0] == DIRENT_END) {
+        if (!(entry.attr & LIBRESD_ATTR_DIRECTORY)) {
+            return LIBRESD_ERR_NOT_DIR;
+        }
+        cluster = fat_dirent_cluster(&entry);
+    }
+    
+    dir->first_cluster = cluster;
+    dir->current_cluster = cluster;
+    
+    /* For FAT12/16 root, use fixed sectors */
+    if (cluster == 0) {
+        dir->current_sector = fat->root_start_sector;
+    } else {
+        dir->current_sector = libresd_fat_cluster_to_sector(fat, cluster);
+    }
+    
+    dir->entry_offset = 0;
+    dir->is_open = true;
+    
+    /* Read first sector */
+    if (libresd_sd_read_sector(fat->sd, dir->current_sector, dir->buffer) != LIBRESD_OK) {
+        return LIBRESD_ERR_SPI;
+    }
+    
+    return LIBRESD_OK;
+}
+
+libresd_err_t fat_dir_next_sector(libresd_fat_t *fat, uint32_t first_cluster,
+                                  uint32_t *cluster, uint32_t *sector) {
+    uint32_t next;
+    
+    if (first_cluster == 0) {
+        /* Fixed root directory */
+        if (*sector + 1 >= fat->root_start_sector +
+                           ((fat->root_entry_count * 32) + 511) / 512) {
             return LIBRESD_ERR_EOF;
         }
+        (*sector)++;
+        return LIBRESD_OK;
+    }
+    
+    /* Cluster-based directory */
+    if (*sector + 1 - libresd_fat_cluster_to_sector(fat, *cluster) < fat->sectors_per_cluster) {
+        (*sector)++;
+        return LIBRESD_OK;
+    }
+    
+    next = libresd_fat_next_cluster(fat, *cluster);
+    if (next == 0) return LIBRESD_ERR_EOF;
+    *cluster = next;
+    *sector = libresd_fat_cluster_to_sector(fat, next);
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Step to the next raw 32-byte entry, reading sectors as needed
+ *
+ * @return LIBRESD_OK, LIBRESD_ERR_EOF past the last sector, or error
+ */
+static libresd_err_t dir_next_entry(libresd_fat_t *fat, libresd_dir_t *dir,
+                                    const fat_dirent_t **entry) {
+    libresd_err_t err;
+    
+    /* Check if we need next sector */
+    if (dir->entry_offset >= 512) {
+        err = fat_dir_next_sector(fat, dir->first_cluster, &dir->current_cluster,
+                                  &dir->current_sector);
+        if (err != LIBRESD_OK) return err;
+        dir->entry_offset = 0;
         
-        /* Deleted entry */
-        if (entry->name[0] == DIRENT_FREE) {
-#if LIBRESD_ENABLE_LFN
-            has_lfn = false;
-            lfn_index = 0;
-#endif
-            continue;
+        /* Read new sector */
+        if (libresd_sd_read_sector(fat->sd, dir->current_sector, dir->buffer) != LIBRESD_OK) {
+            return LIBRESD_ERR_SPI;
         }
+    }
+    
+    *entry = (const fat_dirent_t *)(dir->buffer + dir->entry_offset);
+    dir->entry_offset += FAT_DIRENT_SIZE;
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_fat_readdir(libresd_fat_t *fat, libresd_dir_t *dir,
+                                   libresd_fileinfo_t *info) {
+    const fat_dirent_t *entry;
+    fat_lfn_t lfn;
+    libresd_err_t err;
+    
+    if (!fat || !dir || !info) return LIBRESD_ERR_INVALID_PARAM;
+    if (!dir->is_open) return LIBRESD_ERR_INVALID_HANDLE;
+    
+#if LIBRESD_ENABLE_SNAPSHOT
+    if (dir->snapshot) return snap_readdir(fat, dir, info);
+#endif
+
+    lfn.name = info->name;
+    lfn.valid = false;
+    
+    while (1) {
+        err = dir_next_entry(fat, dir, &entry);
+        if (err != LIBRESD_OK) return err;
         
-#if LIBRESD_ENABLE_LFN
-        /* Long filename entry */
-        if ((entry->attr & LIBRESD_ATTR_LFN) == LIBRESD_ATTR_LFN) {
-            uint8_t *lfn = (uint8_t *)entry;
-            int seq = lfn[0] & 0x1F;
-            int idx = (seq - 1) * FAT_LFN_ENTRY_CHARS;
-            
-            if (lfn[0] & 0x40) {
-                /* Last LFN entry - start fresh */
-                memset(lfn_buffer, 0, sizeof(lfn_buffer));
-                has_lfn = true;
-            }
-            
-            /* Extract Unicode characters (simplified - ASCII only) */
-            if (idx < LIBRESD_MAX_FILENAME - 1) {
-                for (int i = 0; i < 5 && idx < LIBRESD_MAX_FILENAME - 1; i++) {
-                    uint16_t c = lfn[1 + i*2] | (lfn[2 + i*2] << 8);
-                    if (c && c < 128) lfn_buffer[idx++] = c;
-                }
-                for (int i = 0; i < 6 && idx < LIBRESD_MAX_FILENAME - 1; i++) {
-                    uint16_t c = lfn[14 + i*2] | (lfn[15 + i*2] << 8);
-                    if (c && c < 128) lfn_buffer[idx++] = c;
-                }
-                for (int i = 0; i < 2 && idx < LIBRESD_MAX_FILENAME - 1; i++) {
-                    uint16_t c = lfn[28 + i*2] | (lfn[29 + i*2] << 8);
-                    if (c && c < 128) lfn_buffer[idx++] = c;
-                }
-                lfn_index = idx;
+        err = fat_dirent_parse(&lfn, entry, info);
+        if (err == LIBRESD_ERR_NOT_FOUND) continue;
+        
+        if (err == LIBRESD_OK) {
+            info->dir_sector = dir->current_sector;
+            info->dir_offset = dir->entry_offset - FAT_DIRENT_SIZE;
+        }
+        return err;
+    }
+}
+
+libresd_err_t libresd_fat_readdir_glob(libresd_fat_t *fat, libresd_dir_t *dir,
+                                        const libresd_fat_glob_t *glob, uint8_t flags,
+                                        libresd_fileinfo_t *info) {
+    const fat_dirent_t *entry;
+    fat_lfn_t lfn;
+    libresd_err_t err;
+    bool matched;
+    
+    if (!fat || !dir || !glob || !info) return LIBRESD_ERR_INVALID_PARAM;
+    if (!dir->is_open) return LIBRESD_ERR_INVALID_HANDLE;
+    
+#if LIBRESD_ENABLE_SNAPSHOT
+    if (dir->snapshot) {
+        while ((err = snap_readdir(fat, dir, info)) == LIBRESD_OK) {
+            if (glob_is_dot(info->name)) continue;
+            if (((flags & LIBRESD_GLOB_DIRS) && (info->attr & LIBRESD_ATTR_DIRECTORY)) ||
+                libresd_fat_glob_match(glob, info->name)) {
+                return LIBRESD_OK;
             }
-            continue;
         }
+        return err;
+    }
 #endif
+
+    lfn.name = info->name;
+    lfn.valid = false;
+    
+    while (1) {
+        err = dir_next_entry(fat, dir, &entry);
+        if (err != LIBRESD_OK) return err;
         
-        /* Volume label - skip */
-        if (entry->attr & LIBRESD_ATTR_VOLUME_ID) {
+        /* Short entries are decided here, before fat_dirent_parse decodes them */
+        if (entry->name[0] != DIRENT_END && entry->name[0] != DIRENT_FREE &&
+            !(entry->attr & LIBRESD_ATTR_VOLUME_ID)) {
+            if (entry->name[0] == '.') {
+                lfn.valid = false;
+                continue;
+            }
+            if ((flags & LIBRESD_GLOB_DIRS) && (entry->attr & LIBRESD_ATTR_DIRECTORY)) {
+                matched = true;
+            }
 #if LIBRESD_ENABLE_LFN
-            has_lfn = false;
+            else if (fat_lfn_owns(&lfn, entry)) {
+                matched = libresd_fat_glob_match(glob, lfn.name);
+            }
 #endif
-            continue;
+            else {
+                matched = glob_match_short(glob, entry->name);
+            }
+            if (!matched) {
+                lfn.valid = false;
+                continue;
+            }
         }
         
-        /* Found a valid entry! */
-        memset(info, 0, sizeof(libresd_fileinfo_t));
+        err = fat_dirent_parse(&lfn, entry, info);
+        if (err == LIBRESD_ERR_NOT_FOUND) continue;
         
-#if LIBRESD_ENABLE_LFN
-        if (has_lfn && lfn_buffer[0]) {
-            strncpy(info->name, lfn_buffer, LIBRESD_MAX_FILENAME - 1);
-        } else
-#endif
-        {
-            fat_name_to_str(entry->name, info->name);
+        if (err == LIBRESD_OK) {
+            info->dir_sector = dir->current_sector;
+            info->dir_offset = dir->entry_offset - FAT_DIRENT_SIZE;
         }
-        
-        info->attr = entry->attr;
-        info->size = entry->file_size;
-        info->first_cluster = ((uint32_t)entry->cluster_hi << 16) | entry->cluster_lo;
-        info->dir_sector = dir->current_sector;
-        info->dir_offset = dir->entry_offset - FAT_DIRENT_SIZE;
-        
-        /* Parse timestamps */
-        info->created.year = LIBRESD_FAT_YEAR(entry->create_date);
-        info->created.month = LIBRESD_FAT_MONTH(entry->create_date);
-        info->created.day = LIBRESD_FAT_DAY(entry->create_date);
-        info->created.hour = LIBRESD_FAT_HOUR(entry->create_time);
-        info->created.minute = LIBRESD_FAT_MIN(entry->create_time);
-        info->created.second = LIBRESD_FAT_SEC(entry->create_time);
-        
-        info->modified.year = LIBRESD_FAT_YEAR(entry->modify_date);
-        info->modified.month = LIBRESD_FAT_MONTH(entry->modify_date);
-        info->modified.day = LIBRESD_FAT_DAY(entry->modify_date);
-        info->modified.hour = LIBRESD_FAT_HOUR(entry->modify_time);
-        info->modified.minute = LIBRESD_FAT_MIN(entry->modify_time);
-        info->modified.second = LIBRESD_FAT_SEC(entry->modify_time);
-        
-#if LIBRESD_ENABLE_LFN
-        has_lfn = false;
-        lfn_index = 0;
-#endif
-        
-        return LIBRESD_OK;
+        return err;
     }
 }
 
@@ -781,9 +1791,8 @@ void libresd_fat_closedir(libresd_dir_t *dir) {
 }
 
 libresd_err_t libresd_fat_chdir(libresd_fat_t *fat, const char *path) {
-    libresd_fileinfo_t info;
+    fat_dirent_t entry;
     libresd_err_t err;
-    uint32_t cluster;
     
     if (!fat) return LIBRESD_ERR_INVALID_PARAM;
     if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
@@ -795,14 +1804,14 @@ libresd_err_t libresd_fat_chdir(libresd_fat_t *fat, const char *path) {
         return LIBRESD_OK;
     }
     
-    err = fat_resolve_path(fat, path, &cluster, NULL, NULL, &info);
+    err = fat_lookup(fat, path, strlen(path), &entry, NULL, NULL, NULL);
     if (err != LIBRESD_OK) return err;
     
-    if (!(info.attr & LIBRESD_ATTR_DIRECTORY)) {
+    if (!(entry.attr & LIBRESD_ATTR_DIRECTORY)) {
         return LIBRESD_ERR_NOT_DIR;
     }
     
-    fat->cwd_cluster = info.first_cluster;
+    fat->cwd_cluster = fat_dirent_cluster(&entry);
     
     /* Update path string */
     if (path[0] == '/') {
@@ -832,101 +1841,230 @@ char* libresd_fat_getcwd(libresd_fat_t *fat, char *buffer, size_t size) {
  * PATH RESOLUTION
  *============================================================================*/
 
-libresd_err_t fat_resolve_path(libresd_fat_t *fat, const char *path,
-                                       uint32_t *cluster, uint32_t *dir_sector,
-                                       uint16_t *dir_offset, libresd_fileinfo_t *info) {
-    libresd_dir_t dir;
-    libresd_fileinfo_t entry;
+/**
+ * @brief Does the 8.3 name, as fat_name_to_str would spell it, equal name?
+ */
+static bool fat_short_match(const uint8_t *raw, const char *name, uint32_t len) {
+    uint32_t base = 8, ext = 3, i;
+    
+    while (base > 0 && raw[base - 1] == ' ') base--;
+    while (ext > 0 && raw[8 + ext - 1] == ' ') ext--;
+    if (len != base + (ext ? ext + 1 : 0)) return false;
+    
+    for (i = 0; i < len; i++) {
+        if (glob_upper(glob_short_char(raw, base, i)) != glob_upper(name[i])) return false;
+    }
+    return true;
+}
+
+#if LIBRESD_ENABLE_LFN
+/**
+ * @brief Compare one long name entry with its 13-character slice of name
+ *
+ * Sets named if the piece has a character readdir would show (ASCII),
+ * since a long name without any does not replace the 8.3 name.
+ */
+static bool fat_lfn_match(const uint8_t *raw, const char *name, uint32_t len, bool *named) {
+    uint32_t pos = ((raw[0] & 0x1F) - 1) * FAT_LFN_ENTRY_CHARS;
+    bool match = true;
+    
+    for (int i = 0; i < FAT_LFN_ENTRY_CHARS; i++, pos++) {
+        uint16_t c = READ16(raw, fat_lfn_offset[i]);
+    
+        if (c == 0) return match && pos == len;
+        if (c < 128) *named = true;
+        if (pos >= len || c >= 128 || glob_upper((char)c) != glob_upper(name[pos])) {
+            match = false;
+        }
+    }
+    
+    /* A full last piece ends exactly where name does */
+    return match && (!(raw[0] & 0x40) || pos == len);
+}
+#endif
+
+/**
+ * @brief Find the entry for len bytes of name in one directory
+ *
+ * Long name pieces are compared as they go by, so nothing is assembled
+ * unless out is given (then it receives the name readdir would report).
+ */
+static libresd_err_t fat_dir_find(libresd_fat_t *fat, uint32_t first_cluster,
+                                  const char *name, uint32_t len, char *out,
+                                  fat_dirent_t *entry, uint32_t *dir_sector,
+                                  uint16_t *dir_offset) {
+    uint32_t cluster = first_cluster;
+    uint32_t sector = (first_cluster == 0) ? fat->root_start_sector :
+                      libresd_fat_cluster_to_sector(fat, first_cluster);
+    uint8_t lfn_left = 0xFF;    /* Ordinal of the next long name piece, 0xFF = none */
+    uint8_t lfn_sum = 0;
+    bool lfn_match = false;
+    bool lfn_named = false;
     libresd_err_t err;
-    char component[LIBRESD_MAX_FILENAME];
+    
+    if (len >= LIBRESD_MAX_FILENAME) return LIBRESD_ERR_NOT_FOUND;
+    
+    do {
+        if (libresd_sd_read_sector(fat->sd, sector, fat->dir_buffer) != LIBRESD_OK) {
+            return LIBRESD_ERR_SPI;
+        }
+    
+        for (uint32_t off = 0; off < 512; off += FAT_DIRENT_SIZE) {
+            const fat_dirent_t *e = (const fat_dirent_t *)(fat->dir_buffer + off);
+            bool long_ok;
+    
+            if (e->name[0] == DIRENT_END) return LIBRESD_ERR_NOT_FOUND;
+            if (e->name[0] == DIRENT_FREE) {
+                lfn_left = 0xFF;
+                continue;
+            }
+    
+#if LIBRESD_ENABLE_LFN
+            if ((e->attr & LIBRESD_ATTR_LFN) == LIBRESD_ATTR_LFN) {
+                uint8_t seq = e->name[0] & 0x1F;
+    
+                if (e->name[0] & 0x40) {
+                    lfn_left = seq;
+                    lfn_sum = ((const uint8_t *)e)[13];
+                    lfn_match = true;
+                    lfn_named = false;
+                }
+                if (seq == 0 || seq != lfn_left || ((const uint8_t *)e)[13] != lfn_sum) {
+                    lfn_left = 0xFF;
+                    continue;
+                }
+                lfn_left--;
+                lfn_match = fat_lfn_match((const uint8_t *)e, name, len, &lfn_named) &&
+                            lfn_match;
+                if (out) fat_lfn_piece(out, (const uint8_t *)e);
+                continue;
+            }
+#endif
+    
+            if (e->attr & LIBRESD_ATTR_VOLUME_ID) {
+                lfn_left = 0xFF;
+                continue;
+            }
+    
+            /* Short entry: it goes by the long name before it, if there is one */
+            long_ok = (lfn_left == 0 && lfn_named && lfn_sum == fat_lfn_checksum(e->name));
+            lfn_left = 0xFF;
+            if (long_ok ? !lfn_match : !fat_short_match(e->name, name, len)) continue;
+    
+            memcpy(entry, e, sizeof(fat_dirent_t));
+            *dir_sector = sector;
+            *dir_offset = off;
+            if (out && (!long_ok || !out[0])) fat_name_to_str(e->name, out);
+            return LIBRESD_OK;
+        }
+    
+        err = fat_dir_next_sector(fat, first_cluster, &cluster, &sector);
+    } while (err == LIBRESD_OK);
+    
+    return (err == LIBRESD_ERR_EOF) ? LIBRESD_ERR_NOT_FOUND : err;
+}
+
+libresd_err_t fat_lookup(libresd_fat_t *fat, const char *path, size_t len,
+                         fat_dirent_t *entry, uint32_t *dir_sector,
+                         uint16_t *dir_offset, char *name) {
     const char *p = path;
-    uint32_t current_cluster;
-    bool found;
+    const char *end = path + len;
+    uint32_t cluster, sector = 0;
+    uint16_t offset = 0;
+    libresd_err_t err;
     
     /* Start from root or cwd */
-    if (*p == '/') {
-        current_cluster = (fat->fs_type == LIBRESD_FS_FAT32) ? fat->root_cluster : 0;
+    if (p < end && *p == '/') {
+        cluster = (fat->fs_type == LIBRESD_FS_FAT32) ? fat->root_cluster : 0;
         p++;
     } else {
-        current_cluster = fat->cwd_cluster;
+        cluster = fat->cwd_cluster;
     }
-    
-    /* Handle empty path */
-    if (*p == '\0') {
-        if (cluster) *cluster = current_cluster;
-        if (info) {
-            memset(info, 0, sizeof(libresd_fileinfo_t));
-            info->attr = LIBRESD_ATTR_DIRECTORY;
-            info->first_cluster = current_cluster;
+
+#if LIBRESD_ENABLE_SNAPSHOT
+    if (fat->snapshot.entries) {
+        uint32_t idx;
+
+        if (snap_walk(fat, path, len, &p, &cluster, &idx, &err)) {
+            if (err != LIBRESD_OK) return err;
+            snap_entry(fat, idx, entry, &sector, &offset, name);
+            if (idx != SNAP_ROOT) {
+                uint32_t parent = fat->snapshot.entries[idx].parent;
+
+                fat->lookup_dir = (parent == SNAP_ROOT) ? snap_root_cluster(fat) :
+                                  fat->snapshot.entries[parent].first_cluster;
+            }
+            if (dir_sector) *dir_sector = sector;
+            if (dir_offset) *dir_offset = offset;
+            return LIBRESD_OK;
         }
-        return LIBRESD_OK;
+        /* A stale directory on the way: go on from there on the card */
     }
+#endif
+    
+    fat_dir_entry(entry, cluster);
+    if (name) name[0] = '\0';
+    
+    while (p < end) {
+        const char *start = p;
+        uint32_t n;
+    
+        /* Next path component, in place */
+        while (p < end && *p != '/') p++;
+        n = p - start;
+        while (p < end && *p == '/') p++;
     
-    while (*p) {
-        /* Extract path component */
-        int i = 0;
-        while (*p && *p != '/' && i < LIBRESD_MAX_FILENAME - 1) {
-            component[i++] = *p++;
-        }
-        component[i] = '\0';
-        
-        /* Skip trailing slashes */
-        while (*p == '/') p++;
-        
         /* Handle . and .. */
-        if (strcmp(component, ".") == 0) {
-            continue;
-        }
-        
-        if (strcmp(component, "..") == 0) {
-            /* For simplicity, .. just goes to root if we don't track parent */
-            /* A full implementation would need parent tracking */
-            current_cluster = (fat->fs_type == LIBRESD_FS_FAT32) ? fat->root_cluster : 0;
+        if (n == 0 || (n == 1 && start[0] == '.')) continue;
+        if (n == 2 && start[0] == '.' && start[1] == '.') {
+            /* No parent tracking: .. goes to the root */
+            cluster = (fat->fs_type == LIBRESD_FS_FAT32) ? fat->root_cluster : 0;
+            fat_dir_entry(entry, cluster);
+            sector = 0;
+            offset = 0;
+            if (name) name[0] = '\0';
             continue;
         }
-        
-        /* Search directory */
-        memset(&dir, 0, sizeof(dir));
-        dir.first_cluster = current_cluster;
-        dir.current_cluster = current_cluster;
-        dir.current_sector = (current_cluster == 0) ? 
-                             fat->root_start_sector :
-                             libresd_fat_cluster_to_sector(fat, current_cluster);
-        dir.is_open = true;
-        
-        if (libresd_sd_read_sector(fat->sd, dir.current_sector, dir.buffer) != LIBRESD_OK) {
-            return LIBRESD_ERR_SPI;
-        }
-        
-        found = false;
-        while ((err = libresd_fat_readdir(fat, &dir, &entry)) == LIBRESD_OK) {
-            /* Case-insensitive compare */
-            if (strcasecmp(entry.name, component) == 0) {
-                found = true;
-                break;
-            }
-        }
-        
-        if (!found) {
-            return LIBRESD_ERR_NOT_FOUND;
-        }
-        
-        /* If more path components, this must be a directory */
-        if (*p && !(entry.attr & LIBRESD_ATTR_DIRECTORY)) {
-            return LIBRESD_ERR_NOT_DIR;
-        }
-        
-        current_cluster = entry.first_cluster;
-        
-        /* Save info for last component */
-        if (*p == '\0') {
-            if (cluster) *cluster = entry.first_cluster;
-            if (dir_sector) *dir_sector = entry.dir_sector;
-            if (dir_offset) *dir_offset = entry.dir_offset;
-            if (info) memcpy(info, &entry, sizeof(libresd_fileinfo_t));
-        }
+    
+        /* Only directories have components below them */
+        if (!(entry->attr & LIBRESD_ATTR_DIRECTORY)) return LIBRESD_ERR_NOT_DIR;
+    
+        err = fat_dir_find(fat, cluster, start, n, name, entry, &sector, &offset);
+        if (err != LIBRESD_OK) return err;
+        fat->lookup_dir = cluster;
+        cluster = fat_dirent_cluster(entry);
     }
     
+    if (dir_sector) *dir_sector = sector;
+    if (dir_offset) *dir_offset = offset;
+    return LIBRESD_OK;
+}
+
+libresd_err_t fat_resolve_path(libresd_fat_t *fat, const char *path,
+                               uint32_t *cluster, uint32_t *dir_sector,
+                               uint16_t *dir_offset, libresd_fileinfo_t *info) {
+    fat_dirent_t entry;
+    uint32_t sector;
+    uint16_t offset;
+    libresd_err_t err;
+    
+    err = fat_lookup(fat, path, strlen(path), &entry, &sector, &offset,
+                     info ? info->name : NULL);
+    if (err != LIBRESD_OK) return err;
+    
+    if (cluster) *cluster = fat_dirent_cluster(&entry);
+    if (dir_sector) *dir_sector = sector;
+    if (dir_offset) *dir_offset = offset;
+    if (info) {
+        fat_dirent_info(info, &entry);
+        info->dir_sector = sector;
+        info->dir_offset = offset;
+        if (sector == 0) {
+            /* The root has no entry, so no times either */
+            memset(&info->created, 0, sizeof(info->created));
+            memset(&info->modified, 0, sizeof(info->modified));
+        }
+    }
     return LIBRESD_OK;
 }
 
@@ -943,8 +2081,48 @@ libresd_err_t libresd_fat_stat(libresd_fat_t *fat, const char *path,
 }
 
 bool libresd_fat_exists(libresd_fat_t *fat, const char *path) {
-    libresd_fileinfo_t info;
-    return fat_resolve_path(fat, path, NULL, NULL, NULL, &info) == LIBRESD_OK;
+    fat_dirent_t entry;
+    return fat_lookup(fat, path, strlen(path), &entry, NULL, NULL, NULL) == LIBRESD_OK;
+}
+
+libresd_err_t libresd_fat_get_extents(libresd_fat_t *fat, const char *path,
+                                       libresd_extent_t *extents, uint32_t max,
+                                       uint32_t *n) {
+    fat_dirent_t entry;
+    libresd_err_t err;
+
+    if (!fat || !path || !n || (!extents && max)) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+
+    *n = 0;
+
+#if LIBRESD_ENABLE_SNAPSHOT
+    if (fat->snapshot.entries) {
+        const libresd_snap_entry_t *e;
+        const char *rest;
+        uint32_t rest_cluster, idx;
+
+        /* Contiguous files were found at snapshot time: no FAT reads */
+        if (snap_walk(fat, path, strlen(path), &rest, &rest_cluster, &idx, &err) &&
+            err == LIBRESD_OK && idx != SNAP_ROOT &&
+            (fat->snapshot.entries[idx].flags & LIBRESD_SNAP_CONTIGUOUS)) {
+            e = &fat->snapshot.entries[idx];
+            if (max > 0) {
+                extents[0].sector = libresd_fat_cluster_to_sector(fat, e->first_cluster);
+                extents[0].count = (e->size + 511) / 512;
+            }
+            *n = 1;
+            return (max > 0) ? LIBRESD_OK : LIBRESD_ERR_NO_MEM;
+        }
+    }
+#endif
+
+    err = fat_lookup(fat, path, strlen(path), &entry, NULL, NULL, NULL);
+    if (err != LIBRESD_OK) return err;
+    if (entry.attr & LIBRESD_ATTR_DIRECTORY) return LIBRESD_ERR_NOT_FILE;
+
+    return libresd_fat_chain_extents(fat, fat_dirent_cluster(&entry),
+                                     (entry.file_size + 511) / 512, extents, max, n);
 }
 
 libresd_err_t libresd_fat_get_info(libresd_fat_t *fat, libresd_info_t *info) {
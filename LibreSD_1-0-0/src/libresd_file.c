@@ -9,13 +9,93 @@
 #include "libresd_hal.h"
 #include <string.h>
 
+/*============================================================================
+ * INTERNAL HELPERS
+ *============================================================================*/
+
+#if LIBRESD_STREAM_BUFFER
+/**
+ * @brief Settle the attached stream buffer before a direct file operation
+ * 
+ * Pending formatted output is written out; unread read-ahead is handed
+ * back by moving the chain position to what the caller has consumed.
+ */
+static libresd_err_t file_drain(libresd_fat_t *fat, libresd_file_t *file) {
+#if LIBRESD_ENABLE_PRINTF && LIBRESD_ENABLE_WRITE
+    if (file->wbuf_len) {
+        uint32_t pending = file->wbuf_len;
+        uint32_t written = 0;
+        libresd_err_t err;
+        
+        file->wbuf_len = 0;
+        err = libresd_fat_write(fat, file, file->rbuf, pending, &written);
+        if (err != LIBRESD_OK) return err;
+        if (written != pending) return LIBRESD_ERR_FULL;
+    }
+#endif
+    if (file->rbuf_pos != file->rbuf_len) {
+        return libresd_fat_seek(fat, file, 0, LIBRESD_SEEK_CUR);
+    }
+    return LIBRESD_OK;
+}
+#endif
+
+/**
+ * @brief Follow up to steps links of a chain, a contiguous run at a time
+ *
+ * @param cluster In: where to start; out: the last cluster reached
+ * @return Links followed, fewer than steps if the chain ends first
+ */
+static uint32_t file_walk(libresd_fat_t *fat, uint32_t *cluster, uint32_t steps) {
+    uint32_t done = 0, run, next;
+    
+    while (done < steps) {
+        run = libresd_fat_get_run(fat, *cluster, steps - done + 1, &next);
+        if (run == 0) break;
+        *cluster += run - 1;
+        done += run - 1;
+        if (done == steps || next == 0) break;
+        *cluster = next;
+        done++;
+    }
+    return done;
+}
+
+#if LIBRESD_ENABLE_WRITE
+/**
+ * @brief Write size, first cluster and modification time to the dirent
+ */
+static libresd_err_t file_update_dirent(libresd_fat_t *fat, libresd_file_t *file) {
+    uint8_t *buffer = fat->dir_buffer;
+    libresd_err_t err;
+    
+    err = libresd_sd_read_sector(fat->sd, file->dir_sector, buffer);
+    if (err != LIBRESD_OK) return err;
+    
+    fat_dirent_t *entry = (fat_dirent_t *)(buffer + file->dir_offset);
+    
+    entry->cluster_hi = (file->first_cluster >> 16) & 0xFFFF;
+    entry->cluster_lo = file->first_cluster & 0xFFFF;
+    entry->file_size = file->file_size;
+    
+    /* Update modification time */
+    libresd_datetime_t dt;
+    libresd_hal_get_datetime(&dt);
+    entry->modify_date = LIBRESD_FAT_DATE(dt.year, dt.month, dt.day);
+    entry->modify_time = LIBRESD_FAT_TIME(dt.hour, dt.minute, dt.second);
+    
+    fat_snapshot_touch(fat, file->dir_sector);
+    return libresd_sd_write_sector(fat->sd, file->dir_sector, buffer);
+}
+#endif
+
 /*============================================================================
  * FILE OPERATIONS
  *============================================================================*/
 
 libresd_err_t libresd_fat_open(libresd_fat_t *fat, libresd_file_t *file,
                                 const char *path, uint8_t mode) {
-    libresd_fileinfo_t info;
+    fat_dirent_t dirent;
     libresd_err_t err;
     uint32_t dir_sector;
     uint16_t dir_offset;
@@ -33,11 +113,11 @@ libresd_err_t libresd_fat_open(libresd_fat_t *fat, libresd_file_t *file,
 #endif
     
     /* Try to find existing file */
-    err = fat_resolve_path(fat, path, NULL, &dir_sector, &dir_offset, &info);
+    err = fat_lookup(fat, path, strlen(path), &dirent, &dir_sector, &dir_offset, NULL);
     
     if (err == LIBRESD_OK) {
         /* File exists */
-        if (info.attr & LIBRESD_ATTR_DIRECTORY) {
+        if (dirent.attr & LIBRESD_ATTR_DIRECTORY) {
             return LIBRESD_ERR_NOT_FILE;
         }
         
@@ -45,9 +125,9 @@ libresd_err_t libresd_fat_open(libresd_fat_t *fat, libresd_file_t *file,
             return LIBRESD_ERR_EXISTS;
         }
         
-        file->first_cluster = info.first_cluster;
-        file->current_cluster = info.first_cluster;
-        file->file_size = info.size;
+        file->first_cluster = fat_dirent_cluster(&dirent);
+        file->current_cluster = file->first_cluster;
+        file->file_size = dirent.file_size;
         file->dir_sector = dir_sector;
         file->dir_offset = dir_offset;
         
@@ -62,12 +142,13 @@ libresd_err_t libresd_fat_open(libresd_fat_t *fat, libresd_file_t *file,
             file->file_size = 0;
             
             /* Update directory entry */
-            uint8_t buffer[512];
+            uint8_t *buffer = fat->dir_buffer;
             if (libresd_sd_read_sector(fat->sd, dir_sector, buffer) == LIBRESD_OK) {
                 fat_dirent_t *entry = (fat_dirent_t *)(buffer + dir_offset);
                 entry->cluster_hi = 0;
                 entry->cluster_lo = 0;
                 entry->file_size = 0;
+                fat_snapshot_touch(fat, dir_sector);
                 libresd_sd_write_sector(fat->sd, dir_sector, buffer);
             }
         }
@@ -102,13 +183,8 @@ libresd_err_t libresd_fat_open(libresd_fat_t *fat, libresd_file_t *file,
         /* Find last cluster */
         if (file->first_cluster >= 2) {
             uint32_t cluster = file->first_cluster;
-            uint32_t pos = 0;
-            while (pos + fat->cluster_size <= file->file_size) {
-                uint32_t next = libresd_fat_next_cluster(fat, cluster);
-                if (next == 0) break;
-                cluster = next;
-                pos += fat->cluster_size;
-            }
+            uint32_t pos = file_walk(fat, &cluster, file->file_size / fat->cluster_size) *
+                           fat->cluster_size;
             file->current_cluster = cluster;
             file->cluster_offset = file->file_size - pos;
         }
@@ -121,6 +197,10 @@ libresd_err_t libresd_fat_close(libresd_fat_t *fat, libresd_file_t *file) {
     if (!fat || !file) return LIBRESD_ERR_INVALID_PARAM;
     if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
     
+#if LIBRESD_STREAM_BUFFER
+    file_drain(fat, file);
+#endif
+    
 #if LIBRESD_ENABLE_WRITE
     /* Flush buffer if dirty */
     if (file->buffer_dirty && file->buffer_sector != 0xFFFFFFFF) {
@@ -128,23 +208,8 @@ libresd_err_t libresd_fat_close(libresd_fat_t *fat, libresd_file_t *file) {
     }
     
     /* Update directory entry if file was modified */
-    if (file->mode & LIBRESD_WRITE) {
-        uint8_t buffer[512];
-        if (libresd_sd_read_sector(fat->sd, file->dir_sector, buffer) == LIBRESD_OK) {
-            fat_dirent_t *entry = (fat_dirent_t *)(buffer + file->dir_offset);
-            
-            entry->cluster_hi = (file->first_cluster >> 16) & 0xFFFF;
-            entry->cluster_lo = file->first_cluster & 0xFFFF;
-            entry->file_size = file->file_size;
-            
-            /* Update modification time */
-            libresd_datetime_t dt;
-            libresd_hal_get_datetime(&dt);
-            entry->modify_date = LIBRESD_FAT_DATE(dt.year, dt.month, dt.day);
-            entry->modify_time = LIBRESD_FAT_TIME(dt.hour, dt.minute, dt.second);
-            
-            libresd_sd_write_sector(fat->sd, file->dir_sector, buffer);
-        }
+    if (file->mode & (LIBRESD_WRITE | LIBRESD_APPEND)) {
+        file_update_dirent(fat, file);
     }
 #endif
     
@@ -164,16 +229,44 @@ libresd_err_t libresd_fat_read(libresd_fat_t *fat, libresd_file_t *file,
     if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
     if (!(file->mode & LIBRESD_READ)) return LIBRESD_ERR_READ_ONLY;
     
+#if LIBRESD_STREAM_BUFFER
+    /* Pending formatted output must reach the file before reading it */
+    if (file->wbuf_len) {
+        err = file_drain(fat, file);
+        if (err != LIBRESD_OK) return err;
+    }
+    
+    /* Serve what the line reader already pulled in */
+    if (file->rbuf_pos < file->rbuf_len) {
+        to_read = file->rbuf_len - file->rbuf_pos;
+        if (to_read > size) to_read = size;
+        memcpy(dst, file->rbuf + file->rbuf_pos, to_read);
+        file->rbuf_pos += to_read;
+        dst += to_read;
+        size -= to_read;
+        total_read += to_read;
+    }
+#endif
+    
     /* Limit to remaining file size */
     if (file->position >= file->file_size) {
-        if (bytes_read) *bytes_read = 0;
-        return LIBRESD_ERR_EOF;
+        if (bytes_read) *bytes_read = total_read;
+        return (total_read > 0) ? LIBRESD_OK : LIBRESD_ERR_EOF;
     }
     
     if (file->position + size > file->file_size) {
         size = file->file_size - file->position;
     }
     
+    /* A write may have stopped exactly on a cluster boundary */
+    if (file->cluster_offset >= fat->cluster_size && file->current_cluster >= 2) {
+        uint32_t next = libresd_fat_next_cluster(fat, file->current_cluster);
+        if (next != 0) {
+            file->current_cluster = next;
+            file->cluster_offset = 0;
+        }
+    }
+    
     while (size > 0) {
         /* Calculate sector within current cluster */
         uint32_t offset_in_cluster = file->cluster_offset;
@@ -187,34 +280,69 @@ libresd_err_t libresd_fat_read(libresd_fat_t *fat, libresd_file_t *file,
         
         sector = libresd_fat_cluster_to_sector(fat, file->current_cluster) + sector_in_cluster;
         
-        /* Read sector if not in buffer */
-        if (file->buffer_sector != sector) {
+        if (offset_in_sector == 0 && size >= 512) {
+            /* Whole sectors: read straight into the caller's buffer with one
+             * multi-block command, running on across contiguous clusters */
+            uint32_t count = (fat->cluster_size - offset_in_cluster) / 512;
+            uint32_t want = size / 512;
+            uint32_t spc = fat->sectors_per_cluster;
+            
+            if (count < want) {
+                uint32_t run = libresd_fat_get_run(fat, file->current_cluster,
+                                                   1 + (want - count + spc - 1) / spc, NULL);
+                if (run > 1) count += (run - 1) * spc;
+            }
+            if (count > want) count = want;
+            
 #if LIBRESD_ENABLE_WRITE
-            /* Flush dirty buffer */
-            if (file->buffer_dirty) {
+            /* Pending data in the buffer must reach the card first */
+            if (file->buffer_dirty && file->buffer_sector >= sector &&
+                file->buffer_sector < sector + count) {
                 err = libresd_sd_write_sector(fat->sd, file->buffer_sector, file->buffer);
                 if (err != LIBRESD_OK) return err;
                 file->buffer_dirty = false;
             }
 #endif
-            err = libresd_sd_read_sector(fat->sd, sector, file->buffer);
+            err = libresd_sd_read_sectors(fat->sd, sector, dst, count);
             if (err != LIBRESD_OK) return err;
-            file->buffer_sector = sector;
+            
+            to_read = count * 512;
+        } else {
+            /* Read sector if not in buffer */
+            if (file->buffer_sector != sector) {
+#if LIBRESD_ENABLE_WRITE
+                /* Flush dirty buffer */
+                if (file->buffer_dirty) {
+                    err = libresd_sd_write_sector(fat->sd, file->buffer_sector, file->buffer);
+                    if (err != LIBRESD_OK) return err;
+                    file->buffer_dirty = false;
+                }
+#endif
+                err = libresd_sd_read_sector(fat->sd, sector, file->buffer);
+                if (err != LIBRESD_OK) return err;
+                file->buffer_sector = sector;
+            }
+            
+            /* Calculate how much to read from this sector */
+            to_read = 512 - offset_in_sector;
+            if (to_read > size) to_read = size;
+            
+            /* Copy data */
+            memcpy(dst, file->buffer + offset_in_sector, to_read);
         }
         
-        /* Calculate how much to read from this sector */
-        to_read = 512 - offset_in_sector;
-        if (to_read > size) to_read = size;
-        
-        /* Copy data */
-        memcpy(dst, file->buffer + offset_in_sector, to_read);
-        
         dst += to_read;
         size -= to_read;
         total_read += to_read;
         file->position += to_read;
         file->cluster_offset += to_read;
         
+        /* A multi-block run only spans clusters that follow each other */
+        while (file->cluster_offset > fat->cluster_size) {
+            file->current_cluster++;
+            file->cluster_offset -= fat->cluster_size;
+        }
+        
         /* Check if we need to move to next cluster */
         if (file->cluster_offset >= fat->cluster_size) {
             uint32_t next = libresd_fat_next_cluster(fat, file->current_cluster);
@@ -234,155 +362,412 @@ libresd_err_t libresd_fat_read(libresd_fat_t *fat, libresd_file_t *file,
 
 #if LIBRESD_ENABLE_WRITE
 
+#define FILE_HASH_SEED          2166136261UL
+
+/**
+ * @brief Where a run of free directory entries starts
+ */
+typedef struct {
+    uint32_t    cluster;
+    uint32_t    sector;
+    uint32_t    offset;
+    uint32_t    skip;       /* Entries before the run proper, to mark deleted */
+} file_slot_t;
+
+/**
+ * @brief Can c stand in a short name as it is (case aside)?
+ */
+static bool file_short_char(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+           (uint8_t)c >= 0x80 || (c != '\0' && strchr("!#$%&'()-@^_`{}~", c) != NULL);
+}
+
+/**
+ * @brief Long name entries a new name needs
+ *
+ * @return 0 if the name fits 8.3 as it is (in any case), the number of
+ *         long name entries otherwise, or -1 if it cannot be stored
+ */
+static int file_name_pieces(const char *name, uint32_t len) {
+    const char *dot = NULL;
+    bool fits = true;
+    uint32_t i, base;
+    
+    if (len == 0) return -1;
+    for (i = 0; i < len; i++) {
+        if (name[i] == '.') {
+            if (dot) fits = false;
+            dot = name + i;
+        } else if (!file_short_char(name[i])) {
+            fits = false;
+        }
+    }
+    base = dot ? (uint32_t)(dot - name) : len;
+    if (fits && base >= 1 && base <= 8 && (!dot || (len - base >= 2 && len - base <= 4))) {
+        return 0;
+    }
+    
+#if LIBRESD_ENABLE_LFN
+    if (len >= LIBRESD_MAX_FILENAME || name[len - 1] == '.' || name[len - 1] == ' ') return -1;
+    for (i = 0; i < len; i++) {
+        uint8_t c = (uint8_t)name[i];
+    
+        /* Readers keep ASCII only, so that is all a long name may hold */
+        if (c < 0x20 || c >= 0x7F || strchr("\"*/:<>?\\|", c) != NULL) return -1;
+    }
+    return (int)((len + FAT_LFN_ENTRY_CHARS - 1) / FAT_LFN_ENTRY_CHARS);
+#else
+    /* No long names: str_to_fat_name squeezes it into 8.3 */
+    return 0;
+#endif
+}
+
+#if LIBRESD_ENABLE_LFN
+/**
+ * @brief Character c as it goes into an alias: upper case, '_' if invalid
+ */
+static uint8_t file_alias_char(char c) {
+    if (c >= 'a' && c <= 'z') return (uint8_t)(c - 32);
+    return file_short_char(c) ? (uint8_t)c : '_';
+}
+
+/**
+ * @brief Short alias of a long name, e.g. "LO3F2A~1.TXT"
+ *
+ * Up to two leading characters, four hex digits of a hash of the name
+ * (seeded with round), a ~1 tail and up to three extension characters.
+ * The hash keeps aliases of different names apart without probing the
+ * directory for ~1, ~2, ... in turn.
+ *
+ * @return Index of the tail digit in alias
+ */
+static uint32_t file_alias(const char *name, uint32_t len, uint32_t round, uint8_t *alias) {
+    static const char hex[] = "0123456789ABCDEF";
+    const char *end = name + len;
+    const char *dot = NULL;
+    const char *p;
+    uint32_t h = FILE_HASH_SEED + round;
+    uint32_t n = 0, i;
+    
+    memset(alias, ' ', 11);
+    for (p = name; p < end; p++) {
+        /* FNV-1a, case folded like lookups */
+        h ^= (*p >= 'a' && *p <= 'z') ? (uint8_t)(*p - 32) : (uint8_t)*p;
+        h *= 16777619UL;
+        if (*p == '.' && p != name) dot = p;
+    }
+    h ^= h >> 16;
+    
+    for (p = name; p < (dot ? dot : end) && n < 2; p++) {
+        if (*p == '.' || *p == ' ') continue;
+        alias[n++] = file_alias_char(*p);
+    }
+    for (i = 0; i < 4; i++) alias[n++] = hex[(h >> (12 - 4 * i)) & 0xF];
+    alias[n++] = '~';
+    alias[n] = '1';
+    
+    for (p = dot ? dot + 1 : end, i = 8; p < end && i < 11; p++) {
+        if (*p == '.' || *p == ' ') continue;
+        alias[i++] = file_alias_char(*p);
+    }
+    return n;
+}
+#endif
+
+/**
+ * @brief Find need adjacent free entries in a directory, in one pass
+ *
+ * Deleted entries and everything from the end marker on count as free;
+ * past the last cluster the directory grows by zeroed clusters. A run
+ * stays within one cluster (unless a cluster holds fewer than need), so
+ * fat_dirent_remove() can walk back over it. When that skips the free
+ * tail of a cluster after the end marker, slot->skip counts the entries
+ * that must turn into deleted ones so readers go on to the run. Given an
+ * alias, the pass goes on to the end marker and sets bit n of taken for
+ * each short entry that is the alias with tail digit n.
+ */
+static libresd_err_t file_find_slots(libresd_fat_t *fat, uint32_t first_cluster,
+                                     uint32_t need, const uint8_t *alias, uint32_t tail,
+                                     uint16_t *taken, file_slot_t *slot) {
+    uint32_t cluster = first_cluster;
+    uint32_t sector = (first_cluster == 0) ? fat->root_start_sector :
+                      libresd_fat_cluster_to_sector(fat, first_cluster);
+    bool split = need > fat->sectors_per_cluster * (512 / FAT_DIRENT_SIZE);
+    bool ended = false;
+    uint32_t run = 0, prev, next;
+    libresd_err_t err;
+    
+    memset(slot, 0, sizeof(file_slot_t));
+    while (1) {
+        if (!ended && libresd_sd_read_sector(fat->sd, sector, fat->dir_buffer) != LIBRESD_OK) {
+            return LIBRESD_ERR_SPI;
+        }
+    
+        for (uint32_t off = 0; off < 512; off += FAT_DIRENT_SIZE) {
+            const uint8_t *raw = fat->dir_buffer + off;
+    
+            if (!ended && raw[0] == DIRENT_END) ended = true;
+            if (ended || raw[0] == DIRENT_FREE) {
+                if (run == 0) {
+                    slot->cluster = cluster;
+                    slot->sector = sector;
+                    slot->offset = off;
+                }
+                if (run < slot->skip + need) run++;
+            } else {
+                if (run < need) run = 0;
+                if (alias && memcmp(raw, alias, tail) == 0 &&
+                    memcmp(raw + tail + 1, alias + tail + 1, 10 - tail) == 0 &&
+                    raw[tail] >= '1' && raw[tail] <= '9') {
+                    *taken |= 1u << (raw[tail] - '0');
+                }
+            }
+        }
+        if (run >= slot->skip + need && (ended || !alias)) return LIBRESD_OK;
+    
+        prev = cluster;
+        err = fat_dir_next_sector(fat, first_cluster, &cluster, &sector);
+        if (err == LIBRESD_ERR_EOF) {
+            if (run >= slot->skip + need) return LIBRESD_OK;
+            if (first_cluster == 0) return LIBRESD_ERR_ROOT_FULL;
+    
+            /* Grow the directory by a zeroed cluster */
+            next = libresd_fat_alloc_cluster(fat, cluster);
+            if (next == 0) return LIBRESD_ERR_FULL;
+            cluster = next;
+            sector = libresd_fat_cluster_to_sector(fat, next);
+            memset(fat->dir_buffer, 0, 512);
+            if (libresd_sd_fill_sectors(fat->sd, sector, fat->dir_buffer,
+                                        fat->sectors_per_cluster) != LIBRESD_OK) {
+                return LIBRESD_ERR_SPI;
+            }
+            ended = true;
+        } else if (err != LIBRESD_OK) {
+            return err;
+        }
+        if (cluster != prev && run < slot->skip + need && !split) {
+            if (ended) {
+                slot->skip = run;
+            } else {
+                run = 0;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Write the long name pieces (last piece first) and then the short
+ *        entry into the run file_find_slots() found, after the skipped
+ *        entries
+ */
+static libresd_err_t file_write_slots(libresd_fat_t *fat, uint32_t first_cluster,
+                                      const file_slot_t *slot, const char *name,
+                                      uint32_t len, uint32_t pieces,
+                                      const fat_dirent_t *entry, uint32_t *dir_sector,
+                                      uint16_t *dir_offset) {
+    uint32_t cluster = slot->cluster;
+    uint32_t sector = slot->sector;
+    uint32_t off = slot->offset;
+    uint32_t skip = slot->skip;
+    libresd_err_t err;
+    
+    if (libresd_sd_read_sector(fat->sd, sector, fat->dir_buffer) != LIBRESD_OK) {
+        return LIBRESD_ERR_SPI;
+    }
+    
+    while (1) {
+        if (off >= 512) {
+            err = libresd_sd_write_sector(fat->sd, sector, fat->dir_buffer);
+            if (err == LIBRESD_OK) {
+                err = fat_dir_next_sector(fat, first_cluster, &cluster, &sector);
+            }
+            if (err != LIBRESD_OK) return err;
+            if (libresd_sd_read_sector(fat->sd, sector, fat->dir_buffer) != LIBRESD_OK) {
+                return LIBRESD_ERR_SPI;
+            }
+            off = 0;
+        }
+        if (skip > 0) {
+            fat->dir_buffer[off] = DIRENT_FREE;
+            skip--;
+        } else if (pieces > 0) {
+#if LIBRESD_ENABLE_LFN
+            fat_lfn_pack(fat->dir_buffer + off, name, len, (uint8_t)pieces,
+                         fat_lfn_checksum(entry->name));
+#endif
+            pieces--;
+        } else {
+            break;
+        }
+        off += FAT_DIRENT_SIZE;
+    }
+    
+    memcpy(fat->dir_buffer + off, entry, FAT_DIRENT_SIZE);
+    err = libresd_sd_write_sector(fat->sd, sector, fat->dir_buffer);
+    if (err != LIBRESD_OK) return err;
+    
+    if (dir_sector) *dir_sector = sector;
+    if (dir_offset) *dir_offset = (uint16_t)off;
+    return LIBRESD_OK;
+}
+
 /**
  * @brief Create a new file entry in directory
  */
 libresd_err_t libresd_fat_create_file(libresd_fat_t *fat, const char *path,
                                        uint8_t attr, uint32_t *out_dir_sector,
                                        uint16_t *out_dir_offset) {
-    libresd_dir_t dir;
-    uint8_t buffer[512];
-    fat_dirent_t *entry;
-    char parent_path[LIBRESD_MAX_PATH];
-    char filename[LIBRESD_MAX_FILENAME];
-    uint8_t fat_name[11];
+    fat_dirent_t parent;
+    fat_dirent_t entry;
+    file_slot_t slot;
     const char *last_slash;
+    const char *name;
+    uint32_t parent_cluster, len, tail = 0, round;
+    uint16_t taken;
+    int pieces;
     libresd_err_t err;
-    uint32_t parent_cluster;
-    libresd_fileinfo_t parent_info;
     
-    /* Split path into parent and filename */
+    /* Split path into parent and filename, without copying either */
     last_slash = strrchr(path, '/');
-    if (last_slash) {
-        size_t parent_len = last_slash - path;
-        if (parent_len == 0) {
-            strcpy(parent_path, "/");
-        } else {
-            strncpy(parent_path, path, parent_len);
-            parent_path[parent_len] = '\0';
-        }
-        strncpy(filename, last_slash + 1, LIBRESD_MAX_FILENAME - 1);
-    } else {
-        strcpy(parent_path, "");
-        strncpy(filename, path, LIBRESD_MAX_FILENAME - 1);
-    }
-    filename[LIBRESD_MAX_FILENAME - 1] = '\0';
+    name = last_slash ? last_slash + 1 : path;
+    len = (uint32_t)strlen(name);
     
-    /* Convert filename to 8.3 */
-    if (!str_to_fat_name(filename, fat_name)) {
+    /* 8.3 names get a short entry alone */
+    memset(&entry, 0, sizeof(entry));
+    pieces = file_name_pieces(name, len);
+    if (pieces < 0 || (pieces == 0 && !str_to_fat_name(name, entry.name))) {
         return LIBRESD_ERR_INVALID_NAME;
     }
     
     /* Resolve parent directory */
-    if (parent_path[0]) {
-        err = fat_resolve_path(fat, parent_path, &parent_cluster, NULL, NULL, &parent_info);
+    if (last_slash) {
+        err = fat_lookup(fat, path, (last_slash == path) ? 1 : (size_t)(last_slash - path),
+                         &parent, NULL, NULL, NULL);
         if (err != LIBRESD_OK) return err;
-        if (!(parent_info.attr & LIBRESD_ATTR_DIRECTORY)) {
+        if (!(parent.attr & LIBRESD_ATTR_DIRECTORY)) {
             return LIBRESD_ERR_NOT_DIR;
         }
+        parent_cluster = fat_dirent_cluster(&parent);
     } else {
         parent_cluster = fat->cwd_cluster;
     }
     
-    /* Open parent directory to find free entry */
-    memset(&dir, 0, sizeof(dir));
-    dir.first_cluster = parent_cluster;
-    dir.current_cluster = parent_cluster;
-    dir.current_sector = (parent_cluster == 0) ?
-                         fat->root_start_sector :
-                         libresd_fat_cluster_to_sector(fat, parent_cluster);
-    dir.is_open = true;
-    
-    if (libresd_sd_read_sector(fat->sd, dir.current_sector, dir.buffer) != LIBRESD_OK) {
-        return LIBRESD_ERR_SPI;
-    }
-    
-    /* Search for free entry */
-    uint32_t max_entries = (parent_cluster == 0) ? fat->root_entry_count : 0xFFFFFFFF;
-    uint32_t entry_count = 0;
-    bool found = false;
+    /* One pass finds the run and the ~n tails taken for the alias */
+    for (round = 0; ; round++) {
+#if LIBRESD_ENABLE_LFN
+        if (pieces > 0) tail = file_alias(name, len, round, entry.name);
+#endif
+        taken = 0;
+        err = file_find_slots(fat, parent_cluster, (uint32_t)pieces + 1,
+                              (pieces > 0) ? entry.name : NULL, tail, &taken, &slot);
+        if (err != LIBRESD_OK) return err;
+        if (pieces == 0) break;
     
-    while (!found) {
-        if (dir.entry_offset >= 512) {
-            /* Need next sector */
-            dir.entry_offset = 0;
-            
-            if (parent_cluster == 0) {
-                /* Fixed root */
-                dir.current_sector++;
-                if (entry_count >= max_entries) {
-                    return LIBRESD_ERR_ROOT_FULL;
-                }
-            } else {
-                /* Cluster-based */
-                uint32_t sector_in_cluster = dir.current_sector -
-                    libresd_fat_cluster_to_sector(fat, dir.current_cluster);
-                sector_in_cluster++;
-                
-                if (sector_in_cluster >= fat->sectors_per_cluster) {
-                    uint32_t next = libresd_fat_next_cluster(fat, dir.current_cluster);
-                    if (next == 0) {
-                        /* Allocate new cluster for directory */
-                        next = libresd_fat_alloc_cluster(fat, dir.current_cluster);
-                        if (next == 0) return LIBRESD_ERR_FULL;
-                        
-                        /* Zero the new cluster */
-                        memset(buffer, 0, 512);
-                        uint32_t new_sector = libresd_fat_cluster_to_sector(fat, next);
-                        for (uint32_t i = 0; i < fat->sectors_per_cluster; i++) {
-                            libresd_sd_write_sector(fat->sd, new_sector + i, buffer);
-                        }
-                    }
-                    dir.current_cluster = next;
-                    dir.current_sector = libresd_fat_cluster_to_sector(fat, next);
-                } else {
-                    dir.current_sector++;
-                }
-            }
-            
-            if (libresd_sd_read_sector(fat->sd, dir.current_sector, dir.buffer) != LIBRESD_OK) {
-                return LIBRESD_ERR_SPI;
-            }
-        }
-        
-        entry = (fat_dirent_t *)(dir.buffer + dir.entry_offset);
-        
-        if (entry->name[0] == DIRENT_FREE || entry->name[0] == DIRENT_END) {
-            found = true;
-            break;
+        /* All of ~1..~9 taken for this hash: try the next one */
+        while (entry.name[tail] <= '9' && (taken & (1u << (entry.name[tail] - '0')))) {
+            entry.name[tail]++;
         }
-        
-        dir.entry_offset += FAT_DIRENT_SIZE;
-        entry_count++;
+        if (entry.name[tail] <= '9') break;
     }
     
     /* Fill in the entry */
-    memset(entry, 0, FAT_DIRENT_SIZE);
-    memcpy(entry->name, fat_name, 11);
-    entry->attr = attr | LIBRESD_ATTR_ARCHIVE;
-    entry->cluster_hi = 0;
-    entry->cluster_lo = 0;
-    entry->file_size = 0;
+    entry.attr = attr | LIBRESD_ATTR_ARCHIVE;
     
     /* Set timestamps */
     libresd_datetime_t dt;
     libresd_hal_get_datetime(&dt);
-    entry->create_date = LIBRESD_FAT_DATE(dt.year, dt.month, dt.day);
-    entry->create_time = LIBRESD_FAT_TIME(dt.hour, dt.minute, dt.second);
-    entry->modify_date = entry->create_date;
-    entry->modify_time = entry->create_time;
-    entry->access_date = entry->create_date;
+    entry.create_date = LIBRESD_FAT_DATE(dt.year, dt.month, dt.day);
+    entry.create_time = LIBRESD_FAT_TIME(dt.hour, dt.minute, dt.second);
+    entry.modify_date = entry.create_date;
+    entry.modify_time = entry.create_time;
+    entry.access_date = entry.create_date;
+    
+    fat_snapshot_touch_dir(fat, parent_cluster);
+    return file_write_slots(fat, parent_cluster, &slot, name, len, (uint32_t)pieces, &entry,
+                            out_dir_sector, out_dir_offset);
+}
+
+/**
+ * @brief Make sure a cluster backs the write position, allocating as needed
+ */
+static libresd_err_t file_claim_cluster(libresd_fat_t *fat, libresd_file_t *file) {
+    if (file->current_cluster < 2) {
+        uint32_t new_cluster = libresd_fat_alloc_cluster(fat, 0);
+        if (new_cluster == 0) return LIBRESD_ERR_FULL;
+        
+        if (file->first_cluster < 2) {
+            file->first_cluster = new_cluster;
+        }
+        file->current_cluster = new_cluster;
+        file->cluster_offset = 0;
+    }
     
-    /* Write the sector */
-    err = libresd_sd_write_sector(fat->sd, dir.current_sector, dir.buffer);
-    if (err != LIBRESD_OK) return err;
+    if (file->cluster_offset >= fat->cluster_size) {
+        uint32_t next = libresd_fat_next_cluster(fat, file->current_cluster);
+        if (next == 0) {
+            next = libresd_fat_alloc_cluster(fat, file->current_cluster);
+            if (next == 0) return LIBRESD_ERR_FULL;
+        }
+        file->current_cluster = next;
+        file->cluster_offset = 0;
+    }
+    
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Bring the sector under the write position into the file buffer
+ * 
+ * The old contents are only read back when the caller will not overwrite
+ * the whole sector and the sector holds data below EOF.
+ * 
+ * @param size Bytes the caller is about to write
+ */
+static libresd_err_t file_load_for_write(libresd_fat_t *fat, libresd_file_t *file,
+                                         uint32_t sector, uint32_t size) {
+    uint32_t offset_in_sector = file->cluster_offset % 512;
+    libresd_err_t err;
+    
+    if (file->buffer_sector == sector) return LIBRESD_OK;
+    
+    /* Flush dirty buffer */
+    if (file->buffer_dirty) {
+        err = libresd_sd_write_sector(fat->sd, file->buffer_sector, file->buffer);
+        if (err != LIBRESD_OK) return err;
+        file->buffer_dirty = false;
+    }
     
-    if (out_dir_sector) *out_dir_sector = dir.current_sector;
-    if (out_dir_offset) *out_dir_offset = dir.entry_offset;
+    if (offset_in_sector != 0 || size < 512) {
+        if (file->position - offset_in_sector >= file->file_size) {
+            memset(file->buffer, 0, 512);
+        } else {
+            err = libresd_sd_read_sector(fat->sd, sector, file->buffer);
+            if (err != LIBRESD_OK) return err;
+        }
+    }
+    file->buffer_sector = sector;
     
     return LIBRESD_OK;
 }
 
+/**
+ * @brief Account for n bytes written at the current position
+ */
+static void file_advance_write(libresd_fat_t *fat, libresd_file_t *file, uint32_t n) {
+    file->position += n;
+    file->cluster_offset += n;
+    
+    /* A multi-block run only spans clusters that follow each other */
+    while (file->cluster_offset > fat->cluster_size) {
+        file->current_cluster++;
+        file->cluster_offset -= fat->cluster_size;
+    }
+    
+    if (file->position > file->file_size) {
+        file->file_size = file->position;
+    }
+}
+
 libresd_err_t libresd_fat_write(libresd_fat_t *fat, libresd_file_t *file,
                                  const void *buffer, uint32_t size,
                                  uint32_t *bytes_written) {
@@ -398,42 +783,15 @@ libresd_err_t libresd_fat_write(libresd_fat_t *fat, libresd_file_t *file,
         return LIBRESD_ERR_READ_ONLY;
     }
     
+#if LIBRESD_STREAM_BUFFER
+    /* Earlier formatted output goes first; read-ahead is given back so the
+     * write lands at the logical position */
+    err = file_drain(fat, file);
+    if (err != LIBRESD_OK) return err;
+#endif
+    
     while (size > 0) {
-        /* Allocate cluster if needed */
-        if (file->current_cluster < 2) {
-            uint32_t new_cluster = libresd_fat_alloc_cluster(fat, 0);
-            if (new_cluster == 0) {
-                err = LIBRESD_ERR_FULL;
-                break;
-            }
-            
-            if (file->first_cluster < 2) {
-                file->first_cluster = new_cluster;
-            }
-            file->current_cluster = new_cluster;
-            file->cluster_offset = 0;
-            
-            /* Zero the new cluster */
-            memset(file->buffer, 0, 512);
-            sector = libresd_fat_cluster_to_sector(fat, new_cluster);
-            for (uint32_t i = 0; i < fat->sectors_per_cluster; i++) {
-                libresd_sd_write_sector(fat->sd, sector + i, file->buffer);
-            }
-        }
-        
-        /* Check if we need to allocate next cluster */
-        if (file->cluster_offset >= fat->cluster_size) {
-            uint32_t next = libresd_fat_next_cluster(fat, file->current_cluster);
-            if (next == 0) {
-                next = libresd_fat_alloc_cluster(fat, file->current_cluster);
-                if (next == 0) {
-                    err = LIBRESD_ERR_FULL;
-                    break;
-                }
-            }
-            file->current_cluster = next;
-            file->cluster_offset = 0;
-        }
+        if (file_claim_cluster(fat, file) != LIBRESD_OK) break;
         
         /* Calculate sector */
         uint32_t offset_in_cluster = file->cluster_offset;
@@ -442,41 +800,62 @@ libresd_err_t libresd_fat_write(libresd_fat_t *fat, libresd_file_t *file,
         
         sector = libresd_fat_cluster_to_sector(fat, file->current_cluster) + sector_in_cluster;
         
-        /* Load sector if partial write or different sector */
-        if (file->buffer_sector != sector) {
-            /* Flush dirty buffer */
-            if (file->buffer_dirty) {
-                err = libresd_sd_write_sector(fat->sd, file->buffer_sector, file->buffer);
-                if (err != LIBRESD_OK) return err;
-                file->buffer_dirty = false;
+        if (offset_in_sector == 0 && size >= 512) {
+            /* Whole sectors: stream straight from the caller's buffer with
+             * one multi-block command, extending the chain while the new
+             * clusters land right behind the current one */
+            uint32_t count = (fat->cluster_size - offset_in_cluster) / 512;
+            uint32_t want = size / 512;
+            uint32_t spc = fat->sectors_per_cluster;
+            uint32_t last = file->current_cluster;
+            
+            while (count < want) {
+                uint32_t next;
+                uint32_t run = libresd_fat_get_run(fat, last, 1 + (want - count + spc - 1) / spc,
+                                                   &next);
+                
+                /* Clusters the chain already has (overwrite, preallocation) */
+                if (run == 0) break;
+                last += run - 1;
+                count += (run - 1) * spc;
+                if (count >= want) break;
+                
+                if (next == 0) {
+                    next = libresd_fat_alloc_cluster(fat, last);
+                }
+                if (next != last + 1) break;
+                last = next;
+                count += spc;
             }
+            if (count > want) count = want;
             
-            /* Read sector if partial write */
-            if (offset_in_sector != 0 || size < 512) {
-                err = libresd_sd_read_sector(fat->sd, sector, file->buffer);
-                if (err != LIBRESD_OK) return err;
+            /* Buffered copy of a sector we are about to overwrite is stale */
+            if (file->buffer_sector >= sector && file->buffer_sector < sector + count) {
+                file->buffer_sector = 0xFFFFFFFF;
+                file->buffer_dirty = false;
             }
-            file->buffer_sector = sector;
+            
+            err = libresd_sd_write_sectors(fat->sd, sector, src, count);
+            if (err != LIBRESD_OK) return err;
+            
+            to_write = count * 512;
+        } else {
+            err = file_load_for_write(fat, file, sector, size);
+            if (err != LIBRESD_OK) return err;
+            
+            /* Calculate how much to write to this sector */
+            to_write = 512 - offset_in_sector;
+            if (to_write > size) to_write = size;
+            
+            /* Copy data */
+            memcpy(file->buffer + offset_in_sector, src, to_write);
+            file->buffer_dirty = true;
         }
         
-        /* Calculate how much to write to this sector */
-        to_write = 512 - offset_in_sector;
-        if (to_write > size) to_write = size;
-        
-        /* Copy data */
-        memcpy(file->buffer + offset_in_sector, src, to_write);
-        file->buffer_dirty = true;
-        
         src += to_write;
         size -= to_write;
         total_written += to_write;
-        file->position += to_write;
-        file->cluster_offset += to_write;
-        
-        /* Update file size */
-        if (file->position > file->file_size) {
-            file->file_size = file->position;
-        }
+        file_advance_write(fat, file, to_write);
     }
     
     if (bytes_written) *bytes_written = total_written;
@@ -490,6 +869,11 @@ libresd_err_t libresd_fat_flush(libresd_fat_t *fat, libresd_file_t *file) {
     if (!fat || !file) return LIBRESD_ERR_INVALID_PARAM;
     if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
     
+#if LIBRESD_STREAM_BUFFER
+    err = file_drain(fat, file);
+    if (err != LIBRESD_OK) return err;
+#endif
+    
     /* Flush file buffer */
     if (file->buffer_dirty && file->buffer_sector != 0xFFFFFFFF) {
         err = libresd_sd_write_sector(fat->sd, file->buffer_sector, file->buffer);
@@ -501,11 +885,31 @@ libresd_err_t libresd_fat_flush(libresd_fat_t *fat, libresd_file_t *file) {
     return libresd_fat_sync(fat);
 }
 
+libresd_err_t libresd_fat_checkpoint(libresd_fat_t *fat, libresd_file_t *file) {
+    libresd_err_t err;
+    
+    if (!fat || !file) return LIBRESD_ERR_INVALID_PARAM;
+    if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
+    
+    /* Pending output, sector buffer and FAT */
+    err = libresd_fat_flush(fat, file);
+    if (err != LIBRESD_OK) return err;
+    
+    if (!(file->mode & (LIBRESD_WRITE | LIBRESD_APPEND))) return LIBRESD_OK;
+    
+    return file_update_dirent(fat, file);
+}
+
 libresd_err_t libresd_fat_truncate(libresd_fat_t *fat, libresd_file_t *file) {
     if (!fat || !file) return LIBRESD_ERR_INVALID_PARAM;
     if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
     if (!(file->mode & LIBRESD_WRITE)) return LIBRESD_ERR_READ_ONLY;
     
+#if LIBRESD_STREAM_BUFFER
+    libresd_err_t err = file_drain(fat, file);
+    if (err != LIBRESD_OK) return err;
+#endif
+    
     /* Free clusters after current position */
     if (file->current_cluster >= 2 && file->position < file->file_size) {
         uint32_t eoc;
@@ -546,18 +950,234 @@ libresd_err_t libresd_fat_truncate(libresd_fat_t *fat, libresd_file_t *file) {
     return LIBRESD_OK;
 }
 
+libresd_err_t libresd_fat_preallocate(libresd_fat_t *fat, libresd_file_t *file,
+                                       uint32_t size) {
+    uint32_t have = 0, need, last = 0;
+    uint32_t cluster;
+    libresd_err_t err;
+    
+    if (!fat || !file) return LIBRESD_ERR_INVALID_PARAM;
+    if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
+    if (!(file->mode & LIBRESD_WRITE)) return LIBRESD_ERR_READ_ONLY;
+    
+#if LIBRESD_STREAM_BUFFER
+    err = file_drain(fat, file);
+    if (err != LIBRESD_OK) return err;
+#endif
+    
+    if (size <= file->file_size) return LIBRESD_OK;
+    
+    /* Count what the chain already holds (it may run past file_size) */
+    for (cluster = file->first_cluster; cluster >= 2; ) {
+        uint32_t next;
+        uint32_t run = libresd_fat_get_run(fat, cluster, 0, &next);
+        
+        if (run == 0) break;
+        last = cluster + run - 1;
+        have += run;
+        cluster = next;
+    }
+    
+    need = (size + fat->cluster_size - 1) / fat->cluster_size;
+    if (need > have) {
+        uint32_t count = need - have;
+        uint32_t first = libresd_fat_alloc_contiguous(fat, last, count);
+    
+        if (first != 0) {
+            last = first + count - 1;
+        } else {
+            /* No run that long - take clusters wherever they are */
+            first = 0;
+            while (count--) {
+                cluster = libresd_fat_alloc_cluster(fat, last);
+                if (cluster == 0) {
+                    libresd_fat_sync(fat);
+                    if (file->first_cluster < 2 && first >= 2) {
+                        libresd_fat_free_chain(fat, first);
+                    }
+                    return LIBRESD_ERR_FULL;
+                }
+                if (first == 0) first = cluster;
+                last = cluster;
+            }
+        }
+    
+        if (file->first_cluster < 2) {
+            file->first_cluster = first;
+        }
+        if (file->current_cluster < 2) {
+            /* Empty file: the position (0) now sits in the first cluster */
+            file->current_cluster = file->first_cluster;
+            file->cluster_offset = 0;
+        }
+    }
+    
+    file->file_size = size;
+    
+    err = libresd_fat_sync(fat);
+    if (err != LIBRESD_OK) return err;
+    
+    return file_update_dirent(fat, file);
+}
+
+libresd_err_t libresd_fat_make_contiguous(libresd_fat_t *fat, const char *path,
+                                           void *buf, uint32_t buf_size) {
+    fat_dirent_t info;
+    uint8_t *copy;
+    uint32_t copy_sectors = buf ? buf_size / 512 : 1;
+    uint32_t dir_sector, runs, total, need, first, old_first, cluster, done, i;
+    uint16_t dir_offset;
+    libresd_err_t err;
+
+    if (!fat || !path || (buf && buf_size < 512)) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+
+    /* Without a caller buffer, copy a sector at a time through dir_buffer */
+    copy = buf ? (uint8_t *)buf : fat->dir_buffer;
+
+    err = fat_lookup(fat, path, strlen(path), &info, &dir_sector, &dir_offset, NULL);
+    if (err != LIBRESD_OK) return err;
+    if (info.attr & LIBRESD_ATTR_DIRECTORY) return LIBRESD_ERR_NOT_FILE;
+    if (info.attr & LIBRESD_ATTR_READ_ONLY) return LIBRESD_ERR_READ_ONLY;
+
+    old_first = fat_dirent_cluster(&info);
+    total = (info.file_size + 511) / 512;
+    err = libresd_fat_chain_extents(fat, old_first, total, NULL, 0, &runs);
+    if (err != LIBRESD_OK && err != LIBRESD_ERR_NO_MEM) return err;
+    if (runs <= 1) return LIBRESD_OK;
+    err = LIBRESD_OK;
+
+    need = (info.file_size + fat->cluster_size - 1) / fat->cluster_size;
+    first = libresd_fat_alloc_contiguous(fat, 0, need);
+    if (first == 0) {
+        libresd_fat_sync(fat);
+        return LIBRESD_ERR_FULL;
+    }
+
+    /* Copy cluster by cluster, up to the last sector the size reaches */
+    cluster = old_first;
+    for (i = 0, done = 0; err == LIBRESD_OK && done < total; i++) {
+        uint32_t src = libresd_fat_cluster_to_sector(fat, cluster);
+        uint32_t dst = libresd_fat_cluster_to_sector(fat, first + i);
+        uint32_t left = total - done;
+        uint32_t n, k;
+
+        if (left > fat->sectors_per_cluster) left = fat->sectors_per_cluster;
+        for (k = 0; err == LIBRESD_OK && k < left; k += n) {
+            n = (left - k < copy_sectors) ? left - k : copy_sectors;
+            err = libresd_sd_read_sectors(fat->sd, src + k, copy, n);
+            if (err == LIBRESD_OK) err = libresd_sd_write_sectors(fat->sd, dst + k, copy, n);
+        }
+        done += left;
+        if (done < total) cluster = libresd_fat_next_cluster(fat, cluster);
+    }
+
+    /* The new run must be in the FAT before the entry points at it */
+    if (err == LIBRESD_OK) err = libresd_fat_sync(fat);
+    if (err == LIBRESD_OK) err = libresd_sd_read_sector(fat->sd, dir_sector, copy);
+    if (err == LIBRESD_OK) {
+        fat_dirent_t *entry = (fat_dirent_t *)(copy + dir_offset);
+
+        entry->cluster_hi = (first >> 16) & 0xFFFF;
+        entry->cluster_lo = first & 0xFFFF;
+        fat_snapshot_touch(fat, dir_sector);
+        err = libresd_sd_write_sector(fat->sd, dir_sector, copy);
+    }
+    if (err != LIBRESD_OK) {
+        libresd_fat_free_chain(fat, first);
+        libresd_fat_sync(fat);
+        return err;
+    }
+
+    err = libresd_fat_free_chain(fat, old_first);
+    if (err != LIBRESD_OK) return err;
+    return libresd_fat_sync(fat);
+}
+
+/**
+ * @brief Directory sector before sector, if any
+ *
+ * At the start of a cluster the previous cluster is found by following
+ * fat->lookup_dir, which only works when sector's cluster is in that chain.
+ */
+static bool file_prev_sector(libresd_fat_t *fat, uint32_t *sector) {
+    uint32_t cluster, prev, next, n;
+    
+    if (*sector < fat->data_start_sector) {
+        if (*sector <= fat->root_start_sector) return false;
+    } else if ((*sector - fat->data_start_sector) % fat->sectors_per_cluster == 0) {
+        cluster = (*sector - fat->data_start_sector) / fat->sectors_per_cluster + 2;
+        prev = fat->lookup_dir;
+        for (n = 0; prev >= 2 && n < fat->cluster_count; n++) {
+            next = libresd_fat_next_cluster(fat, prev);
+            if (next == cluster) {
+                *sector = libresd_fat_cluster_to_sector(fat, prev) + fat->sectors_per_cluster - 1;
+                return true;
+            }
+            prev = next;
+        }
+        return false;
+    }
+    (*sector)--;
+    return true;
+}
+
+libresd_err_t fat_dirent_remove(libresd_fat_t *fat, uint32_t dir_sector, uint16_t dir_offset) {
+    uint8_t *buf = fat->dir_buffer;
+    uint32_t sector = dir_sector;
+    int32_t off = dir_offset;
+    uint8_t sum, seq, last;
+    bool dirty = true;
+    libresd_err_t err;
+    
+    if (libresd_sd_read_sector(fat->sd, sector, buf) != LIBRESD_OK) return LIBRESD_ERR_SPI;
+    fat_snapshot_touch(fat, dir_sector);
+    sum = fat_lfn_checksum(buf + off);
+    buf[off] = DIRENT_FREE;
+    
+    /* Its long name pieces sit right before it, the first piece nearest */
+    for (seq = 1; ; seq++) {
+        off -= FAT_DIRENT_SIZE;
+        if (off < 0) {
+            uint32_t prev = sector;
+    
+            if (!file_prev_sector(fat, &prev)) break;
+            if (dirty) {
+                err = libresd_sd_write_sector(fat->sd, sector, buf);
+                if (err != LIBRESD_OK) return err;
+            }
+            sector = prev;
+            if (libresd_sd_read_sector(fat->sd, sector, buf) != LIBRESD_OK) {
+                return LIBRESD_ERR_SPI;
+            }
+            dirty = false;
+            off = 512 - FAT_DIRENT_SIZE;
+        }
+        if ((buf[off + 11] & LIBRESD_ATTR_LFN) != LIBRESD_ATTR_LFN ||
+            (buf[off] & 0x1F) != seq || buf[off + 13] != sum) {
+            break;
+        }
+        last = buf[off] & 0x40;
+        buf[off] = DIRENT_FREE;
+        dirty = true;
+        if (last) break;
+    }
+    
+    if (!dirty) return LIBRESD_OK;
+    return libresd_sd_write_sector(fat->sd, sector, buf);
+}
+
 libresd_err_t libresd_fat_unlink(libresd_fat_t *fat, const char *path) {
-    libresd_fileinfo_t info;
+    fat_dirent_t info;
     libresd_err_t err;
     uint32_t dir_sector;
     uint16_t dir_offset;
-    uint8_t buffer[512];
     
     if (!fat || !path) return LIBRESD_ERR_INVALID_PARAM;
     if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
     
     /* Find the file */
-    err = fat_resolve_path(fat, path, NULL, &dir_sector, &dir_offset, &info);
+    err = fat_lookup(fat, path, strlen(path), &info, &dir_sector, &dir_offset, NULL);
     if (err != LIBRESD_OK) return err;
     
     if (info.attr & LIBRESD_ATTR_DIRECTORY) {
@@ -565,32 +1185,22 @@ libresd_err_t libresd_fat_unlink(libresd_fat_t *fat, const char *path) {
     }
     
     /* Free cluster chain */
-    if (info.first_cluster >= 2) {
-        libresd_fat_free_chain(fat, info.first_cluster);
-    }
-    
-    /* Mark directory entry as deleted */
-    if (libresd_sd_read_sector(fat->sd, dir_sector, buffer) != LIBRESD_OK) {
-        return LIBRESD_ERR_SPI;
+    if (fat_dirent_cluster(&info) >= 2) {
+        libresd_fat_free_chain(fat, fat_dirent_cluster(&info));
     }
     
-    buffer[dir_offset] = DIRENT_FREE;
-    
-    /* TODO: Also mark LFN entries as deleted */
-    
-    return libresd_sd_write_sector(fat->sd, dir_sector, buffer);
+    /* Mark directory entry (and its long name) as deleted */
+    return fat_dirent_remove(fat, dir_sector, dir_offset);
 }
 
 libresd_err_t libresd_fat_rename(libresd_fat_t *fat, const char *old_path,
                                   const char *new_path) {
-    /* This is a simplified implementation - doesn't handle cross-directory moves */
-    libresd_fileinfo_t info;
+    fat_dirent_t info;
+    fat_dirent_t *entry;
     libresd_err_t err;
-    uint32_t dir_sector;
-    uint16_t dir_offset;
-    uint8_t buffer[512];
-    uint8_t new_name[11];
-    const char *new_filename;
+    uint32_t dir_sector, new_sector, old_dir;
+    uint16_t dir_offset, new_offset;
+    size_t len;
     
     if (!fat || !old_path || !new_path) return LIBRESD_ERR_INVALID_PARAM;
     if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
@@ -601,39 +1211,61 @@ libresd_err_t libresd_fat_rename(libresd_fat_t *fat, const char *old_path,
     }
     
     /* Find the old file */
-    err = fat_resolve_path(fat, old_path, NULL, &dir_sector, &dir_offset, &info);
+    len = strlen(old_path);
+    err = fat_lookup(fat, old_path, len, &info, &dir_sector, &dir_offset, NULL);
     if (err != LIBRESD_OK) return err;
+    old_dir = fat->lookup_dir;
     
-    /* Get just the filename part of new path */
-    new_filename = strrchr(new_path, '/');
-    new_filename = new_filename ? new_filename + 1 : new_path;
-    
-    /* Convert to 8.3 name */
-    if (!str_to_fat_name(new_filename, new_name)) {
-        return LIBRESD_ERR_INVALID_NAME;
+    /* The root has no entry, and a directory cannot move below itself */
+    if (dir_sector == 0) return LIBRESD_ERR_INVALID_PARAM;
+    if (strncmp(new_path, old_path, len) == 0 && new_path[len] == '/') {
+        return LIBRESD_ERR_INVALID_PARAM;
     }
     
-    /* Update directory entry */
-    if (libresd_sd_read_sector(fat->sd, dir_sector, buffer) != LIBRESD_OK) {
+    /* New entry (long name and alias as needed) first, then the old one goes */
+    err = libresd_fat_create_file(fat, new_path, info.attr, &new_sector, &new_offset);
+    if (err != LIBRESD_OK) return err;
+    
+    if (libresd_sd_read_sector(fat->sd, new_sector, fat->dir_buffer) != LIBRESD_OK) {
+        fat_dirent_remove(fat, new_sector, new_offset);
         return LIBRESD_ERR_SPI;
     }
+    entry = (fat_dirent_t *)(fat->dir_buffer + new_offset);
+    memcpy(&entry->attr, &info.attr, FAT_DIRENT_SIZE - sizeof(entry->name));
     
-    memcpy(buffer + dir_offset, new_name, 11);
+    fat_snapshot_touch(fat, new_sector);
+    err = libresd_sd_write_sector(fat->sd, new_sector, fat->dir_buffer);
+    if (err != LIBRESD_OK) {
+        fat_dirent_remove(fat, new_sector, new_offset);
+        return err;
+    }
     
-    return libresd_sd_write_sector(fat->sd, dir_sector, buffer);
+    fat->lookup_dir = old_dir;
+    return fat_dirent_remove(fat, dir_sector, dir_offset);
 }
 
 #if LIBRESD_ENABLE_DIRS
 
 libresd_err_t libresd_fat_mkdir(libresd_fat_t *fat, const char *path) {
+    return libresd_fat_mkdir_ex(fat, path, 0);
+}
+
+libresd_err_t libresd_fat_mkdir_ex(libresd_fat_t *fat, const char *path,
+                                   uint32_t expected_entries) {
     libresd_err_t err;
-    uint32_t dir_sector, cluster;
+    uint32_t dir_sector, cluster, clusters;
     uint16_t dir_offset;
-    uint8_t buffer[512];
+    uint8_t *buffer;
     fat_dirent_t *entry;
     
     if (!fat || !path) return LIBRESD_ERR_INVALID_PARAM;
     if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+    buffer = fat->dir_buffer;
+    
+    /* FAT caps a directory at 65536 entries, "." and ".." included */
+    if (expected_entries > 65534) return LIBRESD_ERR_INVALID_PARAM;
+    clusters = ((expected_entries + 2) * FAT_DIRENT_SIZE + fat->cluster_size - 1) /
+               fat->cluster_size;
     
     /* Check if already exists */
     if (libresd_fat_exists(fat, path)) {
@@ -645,13 +1277,11 @@ libresd_err_t libresd_fat_mkdir(libresd_fat_t *fat, const char *path) {
                                    &dir_sector, &dir_offset);
     if (err != LIBRESD_OK) return err;
     
-    /* Allocate cluster for directory contents */
-    cluster = libresd_fat_alloc_cluster(fat, 0);
+    /* Allocate one run for the directory contents */
+    cluster = libresd_fat_alloc_contiguous(fat, 0, clusters);
     if (cluster == 0) {
         /* Undo - delete the entry */
-        libresd_sd_read_sector(fat->sd, dir_sector, buffer);
-        buffer[dir_offset] = DIRENT_FREE;
-        libresd_sd_write_sector(fat->sd, dir_sector, buffer);
+        fat_dirent_remove(fat, dir_sector, dir_offset);
         return LIBRESD_ERR_FULL;
     }
     
@@ -700,11 +1330,16 @@ libresd_err_t libresd_fat_mkdir(libresd_fat_t *fat, const char *path) {
     entry->modify_date = entry->create_date;
     entry->modify_time = entry->create_time;
     
-    /* Write all sectors in the cluster */
+    /* First sector, then zero the rest of the run in one multi-block write */
     uint32_t sector = libresd_fat_cluster_to_sector(fat, cluster);
-    for (uint32_t i = 0; i < fat->sectors_per_cluster; i++) {
-        if (libresd_sd_write_sector(fat->sd, sector + i, 
-                                    (i == 0) ? buffer : (uint8_t[512]){0}) != LIBRESD_OK) {
+    uint32_t rest = clusters * fat->sectors_per_cluster - 1;
+    
+    if (libresd_sd_write_sector(fat->sd, sector, buffer) != LIBRESD_OK) {
+        return LIBRESD_ERR_SPI;
+    }
+    if (rest > 0) {
+        memset(buffer, 0, 512);
+        if (libresd_sd_fill_sectors(fat->sd, sector + 1, buffer, rest) != LIBRESD_OK) {
             return LIBRESD_ERR_SPI;
         }
     }
@@ -712,53 +1347,73 @@ libresd_err_t libresd_fat_mkdir(libresd_fat_t *fat, const char *path) {
     return LIBRESD_OK;
 }
 
+/**
+ * @brief Check that a directory holds nothing but . and ..
+ *
+ * @return LIBRESD_OK, LIBRESD_ERR_DIR_NOT_EMPTY or error
+ */
+static libresd_err_t file_dir_empty(libresd_fat_t *fat, uint32_t first_cluster) {
+    uint32_t cluster = first_cluster;
+    uint32_t sector;
+    libresd_err_t err;
+    
+    if (first_cluster < 2) return LIBRESD_OK;
+    sector = libresd_fat_cluster_to_sector(fat, first_cluster);
+    
+    do {
+        if (libresd_sd_read_sector(fat->sd, sector, fat->dir_buffer) != LIBRESD_OK) {
+            return LIBRESD_ERR_SPI;
+        }
+        for (uint32_t off = 0; off < 512; off += FAT_DIRENT_SIZE) {
+            const fat_dirent_t *e = (const fat_dirent_t *)(fat->dir_buffer + off);
+            
+            if (e->name[0] == DIRENT_END) return LIBRESD_OK;
+            
+            /* Deleted, long name pieces and labels do not count */
+            if (e->name[0] == DIRENT_FREE || (e->attr & LIBRESD_ATTR_VOLUME_ID)) continue;
+            if (e->name[0] == '.' &&
+                (e->name[1] == ' ' || (e->name[1] == '.' && e->name[2] == ' '))) {
+                continue;
+            }
+            return LIBRESD_ERR_DIR_NOT_EMPTY;
+        }
+        err = fat_dir_next_sector(fat, first_cluster, &cluster, &sector);
+    } while (err == LIBRESD_OK);
+    
+    return (err == LIBRESD_ERR_EOF) ? LIBRESD_OK : err;
+}
+
 libresd_err_t libresd_fat_rmdir(libresd_fat_t *fat, const char *path) {
-    libresd_fileinfo_t info;
-    libresd_dir_t dir;
+    fat_dirent_t info;
     libresd_err_t err;
     uint32_t dir_sector;
     uint16_t dir_offset;
-    uint8_t buffer[512];
     
     if (!fat || !path) return LIBRESD_ERR_INVALID_PARAM;
     if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
     
     /* Find the directory */
-    err = fat_resolve_path(fat, path, NULL, &dir_sector, &dir_offset, &info);
+    err = fat_lookup(fat, path, strlen(path), &info, &dir_sector, &dir_offset, NULL);
     if (err != LIBRESD_OK) return err;
     
     if (!(info.attr & LIBRESD_ATTR_DIRECTORY)) {
         return LIBRESD_ERR_NOT_DIR;
     }
     
-    /* Check if directory is empty (only . and ..) */
-    err = libresd_fat_opendir(fat, &dir, path);
-    if (err != LIBRESD_OK) return err;
+    /* The root has no entry to delete */
+    if (dir_sector == 0) return LIBRESD_ERR_INVALID_PARAM;
     
-    libresd_fileinfo_t child;
-    int count = 0;
-    while (libresd_fat_readdir(fat, &dir, &child) == LIBRESD_OK) {
-        if (child.name[0] != '.') {
-            libresd_fat_closedir(&dir);
-            return LIBRESD_ERR_DIR_NOT_EMPTY;
-        }
-        count++;
-    }
-    libresd_fat_closedir(&dir);
+    /* Check if directory is empty (only . and ..), straight from the card */
+    err = file_dir_empty(fat, fat_dirent_cluster(&info));
+    if (err != LIBRESD_OK) return err;
     
     /* Free cluster chain */
-    if (info.first_cluster >= 2) {
-        libresd_fat_free_chain(fat, info.first_cluster);
-    }
-    
-    /* Mark directory entry as deleted */
-    if (libresd_sd_read_sector(fat->sd, dir_sector, buffer) != LIBRESD_OK) {
-        return LIBRESD_ERR_SPI;
+    if (fat_dirent_cluster(&info) >= 2) {
+        libresd_fat_free_chain(fat, fat_dirent_cluster(&info));
     }
     
-    buffer[dir_offset] = DIRENT_FREE;
-    
-    return libresd_sd_write_sector(fat->sd, dir_sector, buffer);
+    /* Mark directory entry (and its long name) as deleted */
+    return fat_dirent_remove(fat, dir_sector, dir_offset);
 }
 
 #endif /* LIBRESD_ENABLE_DIRS */
@@ -776,6 +1431,22 @@ libresd_err_t libresd_fat_seek(libresd_fat_t *fat, libresd_file_t *file,
     if (!fat || !file) return LIBRESD_ERR_INVALID_PARAM;
     if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
     
+#if LIBRESD_STREAM_BUFFER
+    /* SEEK_END and the chain walk need pending output on the card */
+    if (file->wbuf_len) {
+        libresd_err_t err = file_drain(fat, file);
+        if (err != LIBRESD_OK) return err;
+    }
+    
+    /* The chain position sits at the end of the read-ahead window; make
+     * relative seeks relative to what the caller has consumed */
+    if (whence == LIBRESD_SEEK_CUR) {
+        offset -= (int32_t)(file->rbuf_len - file->rbuf_pos);
+    }
+    file->rbuf_pos = 0;
+    file->rbuf_len = 0;
+#endif
+    
     /* Calculate new position */
     switch (whence) {
         case LIBRESD_SEEK_SET:
@@ -816,16 +1487,17 @@ libresd_err_t libresd_fat_seek(libresd_fat_t *fat, libresd_file_t *file,
         uint32_t to_advance = new_pos - file->position;
         
         if (to_advance >= remaining_in_cluster) {
-            /* Move to next cluster */
-            uint32_t next = libresd_fat_next_cluster(fat, file->current_cluster);
-            if (next == 0) {
-                /* Past end of file */
-                file->position += remaining_in_cluster;
-                file->cluster_offset = 0;
+            /* Move to the cluster holding new_pos */
+            uint32_t steps = 1 + (to_advance - remaining_in_cluster) / fat->cluster_size;
+            uint32_t moved = file_walk(fat, &file->current_cluster, steps);
+            if (moved < steps) {
+                /* Past end of chain: park at the end of the last cluster
+                 * so a following write allocates instead of overwriting */
+                file->position += remaining_in_cluster + moved * fat->cluster_size;
+                file->cluster_offset = fat->cluster_size;
                 break;
             }
-            file->current_cluster = next;
-            file->position += remaining_in_cluster;
+            file->position += remaining_in_cluster + (steps - 1) * fat->cluster_size;
             file->cluster_offset = 0;
         } else {
             /* Stay in current cluster */
@@ -837,14 +1509,619 @@ libresd_err_t libresd_fat_seek(libresd_fat_t *fat, libresd_file_t *file,
     return LIBRESD_OK;
 }
 
-uint32_t libresd_fat_tell(libresd_file_t *file) {
-    return file ? file->position : 0;
+libresd_err_t libresd_fat_seek_cluster(libresd_fat_t *fat, libresd_file_t *file,
+                                        uint32_t offset, uint32_t cluster) {
+    if (!fat || !file) return LIBRESD_ERR_INVALID_PARAM;
+    if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
+    if (cluster < 2 || cluster >= fat->cluster_count + 2) return LIBRESD_ERR_INVALID_PARAM;
+    if (!(file->mode & LIBRESD_WRITE) && offset > file->file_size) return LIBRESD_ERR_SEEK;
+    
+#if LIBRESD_STREAM_BUFFER
+    if (file->wbuf_len) {
+        libresd_err_t err = file_drain(fat, file);
+        if (err != LIBRESD_OK) return err;
+    }
+    file->rbuf_pos = 0;
+    file->rbuf_len = 0;
+#endif
+    
+    file->position = offset;
+    file->current_cluster = cluster;
+    file->cluster_offset = offset % fat->cluster_size;
+    
+    return LIBRESD_OK;
+}
+
+uint32_t libresd_fat_tell(const libresd_file_t *file) {
+    if (!file) return 0;
+#if LIBRESD_STREAM_BUFFER
+    return file->position + file->wbuf_len - (file->rbuf_len - file->rbuf_pos);
+#else
+    return file->position;
+#endif
 }
 
-bool libresd_fat_eof(libresd_file_t *file) {
-    return !file || file->position >= file->file_size;
+bool libresd_fat_eof(const libresd_file_t *file) {
+    return !file || libresd_fat_tell(file) >= libresd_fat_size(file);
 }
 
-uint32_t libresd_fat_size(libresd_file_t *file) {
-    return file ? file->file_size : 0;
+uint32_t libresd_fat_size(const libresd_file_t *file) {
+    if (!file) return 0;
+#if LIBRESD_STREAM_BUFFER
+    /* Output still in the stream buffer may extend the file */
+    if (file->position + file->wbuf_len > file->file_size) {
+        return file->position + file->wbuf_len;
+    }
+#endif
+    return file->file_size;
 }
+
+#if LIBRESD_STREAM_BUFFER
+
+/*============================================================================
+ * STREAM BUFFER
+ *============================================================================*/
+
+libresd_err_t libresd_fat_setvbuf(libresd_fat_t *fat, libresd_file_t *file,
+                                   void *buf, uint32_t size) {
+    libresd_err_t err;
+    
+    if (!fat || !file) return LIBRESD_ERR_INVALID_PARAM;
+    if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
+    if (buf && (size < 512 || size % 512 != 0)) return LIBRESD_ERR_INVALID_PARAM;
+    
+    /* Empty the old buffer: write pending output, give back read-ahead */
+    err = file_drain(fat, file);
+    if (err != LIBRESD_OK) return err;
+    
+    file->rbuf = (uint8_t *)buf;
+    file->rbuf_size = buf ? size : 0;
+    file->rbuf_pos = 0;
+    file->rbuf_len = 0;
+    
+    return LIBRESD_OK;
+}
+
+#endif /* LIBRESD_STREAM_BUFFER */
+
+#if LIBRESD_ENABLE_GETLINE
+
+/*============================================================================
+ * BUFFERED LINE READER
+ *============================================================================*/
+
+typedef uint32_t __attribute__((may_alias)) line_word_t;
+
+/**
+ * @brief Find the first '\n' in p[0..n), or n if there is none
+ * 
+ * Checks a word at a time once aligned: a byte of w ^ 0x0A0A0A0A is zero
+ * exactly where the input holds '\n', and the classic has-zero-byte test
+ * flags that word without a per-byte branch.
+ */
+static uint32_t line_scan(const uint8_t *p, uint32_t n) {
+    uint32_t i = 0;
+    
+    while (i < n && ((uintptr_t)(p + i) & (sizeof(line_word_t) - 1))) {
+        if (p[i] == '\n') return i;
+        i++;
+    }
+    
+    for (; i + sizeof(line_word_t) <= n; i += sizeof(line_word_t)) {
+        uint32_t w = *(const line_word_t *)(p + i) ^ 0x0A0A0A0AUL;
+        if ((w - 0x01010101UL) & ~w & 0x80808080UL) break;
+    }
+    
+    for (; i < n; i++) {
+        if (p[i] == '\n') return i;
+    }
+    return n;
+}
+
+/**
+ * @brief Expose the unread bytes at the current position
+ * 
+ * With an attached buffer, refills it when empty. Without one, loads the
+ * sector under the position into the file's sector buffer.
+ */
+static libresd_err_t line_peek(libresd_fat_t *fat, libresd_file_t *file,
+                               const uint8_t **data, uint32_t *avail) {
+    libresd_err_t err;
+    
+    if (file->rbuf) {
+        if (file->rbuf_pos == file->rbuf_len) {
+            uint32_t n = 0;
+            
+            file->rbuf_pos = 0;
+            file->rbuf_len = 0;
+            err = libresd_fat_read(fat, file, file->rbuf, file->rbuf_size, &n);
+            if (err != LIBRESD_OK) return err;
+            file->rbuf_len = n;
+        }
+        *data = file->rbuf + file->rbuf_pos;
+        *avail = file->rbuf_len - file->rbuf_pos;
+        return LIBRESD_OK;
+    }
+    
+    if (file->position >= file->file_size) return LIBRESD_ERR_EOF;
+    
+    /* A write may have stopped exactly on a cluster boundary */
+    if (file->cluster_offset >= fat->cluster_size) {
+        uint32_t next = libresd_fat_next_cluster(fat, file->current_cluster);
+        if (next == 0) return LIBRESD_ERR_FAT_CORRUPT;
+        file->current_cluster = next;
+        file->cluster_offset = 0;
+    }
+    if (file->current_cluster < 2) return LIBRESD_ERR_FAT_CORRUPT;
+    
+    uint32_t offset_in_sector = file->cluster_offset % 512;
+    uint32_t sector = libresd_fat_cluster_to_sector(fat, file->current_cluster) +
+                      file->cluster_offset / 512;
+    
+    if (file->buffer_sector != sector) {
+#if LIBRESD_ENABLE_WRITE
+        if (file->buffer_dirty) {
+            err = libresd_sd_write_sector(fat->sd, file->buffer_sector, file->buffer);
+            if (err != LIBRESD_OK) return err;
+            file->buffer_dirty = false;
+        }
+#endif
+        err = libresd_sd_read_sector(fat->sd, sector, file->buffer);
+        if (err != LIBRESD_OK) return err;
+        file->buffer_sector = sector;
+    }
+    
+    *data = file->buffer + offset_in_sector;
+    *avail = 512 - offset_in_sector;
+    if (*avail > file->file_size - file->position) {
+        *avail = file->file_size - file->position;
+    }
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Consume n bytes previously returned by line_peek()
+ */
+static void line_skip(libresd_fat_t *fat, libresd_file_t *file, uint32_t n) {
+    if (file->rbuf) {
+        file->rbuf_pos += n;
+        return;
+    }
+    
+    file->position += n;
+    file->cluster_offset += n;
+    if (file->cluster_offset >= fat->cluster_size) {
+        uint32_t next = libresd_fat_next_cluster(fat, file->current_cluster);
+        if (next != 0) {
+            file->current_cluster = next;
+            file->cluster_offset = 0;
+        }
+    }
+}
+
+/**
+ * @brief Slide the unread tail to the front of the attached buffer and top
+ * it up with whole sectors, so a line split by the window edge becomes
+ * contiguous. Keeps the chain position sector-aligned when it was.
+ * 
+ * @return LIBRESD_ERR_TOO_LONG if no whole sector fits behind the tail
+ */
+static libresd_err_t line_compact(libresd_fat_t *fat, libresd_file_t *file) {
+    uint32_t tail = file->rbuf_len - file->rbuf_pos;
+    uint32_t room = ((file->rbuf_size - tail) / 512) * 512;
+    uint32_t n = 0;
+    libresd_err_t err;
+    
+    if (room == 0) return LIBRESD_ERR_TOO_LONG;
+    
+    memmove(file->rbuf, file->rbuf + file->rbuf_pos, tail);
+    file->rbuf_pos = 0;
+    file->rbuf_len = 0;
+    
+    err = libresd_fat_read(fat, file, file->rbuf + tail, room, &n);
+    file->rbuf_len = tail + ((err == LIBRESD_OK) ? n : 0);
+    
+    return (err == LIBRESD_ERR_EOF) ? LIBRESD_OK : err;
+}
+
+libresd_err_t libresd_fat_getline(libresd_fat_t *fat, libresd_file_t *file,
+                                   char *buf, uint32_t cap, uint32_t *len) {
+    const uint8_t *data;
+    uint32_t avail, nl, take;
+    uint32_t out = 0;
+    bool found = false;
+    libresd_err_t err = LIBRESD_OK;
+    
+    if (!fat || !file || !buf || cap == 0) return LIBRESD_ERR_INVALID_PARAM;
+    if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
+    if (!(file->mode & LIBRESD_READ)) return LIBRESD_ERR_READ_ONLY;
+    
+    if (file->wbuf_len) {
+        err = file_drain(fat, file);
+        if (err != LIBRESD_OK) return err;
+    }
+    
+    while (out < cap - 1) {
+        err = line_peek(fat, file, &data, &avail);
+        if (err != LIBRESD_OK || avail == 0) break;
+        
+        nl = line_scan(data, avail);
+        take = nl;
+        if (take > cap - 1 - out) take = cap - 1 - out;
+        
+        memcpy(buf + out, data, take);
+        out += take;
+        
+        if (take == nl && nl < avail) {
+            line_skip(fat, file, nl + 1);
+            found = true;
+            break;
+        }
+        line_skip(fat, file, take);
+    }
+    
+    if (err != LIBRESD_OK && err != LIBRESD_ERR_EOF) return err;
+    
+    /* Buffer filled exactly up to the line end */
+    if (!found && out == cap - 1 &&
+        line_peek(fat, file, &data, &avail) == LIBRESD_OK && avail > 0 && data[0] == '\n') {
+        line_skip(fat, file, 1);
+        found = true;
+    }
+    
+    if (found && out > 0 && buf[out - 1] == '\r') out--;
+    buf[out] = '\0';
+    if (len) *len = out;
+    
+    if (found) return LIBRESD_OK;
+    if (out == cap - 1 && !libresd_fat_eof(file)) return LIBRESD_ERR_TOO_LONG;
+    return (out > 0) ? LIBRESD_OK : LIBRESD_ERR_EOF;
+}
+
+libresd_err_t libresd_fat_getline_ref(libresd_fat_t *fat, libresd_file_t *file,
+                                       const char **line, uint32_t *len) {
+    const uint8_t *data;
+    uint32_t avail, nl;
+    libresd_err_t err;
+    
+    if (!fat || !file || !line || !len) return LIBRESD_ERR_INVALID_PARAM;
+    if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
+    if (!(file->mode & LIBRESD_READ)) return LIBRESD_ERR_READ_ONLY;
+    
+    if (file->wbuf_len) {
+        err = file_drain(fat, file);
+        if (err != LIBRESD_OK) return err;
+    }
+    
+    err = line_peek(fat, file, &data, &avail);
+    if (err != LIBRESD_OK) return err;
+    if (avail == 0) return LIBRESD_ERR_EOF;
+    
+    nl = line_scan(data, avail);
+    
+    /* Split by the window edge: make it contiguous if the buffer allows */
+    if (nl == avail && file->rbuf && file->position < file->file_size) {
+        err = line_compact(fat, file);
+        if (err != LIBRESD_OK) return err;
+        data = file->rbuf;
+        avail = file->rbuf_len;
+        nl = line_scan(data, avail);
+    }
+    
+    if (nl == avail) {
+        /* Still no '\n': only acceptable as the last line of the file */
+        bool last = file->rbuf ? (file->position >= file->file_size)
+                               : (file->position + avail >= file->file_size);
+        if (!last) return LIBRESD_ERR_TOO_LONG;
+        *line = (const char *)data;
+        *len = avail;
+        line_skip(fat, file, avail);
+        return LIBRESD_OK;
+    }
+    
+    *line = (const char *)data;
+    *len = (nl > 0 && data[nl - 1] == '\r') ? nl - 1 : nl;
+    line_skip(fat, file, nl + 1);
+    
+    return LIBRESD_OK;
+}
+
+#endif /* LIBRESD_ENABLE_GETLINE */
+
+#if LIBRESD_ENABLE_PRINTF && LIBRESD_ENABLE_WRITE
+
+/*============================================================================
+ * FORMATTED WRITER
+ *============================================================================*/
+
+/* Output state for one libresd_fat_printf() call */
+typedef struct {
+    libresd_fat_t  *fat;
+    libresd_file_t *file;
+    libresd_err_t   err;
+} fmt_out_t;
+
+static const char fmt_pairs[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+/**
+ * @brief Write out a full stream buffer
+ * 
+ * The first flush after an unaligned start writes only up to the next
+ * sector boundary; every flush after that is whole sectors.
+ */
+static libresd_err_t fmt_flush_stream(fmt_out_t *o) {
+    libresd_file_t *file = o->file;
+    uint32_t n = file->wbuf_len - (file->position % 512);
+    uint32_t keep = file->wbuf_len - n;
+    uint32_t written = 0;
+    libresd_err_t err;
+    
+    file->wbuf_len = 0;
+    err = libresd_fat_write(o->fat, file, file->rbuf, n, &written);
+    if (err == LIBRESD_OK && written != n) err = LIBRESD_ERR_FULL;
+    
+    memmove(file->rbuf, file->rbuf + n, keep);
+    file->wbuf_len = keep;
+    
+    return err;
+}
+
+/**
+ * @brief Copy text into the file's write buffer
+ */
+static void fmt_put(fmt_out_t *o, const char *s, uint32_t n) {
+    libresd_fat_t *fat = o->fat;
+    libresd_file_t *file = o->file;
+    uint8_t *dst;
+    uint32_t room;
+    
+    while (n > 0 && o->err == LIBRESD_OK) {
+        if (file->rbuf) {
+            if (file->wbuf_len == file->rbuf_size) {
+                o->err = fmt_flush_stream(o);
+                continue;
+            }
+            dst = file->rbuf + file->wbuf_len;
+            room = file->rbuf_size - file->wbuf_len;
+            if (room > n) room = n;
+            memcpy(dst, s, room);
+            file->wbuf_len += room;
+        } else {
+            uint32_t offset_in_sector, sector;
+            
+            o->err = file_claim_cluster(fat, file);
+            if (o->err != LIBRESD_OK) break;
+            
+            offset_in_sector = file->cluster_offset % 512;
+            sector = libresd_fat_cluster_to_sector(fat, file->current_cluster) +
+                     file->cluster_offset / 512;
+            o->err = file_load_for_write(fat, file, sector, n);
+            if (o->err != LIBRESD_OK) break;
+            
+            room = 512 - offset_in_sector;
+            if (room > n) room = n;
+            memcpy(file->buffer + offset_in_sector, s, room);
+            file->buffer_dirty = true;
+            file_advance_write(fat, file, room);
+        }
+        s += room;
+        n -= room;
+    }
+}
+
+static void fmt_pad(fmt_out_t *o, char c, int32_t n) {
+    char run[16];
+    
+    if (n <= 0) return;
+    memset(run, c, sizeof(run));
+    while (n > 0) {
+        uint32_t k = (n > (int32_t)sizeof(run)) ? sizeof(run) : (uint32_t)n;
+        fmt_put(o, run, k);
+        n -= k;
+    }
+}
+
+/**
+ * @brief Render v in decimal, ending just before end
+ * @return First digit
+ */
+static char *fmt_dec(char *end, uint32_t v) {
+    while (v >= 100) {
+        uint32_t q = v / 100;
+        end -= 2;
+        memcpy(end, &fmt_pairs[(v - q * 100) * 2], 2);
+        v = q;
+    }
+    if (v >= 10) {
+        end -= 2;
+        memcpy(end, &fmt_pairs[v * 2], 2);
+    } else {
+        *--end = (char)('0' + v);
+    }
+    return end;
+}
+
+static char *fmt_hex(char *end, uint32_t v, bool upper) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    do {
+        *--end = digits[v & 0xF];
+        v >>= 4;
+    } while (v);
+    return end;
+}
+
+/**
+ * @brief Emit a converted number honouring width, precision and flags
+ *
+ * A precision (minimum digits, -1 = none) zero-pads the digits and, as in
+ * C, turns the '0' flag off.
+ */
+static void fmt_field(fmt_out_t *o, const char *digits, uint32_t len, bool neg,
+                      int32_t width, int32_t prec, bool left, bool zero) {
+    int32_t lead = (prec > (int32_t)len) ? prec - (int32_t)len : 0;
+    int32_t pad = width - (int32_t)len - lead - (neg ? 1 : 0);
+    
+    if (left) {
+        if (neg) fmt_put(o, "-", 1);
+        fmt_pad(o, '0', lead);
+        fmt_put(o, digits, len);
+        fmt_pad(o, ' ', pad);
+    } else if (zero && prec < 0) {
+        if (neg) fmt_put(o, "-", 1);
+        fmt_pad(o, '0', pad);
+        fmt_put(o, digits, len);
+    } else {
+        fmt_pad(o, ' ', pad);
+        if (neg) fmt_put(o, "-", 1);
+        fmt_pad(o, '0', lead);
+        fmt_put(o, digits, len);
+    }
+}
+
+libresd_err_t libresd_fat_vprintf(libresd_fat_t *fat, libresd_file_t *file,
+                                   const char *fmt, va_list ap) {
+    fmt_out_t o;
+    char num[24];
+    char *end = num + sizeof(num);
+    const char *lit;
+    
+    if (!fat || !file || !fmt) return LIBRESD_ERR_INVALID_PARAM;
+    if (!file->is_open) return LIBRESD_ERR_INVALID_HANDLE;
+    if (!(file->mode & LIBRESD_WRITE) && !(file->mode & LIBRESD_APPEND)) {
+        return LIBRESD_ERR_READ_ONLY;
+    }
+    
+    o.fat = fat;
+    o.file = file;
+    o.err = LIBRESD_OK;
+    
+    /* Read-ahead would put the output at the wrong offset */
+    if (file->rbuf_pos != file->rbuf_len) {
+        o.err = file_drain(fat, file);
+    }
+    
+    while (*fmt && o.err == LIBRESD_OK) {
+        bool left = false, zero = false, is_long = false;
+        int32_t width = 0, prec = -1;
+        
+        /* Literal run up to the next conversion */
+        lit = fmt;
+        while (*fmt && *fmt != '%') fmt++;
+        if (fmt != lit) fmt_put(&o, lit, (uint32_t)(fmt - lit));
+        if (!*fmt) break;
+        fmt++;
+        
+        /* Flags */
+        for (;; fmt++) {
+            if (*fmt == '-') left = true;
+            else if (*fmt == '0') zero = true;
+            else break;
+        }
+        
+        /* Width */
+        if (*fmt == '*') {
+            width = va_arg(ap, int);
+            if (width < 0) { left = true; width = -width; }
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9') width = width * 10 + (*fmt++ - '0');
+        }
+        
+        /* Precision */
+        if (*fmt == '.') {
+            fmt++;
+            prec = 0;
+            if (*fmt == '*') {
+                prec = va_arg(ap, int);
+                fmt++;
+            } else {
+                while (*fmt >= '0' && *fmt <= '9') prec = prec * 10 + (*fmt++ - '0');
+            }
+        }
+        
+        while (*fmt == 'l') { is_long = true; fmt++; }
+        
+        switch (*fmt) {
+            case 'd':
+            case 'i': {
+                int32_t v = is_long ? (int32_t)va_arg(ap, long) : va_arg(ap, int);
+                uint32_t mag = (v < 0) ? 0u - (uint32_t)v : (uint32_t)v;
+                char *p = (prec == 0 && mag == 0) ? end : fmt_dec(end, mag);
+                fmt_field(&o, p, (uint32_t)(end - p), v < 0, width, prec, left, zero);
+                break;
+            }
+            case 'u': {
+                uint32_t v = is_long ? (uint32_t)va_arg(ap, unsigned long) : va_arg(ap, unsigned);
+                char *p = (prec == 0 && v == 0) ? end : fmt_dec(end, v);
+                fmt_field(&o, p, (uint32_t)(end - p), false, width, prec, left, zero);
+                break;
+            }
+            case 'x':
+            case 'X': {
+                uint32_t v = is_long ? (uint32_t)va_arg(ap, unsigned long) : va_arg(ap, unsigned);
+                char *p = (prec == 0 && v == 0) ? end : fmt_hex(end, v, *fmt == 'X');
+                fmt_field(&o, p, (uint32_t)(end - p), false, width, prec, left, zero);
+                break;
+            }
+            case 'k': {
+                /* Fixed point: value / 10^prec with prec decimals */
+                int32_t v = is_long ? (int32_t)va_arg(ap, long) : va_arg(ap, int);
+                uint32_t mag = (v < 0) ? 0u - (uint32_t)v : (uint32_t)v;
+                char *p = end;
+                int32_t places = (prec < 0) ? 0 : (prec > 9 ? 9 : prec);
+                
+                for (int32_t i = 0; i < places; i++) {
+                    *--p = (char)('0' + mag % 10);
+                    mag /= 10;
+                }
+                if (places > 0) *--p = '.';
+                p = fmt_dec(p, mag);
+                fmt_field(&o, p, (uint32_t)(end - p), v < 0, width, -1, left, zero);
+                break;
+            }
+            case 'c': {
+                char c = (char)va_arg(ap, int);
+                fmt_field(&o, &c, 1, false, width, -1, left, false);
+                break;
+            }
+            case 's': {
+                const char *s = va_arg(ap, const char *);
+                uint32_t len = 0;
+                if (!s) s = "(null)";
+                while (s[len] && (prec < 0 || len < (uint32_t)prec)) len++;
+                fmt_field(&o, s, len, false, width, -1, left, false);
+                break;
+            }
+            case '%':
+                fmt_put(&o, "%", 1);
+                break;
+            default:
+                /* Unknown conversion: print it verbatim */
+                if (!*fmt) return o.err;
+                fmt_put(&o, "%", 1);
+                fmt_put(&o, fmt, 1);
+                break;
+        }
+        fmt++;
+    }
+    
+    return o.err;
+}
+
+libresd_err_t libresd_fat_printf(libresd_fat_t *fat, libresd_file_t *file,
+                                  const char *fmt, ...) {
+    libresd_err_t err;
+    va_list ap;
+    
+    va_start(ap, fmt);
+    err = libresd_fat_vprintf(fat, file, fmt, ap);
+    va_end(ap);
+    
+    return err;
+}
+
+#endif /* LIBRESD_ENABLE_PRINTF && LIBRESD_ENABLE_WRITE */
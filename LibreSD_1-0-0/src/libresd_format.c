@@ -0,0 +1,411 @@
+/**
+ * @file libresd_format.c
+ * @brief LibreSD Volume Formatter Implementation
+ *
+ * Layout, front to back:
+ *
+ *   MBR             sector 0, one partition (unless no_partition)
+ *   reserved        boot sector, FAT32 FSInfo and backup boot sector,
+ *                   padded so the data area starts on an AU boundary
+ *   FAT x 2
+ *   root directory  FAT12/16 only; on FAT32 it is cluster 2
+ *   data
+ *
+ * Like the SD Association formatter, the padding goes into the reserved
+ * area, so every cluster of an aligned cluster size stays inside one AU.
+ *
+ * The layout is planned in card blocks, every quantity a whole number of
+ * logical sectors; only the boot sector is written in logical sectors.
+ */
+
+#include "libresd_fat.h"
+#include <string.h>
+
+#if LIBRESD_ENABLE_FORMAT && LIBRESD_ENABLE_WRITE
+
+#define WRITE16(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+} while(0)
+
+#define WRITE32(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+    (buf)[(off)+2] = ((v) >> 16) & 0xFF; \
+    (buf)[(off)+3] = ((v) >> 24) & 0xFF; \
+} while(0)
+
+#define FORMAT_NUM_FATS         2
+#define FORMAT_DEFAULT_ALIGN    8192    /* Blocks: a 4 MB AU */
+#define FORMAT_DEFAULT_ROOT     512
+#define FORMAT_FSINFO           1       /* FAT32 reserved sectors (logical) */
+#define FORMAT_BACKUP_BOOT      6
+
+/**
+ * @brief Where everything goes
+ */
+typedef struct {
+    libresd_fs_type_t   type;
+    uint32_t            blocks;         /* Card blocks per logical sector */
+    uint32_t            part_start;     /* First block of the volume */
+    uint32_t            part_sectors;
+    uint32_t            align;          /* Blocks */
+    uint32_t            spc;
+    uint32_t            reserved;
+    uint32_t            fat_sectors;
+    uint32_t            root_entries;
+    uint32_t            root_sectors;
+    uint32_t            clusters;
+} format_layout_t;
+
+/*============================================================================
+ * LAYOUT
+ *============================================================================*/
+
+static libresd_fs_type_t format_type(uint32_t clusters) {
+    if (clusters < 4085) return LIBRESD_FS_FAT12;
+    if (clusters < 65525) return LIBRESD_FS_FAT16;
+    return LIBRESD_FS_FAT32;
+}
+
+/**
+ * @brief Size the FATs and pad the reserved area for one type
+ *
+ * The FATs are sized for the clusters there would be without them, which
+ * wastes at most a few sectors and needs no iteration.
+ *
+ * @return false if the metadata does not fit
+ */
+static bool format_fit(format_layout_t *l, libresd_fs_type_t type) {
+    uint32_t min_reserved = ((type == LIBRESD_FS_FAT32) ? 32 : 1) * l->blocks;
+    uint32_t bytes = l->blocks * 512;
+    uint32_t meta, pad, most;
+    uint64_t fat_bytes;
+    
+    l->type = type;
+    l->root_sectors = (type == LIBRESD_FS_FAT32) ? 0 :
+                      (l->root_entries * 32 + bytes - 1) / bytes * l->blocks;
+    if (min_reserved + l->root_sectors >= l->part_sectors) return false;
+    
+    most = (l->part_sectors - min_reserved - l->root_sectors) / l->spc;
+    switch (type) {
+        case LIBRESD_FS_FAT12: fat_bytes = ((uint64_t)most + 2) * 3 / 2 + 1; break;
+        case LIBRESD_FS_FAT16: fat_bytes = ((uint64_t)most + 2) * 2; break;
+        default:               fat_bytes = ((uint64_t)most + 2) * 4; break;
+    }
+    l->fat_sectors = (uint32_t)((fat_bytes + bytes - 1) / bytes) * l->blocks;
+    
+    meta = min_reserved + FORMAT_NUM_FATS * l->fat_sectors + l->root_sectors;
+    pad = (l->align - (l->part_start + meta) % l->align) % l->align;
+    l->reserved = min_reserved + pad;
+    meta += pad;
+    
+    if (l->reserved / l->blocks > 0xFFFF || meta >= l->part_sectors) return false;
+    l->clusters = (l->part_sectors - meta) / l->spc;
+    return l->clusters > 0 && l->clusters <= 0x0FFFFFF5;
+}
+
+/**
+ * @brief Pick type and cluster size for the card
+ */
+static libresd_err_t format_plan(libresd_sd_t *sd, const libresd_format_t *opt,
+                                 format_layout_t *l) {
+    uint32_t sectors = sd->sector_count;
+    uint32_t tries;
+
+    uint32_t bytes = opt->sector_size ? opt->sector_size : 512;
+
+    memset(l, 0, sizeof(*l));
+
+    if (bytes < 512 || bytes > 4096 || (bytes & (bytes - 1))) return LIBRESD_ERR_INVALID_PARAM;
+    l->blocks = bytes / 512;
+
+    if (opt->align) {
+        if (opt->align % bytes) return LIBRESD_ERR_INVALID_PARAM;
+        l->align = opt->align / 512;
+    } else {
+        l->align = FORMAT_DEFAULT_ALIGN;
+        while (l->align > l->blocks && l->align * 8 > sectors) l->align /= 2;
+    }
+    l->part_start = opt->no_partition ? 0 : l->align;
+    if (l->part_start >= sectors) return LIBRESD_ERR_INVALID_PARAM;
+    l->part_sectors = (sectors - l->part_start) / l->blocks * l->blocks;
+
+    /* Whole logical sectors of entries */
+    l->root_entries = opt->root_entries ? opt->root_entries : FORMAT_DEFAULT_ROOT;
+    l->root_entries = (l->root_entries + bytes / 32 - 1) & ~(bytes / 32 - 1);
+
+    if (opt->cluster_size) {
+        if (opt->cluster_size % bytes || opt->cluster_size > 65536 ||
+            (opt->cluster_size & (opt->cluster_size - 1))) {
+            return LIBRESD_ERR_INVALID_PARAM;
+        }
+        l->spc = opt->cluster_size / 512;
+    } else if (sectors <= 16384) {
+        l->spc = 16;                    /* Up to 8 MB: 8 KB */
+    } else if (sectors <= 2097152) {
+        l->spc = 32;                    /* Up to 1 GB: 16 KB */
+    } else {
+        l->spc = 64;                    /* 32 KB */
+    }
+
+    for (tries = 0; tries < 16; tries++) {
+        libresd_fs_type_t got = LIBRESD_FS_NONE;
+        int type;
+
+        for (type = LIBRESD_FS_FAT12; type <= LIBRESD_FS_FAT32; type++) {
+            if (opt->fs_type != LIBRESD_FS_NONE && (libresd_fs_type_t)type != opt->fs_type) {
+                continue;
+            }
+            if (!format_fit(l, (libresd_fs_type_t)type)) continue;
+            got = format_type(l->clusters);
+            if (got == (libresd_fs_type_t)type) return LIBRESD_OK;
+        }
+
+        /* The cluster count landed outside the type's range: move the
+         * cluster size, unless the caller fixed it */
+        if (opt->cluster_size || got == LIBRESD_FS_NONE) break;
+        if (opt->fs_type == LIBRESD_FS_NONE || got > opt->fs_type) {
+            if (l->spc == 128) break;
+            l->spc *= 2;
+        } else {
+            if (l->spc == l->blocks) break;
+            l->spc /= 2;
+        }
+    }
+    return LIBRESD_ERR_INVALID_PARAM;
+}
+
+/*============================================================================
+ * ON-DISK STRUCTURES
+ *============================================================================*/
+
+static void format_chs(uint8_t *chs, uint32_t lba) {
+    uint32_t c = lba / (255 * 63);
+    uint32_t h = (lba / 63) % 255;
+    uint32_t s = lba % 63 + 1;
+    
+    if (c > 1023) {
+        c = 1023;
+        h = 254;
+        s = 63;
+    }
+    chs[0] = (uint8_t)h;
+    chs[1] = (uint8_t)(s | ((c >> 2) & 0xC0));
+    chs[2] = (uint8_t)c;
+}
+
+static void format_mbr(uint8_t *b, const format_layout_t *l) {
+    uint8_t *p = b + 446;
+    
+    memset(b, 0, 512);
+    format_chs(p + 1, l->part_start);
+    switch (l->type) {
+        case LIBRESD_FS_FAT12: p[4] = 0x01; break;
+        case LIBRESD_FS_FAT16: p[4] = (l->part_sectors < 65536) ? 0x04 : 0x06; break;
+        default:               p[4] = 0x0C; break;
+    }
+    format_chs(p + 5, l->part_start + l->part_sectors - 1);
+    WRITE32(p, 8, l->part_start);
+    WRITE32(p, 12, l->part_sectors);
+    b[510] = 0x55;
+    b[511] = 0xAA;
+}
+
+static void format_boot(uint8_t *b, const format_layout_t *l, const uint8_t *label,
+                        uint32_t serial) {
+    bool fat32 = (l->type == LIBRESD_FS_FAT32);
+    uint32_t ext = fat32 ? 64 : 36;
+
+    memset(b, 0, 512);
+    b[0] = 0xEB;
+    b[1] = fat32 ? 0x58 : 0x3C;
+    b[2] = 0x90;
+    memcpy(b + 3, "LIBRESD ", 8);
+    WRITE16(b, 11, l->blocks * 512);
+    b[13] = (uint8_t)(l->spc / l->blocks);
+    WRITE16(b, 14, l->reserved / l->blocks);
+    b[16] = FORMAT_NUM_FATS;
+    if (!fat32) WRITE16(b, 17, l->root_entries);
+    if (!fat32 && l->part_sectors / l->blocks < 65536) {
+        WRITE16(b, 19, l->part_sectors / l->blocks);
+    } else {
+        WRITE32(b, 32, l->part_sectors / l->blocks);
+    }
+    b[21] = 0xF8;
+    if (!fat32) WRITE16(b, 22, l->fat_sectors / l->blocks);
+    WRITE16(b, 24, 63);
+    WRITE16(b, 26, 255);
+    WRITE32(b, 28, l->part_start / l->blocks);
+
+    if (fat32) {
+        WRITE32(b, 36, l->fat_sectors / l->blocks);
+        WRITE32(b, 44, 2);                      /* Root directory cluster */
+        WRITE16(b, 48, FORMAT_FSINFO);
+        WRITE16(b, 50, FORMAT_BACKUP_BOOT);
+    }
+
+    b[ext] = 0x80;                              /* Drive number */
+    b[ext + 2] = 0x29;                          /* Extended boot signature */
+    WRITE32(b, ext + 3, serial);
+    memcpy(b + ext + 7, label, 11);
+    memcpy(b + ext + 18, fat32 ? "FAT32   " :
+           (l->type == LIBRESD_FS_FAT16) ? "FAT16   " : "FAT12   ", 8);
+    b[510] = 0x55;
+    b[511] = 0xAA;
+}
+
+static void format_fsinfo(uint8_t *b, uint32_t free_clusters) {
+    memset(b, 0, 512);
+    WRITE32(b, 0, 0x41615252UL);
+    WRITE32(b, 484, 0x61417272UL);
+    WRITE32(b, 488, free_clusters);
+    WRITE32(b, 492, 3);                         /* Next free: after the root */
+    b[510] = 0x55;
+    b[511] = 0xAA;
+}
+
+/**
+ * @brief Space-padded, upper-case 8.3 label
+ */
+static void format_label(const char *str, uint8_t *label) {
+    int i;
+    
+    memcpy(label, "NO NAME    ", 11);
+    if (!str || !*str) return;
+    
+    memset(label, ' ', 11);
+    for (i = 0; i < 11 && str[i]; i++) {
+        char c = str[i];
+    
+        if (c >= 'a' && c <= 'z') c -= 32;
+        if (c < 0x20 || strchr("\"*+,./:;<=>?[\\]|", c)) c = '_';
+        label[i] = (uint8_t)c;
+    }
+}
+
+static libresd_err_t format_zero(libresd_sd_t *sd, uint32_t sector, uint32_t count,
+                                 uint8_t *buf) {
+    libresd_err_t err = LIBRESD_OK;
+
+    memset(buf, 0, 512);
+    while (err == LIBRESD_OK && count--) {
+        err = libresd_sd_write_sector(sd, sector++, buf);
+    }
+    return err;
+}
+
+/*============================================================================
+ * FORMAT
+ *============================================================================*/
+
+libresd_err_t libresd_fat_format_ex(libresd_sd_t *sd, const libresd_format_t *opt) {
+    static const libresd_format_t defaults;
+    format_layout_t l;
+    libresd_datetime_t dt;
+    uint8_t buf[512];
+    uint8_t label[11];
+    uint32_t base, fat, root, serial, i;
+    libresd_err_t err;
+    
+    if (!sd) return LIBRESD_ERR_INVALID_PARAM;
+    if (!sd->initialized) return LIBRESD_ERR_NOT_MOUNTED;
+    if (!opt) opt = &defaults;
+    
+    err = format_plan(sd, opt, &l);
+    if (err != LIBRESD_OK) return err;
+    
+    format_label(opt->label, label);
+    libresd_hal_get_datetime(&dt);
+    serial = opt->serial;
+    if (serial == 0) {
+        serial = ((uint32_t)LIBRESD_FAT_DATE(dt.year, dt.month, dt.day) << 16 |
+                  LIBRESD_FAT_TIME(dt.hour, dt.minute, dt.second)) ^ libresd_hal_get_ms();
+    }
+    
+    base = l.part_start;
+    fat = base + l.reserved;
+    root = fat + FORMAT_NUM_FATS * l.fat_sectors;
+    
+    /* Nothing stays mountable while the rest is rewritten */
+    err = format_zero(sd, 0, 1, buf);
+    if (err == LIBRESD_OK && base != 0) err = format_zero(sd, base, 1, buf);
+    
+    /* Reserved area (not its alignment padding) */
+    if (err == LIBRESD_OK) {
+        err = format_zero(sd, base + 1, (l.type == LIBRESD_FS_FAT32 ? 32 : 1) * l.blocks - 1,
+                          buf);
+    }
+    
+    /* FATs: clusters 0 and 1 reserved, FAT32 root cluster taken */
+    for (i = 0; err == LIBRESD_OK && i < FORMAT_NUM_FATS; i++) {
+        uint32_t start = fat + i * l.fat_sectors;
+    
+        err = format_zero(sd, start + 1, l.fat_sectors - 1, buf);
+        if (err != LIBRESD_OK) break;
+        switch (l.type) {
+            case LIBRESD_FS_FAT12:
+                buf[0] = 0xF8; buf[1] = 0xFF; buf[2] = 0xFF;
+                break;
+            case LIBRESD_FS_FAT16:
+                WRITE16(buf, 0, 0xFFF8); WRITE16(buf, 2, 0xFFFF);
+                break;
+            default:
+                WRITE32(buf, 0, 0x0FFFFFF8); WRITE32(buf, 4, 0x0FFFFFFF);
+                WRITE32(buf, 8, 0x0FFFFFFF);
+                break;
+        }
+        err = libresd_sd_write_sector(sd, start, buf);
+    }
+    
+    /* Empty root directory, holding only the label */
+    if (err == LIBRESD_OK) {
+        err = format_zero(sd, root + 1, (l.type == LIBRESD_FS_FAT32 ? l.spc : l.root_sectors) - 1,
+                          buf);
+    }
+    if (err == LIBRESD_OK) {
+        memset(buf, 0, 512);
+        if (memcmp(label, "NO NAME    ", 11) != 0) {
+            fat_dirent_t *e = (fat_dirent_t *)buf;
+    
+            memcpy(e->name, label, 11);
+            e->attr = LIBRESD_ATTR_VOLUME_ID;
+            e->modify_date = LIBRESD_FAT_DATE(dt.year, dt.month, dt.day);
+            e->modify_time = LIBRESD_FAT_TIME(dt.hour, dt.minute, dt.second);
+        }
+        err = libresd_sd_write_sector(sd, root, buf);
+    }
+    
+    if (err == LIBRESD_OK && l.type == LIBRESD_FS_FAT32) {
+        format_fsinfo(buf, l.clusters - 1);
+        err = libresd_sd_write_sector(sd, base + FORMAT_FSINFO * l.blocks, buf);
+        if (err == LIBRESD_OK) {
+            err = libresd_sd_write_sector(sd, base + (FORMAT_BACKUP_BOOT + FORMAT_FSINFO) *
+                                          l.blocks, buf);
+        }
+        if (err == LIBRESD_OK) {
+            format_boot(buf, &l, label, serial);
+            err = libresd_sd_write_sector(sd, base + FORMAT_BACKUP_BOOT * l.blocks, buf);
+        }
+    }
+    
+    if (err == LIBRESD_OK) {
+        format_boot(buf, &l, label, serial);
+        err = libresd_sd_write_sector(sd, base, buf);
+    }
+    if (err == LIBRESD_OK && base != 0) {
+        format_mbr(buf, &l);
+        err = libresd_sd_write_sector(sd, 0, buf);
+    }
+    return err;
+}
+
+libresd_err_t libresd_fat_format(libresd_sd_t *sd, const char *label) {
+    libresd_format_t opt;
+    
+    memset(&opt, 0, sizeof(opt));
+    opt.label = label;
+    return libresd_fat_format_ex(sd, &opt);
+}
+
+#endif /* LIBRESD_ENABLE_FORMAT && LIBRESD_ENABLE_WRITE */
@@ -0,0 +1,1108 @@
+/**
+ * @file libresd_kv.c
+ * @brief LibreSD Packed Key-Value Store Implementation
+ *
+ * Log positions are kept as (sequence, offset) pairs: the sequence of a
+ * log sector counts every sector ever written, so log sector seq % L holds
+ * it and a stale sector from an earlier lap is recognised by its header.
+ * The index stores the lap-free byte address (seq % L) * payload + offset;
+ * live records are always within the last L sectors behind the head, which
+ * makes the sequence recoverable from the address.
+ *
+ * Crash safety rests on one rule: the head never writes into the sector
+ * holding the tail recorded by the last checkpoint. Space compaction frees
+ * becomes reusable only once a checkpoint has moved that tail, so every
+ * record the checkpointed index or the replay can reach is still intact.
+ */
+
+#include "libresd_kv.h"
+#include "libresd_hal.h"
+#include <string.h>
+
+#if LIBRESD_ENABLE_KV && LIBRESD_ENABLE_WRITE
+
+/*============================================================================
+ * ON-CARD FORMAT
+ *============================================================================*/
+
+#define KV_MAGIC                0x564B524CUL    /* "LRKV" */
+#define KV_VERSION              1
+#define KV_SECTOR_MAGIC         0x534B          /* "KS" */
+#define KV_NO_RECORD            0xFFFF
+
+#define KV_PUT                  0xA5
+#define KV_DEL                  0x5A
+#define KV_REC_HDR              4
+
+#define KV_HASH_SEED            2166136261UL
+#define KV_ENTRY_SIZE           8
+#define KV_ENTRIES_PER_SECTOR   (LIBRESD_SECTOR_SIZE / KV_ENTRY_SIZE)
+
+/* Free log kept back from put() so compaction can always move a record */
+#define KV_RESERVE              (KV_REC_HDR + LIBRESD_KV_MAX_KEY + LIBRESD_KV_MAX_VALUE + \
+                                 LIBRESD_KV_PAYLOAD)
+
+/* Superblock (file sector 0 or 1, by checkpoint parity) */
+#define SB_MAGIC                0
+#define SB_VERSION              4
+#define SB_PAYLOAD              6
+#define SB_ID                   8
+#define SB_MAX_KEYS             12
+#define SB_LOG_SECTORS          16
+#define SB_CKPT_SEQ             20
+#define SB_COUNT                24
+#define SB_HEAD_SEQ             28
+#define SB_HEAD_OFF             32
+#define SB_TAIL_OFF             34
+#define SB_TAIL_SEQ             36
+#define SB_GARBAGE              40
+#define SB_INDEX_SUM            44
+#define SB_SUM                  48
+
+/* Log sector header, followed by LIBRESD_KV_PAYLOAD stream bytes */
+#define KS_MAGIC                0
+#define KS_FIRST                2
+#define KS_FILL                 4
+#define KS_ID                   8
+#define KS_SEQ                  12
+#define KS_DATA                 16
+
+#define READ16(buf, off)    ((uint16_t)(buf)[off] | ((uint16_t)(buf)[(off)+1] << 8))
+#define READ32(buf, off)    ((uint32_t)(buf)[off] | ((uint32_t)(buf)[(off)+1] << 8) | \
+                             ((uint32_t)(buf)[(off)+2] << 16) | ((uint32_t)(buf)[(off)+3] << 24))
+
+#define WRITE16(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+} while(0)
+
+#define WRITE32(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+    (buf)[(off)+2] = ((v) >> 16) & 0xFF; \
+    (buf)[(off)+3] = ((v) >> 24) & 0xFF; \
+} while(0)
+
+/** @brief Position in the record stream */
+typedef struct {
+    uint32_t seq;
+    uint16_t off;
+} kv_cursor_t;
+
+/*============================================================================
+ * INTERNAL HELPERS
+ *============================================================================*/
+
+/**
+ * @brief FNV-1a, used for key hashes and checksums
+ */
+static uint32_t kv_hash(uint32_t h, const uint8_t *p, uint32_t n) {
+    while (n--) {
+        h ^= *p++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static uint32_t kv_key_hash(const void *key, uint8_t klen) {
+    uint32_t h = kv_hash(KV_HASH_SEED, (const uint8_t *)key, klen);
+    return h ? h : 1;
+}
+
+/**
+ * @brief Record the sector runs behind a cluster chain
+ */
+static libresd_err_t kv_map(libresd_fat_t *fat, libresd_kv_t *kv,
+                            uint32_t cluster, uint32_t size, uint32_t *total) {
+    libresd_err_t err;
+
+    *total = size / 512;
+    err = libresd_fat_chain_extents(fat, cluster, *total, kv->extent,
+                                    LIBRESD_KV_MAX_EXTENTS, &kv->extent_count);
+    return (err == LIBRESD_ERR_NO_MEM) ? LIBRESD_ERR_NOT_SUPPORTED : err;
+}
+
+/**
+ * @brief Read or write n file sectors starting at file sector idx
+ */
+static libresd_err_t kv_io(libresd_kv_t *kv, uint32_t idx, uint8_t *buf,
+                           uint32_t n, bool write) {
+    uint32_t i;
+    libresd_err_t err;
+
+    for (i = 0; i < kv->extent_count && n > 0; i++) {
+        uint32_t run;
+
+        if (idx >= kv->extent[i].count) {
+            idx -= kv->extent[i].count;
+            continue;
+        }
+
+        run = kv->extent[i].count - idx;
+        if (run > n) run = n;
+
+        if (write) {
+            err = libresd_sd_write_sectors(kv->fat->sd, kv->extent[i].sector + idx, buf, run);
+        } else {
+            err = libresd_sd_read_sectors(kv->fat->sd, kv->extent[i].sector + idx, buf, run);
+        }
+        if (err != LIBRESD_OK) return err;
+
+        buf += run * LIBRESD_SECTOR_SIZE;
+        n -= run;
+        idx = 0;
+    }
+
+    return (n == 0) ? LIBRESD_OK : LIBRESD_ERR_INTERNAL;
+}
+
+/** @brief File sector of log sector 0 */
+static uint32_t kv_log_base(const libresd_kv_t *kv) {
+    return 2 + 2 * kv->ckpt_sectors;
+}
+
+/** @brief Lap-free byte address of a stream position */
+static uint32_t kv_loc(const libresd_kv_t *kv, uint32_t seq, uint16_t off) {
+    return (seq % kv->log_sectors) * LIBRESD_KV_PAYLOAD + off;
+}
+
+/**
+ * @brief Turn an index address back into a stream position
+ */
+static kv_cursor_t kv_cursor_at(const libresd_kv_t *kv, uint32_t loc) {
+    kv_cursor_t cur;
+    uint32_t idx = loc / LIBRESD_KV_PAYLOAD;
+    uint32_t head = kv->head_seq % kv->log_sectors;
+    
+    cur.seq = kv->head_seq - (head + kv->log_sectors - idx) % kv->log_sectors;
+    cur.off = loc % LIBRESD_KV_PAYLOAD;
+    return cur;
+}
+
+static bool kv_sector_valid(const libresd_kv_t *kv, const uint8_t *buf, uint32_t seq) {
+    return READ16(buf, KS_MAGIC) == KV_SECTOR_MAGIC &&
+           READ32(buf, KS_ID) == kv->id &&
+           READ32(buf, KS_SEQ) == seq &&
+           READ16(buf, KS_FILL) <= LIBRESD_KV_PAYLOAD;
+}
+
+static void kv_init_sector(const libresd_kv_t *kv, uint8_t *buf, uint32_t seq) {
+    memset(buf, 0, KS_DATA);
+    WRITE16(buf, KS_MAGIC, KV_SECTOR_MAGIC);
+    WRITE16(buf, KS_FIRST, KV_NO_RECORD);
+    WRITE32(buf, KS_ID, kv->id);
+    WRITE32(buf, KS_SEQ, seq);
+}
+
+static uint8_t *kv_head_buf(libresd_kv_t *kv) {
+    return kv->batch + (kv->head_seq - kv->batch_seq) * LIBRESD_SECTOR_SIZE;
+}
+
+/**
+ * @brief Get log sector seq, from the batch if it has not been written yet
+ *
+ * @return LIBRESD_OK, LIBRESD_ERR_INVALID_FS if the card holds another
+ *         lap there, or error
+ */
+static libresd_err_t kv_load(libresd_kv_t *kv, uint32_t seq,
+                             const uint8_t **buf, uint16_t *fill) {
+    libresd_err_t err;
+
+    if (kv->batch && seq - kv->batch_seq <= kv->head_seq - kv->batch_seq) {
+        *buf = kv->batch + (seq - kv->batch_seq) * LIBRESD_SECTOR_SIZE;
+        *fill = (seq == kv->head_seq) ? kv->head_off : LIBRESD_KV_PAYLOAD;
+        return LIBRESD_OK;
+    }
+
+    if (kv->scratch_seq != seq || seq == 0) {
+        kv->scratch_seq = 0;
+        err = kv_io(kv, kv_log_base(kv) + seq % kv->log_sectors, kv->scratch, 1, false);
+        if (err != LIBRESD_OK) return err;
+        if (!kv_sector_valid(kv, kv->scratch, seq)) return LIBRESD_ERR_INVALID_FS;
+        kv->scratch_seq = seq;
+    }
+
+    *buf = kv->scratch;
+    *fill = READ16(kv->scratch, KS_FILL);
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Copy (dst != NULL) or step over n stream bytes
+ *
+ * @return LIBRESD_OK, LIBRESD_ERR_EOF at the end of the written stream,
+ *         LIBRESD_ERR_INVALID_FS on a stale sector, or error
+ */
+static libresd_err_t kv_read(libresd_kv_t *kv, kv_cursor_t *cur, uint8_t *dst, uint32_t n) {
+    const uint8_t *buf;
+    uint16_t fill;
+    libresd_err_t err;
+    
+    while (n > 0) {
+        uint32_t chunk;
+    
+        if (cur->off == LIBRESD_KV_PAYLOAD) {
+            cur->seq++;
+            cur->off = 0;
+        }
+    
+        err = kv_load(kv, cur->seq, &buf, &fill);
+        if (err != LIBRESD_OK) return err;
+        if (cur->off >= fill) return LIBRESD_ERR_EOF;
+    
+        chunk = fill - cur->off;
+        if (chunk > n) chunk = n;
+    
+        if (dst) {
+            memcpy(dst, buf + KS_DATA + cur->off, chunk);
+            dst += chunk;
+        }
+        cur->off += chunk;
+        n -= chunk;
+    }
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Write batch sectors [batch_seq, end) to the log
+ */
+static libresd_err_t kv_write_batch(libresd_kv_t *kv, uint32_t end) {
+    uint32_t seq = kv->batch_seq;
+    libresd_err_t err;
+    
+    /* One multi-block write, or two where the log wraps */
+    while (seq != end) {
+        uint32_t idx = seq % kv->log_sectors;
+        uint32_t n = end - seq;
+    
+        if (n > kv->log_sectors - idx) n = kv->log_sectors - idx;
+    
+        err = kv_io(kv, kv_log_base(kv) + idx,
+                    kv->batch + (seq - kv->batch_seq) * LIBRESD_SECTOR_SIZE, n, true);
+        if (err != LIBRESD_OK) return err;
+        seq += n;
+    }
+    
+    kv->scratch_seq = 0;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Write everything in the batch, including a partial head sector
+ */
+static libresd_err_t kv_flush(libresd_kv_t *kv) {
+    uint32_t end = kv->head_seq;
+    libresd_err_t err;
+    
+    if (kv->head_off > 0) {
+        WRITE16(kv_head_buf(kv), KS_FILL, kv->head_off);
+        end++;
+    }
+    
+    err = kv_write_batch(kv, end);
+    if (err != LIBRESD_OK) return err;
+    
+    if (kv->head_seq != kv->batch_seq) {
+        memmove(kv->batch, kv_head_buf(kv), LIBRESD_SECTOR_SIZE);
+        kv->batch_seq = kv->head_seq;
+    }
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Seal the full head sector and start the next one
+ */
+static libresd_err_t kv_advance(libresd_kv_t *kv) {
+    libresd_err_t err;
+    
+    WRITE16(kv_head_buf(kv), KS_FILL, LIBRESD_KV_PAYLOAD);
+    
+    if (kv->head_seq - kv->batch_seq + 1 == kv->batch_sectors) {
+        err = kv_write_batch(kv, kv->head_seq + 1);
+        if (err != LIBRESD_OK) return err;
+        kv->batch_seq = kv->head_seq + 1;
+    }
+    
+    kv->head_seq++;
+    kv->head_off = 0;
+    kv_init_sector(kv, kv_head_buf(kv), kv->head_seq);
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Append n stream bytes; start marks the first byte of a record
+ *
+ * A failure part way through a record leaves the stream unusable, so the
+ * handle is closed and the caller has to reopen (replay drops the torn
+ * record).
+ */
+static libresd_err_t kv_emit(libresd_kv_t *kv, const uint8_t *src, uint32_t n, bool start) {
+    libresd_err_t err = LIBRESD_OK;
+    uint8_t *buf;
+    
+    if (kv->head_off == LIBRESD_KV_PAYLOAD) err = kv_advance(kv);
+    
+    buf = kv_head_buf(kv);
+    if (start && READ16(buf, KS_FIRST) == KV_NO_RECORD) {
+        WRITE16(buf, KS_FIRST, kv->head_off);
+    }
+    
+    while (err == LIBRESD_OK && n > 0) {
+        uint32_t chunk = LIBRESD_KV_PAYLOAD - kv->head_off;
+        if (chunk > n) chunk = n;
+    
+        memcpy(buf + KS_DATA + kv->head_off, src, chunk);
+        kv->head_off += chunk;
+        src += chunk;
+        n -= chunk;
+    
+        if (kv->head_off == LIBRESD_KV_PAYLOAD) {
+            err = kv_advance(kv);
+            buf = kv_head_buf(kv);
+        }
+    }
+    
+    if (err != LIBRESD_OK) kv->fat = NULL;
+    return err;
+}
+
+/**
+ * @brief Would rs more bytes keep the head out of sector tail_seq?
+ */
+static bool kv_fits(const libresd_kv_t *kv, uint32_t tail_seq, uint32_t rs) {
+    uint32_t end = kv->head_seq + (kv->head_off + rs) / LIBRESD_KV_PAYLOAD;
+    return end - tail_seq < kv->log_sectors;
+}
+
+/**
+ * @brief Append a whole record header and key, returning its address
+ */
+static libresd_err_t kv_emit_head(libresd_kv_t *kv, uint8_t type, const void *key,
+                                  uint8_t klen, uint16_t vlen, uint32_t *loc) {
+    uint8_t hdr[KV_REC_HDR];
+    libresd_err_t err;
+
+    if (kv->head_off == LIBRESD_KV_PAYLOAD) {
+        err = kv_advance(kv);
+        if (err != LIBRESD_OK) return err;
+    }
+    *loc = kv_loc(kv, kv->head_seq, kv->head_off);
+
+    hdr[0] = type;
+    hdr[1] = klen;
+    WRITE16(hdr, 2, vlen);
+
+    err = kv_emit(kv, hdr, KV_REC_HDR, true);
+    if (err != LIBRESD_OK) return err;
+    return kv_emit(kv, (const uint8_t *)key, klen, false);
+}
+
+/**
+ * @brief Find the slot for a key
+ *
+ * @param idx Matching slot, or the empty slot to insert into
+ * @param cur Left on the value when found (can be NULL)
+ * @param vlen Value length when found (can be NULL)
+ * @return LIBRESD_OK, LIBRESD_ERR_NOT_FOUND, or error
+ */
+static libresd_err_t kv_find(libresd_kv_t *kv, uint32_t h, const void *key, uint8_t klen,
+                             uint32_t *idx, kv_cursor_t *cur, uint16_t *vlen) {
+    uint8_t hdr[KV_REC_HDR];
+    uint8_t stored[LIBRESD_KV_MAX_KEY];
+    uint32_t i = h % kv->slot_count;
+    uint32_t probe;
+    libresd_err_t err;
+
+    for (probe = 0; probe < kv->slot_count; probe++) {
+        libresd_kv_slot_t *slot = &kv->slots[i];
+
+        if (slot->hash == 0) {
+            *idx = i;
+            return LIBRESD_ERR_NOT_FOUND;
+        }
+
+        if (slot->hash == h) {
+            kv_cursor_t c = kv_cursor_at(kv, slot->loc);
+
+            err = kv_read(kv, &c, hdr, KV_REC_HDR);
+            if (err == LIBRESD_OK && hdr[0] != KV_PUT) err = LIBRESD_ERR_INVALID_FS;
+            if (err == LIBRESD_OK && hdr[1] == klen) err = kv_read(kv, &c, stored, klen);
+            if (err != LIBRESD_OK) {
+                return (err == LIBRESD_ERR_EOF) ? LIBRESD_ERR_INVALID_FS : err;
+            }
+
+            if (hdr[1] == klen && memcmp(stored, key, klen) == 0) {
+                *idx = i;
+                if (cur) *cur = c;
+                if (vlen) *vlen = READ16(hdr, 2);
+                return LIBRESD_OK;
+            }
+        }
+
+        if (++i == kv->slot_count) i = 0;
+    }
+
+    /* Cannot happen while count < slot_count */
+    return LIBRESD_ERR_INTERNAL;
+}
+
+/**
+ * @brief Empty slot i, shifting later entries of its probe run back
+ */
+static void kv_slot_remove(libresd_kv_t *kv, uint32_t i) {
+    uint32_t j = i;
+    
+    for (;;) {
+        uint32_t home;
+    
+        if (++j == kv->slot_count) j = 0;
+        if (kv->slots[j].hash == 0) break;
+    
+        /* An entry may fill the hole only if its home is not in (i, j] */
+        home = kv->slots[j].hash % kv->slot_count;
+        if ((j > i) ? (home <= i || home > j) : (home <= i && home > j)) {
+            kv->slots[i] = kv->slots[j];
+            i = j;
+        }
+    }
+    
+    kv->slots[i].hash = 0;
+}
+
+/**
+ * @brief Insert an entry whose key is known to be absent
+ */
+static void kv_slot_insert(libresd_kv_t *kv, uint32_t h, uint32_t loc) {
+    uint32_t i = h % kv->slot_count;
+    
+    while (kv->slots[i].hash != 0) {
+        if (++i == kv->slot_count) i = 0;
+    }
+    kv->slots[i].hash = h;
+    kv->slots[i].loc = loc;
+}
+
+/**
+ * @brief Move the tail to the first record starting after a bad sector
+ *
+ * Sectors the head has lapped only ever held dead records, so skipping
+ * them loses nothing.
+ */
+static libresd_err_t kv_skip_sector(libresd_kv_t *kv) {
+    const uint8_t *buf;
+    uint16_t fill;
+    uint32_t seq = kv->tail_seq;
+    libresd_err_t err;
+    
+    /* Ends at the head sector at the latest, which always loads */
+    for (;;) {
+        seq++;
+    
+        err = kv_load(kv, seq, &buf, &fill);
+        if (err == LIBRESD_ERR_INVALID_FS) continue;
+        if (err != LIBRESD_OK) return err;
+    
+        if (READ16(buf, KS_FIRST) < fill) {
+            kv->tail_seq = seq;
+            kv->tail_off = READ16(buf, KS_FIRST);
+            return LIBRESD_OK;
+        }
+        if (seq == kv->head_seq) {
+            kv->tail_seq = kv->head_seq;
+            kv->tail_off = kv->head_off;
+            return LIBRESD_OK;
+        }
+    }
+}
+
+/**
+ * @brief Compact the record at the tail
+ *
+ * @param advanced Incremented by the log bytes the tail moved over
+ * @return LIBRESD_OK, LIBRESD_ERR_EOF if the log is empty, or error
+ */
+static libresd_err_t kv_compact_one(libresd_kv_t *kv, uint32_t *advanced) {
+    uint8_t hdr[KV_REC_HDR];
+    uint8_t key[LIBRESD_KV_MAX_KEY];
+    uint8_t chunk[64];
+    kv_cursor_t cur;
+    uint32_t loc, h, i, rs, left, total;
+    bool live = false;
+    libresd_err_t err;
+    
+    if (kv->tail_seq == kv->head_seq && kv->tail_off == kv->head_off) {
+        kv->garbage = 0;
+        return LIBRESD_ERR_EOF;
+    }
+    
+    cur.seq = kv->tail_seq;
+    cur.off = kv->tail_off;
+    
+    err = kv_read(kv, &cur, hdr, KV_REC_HDR);
+    if (err == LIBRESD_OK && ((hdr[0] != KV_PUT && hdr[0] != KV_DEL) || hdr[1] == 0)) {
+        err = LIBRESD_ERR_INVALID_FS;
+    }
+    if (err == LIBRESD_OK) err = kv_read(kv, &cur, key, hdr[1]);
+    if (err == LIBRESD_ERR_INVALID_FS) {
+        *advanced += LIBRESD_KV_PAYLOAD;
+        return kv_skip_sector(kv);
+    }
+    if (err != LIBRESD_OK) return err;
+    
+    loc = kv_loc(kv, kv->tail_seq, kv->tail_off);
+    rs = KV_REC_HDR + hdr[1] + READ16(hdr, 2);
+    
+    /* A put is live if the index still points at this copy */
+    if (hdr[0] == KV_PUT) {
+        h = kv_key_hash(key, hdr[1]);
+        for (i = h % kv->slot_count; kv->slots[i].hash != 0;
+             i = (i + 1 == kv->slot_count) ? 0 : i + 1) {
+            if (kv->slots[i].hash == h && kv->slots[i].loc == loc) {
+                live = true;
+                break;
+            }
+        }
+    }
+    
+    if (live) {
+        /* The copy may need space this pass has freed already */
+        if (!kv_fits(kv, kv->ckpt_tail_seq, rs)) {
+            if (!kv_fits(kv, kv->tail_seq, rs)) return LIBRESD_ERR_FULL;
+            err = libresd_kv_checkpoint(kv);
+            if (err != LIBRESD_OK) return err;
+        }
+    
+        err = kv_emit_head(kv, KV_PUT, key, hdr[1], READ16(hdr, 2), &loc);
+        if (err != LIBRESD_OK) return err;
+    
+        for (left = READ16(hdr, 2); left > 0; left -= total) {
+            total = (left < sizeof(chunk)) ? left : sizeof(chunk);
+            err = kv_read(kv, &cur, chunk, total);
+            if (err == LIBRESD_OK) err = kv_emit(kv, chunk, total, false);
+            if (err != LIBRESD_OK) {
+                kv->fat = NULL;
+                return err;
+            }
+        }
+        kv->slots[i].loc = loc;
+    } else {
+        /* Dead value bytes are stepped over without reading them */
+        total = cur.off + READ16(hdr, 2);
+        cur.seq += total / LIBRESD_KV_PAYLOAD;
+        cur.off = total % LIBRESD_KV_PAYLOAD;
+        kv->garbage = (kv->garbage > rs) ? kv->garbage - rs : 0;
+    }
+    
+    if (cur.off == LIBRESD_KV_PAYLOAD) {
+        cur.seq++;
+        cur.off = 0;
+    }
+    kv->tail_seq = cur.seq;
+    kv->tail_off = cur.off;
+    *advanced += rs;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Make sure need bytes can be appended
+ *
+ * Compacts an eighth of the log beyond what is needed so the checkpoint
+ * that releases the space is not paid on every put.
+ */
+static libresd_err_t kv_make_room(libresd_kv_t *kv, uint32_t need) {
+    uint32_t advanced = 0;
+    uint32_t target = need + kv->log_sectors * LIBRESD_KV_PAYLOAD / 8;
+    libresd_err_t err;
+    
+    if (kv_fits(kv, kv->ckpt_tail_seq, need)) return LIBRESD_OK;
+    
+    while (!kv_fits(kv, kv->tail_seq, target) && kv->garbage > 0 &&
+           advanced < kv->log_sectors * LIBRESD_KV_PAYLOAD) {
+        err = kv_compact_one(kv, &advanced);
+        if (err == LIBRESD_ERR_EOF) break;
+        if (err != LIBRESD_OK) return err;
+    }
+    
+    if (!kv_fits(kv, kv->tail_seq, need)) return LIBRESD_ERR_FULL;
+    return libresd_kv_checkpoint(kv);
+}
+
+/**
+ * @brief Check a superblock and pick the newer of two
+ */
+static bool kv_sb_valid(const uint8_t *buf) {
+    return READ32(buf, SB_MAGIC) == KV_MAGIC &&
+           READ16(buf, SB_VERSION) == KV_VERSION &&
+           READ16(buf, SB_PAYLOAD) == LIBRESD_KV_PAYLOAD &&
+           READ32(buf, SB_SUM) == kv_hash(KV_HASH_SEED, buf, SB_SUM);
+}
+
+/**
+ * @brief Check buffers and table size, and attach them to the handle
+ */
+static libresd_err_t kv_attach(libresd_kv_t *kv, libresd_kv_slot_t *slots,
+                               uint32_t slot_count, void *batch, uint32_t batch_size) {
+    if (!slots || !batch || batch_size < LIBRESD_SECTOR_SIZE ||
+        batch_size % LIBRESD_SECTOR_SIZE != 0) {
+        return LIBRESD_ERR_INVALID_PARAM;
+    }
+
+    kv->slots = slots;
+    kv->slot_count = slot_count;
+    kv->batch = (uint8_t *)batch;
+    kv->batch_sectors = batch_size / LIBRESD_SECTOR_SIZE;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Load the newest checkpoint and replay the log written after it
+ */
+static libresd_err_t kv_mount(libresd_kv_t *kv, uint32_t total) {
+    uint8_t hdr[KV_REC_HDR];
+    uint8_t key[LIBRESD_KV_MAX_KEY];
+    const uint8_t *sb;
+    uint8_t *batch = kv->batch;
+    kv_cursor_t cur, rec;
+    uint32_t n, i, h, sum, rs;
+    uint16_t vlen, fill;
+    libresd_err_t err;
+    
+    /* Superblocks: sector 0 into scratch, sector 1 into the batch */
+    err = kv_io(kv, 0, kv->scratch, 1, false);
+    if (err == LIBRESD_OK) err = kv_io(kv, 1, batch, 1, false);
+    if (err != LIBRESD_OK) return err;
+    
+    if (kv_sb_valid(kv->scratch) && kv_sb_valid(batch)) {
+        sb = ((int32_t)(READ32(batch, SB_CKPT_SEQ) - READ32(kv->scratch, SB_CKPT_SEQ)) > 0) ?
+             batch : kv->scratch;
+    } else if (kv_sb_valid(kv->scratch)) {
+        sb = kv->scratch;
+    } else if (kv_sb_valid(batch)) {
+        sb = batch;
+    } else {
+        return LIBRESD_ERR_INVALID_FS;
+    }
+    
+    kv->id = READ32(sb, SB_ID);
+    kv->max_keys = READ32(sb, SB_MAX_KEYS);
+    kv->log_sectors = READ32(sb, SB_LOG_SECTORS);
+    kv->ckpt_seq = READ32(sb, SB_CKPT_SEQ);
+    kv->count = READ32(sb, SB_COUNT);
+    kv->head_seq = READ32(sb, SB_HEAD_SEQ);
+    kv->head_off = READ16(sb, SB_HEAD_OFF);
+    kv->tail_seq = READ32(sb, SB_TAIL_SEQ);
+    kv->tail_off = READ16(sb, SB_TAIL_OFF);
+    kv->garbage = READ32(sb, SB_GARBAGE);
+    sum = READ32(sb, SB_INDEX_SUM);
+    
+    kv->ckpt_sectors = (kv->max_keys + KV_ENTRIES_PER_SECTOR - 1) / KV_ENTRIES_PER_SECTOR;
+    if (kv->max_keys == 0 || kv->count > kv->max_keys ||
+        kv->log_sectors == 0 || kv->log_sectors != total - kv_log_base(kv) ||
+        kv->head_off >= LIBRESD_KV_PAYLOAD || kv->tail_off >= LIBRESD_KV_PAYLOAD) {
+        return LIBRESD_ERR_INVALID_FS;
+    }
+    if (kv->slot_count < kv->max_keys + kv->max_keys / 4 || kv->slot_count <= kv->max_keys) {
+        return LIBRESD_ERR_NO_MEM;
+    }
+    
+    /* Index entries, a batch-full of sectors at a time */
+    memset(kv->slots, 0, kv->slot_count * sizeof(libresd_kv_slot_t));
+    h = KV_HASH_SEED;
+    for (i = 0; i < kv->count; i += n) {
+        uint32_t sectors = (kv->count - i + KV_ENTRIES_PER_SECTOR - 1) / KV_ENTRIES_PER_SECTOR;
+        uint32_t j;
+    
+        if (sectors > kv->batch_sectors) sectors = kv->batch_sectors;
+        n = sectors * KV_ENTRIES_PER_SECTOR;
+        if (n > kv->count - i) n = kv->count - i;
+    
+        err = kv_io(kv, 2 + (kv->ckpt_seq & 1) * kv->ckpt_sectors + i / KV_ENTRIES_PER_SECTOR,
+                    batch, sectors, false);
+        if (err != LIBRESD_OK) return err;
+    
+        h = kv_hash(h, batch, n * KV_ENTRY_SIZE);
+        for (j = 0; j < n; j++) {
+            uint32_t eh = READ32(batch, j * KV_ENTRY_SIZE);
+            uint32_t loc = READ32(batch, j * KV_ENTRY_SIZE + 4);
+    
+            if (eh == 0 || loc >= kv->log_sectors * LIBRESD_KV_PAYLOAD) {
+                return LIBRESD_ERR_INVALID_FS;
+            }
+            kv_slot_insert(kv, eh, loc);
+        }
+    }
+    if (h != sum) return LIBRESD_ERR_INVALID_FS;
+    
+    kv->ckpt_tail_seq = kv->tail_seq;
+    
+    /* Replay complete records after the checkpoint; the first torn or
+     * stale one ends the log. Reads go to the card while batch is NULL. */
+    kv->batch = NULL;
+    cur.seq = kv->head_seq;
+    cur.off = kv->head_off;
+    
+    for (;;) {
+        rec = cur;
+        err = kv_read(kv, &cur, hdr, KV_REC_HDR);
+        if (err == LIBRESD_OK && ((hdr[0] != KV_PUT && hdr[0] != KV_DEL) || hdr[1] == 0)) {
+            break;
+        }
+        if (err == LIBRESD_OK) err = kv_read(kv, &cur, key, hdr[1]);
+        if (err == LIBRESD_OK) err = kv_read(kv, &cur, NULL, READ16(hdr, 2));
+        if (err == LIBRESD_ERR_EOF || err == LIBRESD_ERR_INVALID_FS) break;
+        if (err != LIBRESD_OK) return err;
+    
+        kv->head_seq = cur.seq;
+        kv->head_off = cur.off;
+        rs = KV_REC_HDR + hdr[1] + READ16(hdr, 2);
+        h = kv_key_hash(key, hdr[1]);
+    
+        err = kv_find(kv, h, key, hdr[1], &i, NULL, &vlen);
+        if (err == LIBRESD_OK) {
+            kv->garbage += KV_REC_HDR + hdr[1] + vlen;
+        } else if (err != LIBRESD_ERR_NOT_FOUND) {
+            return err;
+        }
+    
+        if (hdr[0] == KV_PUT) {
+            if (err == LIBRESD_ERR_NOT_FOUND) {
+                if (kv->count == kv->max_keys) return LIBRESD_ERR_INVALID_FS;
+                kv->slots[i].hash = h;
+                kv->count++;
+            }
+            kv->slots[i].loc = kv_loc(kv, rec.seq, rec.off);
+        } else {
+            if (err == LIBRESD_OK) {
+                kv_slot_remove(kv, i);
+                kv->count--;
+            }
+            kv->garbage += rs;
+        }
+    }
+    
+    if (kv->head_off == LIBRESD_KV_PAYLOAD) {
+        kv->head_seq++;
+        kv->head_off = 0;
+    }
+    
+    /* Pick the partial head sector up again */
+    kv->batch = batch;
+    kv->batch_seq = kv->head_seq;
+    kv_init_sector(kv, batch, kv->head_seq);
+    
+    if (kv->head_off > 0) {
+        kv->batch = NULL;
+        err = kv_load(kv, kv->head_seq, &sb, &fill);
+        kv->batch = batch;
+        if (err != LIBRESD_OK) return err;
+    
+        memcpy(batch, sb, LIBRESD_SECTOR_SIZE);
+        if (READ16(batch, KS_FIRST) >= kv->head_off) WRITE16(batch, KS_FIRST, KV_NO_RECORD);
+    }
+    
+    return LIBRESD_OK;
+}
+
+/*============================================================================
+ * KEY-VALUE OPERATIONS
+ *============================================================================*/
+
+libresd_err_t libresd_kv_create(libresd_fat_t *fat, libresd_kv_t *kv,
+                                 const char *path, uint32_t log_size,
+                                 uint32_t max_keys,
+                                 libresd_kv_slot_t *slots, uint32_t slot_count,
+                                 void *batch, uint32_t batch_size) {
+    libresd_file_t file;
+    uint32_t sectors, clusters, total, min_log;
+    libresd_err_t err;
+
+    if (!fat || !kv || !path || max_keys == 0) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+
+    memset(kv, 0, sizeof(*kv));
+    err = kv_attach(kv, slots, slot_count, batch, batch_size);
+    if (err != LIBRESD_OK) return err;
+    if (max_keys > 0x10000000UL || slot_count <= max_keys ||
+        slot_count < max_keys + max_keys / 4) {
+        return LIBRESD_ERR_NO_MEM;
+    }
+
+    kv->max_keys = max_keys;
+    kv->ckpt_sectors = (max_keys + KV_ENTRIES_PER_SECTOR - 1) / KV_ENTRIES_PER_SECTOR;
+    memset(kv->slots, 0, kv->slot_count * sizeof(libresd_kv_slot_t));
+
+    /* Room for the compaction reserve twice over */
+    min_log = 4 * KV_RESERVE / LIBRESD_KV_PAYLOAD;
+    sectors = (log_size + LIBRESD_KV_PAYLOAD - 1) / LIBRESD_KV_PAYLOAD;
+    if (sectors < min_log) sectors = min_log;
+    sectors += kv_log_base(kv);
+
+    clusters = (sectors + fat->sectors_per_cluster - 1) / fat->sectors_per_cluster;
+    if (clusters > 0xFFFFFFFFUL / fat->cluster_size) return LIBRESD_ERR_INVALID_PARAM;
+
+    err = libresd_fat_open(fat, &file, path,
+                           LIBRESD_WRITE | LIBRESD_CREATE | LIBRESD_TRUNCATE);
+    if (err != LIBRESD_OK) return err;
+
+    err = libresd_fat_preallocate(fat, &file, clusters * fat->cluster_size);
+    if (err != LIBRESD_OK) {
+        libresd_fat_close(fat, &file);
+        return err;
+    }
+
+    err = libresd_fat_close(fat, &file);
+    if (err != LIBRESD_OK) return err;
+
+    err = kv_map(fat, kv, file.first_cluster, file.file_size, &total);
+    if (err != LIBRESD_OK) return err;
+    kv->log_sectors = total - kv_log_base(kv);
+
+    /* Sectors left over from an earlier store at the same spot must not
+     * pass for ours */
+    kv->id = (libresd_hal_get_ms() * 2654435761UL) ^ fat->volume_serial ^
+             (file.first_cluster << 8) ^ 0x4B56;
+    if (kv->id == 0) kv->id = 1;
+
+    kv->head_seq = kv->tail_seq = kv->ckpt_tail_seq = kv->batch_seq = 1;
+    kv_init_sector(kv, kv->batch, kv->head_seq);
+
+    /* Only a handle that made it this far is usable. The first checkpoint
+     * lands in superblock 1; clear superblock 0 so nothing older wins. */
+    kv->fat = fat;
+    memset(kv->scratch, 0, sizeof(kv->scratch));
+    err = kv_io(kv, 0, kv->scratch, 1, true);
+    if (err == LIBRESD_OK) err = libresd_kv_checkpoint(kv);
+    if (err != LIBRESD_OK) kv->fat = NULL;
+    return err;
+}
+
+libresd_err_t libresd_kv_open(libresd_fat_t *fat, libresd_kv_t *kv,
+                               const char *path,
+                               libresd_kv_slot_t *slots, uint32_t slot_count,
+                               void *batch, uint32_t batch_size) {
+    libresd_fileinfo_t info;
+    uint32_t total;
+    libresd_err_t err;
+
+    if (!fat || !kv || !path) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+
+    memset(kv, 0, sizeof(*kv));
+    err = kv_attach(kv, slots, slot_count, batch, batch_size);
+    if (err != LIBRESD_OK) return err;
+
+    err = fat_resolve_path(fat, path, NULL, NULL, NULL, &info);
+    if (err != LIBRESD_OK) return err;
+    if (info.attr & LIBRESD_ATTR_DIRECTORY) return LIBRESD_ERR_NOT_FILE;
+
+    err = kv_map(fat, kv, info.first_cluster, info.size, &total);
+    if (err != LIBRESD_OK) return err;
+    if (total < 4) return LIBRESD_ERR_INVALID_FS;
+
+    kv->fat = fat;
+    err = kv_mount(kv, total);
+    if (err != LIBRESD_OK) kv->fat = NULL;
+    return err;
+}
+
+libresd_err_t libresd_kv_get(libresd_kv_t *kv, const void *key, uint8_t klen,
+                              void *val, uint16_t cap, uint16_t *vlen) {
+    kv_cursor_t cur;
+    uint32_t i;
+    uint16_t len;
+    libresd_err_t err;
+
+    if (!kv || !kv->fat || !key || klen == 0 || (!val && cap)) {
+        return LIBRESD_ERR_INVALID_PARAM;
+    }
+
+    err = kv_find(kv, kv_key_hash(key, klen), key, klen, &i, &cur, &len);
+    if (err != LIBRESD_OK) return err;
+
+    err = kv_read(kv, &cur, (uint8_t *)val, (len < cap) ? len : cap);
+    if (err == LIBRESD_ERR_EOF) return LIBRESD_ERR_INVALID_FS;
+    if (err != LIBRESD_OK) return err;
+
+    if (vlen) *vlen = len;
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_kv_put(libresd_kv_t *kv, const void *key, uint8_t klen,
+                              const void *val, uint16_t vlen) {
+    uint32_t h, i, loc, rs;
+    uint16_t old_vlen;
+    bool found;
+    libresd_err_t err;
+
+    if (!kv || !kv->fat || !key || klen == 0 || (!val && vlen) ||
+        vlen > LIBRESD_KV_MAX_VALUE) {
+        return LIBRESD_ERR_INVALID_PARAM;
+    }
+
+    h = kv_key_hash(key, klen);
+    err = kv_find(kv, h, key, klen, &i, NULL, &old_vlen);
+    if (err != LIBRESD_OK && err != LIBRESD_ERR_NOT_FOUND) return err;
+
+    found = (err == LIBRESD_OK);
+    if (!found && kv->count >= kv->max_keys) return LIBRESD_ERR_FULL;
+
+    /* Compaction only rewrites slot locations, so i stays valid */
+    rs = KV_REC_HDR + klen + vlen;
+    err = kv_make_room(kv, rs + KV_RESERVE);
+    if (err != LIBRESD_OK) return err;
+
+    err = kv_emit_head(kv, KV_PUT, key, klen, vlen, &loc);
+    if (err == LIBRESD_OK) err = kv_emit(kv, (const uint8_t *)val, vlen, false);
+    if (err != LIBRESD_OK) return err;
+
+    if (found) {
+        kv->garbage += KV_REC_HDR + klen + old_vlen;
+    } else {
+        kv->slots[i].hash = h;
+        kv->count++;
+    }
+    kv->slots[i].loc = loc;
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_kv_delete(libresd_kv_t *kv, const void *key, uint8_t klen) {
+    uint32_t i, loc, rs;
+    uint16_t old_vlen;
+    libresd_err_t err;
+    
+    if (!kv || !kv->fat || !key || klen == 0) return LIBRESD_ERR_INVALID_PARAM;
+    
+    err = kv_find(kv, kv_key_hash(key, klen), key, klen, &i, NULL, &old_vlen);
+    if (err != LIBRESD_OK) return err;
+    
+    /* The delete record hides older copies from replay until compaction
+     * has passed them */
+    rs = KV_REC_HDR + klen;
+    err = kv_make_room(kv, rs + KV_RESERVE);
+    if (err == LIBRESD_OK) err = kv_emit_head(kv, KV_DEL, key, klen, 0, &loc);
+    if (err != LIBRESD_OK) return err;
+    
+    kv_slot_remove(kv, i);
+    kv->count--;
+    kv->garbage += KV_REC_HDR + klen + old_vlen + rs;
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_kv_iterate(libresd_kv_t *kv, libresd_kv_fn fn, void *ctx) {
+    uint8_t hdr[KV_REC_HDR];
+    uint8_t key[LIBRESD_KV_MAX_KEY];
+    kv_cursor_t cur;
+    uint32_t i;
+    libresd_err_t err;
+    
+    if (!kv || !kv->fat || !fn) return LIBRESD_ERR_INVALID_PARAM;
+    
+    for (i = 0; i < kv->slot_count; i++) {
+        if (kv->slots[i].hash == 0) continue;
+    
+        cur = kv_cursor_at(kv, kv->slots[i].loc);
+        err = kv_read(kv, &cur, hdr, KV_REC_HDR);
+        if (err == LIBRESD_OK) err = kv_read(kv, &cur, key, hdr[1]);
+        if (err == LIBRESD_ERR_EOF) err = LIBRESD_ERR_INVALID_FS;
+        if (err != LIBRESD_OK) return err;
+    
+        if (!fn(ctx, key, hdr[1], READ16(hdr, 2))) break;
+    }
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_kv_compact(libresd_kv_t *kv, uint32_t max_records) {
+    uint32_t advanced = 0;
+    libresd_err_t err;
+    
+    if (!kv || !kv->fat) return LIBRESD_ERR_INVALID_PARAM;
+    
+    while (max_records-- > 0 && kv->garbage > 0) {
+        err = kv_compact_one(kv, &advanced);
+        if (err != LIBRESD_OK) return err;
+    }
+    
+    return (kv->garbage > 0) ? LIBRESD_OK : LIBRESD_ERR_EOF;
+}
+
+libresd_err_t libresd_kv_checkpoint(libresd_kv_t *kv) {
+    uint8_t *buf;
+    uint32_t cap, i, n, s, h, area;
+    libresd_err_t err;
+    
+    if (!kv || !kv->fat) return LIBRESD_ERR_INVALID_PARAM;
+    
+    err = kv_flush(kv);
+    if (err != LIBRESD_OK) return err;
+    
+    /* Stage entries in the batch sectors behind the head, or in scratch */
+    if (kv->batch_sectors > 1) {
+        buf = kv->batch + LIBRESD_SECTOR_SIZE;
+        cap = kv->batch_sectors - 1;
+    } else {
+        buf = kv->scratch;
+        cap = 1;
+    }
+    kv->scratch_seq = 0;
+    
+    area = 2 + ((kv->ckpt_seq + 1) & 1) * kv->ckpt_sectors;
+    h = KV_HASH_SEED;
+    n = 0;
+    s = 0;
+    
+    for (i = 0; i <= kv->slot_count; i++) {
+        if (i < kv->slot_count) {
+            if (kv->slots[i].hash == 0) continue;
+            WRITE32(buf, n * KV_ENTRY_SIZE, kv->slots[i].hash);
+            WRITE32(buf, n * KV_ENTRY_SIZE + 4, kv->slots[i].loc);
+            n++;
+            if (n < cap * KV_ENTRIES_PER_SECTOR) continue;
+        }
+        if (n == 0) continue;
+    
+        /* Pad the last sector; only the entries count towards the sum */
+        h = kv_hash(h, buf, n * KV_ENTRY_SIZE);
+        memset(buf + n * KV_ENTRY_SIZE, 0,
+               (KV_ENTRIES_PER_SECTOR - n % KV_ENTRIES_PER_SECTOR) % KV_ENTRIES_PER_SECTOR *
+               KV_ENTRY_SIZE);
+    
+        err = kv_io(kv, area + s, buf, (n + KV_ENTRIES_PER_SECTOR - 1) / KV_ENTRIES_PER_SECTOR,
+                    true);
+        if (err != LIBRESD_OK) return err;
+        s += (n + KV_ENTRIES_PER_SECTOR - 1) / KV_ENTRIES_PER_SECTOR;
+        n = 0;
+    }
+    
+    memset(buf, 0, LIBRESD_SECTOR_SIZE);
+    WRITE32(buf, SB_MAGIC, KV_MAGIC);
+    WRITE16(buf, SB_VERSION, KV_VERSION);
+    WRITE16(buf, SB_PAYLOAD, LIBRESD_KV_PAYLOAD);
+    WRITE32(buf, SB_ID, kv->id);
+    WRITE32(buf, SB_MAX_KEYS, kv->max_keys);
+    WRITE32(buf, SB_LOG_SECTORS, kv->log_sectors);
+    WRITE32(buf, SB_CKPT_SEQ, kv->ckpt_seq + 1);
+    WRITE32(buf, SB_COUNT, kv->count);
+    WRITE32(buf, SB_HEAD_SEQ, kv->head_seq);
+    WRITE16(buf, SB_HEAD_OFF, kv->head_off);
+    WRITE16(buf, SB_TAIL_OFF, kv->tail_off);
+    WRITE32(buf, SB_TAIL_SEQ, kv->tail_seq);
+    WRITE32(buf, SB_GARBAGE, kv->garbage);
+    WRITE32(buf, SB_INDEX_SUM, h);
+    WRITE32(buf, SB_SUM, kv_hash(KV_HASH_SEED, buf, SB_SUM));
+    
+    err = kv_io(kv, (kv->ckpt_seq + 1) & 1, buf, 1, true);
+    if (err != LIBRESD_OK) return err;
+    
+    kv->ckpt_seq++;
+    kv->ckpt_tail_seq = kv->tail_seq;
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_kv_close(libresd_kv_t *kv) {
+    libresd_err_t err = libresd_kv_checkpoint(kv);
+    
+    if (kv) kv->fat = NULL;
+    return err;
+}
+
+#endif /* LIBRESD_ENABLE_KV && LIBRESD_ENABLE_WRITE */
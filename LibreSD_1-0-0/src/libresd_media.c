@@ -0,0 +1,175 @@
+/**
+ * @file libresd_media.c
+ * @brief LibreSD Media Change Handling
+ *
+ * A card that comes back is checked in three steps, cheapest first: the
+ * CID names the physical card, the boot sector tells whether it was
+ * reformatted, and the fingerprint whether another host wrote to it. Only
+ * the fingerprint costs reads while the card is in use, and only after
+ * the card was written.
+ */
+
+#include "libresd_fat.h"
+#include "libresd_hal.h"
+#include <string.h>
+
+#if LIBRESD_ENABLE_MEDIA
+
+#define READ16(buf, off)    ((uint16_t)(buf)[off] | ((uint16_t)(buf)[(off)+1] << 8))
+#define READ32(buf, off)    ((uint32_t)(buf)[off] | ((uint32_t)(buf)[(off)+1] << 8) | \
+                             ((uint32_t)(buf)[(off)+2] << 16) | ((uint32_t)(buf)[(off)+3] << 24))
+
+#define MEDIA_HASH_SEED         2166136261UL
+
+/*============================================================================
+ * INTERNAL HELPERS
+ *============================================================================*/
+
+/**
+ * @brief FNV-1a
+ */
+static uint32_t media_hash(uint32_t h, const uint8_t *p, uint32_t n) {
+    while (n--) {
+        h ^= *p++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+/**
+ * @brief Hash of the metadata another host would change
+ *
+ * The FSInfo sector (free count and hint, which desktop systems update),
+ * the first root directory sector and evenly spaced FAT sectors.
+ */
+static libresd_err_t media_fingerprint(libresd_fat_t *fat, uint32_t *hash) {
+    uint8_t *buf = fat->dir_buffer;
+    uint32_t h = MEDIA_HASH_SEED;
+    uint32_t sector, i;
+    libresd_err_t err;
+    
+    if (fat->fs_type == LIBRESD_FS_FAT32) {
+        if (fat->fsinfo_sector != 0) {
+            err = libresd_sd_read_sector(fat->sd, fat->fsinfo_sector, buf);
+            if (err != LIBRESD_OK) return err;
+            h = media_hash(h, buf, LIBRESD_SECTOR_SIZE);
+        }
+        sector = libresd_fat_cluster_to_sector(fat, fat->root_cluster);
+    } else {
+        sector = fat->root_start_sector;
+    }
+    
+    err = libresd_sd_read_sector(fat->sd, sector, buf);
+    if (err != LIBRESD_OK) return err;
+    h = media_hash(h, buf, LIBRESD_SECTOR_SIZE);
+    
+    for (i = 0; i < LIBRESD_MEDIA_SAMPLES; i++) {
+        sector = fat->fat_start_sector +
+                 (uint32_t)((uint64_t)fat->sectors_per_fat * i / LIBRESD_MEDIA_SAMPLES);
+        err = libresd_sd_read_sector(fat->sd, sector, buf);
+        if (err != LIBRESD_OK) return err;
+        h = media_hash(h, buf, LIBRESD_SECTOR_SIZE);
+    }
+    
+    *hash = h;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Record the card as it is now
+ */
+static libresd_err_t media_take(libresd_fat_t *fat) {
+    libresd_err_t err;
+    
+    fat->media.valid = false;
+    err = media_fingerprint(fat, &fat->media.hash);
+    if (err != LIBRESD_OK) return err;
+    
+    memcpy(fat->media.cid, fat->sd->cid, sizeof(fat->media.cid));
+    fat->media.writes = fat->sd->write_count;
+    fat->media.valid = true;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Is the card just initialised the one the volume state describes?
+ */
+static bool media_same(libresd_fat_t *fat) {
+    uint8_t *buf = fat->dir_buffer;
+    uint32_t total, hash;
+    
+    if (!fat->media.valid) return false;
+    if (memcmp(fat->media.cid, fat->sd->cid, sizeof(fat->media.cid)) != 0) return false;
+    
+    /* Same card - but maybe reformatted */
+    if (libresd_sd_read_sector(fat->sd, fat->fat_start_sector - fat->reserved_sectors,
+                               buf) != LIBRESD_OK) {
+        return false;
+    }
+    if (buf[510] != 0x55 || buf[511] != 0xAA) return false;
+    total = READ16(buf, 19);
+    if (total == 0) total = READ32(buf, 32);
+    if (READ16(buf, 11) != fat->bytes_per_sector ||
+        total != fat->total_sectors / fat->sector_blocks ||
+        READ32(buf, (fat->fs_type == LIBRESD_FS_FAT32) ? 67 : 39) != fat->volume_serial) {
+        return false;
+    }
+    
+    /* Same volume - but maybe written elsewhere */
+    return media_fingerprint(fat, &hash) == LIBRESD_OK && hash == fat->media.hash;
+}
+
+/*============================================================================
+ * PUBLIC API
+ *============================================================================*/
+
+libresd_err_t libresd_fat_media_poll(libresd_fat_t *fat, libresd_media_event_t *event) {
+    libresd_sd_t *sd;
+    uint32_t reads, writes, errors, speed;
+    libresd_err_t err;
+    
+    if (event) *event = LIBRESD_MEDIA_NONE;
+    if (!fat || !fat->sd) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+    sd = fat->sd;
+    
+    if (!libresd_hal_card_detect()) {
+        if (!fat->media.removed) {
+            fat->media.removed = true;
+            sd->initialized = false;
+            if (event) *event = LIBRESD_MEDIA_REMOVED;
+        }
+        return LIBRESD_ERR_NO_CARD;
+    }
+    
+    /* In use: keep the fingerprint up to date with what was written */
+    if (!fat->media.removed && sd->initialized) {
+        if (fat->media.valid && fat->media.writes == sd->write_count) return LIBRESD_OK;
+        return media_take(fat);
+    }
+    
+    /* Card (back) in: repeat the handshake, keeping the counters */
+    reads = sd->read_count;
+    writes = sd->write_count;
+    errors = sd->error_count;
+    speed = (sd->spi_speed > LIBRESD_SPI_INIT_HZ) ? sd->spi_speed : 0;
+    err = libresd_sd_init(sd, speed);
+    sd->read_count = reads;
+    sd->write_count = writes;
+    sd->error_count = errors;
+    if (err != LIBRESD_OK) return err;
+    fat->media.removed = false;
+    
+    if (media_same(fat)) {
+        if (event) *event = LIBRESD_MEDIA_SAME;
+        return LIBRESD_OK;
+    }
+    
+    LIBRESD_DEBUG_PRINTF("Media changed, remounting");
+    if (event) *event = LIBRESD_MEDIA_CHANGED;
+    err = libresd_fat_mount(fat, sd);
+    if (err != LIBRESD_OK) return err;
+    return media_take(fat);
+}
+
+#endif /* LIBRESD_ENABLE_MEDIA */
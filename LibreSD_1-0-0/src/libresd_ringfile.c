@@ -0,0 +1,577 @@
+/**
+ * @file libresd_ringfile.c
+ * @brief LibreSD Fixed-Capacity Circular Log Implementation
+ *
+ * The FAT is only consulted when a ring is created or opened, to turn the
+ * cluster chain into a short list of sector runs. Appends and iteration
+ * then address card sectors directly.
+ */
+
+#include "libresd_ringfile.h"
+#include "libresd_hal.h"
+#include <string.h>
+
+#if LIBRESD_ENABLE_RINGFILE && LIBRESD_ENABLE_WRITE
+
+/*============================================================================
+ * ON-CARD FORMAT
+ *============================================================================*/
+
+#define RING_MAGIC              0x474E524CUL    /* "LRNG" */
+#define RING_VERSION            1
+#define RING_SECTOR_MAGIC       0x5352          /* "RS" */
+#define RING_NO_RECORD          0xFFFF
+#define RING_FLAG_WRAPPED       0x01
+
+/* Header sector (file sector 0) */
+#define RH_MAGIC                0
+#define RH_VERSION              4
+#define RH_PAYLOAD              6
+#define RH_ID                   8
+#define RH_DATA_SECTORS         12
+#define RH_HEAD                 16
+#define RH_HEAD_SEQ             20
+#define RH_TAIL                 24
+#define RH_FLAGS                28
+
+/* Data sector header, followed by LIBRESD_RINGFILE_PAYLOAD stream bytes */
+#define RS_MAGIC                0
+#define RS_FIRST                2
+#define RS_FILL                 4
+#define RS_ID                   8
+#define RS_SEQ                  12
+#define RS_DATA                 16
+
+#define READ16(buf, off)    ((uint16_t)(buf)[off] | ((uint16_t)(buf)[(off)+1] << 8))
+#define READ32(buf, off)    ((uint32_t)(buf)[off] | ((uint32_t)(buf)[(off)+1] << 8) | \
+                             ((uint32_t)(buf)[(off)+2] << 16) | ((uint32_t)(buf)[(off)+3] << 24))
+
+#define WRITE16(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+} while(0)
+
+#define WRITE32(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+    (buf)[(off)+2] = ((v) >> 16) & 0xFF; \
+    (buf)[(off)+3] = ((v) >> 24) & 0xFF; \
+} while(0)
+
+/*============================================================================
+ * INTERNAL HELPERS
+ *============================================================================*/
+
+/**
+ * @brief Record the sector runs behind a cluster chain
+ */
+static libresd_err_t ring_map(libresd_fat_t *fat, libresd_ringfile_t *ring,
+                              uint32_t cluster, uint32_t size) {
+    uint32_t total = size / 512;
+    libresd_err_t err;
+
+    err = libresd_fat_chain_extents(fat, cluster, total, ring->extent,
+                                    LIBRESD_RINGFILE_MAX_EXTENTS, &ring->extent_count);
+    if (err == LIBRESD_ERR_NO_MEM) return LIBRESD_ERR_NOT_SUPPORTED;
+    if (err != LIBRESD_OK) return err;
+
+    /* Header plus room for a few full sectors of records */
+    if (total < 5) return LIBRESD_ERR_INVALID_FS;
+
+    ring->data_sectors = total - 1;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Card sector holding file sector idx (0 = header)
+ */
+static uint32_t ring_sector(const libresd_ringfile_t *ring, uint32_t idx) {
+    uint32_t i;
+    
+    for (i = 0; i < ring->extent_count; i++) {
+        if (idx < ring->extent[i].count) {
+            return ring->extent[i].sector + idx;
+        }
+        idx -= ring->extent[i].count;
+    }
+    return 0;
+}
+
+/**
+ * @brief Oldest data sector still holding records
+ */
+static uint32_t ring_tail(const libresd_ringfile_t *ring) {
+    if (!ring->wrapped) return 0;
+    return (ring->head + 1 == ring->data_sectors) ? 0 : ring->head + 1;
+}
+
+static libresd_err_t ring_write_header(libresd_ringfile_t *ring) {
+    uint8_t buffer[512];
+    
+    memset(buffer, 0, sizeof(buffer));
+    WRITE32(buffer, RH_MAGIC, RING_MAGIC);
+    WRITE16(buffer, RH_VERSION, RING_VERSION);
+    WRITE16(buffer, RH_PAYLOAD, LIBRESD_RINGFILE_PAYLOAD);
+    WRITE32(buffer, RH_ID, ring->id);
+    WRITE32(buffer, RH_DATA_SECTORS, ring->data_sectors);
+    WRITE32(buffer, RH_HEAD, ring->head);
+    WRITE32(buffer, RH_HEAD_SEQ, ring->head_seq);
+    WRITE32(buffer, RH_TAIL, ring_tail(ring));
+    buffer[RH_FLAGS] = ring->wrapped ? RING_FLAG_WRAPPED : 0;
+    
+    ring->unsynced = 0;
+    return libresd_sd_write_sector(ring->fat->sd, ring_sector(ring, 0), buffer);
+}
+
+/**
+ * @brief Start an empty head sector
+ */
+static void ring_reset_head(libresd_ringfile_t *ring) {
+    memset(ring->head_buf, 0, RS_DATA);
+    WRITE16(ring->head_buf, RS_MAGIC, RING_SECTOR_MAGIC);
+    WRITE16(ring->head_buf, RS_FIRST, RING_NO_RECORD);
+    WRITE32(ring->head_buf, RS_ID, ring->id);
+    WRITE32(ring->head_buf, RS_SEQ, ring->head_seq);
+    ring->head_fill = 0;
+    ring->head_dirty = false;
+}
+
+static libresd_err_t ring_write_head(libresd_ringfile_t *ring) {
+    libresd_err_t err;
+    
+    WRITE16(ring->head_buf, RS_FILL, ring->head_fill);
+    err = libresd_sd_write_sector(ring->fat->sd, ring_sector(ring, ring->head + 1),
+                                  ring->head_buf);
+    if (err != LIBRESD_OK) return err;
+    ring->head_dirty = false;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Step the head onto the next sector (after it was written full)
+ */
+static void ring_step_head(libresd_ringfile_t *ring) {
+    if (++ring->head == ring->data_sectors) {
+        ring->head = 0;
+        ring->wrapped = true;
+    }
+    ring->head_seq++;
+    ring_reset_head(ring);
+}
+
+/**
+ * @brief Check a data sector belongs to this ring at sequence seq
+ */
+static bool ring_sector_valid(const libresd_ringfile_t *ring, const uint8_t *buf,
+                              uint32_t seq) {
+    return READ16(buf, RS_MAGIC) == RING_SECTOR_MAGIC &&
+           READ32(buf, RS_ID) == ring->id &&
+           READ32(buf, RS_SEQ) == seq &&
+           READ16(buf, RS_FILL) <= LIBRESD_RINGFILE_PAYLOAD;
+}
+
+/**
+ * @brief Append n stream bytes; start marks the first byte of a record
+ */
+static libresd_err_t ring_emit(libresd_ringfile_t *ring, const uint8_t *src,
+                               uint32_t n, bool start) {
+    libresd_err_t err;
+
+    if (start && READ16(ring->head_buf, RS_FIRST) == RING_NO_RECORD) {
+        WRITE16(ring->head_buf, RS_FIRST, ring->head_fill);
+    }
+
+    while (n > 0) {
+        uint32_t chunk = LIBRESD_RINGFILE_PAYLOAD - ring->head_fill;
+        if (chunk > n) chunk = n;
+
+        memcpy(ring->head_buf + RS_DATA + ring->head_fill, src, chunk);
+        ring->head_fill += chunk;
+        ring->head_dirty = true;
+        src += chunk;
+        n -= chunk;
+
+        if (ring->head_fill == LIBRESD_RINGFILE_PAYLOAD) {
+            err = ring_write_head(ring);
+            if (err != LIBRESD_OK) return err;
+            ring_step_head(ring);
+
+            if (ring->sync_interval && ++ring->unsynced >= ring->sync_interval) {
+                err = ring_write_header(ring);
+                if (err != LIBRESD_OK) return err;
+            }
+        }
+    }
+
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Load the cursor's sector, from RAM if it is the live head
+ */
+static libresd_err_t ring_iter_load(libresd_ringfile_t *ring,
+                                    libresd_ringfile_iter_t *it) {
+    if (it->sector == ring->head && it->seq == ring->head_seq) {
+        memcpy(it->buf, ring->head_buf, RS_DATA + ring->head_fill);
+        it->fill = ring->head_fill;
+        return LIBRESD_OK;
+    }
+
+    libresd_err_t err = libresd_sd_read_sector(ring->fat->sd,
+                                               ring_sector(ring, it->sector + 1), it->buf);
+    if (err != LIBRESD_OK) return err;
+
+    /* Overwritten since the cursor got here */
+    if (!ring_sector_valid(ring, it->buf, it->seq)) return LIBRESD_ERR_EOF;
+
+    it->fill = READ16(it->buf, RS_FILL);
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Make at least one byte available under the cursor
+ */
+static libresd_err_t ring_iter_avail(libresd_ringfile_t *ring,
+                                     libresd_ringfile_iter_t *it) {
+    libresd_err_t err;
+
+    if (it->offset < it->fill) return LIBRESD_OK;
+
+    if (it->fill == LIBRESD_RINGFILE_PAYLOAD) {
+        if (++it->sector == ring->data_sectors) it->sector = 0;
+        it->seq++;
+        it->offset = 0;
+    }
+
+    /* Either the next sector, or the head again to pick up new records */
+    err = ring_iter_load(ring, it);
+    if (err != LIBRESD_OK) return err;
+
+    return (it->offset < it->fill) ? LIBRESD_OK : LIBRESD_ERR_EOF;
+}
+
+/**
+ * @brief Copy (dst != NULL) or skip n stream bytes
+ */
+static libresd_err_t ring_iter_take(libresd_ringfile_t *ring,
+                                    libresd_ringfile_iter_t *it,
+                                    uint8_t *dst, uint32_t n) {
+    while (n > 0) {
+        libresd_err_t err = ring_iter_avail(ring, it);
+        if (err != LIBRESD_OK) return err;
+
+        uint32_t chunk = it->fill - it->offset;
+        if (chunk > n) chunk = n;
+
+        if (dst) {
+            memcpy(dst, it->buf + RS_DATA + it->offset, chunk);
+            dst += chunk;
+        }
+        it->offset += chunk;
+        n -= chunk;
+    }
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Drop a record torn by a power loss (open only)
+ *
+ * Sectors are written as they fill, so the card can hold the start of a
+ * record whose rest was still in the RAM head. The head is moved back to
+ * where that record starts; the header goes first and the sectors behind
+ * the new head are invalidated last, so an interruption just repeats this.
+ */
+static libresd_err_t ring_trim_torn(libresd_ringfile_t *ring) {
+    libresd_ringfile_iter_t it;
+    uint32_t held, back, start_sector, start_seq, old_seq;
+    uint16_t start_offset, first;
+    uint8_t hdr[2];
+    libresd_err_t err;
+
+    /* Last sector that has a record start, newest first */
+    held = ring->wrapped ? ring->data_sectors - 1 : ring->head;
+    it.sector = ring->head;
+    it.seq = ring->head_seq;
+    for (back = 0;; back++) {
+        err = ring_iter_load(ring, &it);
+        if (err == LIBRESD_ERR_EOF) return LIBRESD_OK;
+        if (err != LIBRESD_OK) return err;
+
+        first = READ16(it.buf, RS_FIRST);
+        if (first != RING_NO_RECORD && first < it.fill) break;
+        if (back == held) return LIBRESD_OK;
+
+        it.sector = (it.sector == 0) ? ring->data_sectors - 1 : it.sector - 1;
+        it.seq--;
+    }
+
+    /* Walk its records to the end of the stream */
+    it.offset = first;
+    for (;;) {
+        err = ring_iter_avail(ring, &it);
+        if (err == LIBRESD_ERR_EOF) return LIBRESD_OK;
+        if (err != LIBRESD_OK) return err;
+
+        start_sector = it.sector;
+        start_seq = it.seq;
+        start_offset = it.offset;
+        err = ring_iter_take(ring, &it, hdr, 2);
+        if (err == LIBRESD_OK) err = ring_iter_take(ring, &it, NULL, READ16(hdr, 0));
+        if (err == LIBRESD_ERR_EOF) break;
+        if (err != LIBRESD_OK) return err;
+    }
+
+    /* Torn: the head goes back to where the record starts */
+    old_seq = ring->head_seq;
+    if (start_seq != ring->head_seq) {
+        err = libresd_sd_read_sector(ring->fat->sd, ring_sector(ring, start_sector + 1),
+                                     ring->head_buf);
+        if (err != LIBRESD_OK) return err;
+        ring->head = start_sector;
+        ring->head_seq = start_seq;
+        ring->wrapped = ring->head_seq != ring->head + 1;
+    }
+    ring->head_fill = start_offset;
+    if (READ16(ring->head_buf, RS_FIRST) >= start_offset) {
+        WRITE16(ring->head_buf, RS_FIRST, RING_NO_RECORD);
+    }
+
+    err = ring_write_header(ring);
+    if (err == LIBRESD_OK) err = ring_write_head(ring);
+    if (err != LIBRESD_OK) return err;
+
+    /* Stale sectors would otherwise continue the sequence once the head
+     * moves past them again */
+    memset(it.buf, 0, sizeof(it.buf));
+    it.sector = ring->head;
+    for (it.seq = ring->head_seq + 1; (int32_t)(old_seq - it.seq) >= 0; it.seq++) {
+        if (++it.sector == ring->data_sectors) it.sector = 0;
+        err = libresd_sd_write_sector(ring->fat->sd, ring_sector(ring, it.sector + 1), it.buf);
+        if (err != LIBRESD_OK) return err;
+    }
+    return LIBRESD_OK;
+}
+
+/*============================================================================
+ * RING FILE OPERATIONS
+ *============================================================================*/
+
+libresd_err_t libresd_ringfile_create(libresd_fat_t *fat, libresd_ringfile_t *ring,
+                                       const char *path, uint32_t capacity,
+                                       uint32_t sync_interval) {
+    libresd_file_t file;
+    uint32_t sectors, clusters;
+    libresd_err_t err;
+
+    if (!fat || !ring || !path || capacity == 0) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->sync_interval = sync_interval;
+
+    sectors = 1 + (capacity + LIBRESD_RINGFILE_PAYLOAD - 1) / LIBRESD_RINGFILE_PAYLOAD;
+    if (sectors < 5) sectors = 5;
+    clusters = (sectors + fat->sectors_per_cluster - 1) / fat->sectors_per_cluster;
+    if (clusters > 0xFFFFFFFFUL / fat->cluster_size) return LIBRESD_ERR_INVALID_PARAM;
+
+    err = libresd_fat_open(fat, &file, path,
+                           LIBRESD_WRITE | LIBRESD_CREATE | LIBRESD_TRUNCATE);
+    if (err != LIBRESD_OK) return err;
+
+    err = libresd_fat_preallocate(fat, &file, clusters * fat->cluster_size);
+    if (err != LIBRESD_OK) {
+        libresd_fat_close(fat, &file);
+        return err;
+    }
+
+    err = libresd_fat_close(fat, &file);
+    if (err != LIBRESD_OK) return err;
+
+    err = ring_map(fat, ring, file.first_cluster, file.file_size);
+    if (err != LIBRESD_OK) return err;
+
+    /* Sectors left over from an earlier ring at the same spot must not
+     * pass for ours */
+    ring->id = (libresd_hal_get_ms() * 2654435761UL) ^ fat->volume_serial ^
+               (file.first_cluster << 8);
+    if (ring->id == 0) ring->id = 1;
+
+    ring->head_seq = 1;
+    ring_reset_head(ring);
+
+    /* Only a handle that made it this far is usable */
+    ring->fat = fat;
+    err = ring_write_header(ring);
+    if (err != LIBRESD_OK) ring->fat = NULL;
+    return err;
+}
+
+libresd_err_t libresd_ringfile_open(libresd_fat_t *fat, libresd_ringfile_t *ring,
+                                     const char *path, uint32_t sync_interval) {
+    libresd_fileinfo_t info;
+    libresd_err_t err;
+    uint32_t i;
+
+    if (!fat || !ring || !path) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->sync_interval = sync_interval;
+
+    err = fat_resolve_path(fat, path, NULL, NULL, NULL, &info);
+    if (err != LIBRESD_OK) return err;
+    if (info.attr & LIBRESD_ATTR_DIRECTORY) return LIBRESD_ERR_NOT_FILE;
+
+    err = ring_map(fat, ring, info.first_cluster, info.size);
+    if (err != LIBRESD_OK) return err;
+
+    /* head_buf doubles as scratch for the header */
+    err = libresd_sd_read_sector(fat->sd, ring_sector(ring, 0), ring->head_buf);
+    if (err != LIBRESD_OK) return err;
+
+    if (READ32(ring->head_buf, RH_MAGIC) != RING_MAGIC ||
+        READ16(ring->head_buf, RH_VERSION) != RING_VERSION ||
+        READ16(ring->head_buf, RH_PAYLOAD) != LIBRESD_RINGFILE_PAYLOAD ||
+        READ32(ring->head_buf, RH_DATA_SECTORS) != ring->data_sectors ||
+        READ32(ring->head_buf, RH_HEAD) >= ring->data_sectors) {
+        return LIBRESD_ERR_INVALID_FS;
+    }
+
+    ring->id = READ32(ring->head_buf, RH_ID);
+    ring->head = READ32(ring->head_buf, RH_HEAD);
+    ring->head_seq = READ32(ring->head_buf, RH_HEAD_SEQ);
+    ring->wrapped = (ring->head_buf[RH_FLAGS] & RING_FLAG_WRAPPED) != 0;
+
+    /* The header may lag the data by up to sync_interval sectors: follow
+     * the sequence numbers forward to the real head */
+    for (i = 0; i < ring->data_sectors; i++) {
+        err = libresd_sd_read_sector(fat->sd, ring_sector(ring, ring->head + 1),
+                                     ring->head_buf);
+        if (err != LIBRESD_OK) return err;
+
+        if (!ring_sector_valid(ring, ring->head_buf, ring->head_seq)) {
+            ring_reset_head(ring);
+            break;
+        }
+
+        ring->head_fill = READ16(ring->head_buf, RS_FILL);
+        if (ring->head_fill < LIBRESD_RINGFILE_PAYLOAD) {
+            ring->head_dirty = false;
+            break;
+        }
+
+        ring_step_head(ring);
+        ring->unsynced++;
+    }
+
+    ring->fat = fat;
+    err = ring_trim_torn(ring);
+    if (err != LIBRESD_OK) ring->fat = NULL;
+    return err;
+}
+
+libresd_err_t libresd_ringfile_append(libresd_ringfile_t *ring,
+                                       const void *data, uint16_t len) {
+    uint8_t hdr[2];
+    libresd_err_t err;
+
+    if (!ring || !ring->fat || (!data && len)) return LIBRESD_ERR_INVALID_PARAM;
+
+    /* Keeps a record from wrapping onto its own start */
+    if ((uint32_t)len + 2 > ring->data_sectors * LIBRESD_RINGFILE_PAYLOAD / 4) {
+        return LIBRESD_ERR_INVALID_PARAM;
+    }
+
+    WRITE16(hdr, 0, len);
+    err = ring_emit(ring, hdr, 2, true);
+    if (err != LIBRESD_OK) return err;
+
+    return ring_emit(ring, (const uint8_t *)data, len, false);
+}
+
+libresd_err_t libresd_ringfile_sync(libresd_ringfile_t *ring) {
+    libresd_err_t err;
+    
+    if (!ring || !ring->fat) return LIBRESD_ERR_INVALID_PARAM;
+    
+    if (ring->head_dirty) {
+        err = ring_write_head(ring);
+        if (err != LIBRESD_OK) return err;
+    }
+    
+    return ring_write_header(ring);
+}
+
+libresd_err_t libresd_ringfile_close(libresd_ringfile_t *ring) {
+    libresd_err_t err = libresd_ringfile_sync(ring);
+    
+    if (ring) ring->fat = NULL;
+    return err;
+}
+
+libresd_err_t libresd_ringfile_first(libresd_ringfile_t *ring,
+                                      libresd_ringfile_iter_t *it) {
+    libresd_err_t err;
+    uint32_t first;
+
+    if (!ring || !ring->fat || !it) return LIBRESD_ERR_INVALID_PARAM;
+
+    if (ring->wrapped) {
+        it->sector = ring_tail(ring);
+        it->seq = ring->head_seq - (ring->data_sectors - 1);
+    } else {
+        it->sector = 0;
+        it->seq = ring->head_seq - ring->head;
+    }
+
+    /* The oldest sector may open with the tail of a record whose start
+     * was overwritten - begin at the first record that starts in it */
+    for (;;) {
+        err = ring_iter_load(ring, it);
+        if (err == LIBRESD_ERR_EOF && it->seq != ring->head_seq) {
+            /* Invalidated when open dropped a torn record */
+            first = RING_NO_RECORD;
+            it->fill = LIBRESD_RINGFILE_PAYLOAD;
+        } else if (err != LIBRESD_OK) {
+            return err;
+        } else {
+            first = READ16(it->buf, RS_FIRST);
+        }
+
+        if (first != RING_NO_RECORD) break;
+        if (it->fill < LIBRESD_RINGFILE_PAYLOAD) return LIBRESD_ERR_EOF;
+
+        if (++it->sector == ring->data_sectors) it->sector = 0;
+        it->seq++;
+    }
+
+    it->offset = first;
+    return (it->offset < it->fill) ? LIBRESD_OK : LIBRESD_ERR_EOF;
+}
+
+libresd_err_t libresd_ringfile_next(libresd_ringfile_t *ring,
+                                     libresd_ringfile_iter_t *it,
+                                     void *buf, uint16_t cap, uint16_t *len) {
+    uint8_t hdr[2];
+    uint16_t rec_len, n;
+    libresd_err_t err;
+
+    if (!ring || !ring->fat || !it || (!buf && cap)) return LIBRESD_ERR_INVALID_PARAM;
+
+    err = ring_iter_take(ring, it, hdr, 2);
+    if (err != LIBRESD_OK) return err;
+
+    rec_len = READ16(hdr, 0);
+    n = (rec_len < cap) ? rec_len : cap;
+
+    err = ring_iter_take(ring, it, (uint8_t *)buf, n);
+    if (err != LIBRESD_OK) return err;
+
+    err = ring_iter_take(ring, it, NULL, rec_len - n);
+    if (err != LIBRESD_OK) return err;
+
+    if (len) *len = rec_len;
+    return LIBRESD_OK;
+}
+
+#endif /* LIBRESD_ENABLE_RINGFILE && LIBRESD_ENABLE_WRITE */
@@ -0,0 +1,248 @@
+/**
+ * @file libresd_sched.c
+ * @brief LibreSD Prioritised I/O Scheduler Implementation
+ *
+ * The queue is a plain list in submission order. Each poll walks it once
+ * to pick the request for the next slice; queues stay short (a handful of
+ * clients), so that beats keeping per-class heaps in order.
+ */
+
+#include "libresd_sched.h"
+#include "libresd_hal.h"
+#include <string.h>
+
+#if LIBRESD_ENABLE_SCHED
+
+/*============================================================================
+ * HELPERS
+ *============================================================================*/
+
+static bool sched_expired(const libresd_sched_req_t *req, uint32_t now) {
+    return (int32_t)(now - req->due) >= 0;
+}
+
+/**
+ * @brief Deadline of a request that did not set one
+ */
+static uint32_t sched_default_wait(const libresd_sched_t *sched, uint8_t cls) {
+    switch (cls) {
+        case LIBRESD_SCHED_INTERACTIVE: return sched->max_wait_ms;
+        case LIBRESD_SCHED_NORMAL:      return LIBRESD_SCHED_NORMAL_WAIT_MS;
+        default:                        return LIBRESD_SCHED_BACKGROUND_WAIT_MS;
+    }
+}
+
+/**
+ * @brief Class a request competes in: overdue requests count as interactive
+ */
+static uint8_t sched_class(const libresd_sched_req_t *req, uint32_t now) {
+    return sched_expired(req, now) ? LIBRESD_SCHED_INTERACTIVE : req->cls;
+}
+
+/**
+ * @brief Does a go before b? Ties keep b, the earlier submission
+ */
+static bool sched_before(const libresd_sched_req_t *a, const libresd_sched_req_t *b,
+                         uint32_t now) {
+    uint8_t ca = sched_class(a, now);
+    uint8_t cb = sched_class(b, now);
+    
+    if (ca != cb) return ca < cb;
+    return (int32_t)(a->due - b->due) < 0;
+}
+
+/**
+ * @brief A file request waits for every earlier request on the same file,
+ *        since slices continue at the file position
+ */
+static bool sched_blocked(const libresd_sched_t *sched, const libresd_sched_req_t *req) {
+    const libresd_sched_req_t *r;
+    
+    if (!req->file) return false;
+    for (r = sched->head; r != req; r = r->next) {
+        if (r->file == req->file) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Most urgent request that may run now
+ */
+static libresd_sched_req_t *sched_pick(libresd_sched_t *sched, uint32_t now) {
+    libresd_sched_req_t *best = NULL;
+    libresd_sched_req_t *req;
+    
+    for (req = sched->head; req; req = req->next) {
+        if (sched_blocked(sched, req)) continue;
+        if (!best || sched_before(req, best, now)) best = req;
+    }
+    return best;
+}
+
+static void sched_complete(libresd_sched_t *sched, libresd_sched_req_t *req,
+                           libresd_err_t err) {
+    libresd_sched_class_stats_t *st = &sched->stats.cls[req->cls];
+    libresd_sched_req_t **link = &sched->head;
+    libresd_sched_req_t *prev = NULL;
+    uint32_t now = libresd_hal_get_ms();
+    
+    while (*link != req) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    *link = req->next;
+    if (sched->tail == req) sched->tail = prev;
+    req->next = NULL;
+    sched->stats.depth--;
+    
+    st->completed++;
+    if (now - req->queued_at > st->latency_max_ms) st->latency_max_ms = now - req->queued_at;
+    if ((int32_t)(now - req->due) > 0) st->missed++;
+    
+    req->status = err;
+    if (req->done) req->done(req);
+}
+
+/**
+ * @brief Move up to n bytes of a request
+ */
+static libresd_err_t sched_transfer(libresd_sched_t *sched, libresd_sched_req_t *req,
+                                    uint32_t n, uint32_t *moved) {
+    uint8_t *buf = req->buf + req->transferred;
+    libresd_err_t err;
+    
+    *moved = 0;
+    if (req->file) {
+#if LIBRESD_ENABLE_WRITE
+        if (req->write) return libresd_fat_write(sched->fat, req->file, buf, n, moved);
+#endif
+        err = libresd_fat_read(sched->fat, req->file, buf, n, moved);
+        
+        /* A read that ends on a slice boundary finds the end on the next
+         * slice; that is a normal completion, as one ending mid-slice */
+        return (err == LIBRESD_ERR_EOF) ? LIBRESD_OK : err;
+    }
+    
+#if LIBRESD_ENABLE_WRITE
+    if (req->write) {
+        err = libresd_sd_write_sectors(sched->fat->sd, req->sector + req->transferred / 512,
+                                       buf, n / 512);
+    } else
+#endif
+    {
+        err = libresd_sd_read_sectors(sched->fat->sd, req->sector + req->transferred / 512,
+                                      buf, n / 512);
+    }
+    if (err == LIBRESD_OK) *moved = n;
+    return err;
+}
+
+/*============================================================================
+ * PUBLIC API
+ *============================================================================*/
+
+void libresd_sched_init(libresd_sched_t *sched, libresd_fat_t *fat,
+                        uint32_t slice_bytes, uint32_t max_wait_ms) {
+    if (!sched) return;
+    
+    memset(sched, 0, sizeof(libresd_sched_t));
+    sched->fat = fat;
+    if (slice_bytes == 0) slice_bytes = LIBRESD_SCHED_SLICE;
+    sched->slice_bytes = (slice_bytes < 512) ? 512 : slice_bytes & ~511u;
+    sched->max_wait_ms = max_wait_ms ? max_wait_ms : LIBRESD_SCHED_MAX_WAIT_MS;
+}
+
+libresd_err_t libresd_sched_submit(libresd_sched_t *sched, libresd_sched_req_t *req) {
+    libresd_sched_class_stats_t *st;
+    
+    if (!sched || !sched->fat || !req) return LIBRESD_ERR_INVALID_PARAM;
+    if (req->cls >= LIBRESD_SCHED_CLASSES || (!req->buf && req->len > 0)) {
+        return LIBRESD_ERR_INVALID_PARAM;
+    }
+    if (!req->file && req->len % 512 != 0) return LIBRESD_ERR_INVALID_PARAM;
+#if !LIBRESD_ENABLE_WRITE
+    if (req->write) return LIBRESD_ERR_NOT_SUPPORTED;
+#endif
+    
+    req->next = NULL;
+    req->status = LIBRESD_ERR_BUSY;
+    req->transferred = 0;
+    req->started = false;
+    req->queued_at = libresd_hal_get_ms();
+    req->due = req->queued_at +
+               (req->deadline_ms ? req->deadline_ms : sched_default_wait(sched, req->cls));
+    
+    if (sched->tail) {
+        sched->tail->next = req;
+    } else {
+        sched->head = req;
+    }
+    sched->tail = req;
+    
+    st = &sched->stats.cls[req->cls];
+    st->submitted++;
+    if (++sched->stats.depth > sched->stats.depth_max) sched->stats.depth_max = sched->stats.depth;
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_sched_poll(libresd_sched_t *sched) {
+    libresd_sched_class_stats_t *st;
+    libresd_sched_req_t *req;
+    libresd_err_t err;
+    uint32_t now, wait, n, moved;
+    
+    if (!sched) return LIBRESD_ERR_INVALID_PARAM;
+    
+    now = libresd_hal_get_ms();
+    req = sched_pick(sched, now);
+    if (!req) return LIBRESD_ERR_EOF;
+    
+    st = &sched->stats.cls[req->cls];
+    if (!req->started) {
+        req->started = true;
+        wait = now - req->queued_at;
+        st->wait_total_ms += wait;
+        if (wait > st->wait_max_ms) st->wait_max_ms = wait;
+    }
+    
+    n = req->len - req->transferred;
+    if (n > sched->slice_bytes) n = sched->slice_bytes;
+    
+    err = sched_transfer(sched, req, n, &moved);
+    req->transferred += moved;
+    st->slices++;
+    st->bytes += moved;
+    
+    /* Done, failed, or a read that hit the end of the file */
+    if (err != LIBRESD_OK || moved < n || req->transferred == req->len) {
+        if (err == LIBRESD_OK && moved < n && req->write) err = LIBRESD_ERR_FULL;
+        sched_complete(sched, req, err);
+    }
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_sched_wait(libresd_sched_t *sched, libresd_sched_req_t *req) {
+    if (!sched || !req) return LIBRESD_ERR_INVALID_PARAM;
+    
+    while (req->status == LIBRESD_ERR_BUSY) {
+        if (libresd_sched_poll(sched) != LIBRESD_OK) break;
+    }
+    return req->status;
+}
+
+void libresd_sched_get_stats(const libresd_sched_t *sched, libresd_sched_stats_t *stats) {
+    if (sched && stats) *stats = sched->stats;
+}
+
+void libresd_sched_reset_stats(libresd_sched_t *sched) {
+    uint32_t depth;
+    
+    if (!sched) return;
+    
+    depth = sched->stats.depth;
+    memset(&sched->stats, 0, sizeof(sched->stats));
+    sched->stats.depth = depth;
+    sched->stats.depth_max = depth;
+}
+
+#endif /* LIBRESD_ENABLE_SCHED */
@@ -148,7 +148,8 @@ libresd_err_t libresd_sd_init(libresd_sd_t *sd, uint32_t fast_speed_hz) {
     }
     
     /* Initialize SPI at slow speed (400kHz) */
-    sd->spi_speed = libresd_hal_spi_init(LIBRESD_SPI_INIT_HZ);
+    libresd_hal_spi_init(LIBRESD_SPI_INIT_HZ);
+    sd->spi_speed = LIBRESD_SPI_INIT_HZ;
     LIBRESD_DEBUG_PRINTF("SPI init at %lu Hz", sd->spi_speed);
     
     /* Send 80+ clock pulses with CS high to wake up card */
@@ -314,7 +315,8 @@ libresd_err_t libresd_sd_init(libresd_sd_t *sd, uint32_t fast_speed_hz) {
     uint32_t target_speed = fast_speed_hz ? fast_speed_hz : LIBRESD_SPI_FAST_HZ;
     if (target_speed > LIBRESD_SPI_MAX_HZ) target_speed = LIBRESD_SPI_MAX_HZ;
     
-    sd->spi_speed = libresd_hal_spi_init(target_speed);
+    libresd_hal_spi_init(target_speed);
+    sd->spi_speed = target_speed;
     LIBRESD_DEBUG_PRINTF("SPI speed: %lu Hz", sd->spi_speed);
     
     sd->initialized = true;
@@ -485,8 +487,12 @@ libresd_err_t libresd_sd_write_sector(libresd_sd_t *sd, uint32_t sector,
     return LIBRESD_OK;
 }
 
-libresd_err_t libresd_sd_write_sectors(libresd_sd_t *sd, uint32_t sector,
-                                        const uint8_t *buffer, uint32_t count) {
+/**
+ * @brief CMD25 write of count blocks, stepping stride bytes through buffer
+ *        (stride 0 sends the same block each time)
+ */
+static libresd_err_t sd_write_multi(libresd_sd_t *sd, uint32_t sector, const uint8_t *buffer,
+                                    uint32_t stride, uint32_t count) {
     uint8_t r1, response;
     libresd_err_t err = LIBRESD_OK;
     
@@ -520,7 +526,7 @@ libresd_err_t libresd_sd_write_sectors(libresd_sd_t *sd, uint32_t sector,
         libresd_hal_spi_transfer(SD_TOKEN_MULTI_W);
         
         /* Send data */
-        libresd_hal_spi_transfer_bulk(buffer + (i * 512), NULL, 512);
+        libresd_hal_spi_transfer_bulk(buffer + i * stride, NULL, 512);
         
         /* Dummy CRC */
         libresd_hal_spi_transfer(0xFF);
@@ -555,6 +561,16 @@ libresd_err_t libresd_sd_write_sectors(libresd_sd_t *sd, uint32_t sector,
     return err;
 }
 
+libresd_err_t libresd_sd_write_sectors(libresd_sd_t *sd, uint32_t sector,
+                                        const uint8_t *buffer, uint32_t count) {
+    return sd_write_multi(sd, sector, buffer, 512, count);
+}
+
+libresd_err_t libresd_sd_fill_sectors(libresd_sd_t *sd, uint32_t sector,
+                                       const uint8_t *block, uint32_t count) {
+    return sd_write_multi(sd, sector, block, 0, count);
+}
+
 libresd_err_t libresd_sd_erase(libresd_sd_t *sd, uint32_t start_sector,
                                 uint32_t end_sector) {
     uint8_t r1;
@@ -622,7 +638,8 @@ uint32_t libresd_sd_set_speed(libresd_sd_t *sd, uint32_t speed_hz) {
         speed_hz = LIBRESD_SPI_MAX_HZ;
     }
     
-    sd->spi_speed = libresd_hal_spi_init(speed_hz);
+    libresd_hal_spi_init(speed_hz);
+    sd->spi_speed = speed_hz;
     return sd->spi_speed;
 }
 
@@ -0,0 +1,264 @@
+/**
+ * @file libresd_segpool.c
+ * @brief LibreSD Segment File Pool Implementation
+ */
+
+#include "libresd_segpool.h"
+#include <stdio.h>
+#include <string.h>
+
+#if LIBRESD_ENABLE_SEGPOOL && LIBRESD_ENABLE_WRITE
+
+/*============================================================================
+ * HELPERS
+ *============================================================================*/
+
+/**
+ * @brief Pattern holds exactly one %u (with optional 0 flag and width)
+ */
+static bool segpool_pattern_ok(const char *p) {
+    uint32_t conversions = 0;
+    
+    for (; *p; p++) {
+        if (*p != '%') continue;
+        if (p[1] == '%') {
+            p++;
+            continue;
+        }
+        p++;
+        if (*p == '0') p++;
+        while (*p >= '0' && *p <= '9') p++;
+        if (*p != 'u') return false;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+static libresd_err_t segpool_path(const libresd_segpool_t *pool, uint32_t seq,
+                                  char *path) {
+    int n = snprintf(path, LIBRESD_MAX_PATH, pool->pattern, (unsigned int)seq);
+    
+    if (n < 0 || n >= LIBRESD_MAX_PATH) return LIBRESD_ERR_PATH_TOO_LONG;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Point a directory entry at first (size 0), or delete it
+ */
+static libresd_err_t segpool_set_entry(libresd_fat_t *fat, uint32_t dir_sector,
+                                       uint16_t dir_offset, uint32_t first, bool remove) {
+    fat_dirent_t *entry = (fat_dirent_t *)(fat->dir_buffer + dir_offset);
+    libresd_err_t err;
+    
+    if (remove) return fat_dirent_remove(fat, dir_sector, dir_offset);
+    
+    err = libresd_sd_read_sector(fat->sd, dir_sector, fat->dir_buffer);
+    if (err != LIBRESD_OK) return err;
+    
+    entry->cluster_hi = (first >> 16) & 0xFFFF;
+    entry->cluster_lo = first & 0xFFFF;
+    entry->file_size = 0;
+    fat_snapshot_touch(fat, dir_sector);
+    return libresd_sd_write_sector(fat->sd, dir_sector, fat->dir_buffer);
+}
+
+/**
+ * @brief New chain of count clusters, one run if there is room for it
+ */
+static uint32_t segpool_alloc(libresd_fat_t *fat, uint32_t count) {
+    uint32_t first = libresd_fat_alloc_contiguous(fat, 0, count);
+    uint32_t last = 0, cluster;
+    
+    if (first != 0) return first;
+    
+    /* No run that long - take clusters wherever they are */
+    while (count--) {
+        cluster = libresd_fat_alloc_cluster(fat, last);
+        if (cluster == 0) {
+            if (first != 0) libresd_fat_free_chain(fat, first);
+            return 0;
+        }
+        if (first == 0) first = cluster;
+        last = cluster;
+    }
+    return first;
+}
+
+/**
+ * @brief Create (or take over) the file for seq and give it its run
+ */
+static libresd_err_t segpool_create(libresd_segpool_t *pool, uint32_t seq,
+                                    libresd_segpool_slot_t *slot) {
+    libresd_fat_t *fat = pool->fat;
+    fat_dirent_t entry;
+    char path[LIBRESD_MAX_PATH];
+    uint32_t need;
+    libresd_err_t err;
+    
+    err = segpool_path(pool, seq, path);
+    if (err != LIBRESD_OK) return err;
+    
+    slot->seq = seq;
+    err = fat_lookup(fat, path, strlen(path), &entry, &slot->dir_sector,
+                     &slot->dir_offset, NULL);
+    if (err == LIBRESD_OK) {
+        if ((entry.attr & LIBRESD_ATTR_DIRECTORY) || entry.file_size != 0) {
+            return LIBRESD_ERR_EXISTS;
+        }
+        slot->first_cluster = fat_dirent_cluster(&entry);
+        if (slot->first_cluster >= 2) return LIBRESD_OK;
+    } else if (err == LIBRESD_ERR_NOT_FOUND) {
+        err = libresd_fat_create_file(fat, path, 0, &slot->dir_sector, &slot->dir_offset);
+        if (err != LIBRESD_OK) return err;
+    } else {
+        return err;
+    }
+    
+    /* The run must be in the FAT before the entry points at it */
+    need = (pool->segment_bytes + fat->cluster_size - 1) / fat->cluster_size;
+    slot->first_cluster = segpool_alloc(fat, need);
+    err = (slot->first_cluster != 0) ? libresd_fat_sync(fat) : LIBRESD_ERR_FULL;
+    if (err == LIBRESD_OK) {
+        err = segpool_set_entry(fat, slot->dir_sector, slot->dir_offset,
+                                slot->first_cluster, false);
+    }
+    if (err != LIBRESD_OK) {
+        if (slot->first_cluster != 0) libresd_fat_free_chain(fat, slot->first_cluster);
+        segpool_set_entry(fat, slot->dir_sector, slot->dir_offset, 0, true);
+        libresd_fat_sync(fat);
+    }
+    return err;
+}
+
+/*============================================================================
+ * PUBLIC API
+ *============================================================================*/
+
+libresd_err_t libresd_segpool_init(libresd_segpool_t *pool, libresd_fat_t *fat,
+                                   const char *pattern, uint32_t first_seq,
+                                   uint32_t segment_bytes, uint8_t depth) {
+    if (!pool || !fat || !pattern || segment_bytes == 0) return LIBRESD_ERR_INVALID_PARAM;
+    if (depth == 0 || depth > LIBRESD_SEGPOOL_MAX) return LIBRESD_ERR_INVALID_PARAM;
+    if (!segpool_pattern_ok(pattern)) return LIBRESD_ERR_INVALID_PARAM;
+    
+    memset(pool, 0, sizeof(libresd_segpool_t));
+    pool->fat = fat;
+    pool->pattern = pattern;
+    pool->segment_bytes = segment_bytes;
+    pool->next_seq = first_seq;
+    pool->depth = depth;
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_segpool_fill(libresd_segpool_t *pool) {
+    libresd_segpool_slot_t *slot;
+    libresd_err_t err;
+    
+    if (!pool || !pool->fat) return LIBRESD_ERR_INVALID_PARAM;
+    if (!pool->fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+    if (pool->count >= pool->depth) return LIBRESD_ERR_EOF;
+    
+    slot = &pool->slot[(pool->head + pool->count) % LIBRESD_SEGPOOL_MAX];
+    err = segpool_create(pool, pool->next_seq, slot);
+    if (err != LIBRESD_OK) return err;
+    
+    pool->next_seq++;
+    pool->count++;
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_segpool_next(libresd_segpool_t *pool, libresd_file_t *file,
+                                   uint32_t *seq) {
+    libresd_segpool_slot_t *slot;
+    libresd_err_t err;
+    
+    if (!pool || !pool->fat || !file) return LIBRESD_ERR_INVALID_PARAM;
+    
+    if (pool->count == 0) {
+        err = libresd_segpool_fill(pool);
+        if (err != LIBRESD_OK) return err;
+        pool->misses++;
+    }
+    
+    slot = &pool->slot[pool->head];
+    pool->head = (pool->head + 1) % LIBRESD_SEGPOOL_MAX;
+    pool->count--;
+    pool->handoffs++;
+    
+    /* What libresd_fat_open would have found in the entry */
+    memset(file, 0, sizeof(libresd_file_t));
+    file->buffer_sector = 0xFFFFFFFF;
+    file->first_cluster = slot->first_cluster;
+    file->current_cluster = slot->first_cluster;
+    file->dir_sector = slot->dir_sector;
+    file->dir_offset = slot->dir_offset;
+    file->mode = LIBRESD_READ | LIBRESD_WRITE;
+    file->is_open = true;
+    
+    if (seq) *seq = slot->seq;
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_segpool_close(libresd_segpool_t *pool, libresd_file_t *file) {
+    libresd_fat_t *fat;
+    uint32_t keep, last, next, k, eoc;
+    libresd_err_t err;
+    
+    if (!pool || !pool->fat || !file) return LIBRESD_ERR_INVALID_PARAM;
+    fat = pool->fat;
+    
+    err = libresd_fat_close(fat, file);
+    if (err != LIBRESD_OK) return err;
+    if (file->first_cluster < 2) return LIBRESD_OK;
+    
+    /* An empty segment drops its whole run, the entry first */
+    keep = (file->file_size + fat->cluster_size - 1) / fat->cluster_size;
+    if (keep == 0) {
+        err = segpool_set_entry(fat, file->dir_sector, file->dir_offset, 0, false);
+        if (err == LIBRESD_OK) err = libresd_fat_free_chain(fat, file->first_cluster);
+        if (err != LIBRESD_OK) return err;
+        file->first_cluster = 0;
+        return libresd_fat_sync(fat);
+    }
+    
+    switch (fat->fs_type) {
+        case LIBRESD_FS_FAT12: eoc = 0x0FFF; break;
+        case LIBRESD_FS_FAT16: eoc = 0xFFFF; break;
+        default: eoc = 0x0FFFFFFF; break;
+    }
+    
+    last = file->first_cluster;
+    for (k = 1; k < keep && last >= 2; k++) last = libresd_fat_next_cluster(fat, last);
+    next = (last >= 2) ? libresd_fat_next_cluster(fat, last) : 0;
+    if (next >= 2) {
+        err = libresd_fat_write_entry(fat, last, eoc);
+        if (err == LIBRESD_OK) err = libresd_fat_free_chain(fat, next);
+        if (err != LIBRESD_OK) return err;
+    }
+    return libresd_fat_sync(fat);
+}
+
+libresd_err_t libresd_segpool_trim(libresd_segpool_t *pool) {
+    libresd_segpool_slot_t *slot;
+    libresd_err_t err = LIBRESD_OK;
+    
+    if (!pool || !pool->fat) return LIBRESD_ERR_INVALID_PARAM;
+    
+    /* Newest first, so a failure leaves the series without a gap */
+    while (pool->count > 0 && err == LIBRESD_OK) {
+        slot = &pool->slot[(pool->head + pool->count - 1) % LIBRESD_SEGPOOL_MAX];
+        err = segpool_set_entry(pool->fat, slot->dir_sector, slot->dir_offset, 0, true);
+        if (err == LIBRESD_OK && slot->first_cluster >= 2) {
+            err = libresd_fat_free_chain(pool->fat, slot->first_cluster);
+        }
+        if (err == LIBRESD_OK) {
+            pool->next_seq = slot->seq;
+            pool->count--;
+        }
+    }
+    
+    if (err == LIBRESD_OK) err = libresd_fat_sync(pool->fat);
+    return err;
+}
+
+#endif /* LIBRESD_ENABLE_SEGPOOL && LIBRESD_ENABLE_WRITE */
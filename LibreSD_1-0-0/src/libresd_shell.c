@@ -12,6 +12,10 @@
 #include <stdarg.h>
 #include <stdlib.h>
 
+#if LIBRESD_SHELL_IO_SIZE < 16
+#error "LIBRESD_SHELL_IO_SIZE must hold at least one hexdump line (16 bytes)"
+#endif
+
 /*============================================================================
  * INTERNAL HELPERS
  *============================================================================*/
@@ -21,9 +25,26 @@ static void default_print(const char *str) {
     printf("%s", str);
 }
 
+/* Raw output into the sink buffer (binary-safe), flushing as it fills */
+static void sink_write(libresd_shell_t *shell, const char *data, uint32_t len) {
+    uint32_t n;
+    
+    while (len > 0) {
+        if (shell->out_len == shell->out_size) libresd_shell_flush(shell);
+        n = shell->out_size - shell->out_len;
+        if (n > len) n = len;
+        memcpy(shell->out_buf + shell->out_len, data, n);
+        shell->out_len += n;
+        data += n;
+        len -= n;
+    }
+}
+
 /* Print wrapper */
 static void shell_print(libresd_shell_t *shell, const char *str) {
-    if (shell->print) {
+    if (shell->write) {
+        sink_write(shell, str, strlen(str));
+    } else if (shell->print) {
         shell->print(str);
     } else {
         default_print(str);
@@ -34,6 +55,28 @@ static void shell_print(libresd_shell_t *shell, const char *str) {
 static void shell_printf(libresd_shell_t *shell, const char *fmt, ...) {
     char buf[256];
     va_list args;
+    int n;
+    
+    /* Format in place in the sink buffer when the result fits */
+    if (shell->write) {
+        va_start(args, fmt);
+        n = vsnprintf(shell->out_buf + shell->out_len, shell->out_size - shell->out_len,
+                      fmt, args);
+        va_end(args);
+        if (n >= 0 && (uint32_t)n < shell->out_size - shell->out_len) {
+            shell->out_len += n;
+            return;
+        }
+        libresd_shell_flush(shell);
+        if (n >= 0 && (uint32_t)n < shell->out_size) {
+            va_start(args, fmt);
+            vsnprintf(shell->out_buf, shell->out_size, fmt, args);
+            va_end(args);
+            shell->out_len = n;
+            return;
+        }
+    }
+    
     va_start(args, fmt);
     vsnprintf(buf, sizeof(buf), fmt, args);
     va_end(args);
@@ -43,6 +86,7 @@ static void shell_printf(libresd_shell_t *shell, const char *fmt, ...) {
 /* Error print */
 static void shell_error(libresd_shell_t *shell, const char *str) {
     if (shell->error) {
+        libresd_shell_flush(shell);     /* Keep it after the output before it */
         shell->error(str);
     } else {
         shell_print(shell, str);
@@ -69,29 +113,6 @@ static void format_datetime(libresd_datetime_t *dt, char *buf, size_t bufsize) {
              dt->hour, dt->minute);
 }
 
-/* Simple glob match */
-static bool glob_match(const char *pattern, const char *str) {
-    while (*pattern && *str) {
-        if (*pattern == '*') {
-            pattern++;
-            if (*pattern == '\0') return true;
-            while (*str) {
-                if (glob_match(pattern, str)) return true;
-                str++;
-            }
-            return false;
-        }
-        if (*pattern == '?' || tolower(*pattern) == tolower(*str)) {
-            pattern++;
-            str++;
-        } else {
-            return false;
-        }
-    }
-    while (*pattern == '*') pattern++;
-    return *pattern == '\0' && *str == '\0';
-}
-
 /*============================================================================
  * INITIALIZATION
  *============================================================================*/
@@ -115,6 +136,26 @@ void libresd_shell_set_output(libresd_shell_t *shell, void (*print)(const char *
     }
 }
 
+void libresd_shell_set_sink(libresd_shell_t *shell,
+                            void (*write)(const char *data, uint32_t len),
+                            char *buf, uint32_t size) {
+    if (!shell) return;
+    
+    libresd_shell_flush(shell);
+    if (!buf || size == 0) write = NULL;
+    shell->write = write;
+    shell->out_buf = write ? buf : NULL;
+    shell->out_size = write ? size : 0;
+    shell->out_len = 0;
+}
+
+void libresd_shell_flush(libresd_shell_t *shell) {
+    if (shell && shell->write && shell->out_len > 0) {
+        shell->write(shell->out_buf, shell->out_len);
+        shell->out_len = 0;
+    }
+}
+
 /*============================================================================
  * DIRECTORY COMMANDS
  *============================================================================*/
@@ -245,11 +286,50 @@ libresd_err_t libresd_shell_rmdir(libresd_shell_t *shell, const char *path) {
  * FILE COMMANDS
  *============================================================================*/
 
+/**
+ * @brief Copy up to limit bytes of an open file to the output
+ *
+ * With a sink the file is read straight into its buffer, as many whole
+ * sectors per read as fit; otherwise through a stack buffer and print
+ * (which stops at NUL bytes, as it always did).
+ */
+static void shell_stream(libresd_shell_t *shell, libresd_file_t *file, uint32_t limit) {
+    uint32_t total = 0;
+    uint32_t to_read, bytes_read;
+    
+    while (total < limit) {
+        if (shell->write) {
+            if (shell->out_size - shell->out_len < LIBRESD_SECTOR_SIZE && shell->out_len > 0) {
+                libresd_shell_flush(shell);
+            }
+            to_read = shell->out_size - shell->out_len;
+            if (to_read > limit - total) to_read = limit - total;
+            
+            if (libresd_fat_read(shell->fat, file, shell->out_buf + shell->out_len, to_read,
+                                 &bytes_read) != LIBRESD_OK || bytes_read == 0) {
+                break;
+            }
+            shell->out_len += bytes_read;
+        } else {
+            uint8_t buf[LIBRESD_SHELL_IO_SIZE + 1];
+    
+            to_read = sizeof(buf) - 1;
+            if (to_read > limit - total) to_read = limit - total;
+            
+            if (libresd_fat_read(shell->fat, file, buf, to_read, &bytes_read) != LIBRESD_OK ||
+                bytes_read == 0) {
+                break;
+            }
+            buf[bytes_read] = '\0';
+            shell_print(shell, (char *)buf);
+        }
+        total += bytes_read;
+    }
+}
+
 libresd_err_t libresd_shell_cat(libresd_shell_t *shell, const char *path) {
     libresd_file_t file;
     libresd_err_t err;
-    uint8_t buf[128];
-    uint32_t bytes_read;
     
     if (!shell || !shell->fat || !path) return LIBRESD_ERR_INVALID_PARAM;
     
@@ -259,11 +339,7 @@ libresd_err_t libresd_shell_cat(libresd_shell_t *shell, const char *path) {
         return err;
     }
     
-    while (libresd_fat_read(shell->fat, &file, buf, sizeof(buf) - 1, &bytes_read) == LIBRESD_OK 
-           && bytes_read > 0) {
-        buf[bytes_read] = '\0';
-        shell_print(shell, (char *)buf);
-    }
+    shell_stream(shell, &file, 0xFFFFFFFF);
     
     shell_print(shell, "\n");
     libresd_fat_close(shell->fat, &file);
@@ -274,9 +350,6 @@ libresd_err_t libresd_shell_cat(libresd_shell_t *shell, const char *path) {
 libresd_err_t libresd_shell_head(libresd_shell_t *shell, const char *path, uint32_t bytes) {
     libresd_file_t file;
     libresd_err_t err;
-    uint8_t buf[128];
-    uint32_t bytes_read;
-    uint32_t total = 0;
     
     if (!shell || !shell->fat || !path) return LIBRESD_ERR_INVALID_PARAM;
     if (bytes == 0) bytes = 1024;
@@ -287,17 +360,7 @@ libresd_err_t libresd_shell_head(libresd_shell_t *shell, const char *path, uint3
         return err;
     }
     
-    while (total < bytes) {
-        uint32_t to_read = sizeof(buf) - 1;
-        if (to_read > bytes - total) to_read = bytes - total;
-        
-        err = libresd_fat_read(shell->fat, &file, buf, to_read, &bytes_read);
-        if (err != LIBRESD_OK || bytes_read == 0) break;
-        
-        buf[bytes_read] = '\0';
-        shell_print(shell, (char *)buf);
-        total += bytes_read;
-    }
+    shell_stream(shell, &file, bytes);
     
     shell_print(shell, "\n");
     libresd_fat_close(shell->fat, &file);
@@ -305,12 +368,55 @@ libresd_err_t libresd_shell_head(libresd_shell_t *shell, const char *path, uint3
     return LIBRESD_OK;
 }
 
+/* Longest hexdump line: address, 16 bytes, ASCII column */
+#define HEXDUMP_LINE_MAX    80
+
+static const char hex_digits[16] = {
+    '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+/**
+ * @brief Format one hexdump line ("%08X  " + "%02X " x 16 + " |ascii|\n")
+ *
+ * @return Line length (not terminated)
+ */
+static uint32_t hexdump_line(char *out, uint32_t addr, const uint8_t *data, uint32_t n) {
+    char *p = out;
+    uint32_t i;
+    
+    for (i = 0; i < 8; i++) *p++ = hex_digits[(addr >> (28 - 4 * i)) & 0xF];
+    *p++ = ' ';
+    *p++ = ' ';
+    
+    for (i = 0; i < 16; i++) {
+        if (i < n) {
+            *p++ = hex_digits[data[i] >> 4];
+            *p++ = hex_digits[data[i] & 0xF];
+        } else {
+            *p++ = ' ';
+            *p++ = ' ';
+        }
+        *p++ = ' ';
+        if (i == 7) *p++ = ' ';
+    }
+    
+    *p++ = ' ';
+    *p++ = '|';
+    for (i = 0; i < n; i++) {
+        *p++ = (data[i] >= 32 && data[i] < 127) ? (char)data[i] : '.';
+    }
+    *p++ = '|';
+    *p++ = '\n';
+    return (uint32_t)(p - out);
+}
+
 libresd_err_t libresd_shell_hexdump(libresd_shell_t *shell, const char *path,
                                      uint32_t offset, uint32_t length) {
     libresd_file_t file;
     libresd_err_t err;
-    uint8_t buf[16];
-    uint32_t bytes_read;
+    uint8_t buf[LIBRESD_SHELL_IO_SIZE];
+    char line[HEXDUMP_LINE_MAX + 1];
+    uint32_t bytes_read, i, n, len;
     uint32_t addr = offset;
     uint32_t total = 0;
     
@@ -328,34 +434,25 @@ libresd_err_t libresd_shell_hexdump(libresd_shell_t *shell, const char *path,
     }
     
     while (total < length) {
-        uint32_t to_read = 16;
+        uint32_t to_read = sizeof(buf) & ~15u;
         if (to_read > length - total) to_read = length - total;
         
         err = libresd_fat_read(shell->fat, &file, buf, to_read, &bytes_read);
         if (err != LIBRESD_OK || bytes_read == 0) break;
         
-        /* Print address */
-        shell_printf(shell, "%08X  ", addr);
-        
-        /* Print hex bytes */
-        for (uint32_t i = 0; i < 16; i++) {
-            if (i < bytes_read) {
-                shell_printf(shell, "%02X ", buf[i]);
+        /* Lines go straight into the sink buffer when there is one */
+        for (i = 0; i < bytes_read; i += 16) {
+            n = (bytes_read - i < 16) ? bytes_read - i : 16;
+            if (shell->write && shell->out_size >= HEXDUMP_LINE_MAX) {
+                if (shell->out_size - shell->out_len < HEXDUMP_LINE_MAX) libresd_shell_flush(shell);
+                shell->out_len += hexdump_line(shell->out_buf + shell->out_len, addr, buf + i, n);
             } else {
-                shell_print(shell, "   ");
+                len = hexdump_line(line, addr, buf + i, n);
+                line[len] = '\0';
+                shell_print(shell, line);
             }
-            if (i == 7) shell_print(shell, " ");
-        }
-        
-        /* Print ASCII */
-        shell_print(shell, " |");
-        for (uint32_t i = 0; i < bytes_read; i++) {
-            char c = (buf[i] >= 32 && buf[i] < 127) ? buf[i] : '.';
-            shell_printf(shell, "%c", c);
+            addr += n;
         }
-        shell_print(shell, "|\n");
-        
-        addr += bytes_read;
         total += bytes_read;
     }
     
@@ -548,6 +645,87 @@ libresd_err_t libresd_shell_df(libresd_shell_t *shell) {
     return LIBRESD_OK;
 }
 
+#if LIBRESD_ENABLE_CHECK
+libresd_err_t libresd_shell_fsck(libresd_shell_t *shell, bool repair) {
+    static uint8_t work[LIBRESD_SHELL_FSCK_WORK];
+    libresd_check_t r;
+    libresd_err_t err;
+    
+    if (!shell || !shell->fat) return LIBRESD_ERR_INVALID_PARAM;
+    
+    err = libresd_fat_check(shell->fat, repair ? LIBRESD_CHECK_REPAIR : 0,
+                            work, sizeof(work), &r);
+    if (err != LIBRESD_OK) {
+        shell_error(shell, err == LIBRESD_ERR_NOT_SUPPORTED ?
+                    "Error: Directory tree too deep\n" : "Error: Check failed\n");
+        return err;
+    }
+    
+    shell_printf(shell, "%lu files, %lu directories, %lu clusters used, %lu free (%lu pass%s)\n",
+                 (unsigned long)r.files, (unsigned long)r.dirs,
+                 (unsigned long)r.used_clusters, (unsigned long)r.free_clusters,
+                 (unsigned long)r.passes, r.passes == 1 ? "" : "es");
+    if (r.lost_clusters) {
+        shell_printf(shell, "Lost clusters:      %lu\n", (unsigned long)r.lost_clusters);
+    }
+    if (r.cross_links) {
+        shell_printf(shell, "Cross-linked:       %lu\n", (unsigned long)r.cross_links);
+    }
+    if (r.bad_chains) {
+        shell_printf(shell, "Broken chains:      %lu\n", (unsigned long)r.bad_chains);
+    }
+    if (r.size_mismatches) {
+        shell_printf(shell, "Size mismatches:    %lu\n", (unsigned long)r.size_mismatches);
+    }
+    if (r.preallocated) {
+        shell_printf(shell, "Preallocated files: %lu\n", (unsigned long)r.preallocated);
+    }
+    if (r.free_count_was != 0xFFFFFFFF && r.free_count_was != r.free_clusters) {
+        shell_printf(shell, "Free count was %lu, corrected to %lu\n",
+                     (unsigned long)r.free_count_was, (unsigned long)r.free_clusters);
+    }
+    if (r.fsinfo_free != 0xFFFFFFFF && r.fsinfo_free != r.free_clusters) {
+        shell_printf(shell, "FSInfo free count %lu%s\n", (unsigned long)r.fsinfo_free,
+                     repair ? ", corrected" : ", wrong");
+    }
+    if (repair) {
+        shell_printf(shell, "%lu repairs written\n", (unsigned long)r.repaired);
+    } else if (r.lost_clusters || r.cross_links || r.bad_chains || r.size_mismatches) {
+        shell_print(shell, "Run 'fsck -r' to repair\n");
+    } else {
+        shell_print(shell, "Volume is clean\n");
+    }
+    
+    return LIBRESD_OK;
+}
+#endif
+
+#if LIBRESD_ENABLE_DEFRAG && LIBRESD_ENABLE_WRITE
+libresd_err_t libresd_shell_defrag(libresd_shell_t *shell, const char *path) {
+    static uint8_t copy[8 * LIBRESD_SECTOR_SIZE];
+    libresd_defrag_t df;
+    libresd_err_t err;
+    
+    if (!shell || !shell->fat) return LIBRESD_ERR_INVALID_PARAM;
+    
+    memset(&df, 0, sizeof(df));
+    do {
+        err = libresd_fat_defrag(shell->fat, &df, path, 256, copy, sizeof(copy));
+    } while (err == LIBRESD_OK);
+    if (err != LIBRESD_ERR_EOF) {
+        shell_error(shell, "Error: Defragment failed\n");
+        return err;
+    }
+    
+    shell_printf(shell, "%lu files, %lu directories: %lu extents before, %lu after\n",
+                 (unsigned long)df.files, (unsigned long)df.dirs,
+                 (unsigned long)df.extents_before, (unsigned long)df.extents_after);
+    shell_printf(shell, "%lu moved, %lu left fragmented\n",
+                 (unsigned long)df.moved, (unsigned long)df.skipped);
+    return LIBRESD_OK;
+}
+#endif
+
 libresd_err_t libresd_shell_sdinfo(libresd_shell_t *shell) {
     if (!shell || !shell->sd || !shell->fat) return LIBRESD_ERR_INVALID_PARAM;
     
@@ -556,7 +734,7 @@ libresd_err_t libresd_shell_sdinfo(libresd_shell_t *shell) {
     char size_buf[16];
     
     shell_print(shell, "=== SD Card Information ===\n");
-    shell_printf(shell, "Card Type: %s\n", libresd_sd_type_str(sd->card_type));
+    shell_printf(shell, "Card Type: %s\n", libresd_sd_type_str(sd->type));
     
     format_size(sd->capacity, size_buf, sizeof(size_buf), shell->human_readable);
     shell_printf(shell, "Capacity: %s\n", size_buf);
@@ -582,49 +760,65 @@ libresd_err_t libresd_shell_sdinfo(libresd_shell_t *shell) {
     return LIBRESD_OK;
 }
 
-libresd_err_t libresd_shell_find(libresd_shell_t *shell, const char *path,
-                                  const char *pattern) {
-    /* Simple recursive find - limited depth to avoid stack overflow */
+/**
+ * @brief Walk one directory for find
+ *
+ * path holds len characters and is extended in place for each entry, so
+ * the whole walk shares one path buffer.
+ */
+static libresd_err_t find_recursive(libresd_shell_t *shell, char *path, uint32_t len,
+                                    const libresd_fat_glob_t *glob) {
     libresd_dir_t dir;
     libresd_fileinfo_t info;
+    uint32_t name_len;
     libresd_err_t err;
-    char full_path[LIBRESD_MAX_PATH];
     
-    if (!shell || !shell->fat || !pattern) return LIBRESD_ERR_INVALID_PARAM;
-    if (!path) path = "/";
-    
-    err = libresd_fat_opendir(shell->fat, &dir, path);
+    err = libresd_fat_opendir(shell->fat, &dir, len ? path : "/");
     if (err != LIBRESD_OK) return err;
     
-    while (libresd_fat_readdir(shell->fat, &dir, &info) == LIBRESD_OK) {
-        /* Skip . and .. */
-        if (info.name[0] == '.' && (info.name[1] == '\0' || 
-            (info.name[1] == '.' && info.name[2] == '\0'))) {
-            continue;
-        }
+    /* Only matches and directories get decoded; the rest is rejected on raw entries */
+    while (libresd_fat_readdir_glob(shell->fat, &dir, glob, LIBRESD_GLOB_DIRS,
+                                    &info) == LIBRESD_OK) {
+        name_len = strlen(info.name);
+        if (len + 1 + name_len >= LIBRESD_MAX_PATH) continue;
+        path[len] = '/';
+        memcpy(path + len + 1, info.name, name_len + 1);
         
-        /* Build full path */
-        if (strcmp(path, "/") == 0) {
-            snprintf(full_path, sizeof(full_path), "/%s", info.name);
-        } else {
-            snprintf(full_path, sizeof(full_path), "%s/%s", path, info.name);
+        if (!(info.attr & LIBRESD_ATTR_DIRECTORY) || libresd_fat_glob_match(glob, info.name)) {
+            shell_printf(shell, "%s\n", path);
         }
-        
-        /* Check if name matches pattern */
-        if (glob_match(pattern, info.name)) {
-            shell_printf(shell, "%s\n", full_path);
-        }
-        
-        /* Recurse into directories */
         if (info.attr & LIBRESD_ATTR_DIRECTORY) {
-            libresd_shell_find(shell, full_path, pattern);
+            find_recursive(shell, path, len + 1 + name_len, glob);
         }
     }
+    path[len] = '\0';
     
     libresd_fat_closedir(&dir);
     return LIBRESD_OK;
 }
 
+libresd_err_t libresd_shell_find(libresd_shell_t *shell, const char *path,
+                                  const char *pattern) {
+    libresd_fat_glob_t glob;
+    char full_path[LIBRESD_MAX_PATH];
+    uint32_t len;
+    libresd_err_t err;
+    
+    if (!shell || !shell->fat || !pattern) return LIBRESD_ERR_INVALID_PARAM;
+    if (!path) path = "/";
+    
+    /* Compiled once for the whole walk */
+    err = libresd_fat_glob_compile(&glob, pattern);
+    if (err != LIBRESD_OK) return err;
+    
+    len = strlen(path);
+    if (len >= sizeof(full_path)) return LIBRESD_ERR_INVALID_PARAM;
+    memcpy(full_path, path, len + 1);
+    while (len > 0 && full_path[len - 1] == '/') full_path[--len] = '\0';
+    
+    return find_recursive(shell, full_path, len, &glob);
+}
+
 /*============================================================================
  * UTILITY COMMANDS
  *============================================================================*/
@@ -737,7 +931,7 @@ static int tokenize(char *str, char **tokens, int max_tokens) {
     return count;
 }
 
-libresd_err_t libresd_shell_exec(libresd_shell_t *shell, const char *cmdline) {
+static libresd_err_t shell_dispatch(libresd_shell_t *shell, const char *cmdline) {
     char buf[256];
     char *tokens[16];
     int argc;
@@ -902,6 +1096,21 @@ libresd_err_t libresd_shell_exec(libresd_shell_t *shell, const char *cmdline) {
         return libresd_shell_df(shell);
     }
     
+#if LIBRESD_ENABLE_CHECK
+    /* fsck command */
+    if (strcmp(cmd, "fsck") == 0 || strcmp(cmd, "chkdsk") == 0) {
+        bool repair = argc > 1 && (strcmp(tokens[1], "-r") == 0 || strcmp(tokens[1], "/f") == 0);
+        return libresd_shell_fsck(shell, repair);
+    }
+#endif
+    
+#if LIBRESD_ENABLE_DEFRAG && LIBRESD_ENABLE_WRITE
+    /* defrag command */
+    if (strcmp(cmd, "defrag") == 0) {
+        return libresd_shell_defrag(shell, argc > 1 ? tokens[1] : NULL);
+    }
+#endif
+    
     /* tree command */
     if (strcmp(cmd, "tree") == 0) {
         return libresd_shell_tree(shell, argc > 1 ? tokens[1] : ".", 0);
@@ -931,6 +1140,13 @@ libresd_err_t libresd_shell_exec(libresd_shell_t *shell, const char *cmdline) {
     return LIBRESD_ERR_NOT_SUPPORTED;
 }
 
+libresd_err_t libresd_shell_exec(libresd_shell_t *shell, const char *cmdline) {
+    libresd_err_t err = shell_dispatch(shell, cmdline);
+    
+    libresd_shell_flush(shell);
+    return err;
+}
+
 void libresd_shell_help(libresd_shell_t *shell) {
     shell_print(shell, "LibreSD Shell Commands:\n");
     shell_print(shell, "  ls [-l] [-a] [path]  - List directory\n");
@@ -951,6 +1167,12 @@ void libresd_shell_help(libresd_shell_t *shell) {
 #endif
     shell_print(shell, "  stat <path>          - File/dir info\n");
     shell_print(shell, "  df                   - Disk free space\n");
+#if LIBRESD_ENABLE_CHECK
+    shell_print(shell, "  fsck [-r]            - Check (and repair) volume\n");
+#endif
+#if LIBRESD_ENABLE_DEFRAG && LIBRESD_ENABLE_WRITE
+    shell_print(shell, "  defrag [path]        - Make files contiguous\n");
+#endif
     shell_print(shell, "  tree [path]          - Directory tree\n");
     shell_print(shell, "  find <pattern>       - Find files\n");
     shell_print(shell, "  sdinfo               - SD card info\n");
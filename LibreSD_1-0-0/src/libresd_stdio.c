@@ -0,0 +1,338 @@
+/**
+ * @file libresd_stdio.c
+ * @brief LibreSD POSIX descriptor layer Implementation
+ *
+ * Descriptor table and newlib/picolibc syscall shims on top of libresd_fat_*.
+ */
+
+#include "libresd_stdio.h"
+
+#if LIBRESD_ENABLE_STDIO
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+/*============================================================================
+ * DESCRIPTOR TABLE
+ *============================================================================*/
+
+static libresd_fat_t *stdio_fat;
+static libresd_file_t stdio_files[LIBRESD_STDIO_MAX_FDS];
+static bool stdio_append[LIBRESD_STDIO_MAX_FDS];
+
+/* Descriptor to table slot, or NULL (errno EBADF) */
+static libresd_file_t *fd_to_file(int fd) {
+    int slot = fd - LIBRESD_STDIO_FD_BASE;
+
+    if (slot < 0 || slot >= LIBRESD_STDIO_MAX_FDS || !stdio_files[slot].is_open) {
+        errno = EBADF;
+        return NULL;
+    }
+    return &stdio_files[slot];
+}
+
+/* Map LibreSD status codes to errno; always returns -1 */
+static int set_errno(libresd_err_t err) {
+    switch (err) {
+        case LIBRESD_ERR_NOT_FOUND:       errno = ENOENT; break;
+        case LIBRESD_ERR_EXISTS:          errno = EEXIST; break;
+        case LIBRESD_ERR_NOT_FILE:        errno = EISDIR; break;
+        case LIBRESD_ERR_NOT_DIR:         errno = ENOTDIR; break;
+        case LIBRESD_ERR_DIR_NOT_EMPTY:   errno = ENOTEMPTY; break;
+        case LIBRESD_ERR_FULL:
+        case LIBRESD_ERR_ROOT_FULL:       errno = ENOSPC; break;
+        case LIBRESD_ERR_PATH_TOO_LONG:   errno = ENAMETOOLONG; break;
+        case LIBRESD_ERR_TOO_MANY_OPEN:   errno = EMFILE; break;
+        case LIBRESD_ERR_READ_ONLY:
+        case LIBRESD_ERR_INVALID_HANDLE:  errno = EBADF; break;
+        case LIBRESD_ERR_WRITE_PROTECT:   errno = EROFS; break;
+        case LIBRESD_ERR_INVALID_NAME:
+        case LIBRESD_ERR_INVALID_PARAM:
+        case LIBRESD_ERR_SEEK:            errno = EINVAL; break;
+        case LIBRESD_ERR_NOT_SUPPORTED:   errno = ENOSYS; break;
+        case LIBRESD_ERR_NOT_MOUNTED:     errno = ENODEV; break;
+        default:                          errno = EIO; break;
+    }
+    return -1;
+}
+
+/*============================================================================
+ * SETUP
+ *============================================================================*/
+
+libresd_err_t libresd_stdio_init(libresd_fat_t *fat) {
+    if (fat && !fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+
+    stdio_fat = fat;
+    memset(stdio_files, 0, sizeof(stdio_files));
+    memset(stdio_append, 0, sizeof(stdio_append));
+
+    return LIBRESD_OK;
+}
+
+size_t libresd_stdio_bufsize(void) {
+    if (!stdio_fat || stdio_fat->cluster_size == 0) return LIBRESD_SECTOR_SIZE;
+    if (stdio_fat->cluster_size > LIBRESD_STDIO_MAX_BLKSIZE) return LIBRESD_STDIO_MAX_BLKSIZE;
+    return stdio_fat->cluster_size;
+}
+
+libresd_file_t *libresd_stdio_file(int fd) {
+    return fd_to_file(fd);
+}
+
+/*============================================================================
+ * POSIX-STYLE I/O
+ *============================================================================*/
+
+int libresd_stdio_open(const char *path, int flags, int mode) {
+    uint8_t fmode = 0;
+    libresd_err_t err;
+    int slot;
+
+    (void)mode;
+
+    if (!path) return set_errno(LIBRESD_ERR_INVALID_PARAM);
+    if (!stdio_fat) return set_errno(LIBRESD_ERR_NOT_MOUNTED);
+
+    for (slot = 0; slot < LIBRESD_STDIO_MAX_FDS; slot++) {
+        if (!stdio_files[slot].is_open) break;
+    }
+    if (slot == LIBRESD_STDIO_MAX_FDS) return set_errno(LIBRESD_ERR_TOO_MANY_OPEN);
+
+    switch (flags & O_ACCMODE) {
+        case O_RDONLY: fmode = LIBRESD_READ; break;
+        case O_WRONLY: fmode = LIBRESD_WRITE; break;
+        case O_RDWR:   fmode = LIBRESD_READ | LIBRESD_WRITE; break;
+        default:       return set_errno(LIBRESD_ERR_INVALID_PARAM);
+    }
+    if (flags & O_CREAT)  fmode |= LIBRESD_CREATE;
+    if (flags & O_TRUNC)  fmode |= LIBRESD_TRUNCATE;
+    if (flags & O_EXCL)   fmode |= LIBRESD_EXCL;
+    if (flags & O_APPEND) fmode |= LIBRESD_APPEND;
+
+    err = libresd_fat_open(stdio_fat, &stdio_files[slot], path, fmode);
+    if (err != LIBRESD_OK) return set_errno(err);
+
+    stdio_append[slot] = (flags & O_APPEND) != 0;
+
+    return slot + LIBRESD_STDIO_FD_BASE;
+}
+
+int libresd_stdio_close(int fd) {
+    libresd_file_t *file = fd_to_file(fd);
+    libresd_err_t err;
+
+    if (!file) return -1;
+
+    err = libresd_fat_close(stdio_fat, file);
+    if (err != LIBRESD_OK) return set_errno(err);
+
+    /* Make the FAT durable too; stdio callers expect fclose to mean "on disk" */
+    err = libresd_fat_sync(stdio_fat);
+    if (err != LIBRESD_OK) return set_errno(err);
+
+    return 0;
+}
+
+int libresd_stdio_read(int fd, void *buf, size_t len) {
+    libresd_file_t *file = fd_to_file(fd);
+    uint32_t n = 0;
+    libresd_err_t err;
+
+    if (!file) return -1;
+    if (len == 0) return 0;
+    if (len > INT32_MAX) len = INT32_MAX;
+
+    err = libresd_fat_read(stdio_fat, file, buf, (uint32_t)len, &n);
+    if (err == LIBRESD_ERR_EOF) return 0;
+    if (err != LIBRESD_OK) return set_errno(err);
+
+    return (int)n;
+}
+
+int libresd_stdio_write(int fd, const void *buf, size_t len) {
+    libresd_file_t *file = fd_to_file(fd);
+    uint32_t n = 0;
+    libresd_err_t err;
+
+    if (!file) return -1;
+    if (len == 0) return 0;
+    if (len > INT32_MAX) len = INT32_MAX;
+
+    /* O_APPEND: every write lands at the current end of file */
+    if (stdio_append[fd - LIBRESD_STDIO_FD_BASE] && libresd_fat_tell(file) != file->file_size) {
+        err = libresd_fat_seek(stdio_fat, file, 0, LIBRESD_SEEK_END);
+        if (err != LIBRESD_OK) return set_errno(err);
+    }
+
+    err = libresd_fat_write(stdio_fat, file, buf, (uint32_t)len, &n);
+    if (err != LIBRESD_OK) return set_errno(err);
+    if (n == 0) return set_errno(LIBRESD_ERR_FULL);
+
+    return (int)n;
+}
+
+long libresd_stdio_lseek(int fd, long offset, int whence) {
+    libresd_file_t *file = fd_to_file(fd);
+    libresd_seek_t w;
+    libresd_err_t err;
+
+    if (!file) return -1;
+
+    switch (whence) {
+        case SEEK_SET: w = LIBRESD_SEEK_SET; break;
+        case SEEK_CUR: w = LIBRESD_SEEK_CUR; break;
+        case SEEK_END: w = LIBRESD_SEEK_END; break;
+        default:       return set_errno(LIBRESD_ERR_INVALID_PARAM);
+    }
+
+    /* Skip the chain walk for the ftell()-style no-op seek */
+    if (w == LIBRESD_SEEK_CUR && offset == 0) {
+        return (long)libresd_fat_tell(file);
+    }
+
+    if (offset > INT32_MAX || offset < INT32_MIN) return set_errno(LIBRESD_ERR_SEEK);
+
+    err = libresd_fat_seek(stdio_fat, file, (int32_t)offset, w);
+    if (err != LIBRESD_OK) return set_errno(err);
+
+    return (long)libresd_fat_tell(file);
+}
+
+/* Fill in the fields newlib and picolibc look at */
+static void fill_stat(struct stat *st, uint32_t size, bool is_dir) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = is_dir ? (S_IFDIR | 0777) : (S_IFREG | 0666);
+    st->st_nlink = 1;
+    st->st_size = size;
+    st->st_blksize = libresd_stdio_bufsize();
+    st->st_blocks = (size + 511) / 512;
+}
+
+int libresd_stdio_fstat(int fd, struct stat *st) {
+    libresd_file_t *file;
+
+    if (!st) return set_errno(LIBRESD_ERR_INVALID_PARAM);
+
+    if (fd >= 0 && fd < LIBRESD_STDIO_FD_BASE) {
+        memset(st, 0, sizeof(*st));
+        st->st_mode = S_IFCHR;
+        return 0;
+    }
+
+    file = fd_to_file(fd);
+    if (!file) return -1;
+
+    fill_stat(st, file->file_size, false);
+    return 0;
+}
+
+int libresd_stdio_stat(const char *path, struct stat *st) {
+    libresd_fileinfo_t info;
+    libresd_err_t err;
+
+    if (!path || !st) return set_errno(LIBRESD_ERR_INVALID_PARAM);
+    if (!stdio_fat) return set_errno(LIBRESD_ERR_NOT_MOUNTED);
+
+    err = libresd_fat_stat(stdio_fat, path, &info);
+    if (err != LIBRESD_OK) return set_errno(err);
+
+    fill_stat(st, info.size, (info.attr & LIBRESD_ATTR_DIRECTORY) != 0);
+    return 0;
+}
+
+int libresd_stdio_unlink(const char *path) {
+    libresd_err_t err;
+
+    if (!path) return set_errno(LIBRESD_ERR_INVALID_PARAM);
+    if (!stdio_fat) return set_errno(LIBRESD_ERR_NOT_MOUNTED);
+
+#if LIBRESD_ENABLE_WRITE
+    err = libresd_fat_unlink(stdio_fat, path);
+#else
+    err = LIBRESD_ERR_NOT_SUPPORTED;
+#endif
+    if (err != LIBRESD_OK) return set_errno(err);
+
+    return 0;
+}
+
+int libresd_stdio_isatty(int fd) {
+    if (fd >= 0 && fd < LIBRESD_STDIO_FD_BASE) return 1;
+    errno = fd_to_file(fd) ? ENOTTY : EBADF;
+    return 0;
+}
+
+/*============================================================================
+ * CONSOLE HOOKS (weak)
+ *============================================================================*/
+
+__attribute__((weak))
+int libresd_stdio_console_read(int fd, void *buf, size_t len) {
+    (void)fd; (void)buf; (void)len;
+    errno = EBADF;
+    return -1;
+}
+
+__attribute__((weak))
+int libresd_stdio_console_write(int fd, const void *buf, size_t len) {
+    (void)fd; (void)buf;
+    return (int)len;
+}
+
+/*============================================================================
+ * SYSCALL SHIMS
+ *============================================================================*/
+
+#if LIBRESD_STDIO_SYSCALLS
+
+int LIBRESD_STDIO_SYSCALL(open)(const char *path, int flags, int mode) {
+    return libresd_stdio_open(path, flags, mode);
+}
+
+int LIBRESD_STDIO_SYSCALL(close)(int fd) {
+    if (fd >= 0 && fd < LIBRESD_STDIO_FD_BASE) return 0;
+    return libresd_stdio_close(fd);
+}
+
+int LIBRESD_STDIO_SYSCALL(read)(int fd, char *buf, int len) {
+    if (len < 0) return set_errno(LIBRESD_ERR_INVALID_PARAM);
+    if (fd >= 0 && fd < LIBRESD_STDIO_FD_BASE) {
+        return libresd_stdio_console_read(fd, buf, (size_t)len);
+    }
+    return libresd_stdio_read(fd, buf, (size_t)len);
+}
+
+int LIBRESD_STDIO_SYSCALL(write)(int fd, const char *buf, int len) {
+    if (len < 0) return set_errno(LIBRESD_ERR_INVALID_PARAM);
+    if (fd >= 0 && fd < LIBRESD_STDIO_FD_BASE) {
+        return libresd_stdio_console_write(fd, buf, (size_t)len);
+    }
+    return libresd_stdio_write(fd, buf, (size_t)len);
+}
+
+int LIBRESD_STDIO_SYSCALL(lseek)(int fd, int offset, int whence) {
+    return (int)libresd_stdio_lseek(fd, offset, whence);
+}
+
+int LIBRESD_STDIO_SYSCALL(fstat)(int fd, struct stat *st) {
+    return libresd_stdio_fstat(fd, st);
+}
+
+int LIBRESD_STDIO_SYSCALL(stat)(const char *path, struct stat *st) {
+    return libresd_stdio_stat(path, st);
+}
+
+int LIBRESD_STDIO_SYSCALL(isatty)(int fd) {
+    return libresd_stdio_isatty(fd);
+}
+
+int LIBRESD_STDIO_SYSCALL(unlink)(const char *path) {
+    return libresd_stdio_unlink(path);
+}
+
+#endif /* LIBRESD_STDIO_SYSCALLS */
+
+#endif /* LIBRESD_ENABLE_STDIO */
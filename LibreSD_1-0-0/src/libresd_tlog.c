@@ -0,0 +1,413 @@
+/**
+ * @file libresd_tlog.c
+ * @brief LibreSD Time-Indexed Log Implementation
+ *
+ * Built on the regular file API. The only thing kept beyond the two file
+ * handles is where the write position lives in the cluster chain, so
+ * queries can wander off and come back without walking the chain.
+ */
+
+#include "libresd_tlog.h"
+#include <stddef.h>
+#include <string.h>
+
+#if LIBRESD_ENABLE_TLOG && LIBRESD_ENABLE_WRITE
+
+#if (LIBRESD_TLOG_BLOCK_SIZE % 512) != 0 || \
+    (LIBRESD_TLOG_BLOCK_SIZE & (LIBRESD_TLOG_BLOCK_SIZE - 1)) != 0
+#error "LIBRESD_TLOG_BLOCK_SIZE must be a power of two, 512 or more"
+#endif
+
+/*============================================================================
+ * ON-CARD FORMAT
+ *============================================================================*/
+
+#define TLOG_MAGIC              0x474F4C54UL    /* "TLOG" */
+#define TLOG_BLOCK              LIBRESD_TLOG_BLOCK_SIZE
+#define TLOG_DEFAULT_EVERY      16
+
+/* Block header */
+#define TB_MAGIC                0
+#define TB_T_FIRST              4
+#define TB_T_LAST               8
+#define TB_COUNT                12
+#define TB_USED                 14
+#define TB_DATA                 16
+
+/* Record header */
+#define TR_TIME                 0
+#define TR_LEN                  4
+#define TR_DATA                 6
+
+/* Index entry */
+#define TI_T_FIRST              0
+#define TI_BLOCK                4
+#define TI_CLUSTER              8
+#define TI_SIZE                 16
+
+#define READ16(buf, off)    ((uint16_t)(buf)[off] | ((uint16_t)(buf)[(off)+1] << 8))
+#define READ32(buf, off)    ((uint32_t)(buf)[off] | ((uint32_t)(buf)[(off)+1] << 8) | \
+                             ((uint32_t)(buf)[(off)+2] << 16) | ((uint32_t)(buf)[(off)+3] << 24))
+
+#define WRITE16(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+} while(0)
+
+#define WRITE32(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+    (buf)[(off)+2] = ((v) >> 16) & 0xFF; \
+    (buf)[(off)+3] = ((v) >> 24) & 0xFF; \
+} while(0)
+
+/*============================================================================
+ * INTERNAL HELPERS
+ *============================================================================*/
+
+static void tlog_reset_block(libresd_tlog_t *log) {
+    memset(log->block, 0, TLOG_BLOCK);
+    WRITE32(log->block, TB_MAGIC, TLOG_MAGIC);
+    log->count = 0;
+    log->used = TB_DATA;
+}
+
+/**
+ * @brief Put the data file back at the RAM block's slot
+ */
+static libresd_err_t tlog_seek_end(libresd_tlog_t *log) {
+    libresd_fat_t *fat = log->fat;
+    uint32_t pos = log->blocks * TLOG_BLOCK;
+    libresd_err_t err;
+    
+    if (log->cur_cluster >= 2) {
+        return libresd_fat_seek_cluster(fat, &log->data, pos, log->cur_cluster);
+    }
+    if (log->blocks == 0) {
+        return libresd_fat_seek(fat, &log->data, 0, LIBRESD_SEEK_SET);
+    }
+    
+    /* Slot not allocated yet: park at the end of the previous block, where
+     * at most one FAT lookup separates us from the slot */
+    err = libresd_fat_seek_cluster(fat, &log->data, pos - TLOG_BLOCK, log->tail_cluster);
+    if (err != LIBRESD_OK) return err;
+    return libresd_fat_seek(fat, &log->data, TLOG_BLOCK, LIBRESD_SEEK_CUR);
+}
+
+/**
+ * @brief Write the RAM block to its slot
+ *
+ * A sealed block is final: it is indexed if due and the next slot starts
+ * empty. Otherwise the write position returns to the same slot.
+ */
+static libresd_err_t tlog_write_block(libresd_tlog_t *log, bool seal) {
+    libresd_fat_t *fat = log->fat;
+    uint32_t written;
+    libresd_err_t err;
+    
+    WRITE16(log->block, TB_COUNT, log->count);
+    WRITE16(log->block, TB_USED, log->used);
+    
+    err = libresd_fat_write(fat, &log->data, log->block, TLOG_BLOCK, &written);
+    if (err != LIBRESD_OK) return err;
+    if (written != TLOG_BLOCK) return LIBRESD_ERR_FULL;
+    
+    /* Blocks never straddle clusters, so this still holds the block */
+    log->cur_cluster = log->data.current_cluster;
+    
+    if (!seal) {
+        return tlog_seek_end(log);
+    }
+    
+    if (log->blocks % log->index_every == 0) {
+        uint8_t entry[TI_SIZE];
+    
+        memset(entry, 0, sizeof(entry));
+        WRITE32(entry, TI_T_FIRST, READ32(log->block, TB_T_FIRST));
+        WRITE32(entry, TI_BLOCK, log->blocks);
+        WRITE32(entry, TI_CLUSTER, log->cur_cluster);
+    
+        err = libresd_fat_write(fat, &log->index, entry, TI_SIZE, &written);
+        if (err != LIBRESD_OK) return err;
+        if (written != TI_SIZE) return LIBRESD_ERR_FULL;
+        log->index_count++;
+    }
+    
+    log->tail_cluster = log->cur_cluster;
+    log->cur_cluster = 0;
+    log->blocks++;
+    tlog_reset_block(log);
+    
+    return LIBRESD_OK;
+}
+
+static libresd_err_t tlog_read_entry(libresd_tlog_t *log, uint32_t i, uint8_t *entry) {
+    uint32_t got;
+    libresd_err_t err;
+    
+    err = libresd_fat_seek(log->fat, &log->index, (int32_t)(i * TI_SIZE), LIBRESD_SEEK_SET);
+    if (err != LIBRESD_OK) return err;
+    
+    err = libresd_fat_read(log->fat, &log->index, entry, TI_SIZE, &got);
+    if (err != LIBRESD_OK) return err;
+    return (got == TI_SIZE) ? LIBRESD_OK : LIBRESD_ERR_EOF;
+}
+
+/**
+ * @brief Hand the samples of one block that fall in [t1, t2] to fn
+ *
+ * @return false once fn asked to stop or the block runs past t2
+ */
+static bool tlog_scan_block(const uint8_t *blk, uint32_t t1, uint32_t t2,
+                            libresd_tlog_fn fn, void *ctx, uint32_t *matched) {
+    uint16_t count = READ16(blk, TB_COUNT);
+    uint32_t off = TB_DATA;
+
+    while (count-- > 0) {
+        uint32_t t = READ32(blk + off, TR_TIME);
+        uint16_t len = READ16(blk + off, TR_LEN);
+
+        if (off + TR_DATA + len > TLOG_BLOCK) return false;
+        if (t > t2) return false;
+        if (t >= t1) {
+            (*matched)++;
+            if (!fn(ctx, t, blk + off + TR_DATA, len)) return false;
+        }
+        off += TR_DATA + len;
+    }
+    return true;
+}
+
+/*============================================================================
+ * TIME LOG OPERATIONS
+ *============================================================================*/
+
+libresd_err_t libresd_tlog_open(libresd_fat_t *fat, libresd_tlog_t *log,
+                                 const char *data_path, const char *index_path,
+                                 uint32_t index_every) {
+    uint32_t size;
+    libresd_err_t err;
+
+    if (!fat || !log || !data_path || !index_path) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+    if (fat->cluster_size < TLOG_BLOCK) return LIBRESD_ERR_NOT_SUPPORTED;
+
+    memset(log, 0, offsetof(libresd_tlog_t, block));
+    log->index_every = index_every ? index_every : TLOG_DEFAULT_EVERY;
+    tlog_reset_block(log);
+
+    err = libresd_fat_open(fat, &log->data, data_path,
+                           LIBRESD_READ | LIBRESD_WRITE | LIBRESD_CREATE);
+    if (err != LIBRESD_OK) return err;
+
+    err = libresd_fat_open(fat, &log->index, index_path,
+                           LIBRESD_READ | LIBRESD_WRITE | LIBRESD_CREATE);
+    if (err != LIBRESD_OK) {
+        libresd_fat_close(fat, &log->data);
+        return err;
+    }
+
+    log->fat = fat;
+
+    /* The last block becomes the RAM block again: it may be a partial one
+     * written by sync, or a torn write that is simply redone */
+    size = libresd_fat_size(&log->data);
+    log->blocks = size / TLOG_BLOCK;
+    if (log->blocks > 0) {
+        uint32_t got = 0;
+
+        log->blocks--;
+        err = libresd_fat_seek(fat, &log->data,
+                               -(int32_t)(size - log->blocks * TLOG_BLOCK), LIBRESD_SEEK_END);
+        if (err != LIBRESD_OK) goto fail;
+        log->cur_cluster = log->data.current_cluster;
+
+        err = libresd_fat_read(fat, &log->data, log->block, TLOG_BLOCK, &got);
+        if (err != LIBRESD_OK) goto fail;
+
+        if (got == TLOG_BLOCK && READ32(log->block, TB_MAGIC) == TLOG_MAGIC &&
+            READ16(log->block, TB_USED) >= TB_DATA &&
+            READ16(log->block, TB_USED) <= TLOG_BLOCK) {
+            log->count = READ16(log->block, TB_COUNT);
+            log->used = READ16(log->block, TB_USED);
+            log->t_last = READ32(log->block, TB_T_LAST);
+        } else {
+            tlog_reset_block(log);
+        }
+
+        err = tlog_seek_end(log);
+        if (err != LIBRESD_OK) goto fail;
+    }
+
+    /* Drop index entries for blocks that did not make it to the card */
+    log->index_count = libresd_fat_size(&log->index) / TI_SIZE;
+    while (log->index_count > 0) {
+        uint8_t entry[TI_SIZE];
+
+        err = tlog_read_entry(log, log->index_count - 1, entry);
+        if (err != LIBRESD_OK) goto fail;
+        if (READ32(entry, TI_BLOCK) < log->blocks) break;
+        log->index_count--;
+    }
+
+    err = libresd_fat_seek(fat, &log->index, (int32_t)(log->index_count * TI_SIZE),
+                           LIBRESD_SEEK_SET);
+    if (err != LIBRESD_OK) goto fail;
+    if (libresd_fat_size(&log->index) != log->index_count * TI_SIZE) {
+        err = libresd_fat_truncate(fat, &log->index);
+        if (err != LIBRESD_OK) goto fail;
+    }
+
+    return LIBRESD_OK;
+
+fail:
+    libresd_fat_close(fat, &log->index);
+    libresd_fat_close(fat, &log->data);
+    log->fat = NULL;
+    return err;
+}
+
+libresd_err_t libresd_tlog_append(libresd_tlog_t *log, uint32_t t,
+                                   const void *data, uint16_t len) {
+    libresd_err_t err;
+
+    if (!log || !log->fat || (!data && len)) return LIBRESD_ERR_INVALID_PARAM;
+    if ((uint32_t)len > TLOG_BLOCK - TB_DATA - TR_DATA) return LIBRESD_ERR_INVALID_PARAM;
+    if (t < log->t_last) return LIBRESD_ERR_INVALID_PARAM;
+
+    if (log->used + TR_DATA + len > TLOG_BLOCK) {
+        err = tlog_write_block(log, true);
+        if (err != LIBRESD_OK) return err;
+    }
+
+    if (log->count == 0) {
+        WRITE32(log->block, TB_T_FIRST, t);
+    }
+    WRITE32(log->block, TB_T_LAST, t);
+
+    WRITE32(log->block + log->used, TR_TIME, t);
+    WRITE16(log->block + log->used, TR_LEN, len);
+    if (len) memcpy(log->block + log->used + TR_DATA, data, len);
+
+    log->used += TR_DATA + len;
+    log->count++;
+    log->t_last = t;
+
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_tlog_sync(libresd_tlog_t *log) {
+    libresd_err_t err;
+    
+    if (!log || !log->fat) return LIBRESD_ERR_INVALID_PARAM;
+    
+    if (log->count > 0) {
+        err = tlog_write_block(log, false);
+        if (err != LIBRESD_OK) return err;
+    }
+    
+    err = libresd_fat_checkpoint(log->fat, &log->data);
+    if (err != LIBRESD_OK) return err;
+    return libresd_fat_checkpoint(log->fat, &log->index);
+}
+
+libresd_err_t libresd_tlog_close(libresd_tlog_t *log) {
+    libresd_err_t err, err2;
+    
+    if (!log || !log->fat) return LIBRESD_ERR_INVALID_PARAM;
+    
+    err = LIBRESD_OK;
+    if (log->count > 0) {
+        err = tlog_write_block(log, false);
+    }
+    
+    err2 = libresd_fat_close(log->fat, &log->data);
+    if (err == LIBRESD_OK) err = err2;
+    err2 = libresd_fat_close(log->fat, &log->index);
+    if (err == LIBRESD_OK) err = err2;
+    
+    log->fat = NULL;
+    return err;
+}
+
+libresd_err_t libresd_tlog_query(libresd_tlog_t *log, uint32_t t1, uint32_t t2,
+                                  libresd_tlog_fn fn, void *ctx, uint32_t *matched) {
+    libresd_fat_t *fat;
+    uint8_t blk[TLOG_BLOCK];
+    uint8_t entry[TI_SIZE];
+    uint32_t lo, hi, b;
+    uint32_t start = 0, cluster = 0;
+    uint32_t n = 0;
+    bool more = true;
+    libresd_err_t err, err2;
+
+    if (!log || !log->fat || !fn || t1 > t2) return LIBRESD_ERR_INVALID_PARAM;
+    fat = log->fat;
+
+    /* Last indexed block that starts strictly before t1 - a block starting
+     * at exactly t1 may have earlier blocks ending at t1 */
+    lo = 0;
+    hi = log->index_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        err = tlog_read_entry(log, mid, entry);
+        if (err != LIBRESD_OK) goto done;
+
+        if (READ32(entry, TI_T_FIRST) < t1) {
+            start = READ32(entry, TI_BLOCK);
+            cluster = READ32(entry, TI_CLUSTER);
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (start < log->blocks) {
+        if (cluster >= 2) {
+            err = libresd_fat_seek_cluster(fat, &log->data, start * TLOG_BLOCK, cluster);
+        } else {
+            err = libresd_fat_seek(fat, &log->data, (int32_t)(start * TLOG_BLOCK),
+                                   LIBRESD_SEEK_SET);
+        }
+        if (err != LIBRESD_OK) goto done;
+    }
+
+    /* Blocks on the card, in order */
+    for (b = start; b < log->blocks && more; b++) {
+        uint32_t got;
+
+        err = libresd_fat_read(fat, &log->data, blk, TLOG_BLOCK, &got);
+        if (err != LIBRESD_OK) goto done;
+        if (got != TLOG_BLOCK || READ32(blk, TB_MAGIC) != TLOG_MAGIC) {
+            err = LIBRESD_ERR_INVALID_FS;
+            goto done;
+        }
+
+        if (READ32(blk, TB_T_FIRST) > t2) {
+            more = false;
+        } else if (READ32(blk, TB_T_LAST) >= t1) {
+            more = tlog_scan_block(blk, t1, t2, fn, ctx, &n);
+        }
+    }
+
+    /* Then the block still in RAM */
+    if (more && log->count > 0) {
+        WRITE16(log->block, TB_COUNT, log->count);
+        tlog_scan_block(log->block, t1, t2, fn, ctx, &n);
+    }
+    err = LIBRESD_OK;
+
+done:
+    if (matched) *matched = n;
+
+    /* Back to appending */
+    err2 = tlog_seek_end(log);
+    if (err == LIBRESD_OK) err = err2;
+    err2 = libresd_fat_seek(fat, &log->index, 0, LIBRESD_SEEK_END);
+    if (err == LIBRESD_OK) err = err2;
+
+    return err;
+}
+
+#endif /* LIBRESD_ENABLE_TLOG && LIBRESD_ENABLE_WRITE */
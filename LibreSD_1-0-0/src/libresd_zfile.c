@@ -0,0 +1,929 @@
+/**
+ * @file libresd_zfile.c
+ * @brief LibreSD Compressed Stream File Implementation
+ *
+ * The codec is a greedy LZ4 block compressor with a single hash probe per
+ * position, sized so its table fits in LIBRESD_ZFILE_HASH_BITS bits. It
+ * trades a little ratio for a small table and no heap; decoding needs no
+ * table at all.
+ */
+
+#include "libresd_zfile.h"
+#include <stddef.h>
+#include <string.h>
+
+#if LIBRESD_ENABLE_ZFILE
+
+#if (LIBRESD_ZFILE_BLOCK_SIZE % 4) != 0 || LIBRESD_ZFILE_BLOCK_SIZE > 32768 || \
+    LIBRESD_ZFILE_BLOCK_SIZE < 64
+#error "LIBRESD_ZFILE_BLOCK_SIZE must be a multiple of 4 between 64 and 32768"
+#endif
+
+/*============================================================================
+ * ON-CARD FORMAT
+ *============================================================================*/
+
+#define Z_BLOCK                 LIBRESD_ZFILE_BLOCK_SIZE
+#define Z_MAGIC                 0x425A          /* "ZB" */
+#define Z_FLAG_STORED           0x01
+#define Z_FILTER_MASK           (0x07 | LIBRESD_ZFILE_DELTA | LIBRESD_ZFILE_SHUFFLE)
+#define Z_HASH_SEED             2166136261UL
+
+/* Block header */
+#define ZB_MAGIC                0
+#define ZB_FLAGS                2
+#define ZB_FILTER               3
+#define ZB_RAW                  4
+#define ZB_STORED               6
+#define ZB_SPAN                 8
+#define ZB_CHECK                12
+#define ZB_SIZE                 16
+
+/* Index entry */
+#define ZI_OFFSET               0
+#define ZI_CLUSTER              4
+#define ZI_SIZE                 8
+
+/* LZ4 block format limits */
+#define Z_MIN_MATCH             4
+#define Z_LAST_LITERALS         5
+#define Z_MF_LIMIT              12
+
+#define READ16(buf, off)    ((uint16_t)(buf)[off] | ((uint16_t)(buf)[(off)+1] << 8))
+#define READ32(buf, off)    ((uint32_t)(buf)[off] | ((uint32_t)(buf)[(off)+1] << 8) | \
+                             ((uint32_t)(buf)[(off)+2] << 16) | ((uint32_t)(buf)[(off)+3] << 24))
+
+#define WRITE16(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+} while(0)
+
+#define WRITE32(buf, off, v) do { \
+    (buf)[off] = (v) & 0xFF; \
+    (buf)[(off)+1] = ((v) >> 8) & 0xFF; \
+    (buf)[(off)+2] = ((v) >> 16) & 0xFF; \
+    (buf)[(off)+3] = ((v) >> 24) & 0xFF; \
+} while(0)
+
+/*============================================================================
+ * CODEC
+ *============================================================================*/
+
+static uint32_t z_hash(uint32_t h, const uint8_t *p, uint32_t n) {
+    while (n--) {
+        h ^= *p++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static uint32_t z_get(const uint8_t *p, uint32_t w) {
+    return (w == 1) ? (uint32_t)p[0] : (w == 2) ? (uint32_t)READ16(p, 0) : READ32(p, 0);
+}
+
+static void z_put(uint8_t *p, uint32_t w, uint32_t v) {
+    if (w == 1) {
+        p[0] = (uint8_t)v;
+    } else if (w == 2) {
+        WRITE16(p, 0, v);
+    } else {
+        WRITE32(p, 0, v);
+    }
+}
+
+static bool z_filter_valid(uint8_t filter) {
+    uint8_t w = filter & 0x07;
+    return (filter & ~Z_FILTER_MASK) == 0 && (w == 0 || w == 1 || w == 2 || w == 4);
+}
+
+/**
+ * @brief Apply the prefilter in place (tmp: n bytes of scratch)
+ */
+static void z_filter(uint8_t *buf, uint32_t n, uint8_t filter, uint8_t *tmp) {
+    uint32_t w = filter & 0x07;
+    uint32_t count, i, b;
+    
+    if (w == 0) return;
+    count = n / w;
+    
+    if (filter & LIBRESD_ZFILE_DELTA) {
+        for (i = count; i-- > 1; ) {
+            z_put(buf + i * w, w, z_get(buf + i * w, w) - z_get(buf + (i - 1) * w, w));
+        }
+    }
+    
+    if ((filter & LIBRESD_ZFILE_SHUFFLE) && w > 1) {
+        for (i = 0; i < count; i++) {
+            for (b = 0; b < w; b++) tmp[b * count + i] = buf[i * w + b];
+        }
+        memcpy(buf, tmp, count * w);
+    }
+}
+
+/**
+ * @brief Undo z_filter()
+ */
+static void z_unfilter(uint8_t *buf, uint32_t n, uint8_t filter, uint8_t *tmp) {
+    uint32_t w = filter & 0x07;
+    uint32_t count, i, b;
+    
+    if (w == 0) return;
+    count = n / w;
+    
+    if ((filter & LIBRESD_ZFILE_SHUFFLE) && w > 1) {
+        for (i = 0; i < count; i++) {
+            for (b = 0; b < w; b++) tmp[i * w + b] = buf[b * count + i];
+        }
+        memcpy(buf, tmp, count * w);
+    }
+    
+    if (filter & LIBRESD_ZFILE_DELTA) {
+        for (i = 1; i < count; i++) {
+            z_put(buf + i * w, w, z_get(buf + i * w, w) + z_get(buf + (i - 1) * w, w));
+        }
+    }
+}
+
+#if LIBRESD_ENABLE_WRITE
+
+/**
+ * @brief Append one LZ4 sequence (mlen = 0: the closing literal run)
+ */
+static bool z_sequence(uint8_t *dst, uint32_t cap, uint32_t *op,
+                       const uint8_t *lit, uint32_t litlen, uint32_t offset, uint32_t mlen) {
+    uint32_t o = *op;
+    uint32_t need = 1 + litlen + litlen / 255 + 1;
+    uint8_t *token;
+
+    if (mlen) need += 2 + (mlen - Z_MIN_MATCH) / 255 + 1;
+    if (o + need > cap) return false;
+
+    token = &dst[o++];
+    if (litlen >= 15) {
+        uint32_t l = litlen - 15;
+        *token = 15 << 4;
+        for (; l >= 255; l -= 255) dst[o++] = 255;
+        dst[o++] = (uint8_t)l;
+    } else {
+        *token = (uint8_t)(litlen << 4);
+    }
+    memcpy(dst + o, lit, litlen);
+    o += litlen;
+
+    if (mlen) {
+        uint32_t m = mlen - Z_MIN_MATCH;
+
+        dst[o++] = offset & 0xFF;
+        dst[o++] = (offset >> 8) & 0xFF;
+        if (m >= 15) {
+            *token |= 15;
+            for (m -= 15; m >= 255; m -= 255) dst[o++] = 255;
+            dst[o++] = (uint8_t)m;
+        } else {
+            *token |= (uint8_t)m;
+        }
+    }
+
+    *op = o;
+    return true;
+}
+
+/**
+ * @brief LZ4-compress src into dst
+ *
+ * @return Compressed size, or 0 if it would not fit in cap
+ */
+static uint32_t z_compress(const uint8_t *src, uint32_t n, uint8_t *dst, uint32_t cap,
+                           uint16_t *table) {
+    uint32_t ip = 0, anchor = 0, op = 0;
+
+    memset(table, 0, sizeof(uint16_t) << LIBRESD_ZFILE_HASH_BITS);
+
+    if (n > Z_MF_LIMIT) {
+        uint32_t mf_limit = n - Z_MF_LIMIT;
+        uint32_t match_limit = n - Z_LAST_LITERALS;
+
+        while (ip < mf_limit) {
+            uint32_t v, r, h, ref, len;
+
+            memcpy(&v, src + ip, 4);
+            h = (uint32_t)(v * 2654435761UL) >> (32 - LIBRESD_ZFILE_HASH_BITS);
+            ref = table[h];
+            table[h] = (uint16_t)ip;
+
+            if (ref < ip) memcpy(&r, src + ref, 4);
+            if (ref >= ip || r != v) {
+                /* Step faster through data that keeps missing */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+
+            len = Z_MIN_MATCH;
+            while (ip + len < match_limit && src[ip + len] == src[ref + len]) len++;
+
+            if (!z_sequence(dst, cap, &op, src + anchor, ip - anchor, ip - ref, len)) return 0;
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    if (!z_sequence(dst, cap, &op, src + anchor, n - anchor, 0, 0)) return 0;
+    return op;
+}
+
+#endif /* LIBRESD_ENABLE_WRITE */
+
+/**
+ * @brief Decode one LZ4 block
+ *
+ * @return Bytes produced, or -1 on malformed input
+ */
+static int32_t z_decompress(const uint8_t *src, uint32_t n, uint8_t *dst, uint32_t cap) {
+    uint32_t ip = 0, op = 0;
+    
+    while (ip < n) {
+        uint8_t token = src[ip++];
+        uint32_t lit = token >> 4;
+        uint32_t mlen, offset;
+        uint8_t b;
+    
+        if (lit == 15) {
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > n - ip || lit > cap - op) return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+    
+        /* The last sequence carries literals only */
+        if (ip == n) break;
+    
+        if (n - ip < 2) return -1;
+        offset = READ16(src, ip);
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+    
+        mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += Z_MIN_MATCH;
+        if (mlen > cap - op) return -1;
+    
+        /* Byte copy: matches may overlap their own output */
+        while (mlen--) {
+            dst[op] = dst[op - offset];
+            op++;
+        }
+    }
+    
+    return (int32_t)op;
+}
+
+/*============================================================================
+ * INTERNAL HELPERS
+ *============================================================================*/
+
+/**
+ * @brief Read the block header at the data position
+ *
+ * With decode, the payload is read, checked and unpacked into raw; without
+ * it, the block is skipped.
+ *
+ * @return LIBRESD_OK, LIBRESD_ERR_EOF at the end of the file,
+ *         LIBRESD_ERR_INVALID_FS on a damaged or torn block, or error
+ */
+static libresd_err_t z_load(libresd_zfile_t *zf, uint8_t *hdr, bool decode) {
+    libresd_fat_t *fat = zf->fat;
+    uint16_t raw, stored, span;
+    uint32_t got;
+    int32_t n;
+    libresd_err_t err;
+    
+    err = libresd_fat_read(fat, &zf->data, hdr, ZB_SIZE, &got);
+    if (err != LIBRESD_OK) return err;
+    if (got == 0) return LIBRESD_ERR_EOF;
+    
+    raw = READ16(hdr, ZB_RAW);
+    stored = READ16(hdr, ZB_STORED);
+    span = READ16(hdr, ZB_SPAN);
+    
+    if (got != ZB_SIZE || READ16(hdr, ZB_MAGIC) != Z_MAGIC || raw == 0 || raw > Z_BLOCK ||
+        stored > span || span > LIBRESD_ZFILE_BOUND || !z_filter_valid(hdr[ZB_FILTER]) ||
+        ((hdr[ZB_FLAGS] & Z_FLAG_STORED) && stored != raw)) {
+        return LIBRESD_ERR_INVALID_FS;
+    }
+    
+    if (!decode) {
+        return libresd_fat_seek(fat, &zf->data, span, LIBRESD_SEEK_CUR);
+    }
+    
+    err = libresd_fat_read(fat, &zf->data, zf->comp, stored, &got);
+    if (err != LIBRESD_OK) return err;
+    if (got != stored ||
+        z_hash(z_hash(Z_HASH_SEED, hdr, ZB_CHECK), zf->comp, stored) != READ32(hdr, ZB_CHECK)) {
+        return LIBRESD_ERR_INVALID_FS;
+    }
+    
+    if (span > stored) {
+        err = libresd_fat_seek(fat, &zf->data, span - stored, LIBRESD_SEEK_CUR);
+        if (err != LIBRESD_OK) return err;
+    }
+    
+    if (hdr[ZB_FLAGS] & Z_FLAG_STORED) {
+        memcpy(zf->raw, zf->comp, raw);
+    } else {
+        n = z_decompress(zf->comp, stored, zf->raw, Z_BLOCK);
+        if (n != raw) return LIBRESD_ERR_INVALID_FS;
+        /* comp is free again and serves as scratch */
+        z_unfilter(zf->raw, raw, hdr[ZB_FILTER], zf->comp);
+    }
+    
+    zf->raw_len = raw;
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Cluster holding the byte at the data position (0 = none yet)
+ */
+static uint32_t z_cluster_here(libresd_zfile_t *zf) {
+    libresd_file_t *file = &zf->data;
+    
+    if (file->current_cluster < 2) return file->first_cluster;
+    if (file->cluster_offset == zf->fat->cluster_size) {
+        return libresd_fat_next_cluster(zf->fat, file->current_cluster);
+    }
+    return file->current_cluster;
+}
+
+static libresd_err_t z_read_entry(libresd_zfile_t *zf, uint32_t i, uint8_t *entry) {
+    uint32_t got;
+    libresd_err_t err;
+    
+    err = libresd_fat_seek(zf->fat, &zf->index, (int32_t)(i * ZI_SIZE), LIBRESD_SEEK_SET);
+    if (err != LIBRESD_OK) return err;
+    
+    err = libresd_fat_read(zf->fat, &zf->index, entry, ZI_SIZE, &got);
+    if (err != LIBRESD_OK) return err;
+    return (got == ZI_SIZE) ? LIBRESD_OK : LIBRESD_ERR_EOF;
+}
+
+/**
+ * @brief Drop index entries that point past the data
+ */
+static libresd_err_t z_trim_index(libresd_zfile_t *zf) {
+    uint8_t entry[ZI_SIZE];
+    uint32_t size = libresd_fat_size(&zf->data);
+    libresd_err_t err;
+    
+    zf->index_count = libresd_fat_size(&zf->index) / ZI_SIZE;
+    while (zf->index_count > 0) {
+        err = z_read_entry(zf, zf->index_count - 1, entry);
+        if (err != LIBRESD_OK) return err;
+        if (READ32(entry, ZI_OFFSET) + ZB_SIZE <= size) break;
+        zf->index_count--;
+    }
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Put the data position at the start of block n
+ */
+static libresd_err_t z_seek_block(libresd_zfile_t *zf, uint32_t n) {
+    uint8_t entry[ZI_SIZE];
+    uint32_t from;
+    libresd_err_t err;
+    
+    if (zf->has_index && zf->index_count > 0) {
+        from = (n < zf->index_count) ? n : zf->index_count - 1;
+        err = z_read_entry(zf, from, entry);
+        if (err == LIBRESD_OK) {
+            err = libresd_fat_seek_cluster(zf->fat, &zf->data, READ32(entry, ZI_OFFSET),
+                                           READ32(entry, ZI_CLUSTER));
+        }
+    } else if (!zf->has_index && zf->blocks + (zf->loaded ? 1 : 0) <= n) {
+        /* Walk on from where the file already is */
+        from = zf->blocks + (zf->loaded ? 1 : 0);
+        err = LIBRESD_OK;
+    } else {
+        from = 0;
+        err = libresd_fat_seek(zf->fat, &zf->data, 0, LIBRESD_SEEK_SET);
+    }
+    if (err != LIBRESD_OK) return err;
+    
+    for (; from < n; from++) {
+        uint8_t hdr[ZB_SIZE];
+    
+        err = z_load(zf, hdr, false);
+        if (err == LIBRESD_ERR_EOF) err = LIBRESD_ERR_INVALID_FS;
+        if (err != LIBRESD_OK) return err;
+    }
+    return LIBRESD_OK;
+}
+
+/**
+ * @brief Work out the stream length from the last indexed block on
+ */
+static libresd_err_t z_scan_size(libresd_zfile_t *zf) {
+    uint8_t hdr[ZB_SIZE];
+    uint32_t n = (zf->index_count > 0) ? zf->index_count - 1 : 0;
+    libresd_err_t err;
+    
+    err = z_seek_block(zf, n);
+    if (err != LIBRESD_OK) return err;
+    
+    for (;;) {
+        err = z_load(zf, hdr, false);
+        if (err == LIBRESD_ERR_EOF || err == LIBRESD_ERR_INVALID_FS) {
+            zf->size = n * Z_BLOCK;
+            break;
+        }
+        if (err != LIBRESD_OK) return err;
+    
+        if (READ16(hdr, ZB_RAW) < Z_BLOCK) {
+            zf->size = n * Z_BLOCK + READ16(hdr, ZB_RAW);
+            break;
+        }
+        n++;
+    }
+    
+    zf->blocks = 0;
+    zf->loaded = false;
+    zf->raw_pos = 0;
+    return libresd_fat_seek(zf->fat, &zf->data, 0, LIBRESD_SEEK_SET);
+}
+
+#if LIBRESD_ENABLE_WRITE
+
+/**
+ * @brief Remember where the block at the data position starts
+ */
+static void z_mark_tail(libresd_zfile_t *zf) {
+    zf->tail_off = zf->data.position;
+    zf->tail_cluster = zf->data.current_cluster;
+    zf->tail_lazy = zf->data.current_cluster >= 2 &&
+                    zf->data.cluster_offset == zf->fat->cluster_size;
+}
+
+/**
+ * @brief Compress raw and write it at tail_off
+ *
+ * A full block is final: it is indexed and the next block starts behind
+ * it. A partial one is rewritten by the next call, so the file position
+ * returns to tail_off and raw is left as it was.
+ *
+ * Rewriting a synced partial block puts its bytes at risk until the new
+ * block is on the card, so a full block that replaces one is committed
+ * straight away instead of waiting for the next sync.
+ */
+static libresd_err_t z_write_block(libresd_zfile_t *zf, bool full) {
+    static const uint8_t zeros[32];
+    libresd_fat_t *fat = zf->fat;
+    uint8_t hdr[ZB_SIZE];
+    const uint8_t *payload = zf->comp;
+    uint8_t filter = zf->filter;
+    bool replaces = zf->tail_span > 0;
+    uint32_t stored, span, written, pad;
+    libresd_err_t err;
+    
+    z_filter(zf->raw, zf->raw_len, filter, zf->comp);
+    stored = z_compress(zf->raw, zf->raw_len, zf->comp, zf->raw_len - 1, zf->table);
+    
+    memset(hdr, 0, sizeof(hdr));
+    WRITE16(hdr, ZB_MAGIC, Z_MAGIC);
+    if (stored == 0) {
+        z_unfilter(zf->raw, zf->raw_len, filter, zf->comp);
+        hdr[ZB_FLAGS] = Z_FLAG_STORED;
+        payload = zf->raw;
+        stored = zf->raw_len;
+        filter = 0;
+    }
+    
+    /* Never shorter than the partial block it replaces, so no stale bytes
+     * are left behind it */
+    span = (stored > zf->tail_span) ? stored : zf->tail_span;
+    
+    hdr[ZB_FILTER] = filter;
+    WRITE16(hdr, ZB_RAW, zf->raw_len);
+    WRITE16(hdr, ZB_STORED, stored);
+    WRITE16(hdr, ZB_SPAN, span);
+    WRITE32(hdr, ZB_CHECK, z_hash(z_hash(Z_HASH_SEED, hdr, ZB_CHECK), payload, stored));
+    
+    err = libresd_fat_write(fat, &zf->data, hdr, ZB_SIZE, &written);
+    if (err == LIBRESD_OK && written == ZB_SIZE) {
+        err = libresd_fat_write(fat, &zf->data, payload, stored, &written);
+        if (err == LIBRESD_OK && written != stored) err = LIBRESD_ERR_FULL;
+    } else if (err == LIBRESD_OK) {
+        err = LIBRESD_ERR_FULL;
+    }
+    
+    for (pad = span - stored; err == LIBRESD_OK && pad > 0; pad -= written) {
+        err = libresd_fat_write(fat, &zf->data, zeros,
+                                (pad < sizeof(zeros)) ? pad : sizeof(zeros), &written);
+        if (err == LIBRESD_OK && written == 0) err = LIBRESD_ERR_FULL;
+    }
+    
+    if (!full && filter) z_unfilter(zf->raw, zf->raw_len, filter, zf->comp);
+    if (err != LIBRESD_OK) return err;
+    
+    /* The block's first cluster exists now */
+    if (zf->tail_cluster < 2) {
+        zf->tail_cluster = zf->data.first_cluster;
+    } else if (zf->tail_lazy) {
+        zf->tail_cluster = libresd_fat_next_cluster(fat, zf->tail_cluster);
+    }
+    zf->tail_lazy = false;
+    
+    if (!full) {
+        zf->tail_span = span;
+        return libresd_fat_seek_cluster(fat, &zf->data, zf->tail_off, zf->tail_cluster);
+    }
+    
+    if (zf->has_index) {
+        uint8_t entry[ZI_SIZE];
+    
+        WRITE32(entry, ZI_OFFSET, zf->tail_off);
+        WRITE32(entry, ZI_CLUSTER, zf->tail_cluster);
+        err = libresd_fat_write(fat, &zf->index, entry, ZI_SIZE, &written);
+        if (err != LIBRESD_OK) return err;
+        if (written != ZI_SIZE) return LIBRESD_ERR_FULL;
+        zf->index_count++;
+    }
+    
+    zf->blocks++;
+    zf->raw_len = 0;
+    zf->tail_span = 0;
+    z_mark_tail(zf);
+    
+    if (!replaces) return LIBRESD_OK;
+    err = libresd_fat_checkpoint(fat, &zf->data);
+    if (err != LIBRESD_OK || !zf->has_index) return err;
+    return libresd_fat_checkpoint(fat, &zf->index);
+}
+
+/**
+ * @brief Keep the first count index entries and append behind them
+ */
+static libresd_err_t z_cut_index(libresd_zfile_t *zf, uint32_t count) {
+    libresd_err_t err;
+    
+    zf->index_count = count;
+    err = libresd_fat_seek(zf->fat, &zf->index, (int32_t)(count * ZI_SIZE), LIBRESD_SEEK_SET);
+    if (err == LIBRESD_OK && libresd_fat_size(&zf->index) != count * ZI_SIZE) {
+        err = libresd_fat_truncate(zf->fat, &zf->index);
+    }
+    return err;
+}
+
+/**
+ * @brief Find the end of the stream and take up its partial block
+ *
+ * Full blocks the index has not seen yet get their entries back. The last
+ * block is checked in full: a torn one is dropped, and the next block
+ * written there pads over what is left of it.
+ */
+static libresd_err_t z_recover(libresd_zfile_t *zf) {
+    libresd_fat_t *fat = zf->fat;
+    uint8_t hdr[ZB_SIZE];
+    uint8_t entry[ZI_SIZE];
+    uint32_t size = libresd_fat_size(&zf->data);
+    uint32_t n, off = 0, cluster = 0, written;
+    bool have_last = false;
+    libresd_err_t err;
+    
+    n = (zf->index_count > 0) ? zf->index_count - 1 : 0;
+    err = z_seek_block(zf, n);
+    if (err != LIBRESD_OK) return err;
+    
+    /* Headers only; entries are added one block behind the walk */
+    for (;;) {
+        uint32_t here = zf->data.position;
+        uint32_t c = z_cluster_here(zf);
+    
+        err = z_load(zf, hdr, false);
+        if (err == LIBRESD_ERR_EOF || err == LIBRESD_ERR_INVALID_FS) break;
+        if (err != LIBRESD_OK) return err;
+    
+        if (have_last && zf->has_index && n >= zf->index_count) {
+            WRITE32(entry, ZI_OFFSET, off);
+            WRITE32(entry, ZI_CLUSTER, cluster);
+            err = libresd_fat_write(fat, &zf->index, entry, ZI_SIZE, &written);
+            if (err != LIBRESD_OK) return err;
+            if (written != ZI_SIZE) return LIBRESD_ERR_FULL;
+            zf->index_count++;
+        }
+        if (have_last) n++;
+    
+        have_last = true;
+        off = here;
+        cluster = c;
+        if (READ16(hdr, ZB_RAW) < Z_BLOCK) break;
+    }
+    
+    zf->blocks = n;
+    zf->raw_len = 0;
+    zf->tail_span = 0;
+    
+    if (!have_last) {
+        /* The indexed block the walk started at is torn */
+        if (zf->has_index && zf->index_count > n) {
+            err = z_cut_index(zf, n);
+            if (err != LIBRESD_OK) return err;
+        }
+    
+        err = libresd_fat_seek(fat, &zf->data, 0, LIBRESD_SEEK_SET);
+        if (err != LIBRESD_OK) return err;
+        z_mark_tail(zf);
+        if (size > ZB_SIZE) {
+            zf->tail_span = (size - ZB_SIZE < LIBRESD_ZFILE_BOUND) ? size - ZB_SIZE :
+                            LIBRESD_ZFILE_BOUND;
+        }
+        return LIBRESD_OK;
+    }
+    
+    err = libresd_fat_seek_cluster(fat, &zf->data, off, cluster);
+    if (err != LIBRESD_OK) return err;
+    err = z_load(zf, hdr, true);
+    if (err != LIBRESD_OK && err != LIBRESD_ERR_EOF && err != LIBRESD_ERR_INVALID_FS) {
+        return err;
+    }
+    
+    if (err == LIBRESD_OK && zf->raw_len == Z_BLOCK) {
+        /* Complete: goes into the index, appending starts behind it */
+        if (zf->has_index && n >= zf->index_count) {
+            WRITE32(entry, ZI_OFFSET, off);
+            WRITE32(entry, ZI_CLUSTER, cluster);
+            err = libresd_fat_write(fat, &zf->index, entry, ZI_SIZE, &written);
+            if (err != LIBRESD_OK) return err;
+            if (written != ZI_SIZE) return LIBRESD_ERR_FULL;
+            zf->index_count++;
+        }
+        zf->blocks++;
+        zf->raw_len = 0;
+        z_mark_tail(zf);
+        return LIBRESD_OK;
+    }
+    
+    if (err == LIBRESD_OK) {
+        zf->tail_span = READ16(hdr, ZB_SPAN);
+    } else {
+        zf->raw_len = 0;
+        zf->tail_span = (size - off - ZB_SIZE < LIBRESD_ZFILE_BOUND) ? size - off - ZB_SIZE :
+                        LIBRESD_ZFILE_BOUND;
+        if (zf->has_index && zf->index_count > n) {
+            err = z_cut_index(zf, n);
+            if (err != LIBRESD_OK) return err;
+        }
+    }
+    
+    err = libresd_fat_seek_cluster(fat, &zf->data, off, cluster);
+    if (err != LIBRESD_OK) return err;
+    z_mark_tail(zf);
+    return LIBRESD_OK;
+}
+
+#endif /* LIBRESD_ENABLE_WRITE */
+
+/*============================================================================
+ * COMPRESSED FILE OPERATIONS
+ *============================================================================*/
+
+libresd_err_t libresd_zfile_open(libresd_fat_t *fat, libresd_zfile_t *zf,
+                                  const char *path, const char *index_path,
+                                  uint8_t mode, uint8_t filter) {
+    uint8_t fmode;
+    libresd_err_t err;
+
+    if (!fat || !zf || !path || !z_filter_valid(filter)) return LIBRESD_ERR_INVALID_PARAM;
+    if (!fat->mounted) return LIBRESD_ERR_NOT_MOUNTED;
+
+    memset(zf, 0, offsetof(libresd_zfile_t, table));
+    zf->filter = filter;
+
+#if LIBRESD_ENABLE_WRITE
+    zf->writing = (mode & LIBRESD_WRITE) != 0;
+#else
+    if (mode & LIBRESD_WRITE) return LIBRESD_ERR_NOT_SUPPORTED;
+#endif
+
+    fmode = zf->writing ?
+            (LIBRESD_READ | LIBRESD_WRITE | (mode & (LIBRESD_CREATE | LIBRESD_TRUNCATE))) :
+            LIBRESD_READ;
+
+    err = libresd_fat_open(fat, &zf->data, path, fmode);
+    if (err != LIBRESD_OK) return err;
+
+    if (index_path) {
+        err = libresd_fat_open(fat, &zf->index, index_path,
+                               zf->writing ? (fmode | LIBRESD_CREATE) : fmode);
+        if (err == LIBRESD_OK) {
+            zf->has_index = true;
+        } else if (err != LIBRESD_ERR_NOT_FOUND || zf->writing) {
+            libresd_fat_close(fat, &zf->data);
+            return err;
+        }
+    }
+
+    zf->fat = fat;
+
+    if (zf->has_index) {
+        err = z_trim_index(zf);
+        if (err != LIBRESD_OK) goto fail;
+    }
+
+#if LIBRESD_ENABLE_WRITE
+    if (zf->writing) {
+        if (zf->has_index) {
+            err = z_cut_index(zf, zf->index_count);
+            if (err != LIBRESD_OK) goto fail;
+        }
+
+        err = z_recover(zf);
+        if (err != LIBRESD_OK) goto fail;
+        return LIBRESD_OK;
+    }
+#endif
+
+    err = z_scan_size(zf);
+    if (err != LIBRESD_OK) goto fail;
+    return LIBRESD_OK;
+
+fail:
+    if (zf->has_index) libresd_fat_close(fat, &zf->index);
+    libresd_fat_close(fat, &zf->data);
+    zf->fat = NULL;
+    return err;
+}
+
+libresd_err_t libresd_zfile_read(libresd_zfile_t *zf, void *buf, uint32_t len,
+                                  uint32_t *got) {
+    uint8_t hdr[ZB_SIZE];
+    uint8_t *dst = (uint8_t *)buf;
+    uint32_t n = 0;
+    libresd_err_t err = LIBRESD_OK;
+
+    if (got) *got = 0;
+    if (!zf || !zf->fat || (!buf && len)) return LIBRESD_ERR_INVALID_PARAM;
+    if (zf->writing) return LIBRESD_ERR_INVALID_HANDLE;
+
+    while (n < len) {
+        uint32_t chunk;
+
+        if (!zf->loaded || zf->raw_pos == zf->raw_len) {
+            if (zf->loaded) {
+                zf->blocks++;
+                zf->loaded = false;
+                zf->raw_pos = 0;
+            }
+            if (zf->blocks * Z_BLOCK >= zf->size) break;
+
+            err = z_load(zf, hdr, true);
+            if (err != LIBRESD_OK) {
+                /* A torn last block just ends the stream early */
+                if (err == LIBRESD_ERR_INVALID_FS &&
+                    (zf->blocks + 1) * Z_BLOCK >= zf->size) {
+                    zf->size = zf->blocks * Z_BLOCK;
+                    err = LIBRESD_OK;
+                }
+                break;
+            }
+            zf->loaded = true;
+        }
+
+        chunk = zf->raw_len - zf->raw_pos;
+        if (chunk > len - n) chunk = len - n;
+        memcpy(dst + n, zf->raw + zf->raw_pos, chunk);
+        zf->raw_pos += chunk;
+        n += chunk;
+    }
+
+    if (got) *got = n;
+    return err;
+}
+
+libresd_err_t libresd_zfile_seek(libresd_zfile_t *zf, uint32_t pos) {
+    uint8_t hdr[ZB_SIZE];
+    uint32_t block = pos / Z_BLOCK;
+    libresd_err_t err;
+    
+    if (!zf || !zf->fat) return LIBRESD_ERR_INVALID_PARAM;
+    if (zf->writing) return LIBRESD_ERR_INVALID_HANDLE;
+    if (pos > zf->size) return LIBRESD_ERR_SEEK;
+    
+    if (zf->loaded && block == zf->blocks) {
+        zf->raw_pos = pos % Z_BLOCK;
+        return LIBRESD_OK;
+    }
+    
+    err = z_seek_block(zf, block);
+    if (err != LIBRESD_OK) return err;
+    
+    zf->blocks = block;
+    zf->loaded = false;
+    zf->raw_pos = 0;
+    
+    /* pos on a block boundary at the very end: nothing to decode */
+    if (block * Z_BLOCK == zf->size) return LIBRESD_OK;
+    
+    err = z_load(zf, hdr, true);
+    if (err != LIBRESD_OK) return err;
+    
+    zf->loaded = true;
+    zf->raw_pos = pos % Z_BLOCK;
+    return LIBRESD_OK;
+}
+
+uint32_t libresd_zfile_tell(const libresd_zfile_t *zf) {
+    if (!zf) return 0;
+    if (zf->writing) return zf->blocks * Z_BLOCK + zf->raw_len;
+    return zf->blocks * Z_BLOCK + zf->raw_pos;
+}
+
+uint32_t libresd_zfile_size(const libresd_zfile_t *zf) {
+    if (!zf) return 0;
+    if (zf->writing) return zf->blocks * Z_BLOCK + zf->raw_len;
+    return zf->size;
+}
+
+#if LIBRESD_ENABLE_WRITE
+
+libresd_err_t libresd_zfile_write(libresd_zfile_t *zf, const void *data, uint32_t len) {
+    const uint8_t *src = (const uint8_t *)data;
+    libresd_err_t err;
+    
+    if (!zf || !zf->fat || (!data && len)) return LIBRESD_ERR_INVALID_PARAM;
+    if (!zf->writing) return LIBRESD_ERR_READ_ONLY;
+    
+    while (len > 0) {
+        uint32_t chunk = Z_BLOCK - zf->raw_len;
+        if (chunk > len) chunk = len;
+    
+        memcpy(zf->raw + zf->raw_len, src, chunk);
+        zf->raw_len += chunk;
+        src += chunk;
+        len -= chunk;
+    
+        if (zf->raw_len == Z_BLOCK) {
+            err = z_write_block(zf, true);
+            if (err != LIBRESD_OK) return err;
+        }
+    }
+    
+    return LIBRESD_OK;
+}
+
+libresd_err_t libresd_zfile_sync(libresd_zfile_t *zf) {
+    libresd_err_t err;
+    
+    if (!zf || !zf->fat) return LIBRESD_ERR_INVALID_PARAM;
+    if (!zf->writing) return LIBRESD_ERR_READ_ONLY;
+    
+    if (zf->raw_len > 0) {
+        err = z_write_block(zf, false);
+        if (err != LIBRESD_OK) return err;
+    }
+    
+    /* Data first: an index entry must never point past it */
+    err = libresd_fat_checkpoint(zf->fat, &zf->data);
+    if (err != LIBRESD_OK || !zf->has_index) return err;
+    return libresd_fat_checkpoint(zf->fat, &zf->index);
+}
+
+#endif /* LIBRESD_ENABLE_WRITE */
+
+libresd_err_t libresd_zfile_close(libresd_zfile_t *zf) {
+    libresd_err_t err = LIBRESD_OK, err2;
+    
+    if (!zf || !zf->fat) return LIBRESD_ERR_INVALID_PARAM;
+    
+#if LIBRESD_ENABLE_WRITE
+    if (zf->writing && zf->raw_len > 0) {
+        err = z_write_block(zf, false);
+    }
+#endif
+    
+    err2 = libresd_fat_close(zf->fat, &zf->data);
+    if (err == LIBRESD_OK) err = err2;
+    if (zf->has_index) {
+        err2 = libresd_fat_close(zf->fat, &zf->index);
+        if (err == LIBRESD_OK) err = err2;
+    }
+    
+    zf->fat = NULL;
+    return err;
+}
+
+#endif /* LIBRESD_ENABLE_ZFILE */
@@ -0,0 +1,439 @@
+/**
+ * @file test_host.c
+ * @brief Host test of the library against a card image
+ *
+ * Usage: libresd-test [IMAGE]
+ *
+ * Formats an image through the image-file HAL (tools/mkimage) once as
+ * FAT16 and once as FAT32, then exercises long names, the key-value store,
+ * the time log, compressed files, ring files, the segment pool, the
+ * metadata snapshot, the persisted mount state, the defragmenter and the
+ * consistency checker on it. Every volume is checked clean at the end.
+ * Exits 0 if everything passed.
+ */
+
+#include "libresd.h"
+#include "libresd_hal_image.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define IMAGE_SIZE      (64u * 1024 * 1024)
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+        return; \
+    } \
+} while (0)
+
+#define CHECK_OK(call) CHECK((call) == LIBRESD_OK)
+
+static int failures;
+static libresd_sd_t sd;
+static libresd_fat_t fat;
+
+/* Big handles and buffers stay off the stack */
+static uint8_t data[96 * 1024];
+static uint8_t back[96 * 1024];
+static uint8_t work[8192];
+static uint8_t snap[16384];
+static libresd_kv_slot_t slots[160];
+static uint8_t batch[4 * LIBRESD_SECTOR_SIZE];
+static libresd_kv_t kv;
+static libresd_tlog_t tlog;
+static libresd_zfile_t zf;
+static libresd_ringfile_t ring;
+static libresd_ringfile_iter_t ring_it;
+static libresd_defrag_t df;
+
+/*============================================================================
+ * HELPERS
+ *============================================================================*/
+
+static libresd_err_t write_file(const char *path, const void *buf, uint32_t len)
+{
+    libresd_file_t file;
+    libresd_err_t err;
+    uint32_t n;
+
+    err = libresd_fat_open(&fat, &file, path, LIBRESD_WRITE | LIBRESD_CREATE | LIBRESD_TRUNCATE);
+    if (err != LIBRESD_OK) return err;
+    err = libresd_fat_write(&fat, &file, buf, len, &n);
+    if (err == LIBRESD_OK && n != len) err = LIBRESD_ERR_FULL;
+    libresd_fat_close(&fat, &file);
+    return err;
+}
+
+static bool same_file(const char *path, const void *buf, uint32_t len)
+{
+    libresd_file_t file;
+    uint32_t n = 0;
+
+    if (libresd_fat_open(&fat, &file, path, LIBRESD_READ) != LIBRESD_OK) return false;
+    libresd_fat_read(&fat, &file, back, sizeof(back), &n);
+    libresd_fat_close(&fat, &file);
+    return n == len && memcmp(back, buf, len) == 0;
+}
+
+static bool volume_clean(void)
+{
+    libresd_check_t r;
+
+    if (libresd_fat_check(&fat, 0, work, sizeof(work), &r) != LIBRESD_OK) return false;
+    if (r.lost_clusters || r.cross_links || r.bad_chains || r.size_mismatches) {
+        printf("  check: lost %u, cross %u, bad %u, size %u\n",
+               (unsigned)r.lost_clusters, (unsigned)r.cross_links,
+               (unsigned)r.bad_chains, (unsigned)r.size_mismatches);
+        return false;
+    }
+    return true;
+}
+
+static libresd_err_t remount(void)
+{
+    libresd_err_t err = libresd_fat_unmount(&fat);
+
+    if (err != LIBRESD_OK) return err;
+    return libresd_fat_mount(&fat, &sd);
+}
+
+/*============================================================================
+ * TESTS
+ *============================================================================*/
+
+static void test_long_names(void)
+{
+    static const char *names[] = {
+        "/Long Directory Name/first long file name.txt",
+        "/Long Directory Name/second long file name.txt",
+        "/Long Directory Name/third long file name.txt",
+    };
+    libresd_dir_t dir;
+    libresd_fileinfo_t info;
+    uint32_t i, seen = 0;
+
+    CHECK_OK(libresd_fat_mkdir(&fat, "/Long Directory Name"));
+    for (i = 0; i < 3; i++) {
+        CHECK_OK(write_file(names[i], names[i], (uint32_t)strlen(names[i])));
+    }
+    CHECK_OK(libresd_fat_rename(&fat, names[1], "/Long Directory Name/renamed with a long name.txt"));
+    CHECK_OK(libresd_fat_unlink(&fat, names[2]));
+    CHECK(!libresd_fat_exists(&fat, names[1]));
+    CHECK(!libresd_fat_exists(&fat, names[2]));
+    CHECK(same_file("/long directory name/FIRST LONG FILE NAME.TXT", names[0], strlen(names[0])));
+    CHECK(same_file("/Long Directory Name/renamed with a long name.txt", names[1], strlen(names[1])));
+
+    CHECK_OK(libresd_fat_opendir(&fat, &dir, "/Long Directory Name"));
+    while (libresd_fat_readdir(&fat, &dir, &info) == LIBRESD_OK) {
+        if (strcmp(info.name, "first long file name.txt") == 0 ||
+            strcmp(info.name, "renamed with a long name.txt") == 0) seen++;
+    }
+    libresd_fat_closedir(&dir);
+    CHECK(seen == 2);
+}
+
+static void test_kv(void)
+{
+    char key[8];
+    uint32_t i, value;
+    uint16_t len;
+
+    CHECK_OK(libresd_kv_create(&fat, &kv, "/STORE.KV", 64 * 1024, 128,
+                               slots, 160, batch, sizeof(batch)));
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "k%u", (unsigned)i);
+        CHECK_OK(libresd_kv_put(&kv, key, (uint8_t)strlen(key), &i, sizeof(i)));
+    }
+    for (i = 0; i < 100; i += 2) {
+        snprintf(key, sizeof(key), "k%u", (unsigned)i);
+        CHECK_OK(libresd_kv_delete(&kv, key, (uint8_t)strlen(key)));
+    }
+    value = 7777;
+    CHECK_OK(libresd_kv_put(&kv, "k1", 2, &value, sizeof(value)));
+    CHECK_OK(libresd_kv_close(&kv));
+
+    CHECK_OK(remount());
+    CHECK_OK(libresd_kv_open(&fat, &kv, "/STORE.KV", slots, 160, batch, sizeof(batch)));
+    for (i = 0; i < 100; i++) {
+        libresd_err_t err;
+
+        snprintf(key, sizeof(key), "k%u", (unsigned)i);
+        err = libresd_kv_get(&kv, key, (uint8_t)strlen(key), &value, sizeof(value), &len);
+        if (i % 2 == 0) {
+            CHECK(err == LIBRESD_ERR_NOT_FOUND);
+        } else {
+            CHECK(err == LIBRESD_OK && len == sizeof(value));
+            CHECK(value == (i == 1 ? 7777 : i));
+        }
+    }
+    while (libresd_kv_compact(&kv, 16) == LIBRESD_OK) {
+    }
+    CHECK_OK(libresd_kv_get(&kv, "k99", 3, &value, sizeof(value), NULL));
+    CHECK(value == 99);
+    CHECK_OK(libresd_kv_close(&kv));
+}
+
+typedef struct {
+    uint32_t count;
+    uint32_t first;
+    uint32_t last;
+    bool     ordered;
+} tlog_seen_t;
+
+static bool tlog_sample(void *ctx, uint32_t t, const void *sample, uint16_t len)
+{
+    tlog_seen_t *seen = (tlog_seen_t *)ctx;
+    uint32_t v;
+
+    memcpy(&v, sample, sizeof(v));
+    if (len != sizeof(v) || v != t * 3 || (seen->count && t < seen->last)) seen->ordered = false;
+    if (!seen->count) seen->first = t;
+    seen->last = t;
+    seen->count++;
+    return true;
+}
+
+static void test_tlog(void)
+{
+    tlog_seen_t seen;
+    uint32_t t, v, matched;
+
+    CHECK_OK(libresd_tlog_open(&fat, &tlog, "/DATA.LOG", "/DATA.IDX", 4));
+    for (t = 0; t < 5000; t++) {
+        v = t * 3;
+        CHECK_OK(libresd_tlog_append(&tlog, t, &v, sizeof(v)));
+    }
+    CHECK_OK(libresd_tlog_close(&tlog));
+
+    CHECK_OK(remount());
+    CHECK_OK(libresd_tlog_open(&fat, &tlog, "/DATA.LOG", "/DATA.IDX", 4));
+    memset(&seen, 0, sizeof(seen));
+    seen.ordered = true;
+    CHECK_OK(libresd_tlog_query(&tlog, 1234, 2345, tlog_sample, &seen, &matched));
+    CHECK(seen.ordered && matched == 1112 && seen.count == 1112);
+    CHECK(seen.first == 1234 && seen.last == 2345);
+
+    /* Appending picks up where the log left off */
+    v = 5000 * 3;
+    CHECK_OK(libresd_tlog_append(&tlog, 5000, &v, sizeof(v)));
+    memset(&seen, 0, sizeof(seen));
+    seen.ordered = true;
+    CHECK_OK(libresd_tlog_query(&tlog, 4990, 6000, tlog_sample, &seen, NULL));
+    CHECK(seen.ordered && seen.count == 11 && seen.last == 5000);
+    CHECK_OK(libresd_tlog_close(&tlog));
+}
+
+static void test_zfile(void)
+{
+    uint32_t i, got;
+    uint16_t sample;
+    libresd_fileinfo_t info;
+
+    for (i = 0; i < sizeof(data) / 2; i++) {
+        sample = (uint16_t)(1000 + (i % 200) * 3);
+        memcpy(data + i * 2, &sample, 2);
+    }
+    CHECK_OK(libresd_zfile_open(&fat, &zf, "/ADC.LZ", "/ADC.LZI",
+                                LIBRESD_WRITE | LIBRESD_CREATE | LIBRESD_TRUNCATE,
+                                LIBRESD_ZFILE_W16 | LIBRESD_ZFILE_DELTA | LIBRESD_ZFILE_SHUFFLE));
+    CHECK_OK(libresd_zfile_write(&zf, data, 50000));
+    CHECK_OK(libresd_zfile_sync(&zf));
+    CHECK_OK(libresd_zfile_write(&zf, data + 50000, sizeof(data) - 50000));
+    CHECK_OK(libresd_zfile_close(&zf));
+    CHECK_OK(libresd_fat_stat(&fat, "/ADC.LZ", &info));
+    CHECK(info.size < sizeof(data) / 4);
+
+    CHECK_OK(libresd_zfile_open(&fat, &zf, "/ADC.LZ", "/ADC.LZI", LIBRESD_READ, 0));
+    CHECK(libresd_zfile_size(&zf) == sizeof(data));
+    CHECK_OK(libresd_zfile_read(&zf, back, sizeof(back), &got));
+    CHECK(got == sizeof(data) && memcmp(back, data, got) == 0);
+    CHECK_OK(libresd_zfile_seek(&zf, 70001));
+    CHECK(libresd_zfile_tell(&zf) == 70001);
+    CHECK_OK(libresd_zfile_read(&zf, back, 1000, &got));
+    CHECK(got == 1000 && memcmp(back, data + 70001, 1000) == 0);
+    CHECK_OK(libresd_zfile_close(&zf));
+}
+
+static void test_ringfile(void)
+{
+    uint32_t i, v, expect;
+    uint16_t len;
+
+    CHECK_OK(libresd_ringfile_create(&fat, &ring, "/EVENTS.RNG", 8 * LIBRESD_SECTOR_SIZE, 2));
+    for (i = 0; i < 3000; i++) {
+        CHECK_OK(libresd_ringfile_append(&ring, &i, sizeof(i)));
+    }
+    CHECK_OK(libresd_ringfile_close(&ring));
+
+    CHECK_OK(libresd_ringfile_open(&fat, &ring, "/EVENTS.RNG", 2));
+    CHECK_OK(libresd_ringfile_first(&ring, &ring_it));
+    CHECK_OK(libresd_ringfile_next(&ring, &ring_it, &v, sizeof(v), &len));
+    CHECK(ring.wrapped && len == sizeof(v) && v > 0);
+    for (expect = v + 1; libresd_ringfile_next(&ring, &ring_it, &v, sizeof(v), &len) == LIBRESD_OK;
+         expect++) {
+        CHECK(v == expect);
+    }
+    CHECK(expect == 3000);
+    CHECK_OK(libresd_ringfile_close(&ring));
+}
+
+static void test_segpool(void)
+{
+    libresd_segpool_t pool;
+    libresd_file_t file;
+    libresd_fileinfo_t info;
+    libresd_check_t r;
+    uint32_t seq, n;
+
+    CHECK_OK(libresd_fat_mkdir(&fat, "/REC"));
+    CHECK_OK(libresd_segpool_init(&pool, &fat, "/REC/SEG%04u.BIN", 1, 32768, 3));
+    while (libresd_segpool_fill(&pool) == LIBRESD_OK) {
+    }
+    CHECK_OK(libresd_segpool_next(&pool, &file, &seq));
+    CHECK(seq == 1);
+    CHECK_OK(libresd_fat_write(&fat, &file, data, 20000, &n));
+    CHECK_OK(libresd_segpool_close(&pool, &file));
+    CHECK(same_file("/REC/SEG0001.BIN", data, 20000));
+
+    /* Files still waiting in the pool are not taken for damage */
+    CHECK_OK(libresd_fat_check(&fat, LIBRESD_CHECK_REPAIR, work, sizeof(work), &r));
+    CHECK(r.preallocated == 2 && r.lost_clusters == 0 && r.size_mismatches == 0);
+    CHECK_OK(libresd_fat_stat(&fat, "/REC/SEG0003.BIN", &info));
+    CHECK(info.size == 0 && info.first_cluster != 0);
+    CHECK_OK(libresd_segpool_trim(&pool));
+    CHECK(!libresd_fat_exists(&fat, "/REC/SEG0002.BIN"));
+}
+
+static void test_snapshot(void)
+{
+    libresd_fileinfo_t info;
+    libresd_extent_t ext[2];
+    libresd_hal_image_stats_t st;
+    uint32_t used, count;
+
+    CHECK_OK(libresd_fat_snapshot(&fat, snap, sizeof(snap), &used));
+    CHECK(used > 0 && used <= sizeof(snap));
+
+    /* Lookups are answered from RAM */
+    libresd_hal_image_reset_stats();
+    CHECK_OK(libresd_fat_stat(&fat, "/Long Directory Name/first long file name.txt", &info));
+    CHECK_OK(libresd_fat_stat(&fat, "/REC/SEG0001.BIN", &info));
+    CHECK(info.size == 20000);
+    CHECK(libresd_fat_stat(&fat, "/REC/NOTHERE.BIN", &info) == LIBRESD_ERR_NOT_FOUND);
+    libresd_hal_image_get_stats(&st);
+    CHECK(st.read_commands == 0);
+    CHECK_OK(libresd_fat_get_extents(&fat, "/REC/SEG0001.BIN", ext, 2, &count));
+    CHECK(count == 1);
+
+    /* A write makes its directory stale; lookups still see it */
+    CHECK_OK(write_file("/REC/NEW.BIN", data, 100));
+    CHECK(same_file("/REC/NEW.BIN", data, 100));
+    CHECK_OK(libresd_fat_unlink(&fat, "/REC/NEW.BIN"));
+    CHECK(!libresd_fat_exists(&fat, "/REC/NEW.BIN"));
+    libresd_fat_snapshot_drop(&fat);
+}
+
+static void test_accel(void)
+{
+    libresd_fileinfo_t info;
+    libresd_info_t before, after;
+    uint32_t used;
+
+    CHECK(libresd_accel_load(&fat, NULL, snap, sizeof(snap)) == LIBRESD_ERR_NOT_FOUND);
+    CHECK_OK(libresd_fat_snapshot(&fat, snap, sizeof(snap), &used));
+    CHECK_OK(libresd_fat_get_info(&fat, &before));
+    CHECK_OK(libresd_accel_save(&fat, NULL));
+    CHECK_OK(remount());
+
+    memset(snap, 0, sizeof(snap));
+    CHECK_OK(libresd_accel_load(&fat, NULL, snap, sizeof(snap)));
+    CHECK_OK(libresd_fat_get_info(&fat, &after));
+    CHECK(after.free_bytes == before.free_bytes);
+    CHECK_OK(libresd_fat_stat(&fat, "/REC/SEG0001.BIN", &info));
+    CHECK(info.size == 20000);
+    libresd_fat_snapshot_drop(&fat);
+}
+
+static void test_defrag(void)
+{
+    libresd_file_t a, b;
+    libresd_extent_t ext[2];
+    libresd_check_t r;
+    uint32_t i, n, count, step = 3 * fat.cluster_size;
+    libresd_err_t err;
+
+    /* Interleave two files so both end up in many runs */
+    CHECK_OK(libresd_fat_open(&fat, &a, "/FRAG A.BIN", LIBRESD_WRITE | LIBRESD_CREATE));
+    CHECK_OK(libresd_fat_open(&fat, &b, "/FRAG B.BIN", LIBRESD_WRITE | LIBRESD_CREATE));
+    for (i = 0; i + step <= 16 * step && i + step <= sizeof(data); i += step) {
+        CHECK_OK(libresd_fat_write(&fat, &a, data + i, step, &n));
+        CHECK_OK(libresd_fat_write(&fat, &b, back, step, &n));
+    }
+    libresd_fat_close(&fat, &a);
+    libresd_fat_close(&fat, &b);
+    CHECK_OK(libresd_fat_unlink(&fat, "/FRAG B.BIN"));
+
+    memset(&df, 0, sizeof(df));
+    while ((err = libresd_fat_defrag(&fat, &df, NULL, 16, work, sizeof(work))) == LIBRESD_OK) {
+    }
+    CHECK(err == LIBRESD_ERR_EOF);
+    CHECK(df.moved >= 1 && df.skipped == 0 && df.extents_after < df.extents_before);
+    CHECK_OK(libresd_fat_get_extents(&fat, "/FRAG A.BIN", ext, 2, &count));
+    CHECK(count == 1);
+    CHECK(same_file("/FRAG A.BIN", data, i));
+
+    CHECK_OK(libresd_fat_check(&fat, 0, work, sizeof(work), &r));
+    CHECK(r.lost_clusters == 0 && r.cross_links == 0 && r.files == df.files);
+}
+
+/*============================================================================
+ * MAIN
+ *============================================================================*/
+
+static void run_volume(const char *image, libresd_fs_type_t type, uint32_t cluster_size)
+{
+    libresd_format_t fmt;
+    uint32_t i;
+
+    printf("%s, %u byte clusters\n", type == LIBRESD_FS_FAT32 ? "FAT32" : "FAT16",
+           (unsigned)cluster_size);
+    for (i = 0; i < sizeof(data); i++) data[i] = (uint8_t)(i * 7 + (i >> 9));
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.label = "LIBRESD";
+    fmt.fs_type = type;
+    fmt.cluster_size = cluster_size;
+    CHECK(libresd_hal_image_open(image, IMAGE_SIZE));
+    CHECK_OK(libresd_sd_init(&sd, 25000000));
+    CHECK_OK(libresd_fat_format_ex(&sd, &fmt));
+    CHECK_OK(libresd_fat_mount(&fat, &sd));
+    CHECK(fat.fs_type == type);
+
+    test_long_names();
+    test_kv();
+    test_tlog();
+    test_zfile();
+    test_ringfile();
+    test_segpool();
+    test_snapshot();
+    test_accel();
+    test_defrag();
+    CHECK(volume_clean());
+
+    CHECK_OK(libresd_fat_unmount(&fat));
+    CHECK(libresd_hal_image_close());
+}
+
+int main(int argc, char **argv)
+{
+    const char *image = argc > 1 ? argv[1] : "libresd-test.img";
+
+    run_volume(image, LIBRESD_FS_FAT16, 4096);
+    run_volume(image, LIBRESD_FS_FAT32, 512);
+
+    remove(image);
+    printf(failures ? "%d FAILED\n" : "all passed\n", failures);
+    return failures ? 1 : 0;
+}
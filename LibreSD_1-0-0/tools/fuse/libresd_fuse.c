@@ -0,0 +1,716 @@
+/**
+ * @file libresd_fuse.c
+ * @brief Mount a FAT image through LibreSD with FUSE (host tool)
+ *
+ * Usage: libresd-fuse IMAGE MOUNTPOINT [FUSE options]
+ *
+ * Every operation goes through the same SD driver and FAT code the
+ * firmware runs, over the image-file HAL, so standard workloads (fio, tar,
+ * rsync, cp) exercise the shipped stack and can be compared against the
+ * kernel vfat driver on the same image.
+ *
+ * The root holds a virtual file, /.libresd-stats, with per-operation call,
+ * error, byte and time counters plus the card traffic (commands and
+ * blocks) the emulated card saw. Writing anything to it resets them:
+ *
+ *   cat mnt/.libresd-stats
+ *   echo > mnt/.libresd-stats
+ *
+ * The library is single-threaded, so operations are serialized by one
+ * lock; times are measured inside it and exclude the wait. FAT keeps no
+ * owners or permissions, so chmod, chown and utimens succeed without
+ * effect. Pass -o direct_io to see every read and write the application
+ * makes instead of the page cache's.
+ */
+
+#define FUSE_USE_VERSION 31
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+
+#include "libresd.h"
+#include "libresd_hal_image.h"
+
+#include <fuse.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATS_NAME          ".libresd-stats"
+#define STATS_PATH          "/" STATS_NAME
+#define STATS_MAX           4096
+#define ZERO_CHUNK          (64 * 1024)
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE    (1 << 0)
+#endif
+
+/*============================================================================
+ * VOLUME AND COUNTERS
+ *============================================================================*/
+
+typedef enum {
+    OP_GETATTR,
+    OP_READDIR,
+    OP_OPEN,
+    OP_CREATE,
+    OP_READ,
+    OP_WRITE,
+    OP_TRUNCATE,
+    OP_FLUSH,
+    OP_FSYNC,
+    OP_RELEASE,
+    OP_UNLINK,
+    OP_MKDIR,
+    OP_RMDIR,
+    OP_RENAME,
+    OP_STATFS,
+    OP_COUNT
+} op_t;
+
+static const char *const op_names[OP_COUNT] = {
+    "getattr", "readdir", "open", "create", "read", "write", "truncate",
+    "flush", "fsync", "release", "unlink", "mkdir", "rmdir", "rename", "statfs"
+};
+
+/**
+ * @brief Counters for one operation
+ */
+typedef struct {
+    uint64_t        calls;
+    uint64_t        errors;
+    uint64_t        bytes;              /* Read and write only */
+    uint64_t        ns;                 /* Time inside the library */
+} op_stats_t;
+
+/**
+ * @brief Open file: a library handle, or a rendering of the stats file
+ */
+typedef struct handle {
+    struct handle  *next;               /* Open library handles */
+    bool            is_stats;
+    libresd_file_t  file;
+    char            text[STATS_MAX];
+    size_t          len;
+} handle_t;
+
+static libresd_sd_t sd;
+static libresd_fat_t fat;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static op_stats_t op_stats[OP_COUNT];
+static handle_t *handles;
+
+/* Map LibreSD status codes to negative errno, as FUSE expects */
+static int to_errno(libresd_err_t err) {
+    switch (err) {
+        case LIBRESD_OK:                  return 0;
+        case LIBRESD_ERR_NOT_FOUND:       return -ENOENT;
+        case LIBRESD_ERR_EXISTS:          return -EEXIST;
+        case LIBRESD_ERR_NOT_FILE:        return -EISDIR;
+        case LIBRESD_ERR_NOT_DIR:         return -ENOTDIR;
+        case LIBRESD_ERR_DIR_NOT_EMPTY:   return -ENOTEMPTY;
+        case LIBRESD_ERR_FULL:
+        case LIBRESD_ERR_ROOT_FULL:       return -ENOSPC;
+        case LIBRESD_ERR_PATH_TOO_LONG:   return -ENAMETOOLONG;
+        case LIBRESD_ERR_TOO_MANY_OPEN:   return -EMFILE;
+        case LIBRESD_ERR_READ_ONLY:
+        case LIBRESD_ERR_INVALID_HANDLE:  return -EBADF;
+        case LIBRESD_ERR_WRITE_PROTECT:   return -EROFS;
+        case LIBRESD_ERR_INVALID_NAME:
+        case LIBRESD_ERR_INVALID_PARAM:
+        case LIBRESD_ERR_SEEK:            return -EINVAL;
+        case LIBRESD_ERR_NOT_SUPPORTED:   return -ENOSYS;
+        default:                          return -EIO;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Take the volume lock and start timing an operation */
+static uint64_t op_begin(void) {
+    pthread_mutex_lock(&lock);
+    return now_ns();
+}
+
+/* Record an operation, drop the lock and pass its result through */
+static int op_end(op_t op, uint64_t start, int ret, uint64_t bytes) {
+    op_stats_t *s = &op_stats[op];
+    
+    s->calls++;
+    if (ret < 0) s->errors++;
+    s->bytes += bytes;
+    s->ns += now_ns() - start;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+static bool is_stats(const char *path) {
+    return strcmp(path, STATS_PATH) == 0;
+}
+
+/* Render the counters (caller holds the lock) */
+static size_t stats_render(char *buf, size_t size) {
+    libresd_hal_image_stats_t card;
+    size_t n;
+    int i;
+    
+    n = (size_t)snprintf(buf, size, "%-10s %12s %8s %16s %14s\n",
+                         "op", "calls", "errors", "bytes", "time_us");
+    for (i = 0; i < OP_COUNT && n < size; i++) {
+        const op_stats_t *s = &op_stats[i];
+    
+        n += (size_t)snprintf(buf + n, size - n, "%-10s %12llu %8llu %16llu %14llu\n",
+                              op_names[i], (unsigned long long)s->calls,
+                              (unsigned long long)s->errors,
+                              (unsigned long long)s->bytes,
+                              (unsigned long long)(s->ns / 1000));
+    }
+    
+    libresd_hal_image_get_stats(&card);
+    if (n < size) {
+        n += (size_t)snprintf(buf + n, size - n,
+                              "card: %llu commands, %llu reads (%llu blocks), "
+                              "%llu writes (%llu blocks)\n",
+                              (unsigned long long)card.commands,
+                              (unsigned long long)card.read_commands,
+                              (unsigned long long)card.blocks_read,
+                              (unsigned long long)card.write_commands,
+                              (unsigned long long)card.blocks_written);
+    }
+    return n < size ? n : size - 1;
+}
+
+static void stats_reset(void) {
+    memset(op_stats, 0, sizeof(op_stats));
+    libresd_hal_image_reset_stats();
+}
+
+/*
+ * Size of a file as its open writers see it. The directory entry only
+ * catches up on flush or close, and the kernel trusts getattr for reads.
+ */
+static uint32_t live_size(const libresd_fileinfo_t *info) {
+    const handle_t *h;
+    uint32_t size = info->size;
+    
+    for (h = handles; h; h = h->next) {
+        if ((h->file.mode & LIBRESD_WRITE) && h->file.dir_sector == info->dir_sector &&
+            h->file.dir_offset == info->dir_offset) {
+            size = libresd_fat_size(&h->file);
+        }
+    }
+    return size;
+}
+
+static time_t to_time(const libresd_datetime_t *dt) {
+    struct tm tm;
+    
+    if (dt->year == 0) return 0;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = dt->year - 1900;
+    tm.tm_mon = dt->month - 1;
+    tm.tm_mday = dt->day;
+    tm.tm_hour = dt->hour;
+    tm.tm_min = dt->minute;
+    tm.tm_sec = dt->second;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+/* Extend a file with zeros from its end to size (caller holds the lock) */
+static libresd_err_t zero_fill(libresd_file_t *file, uint32_t size) {
+    static const uint8_t zeros[ZERO_CHUNK];
+    libresd_err_t err;
+    
+    err = libresd_fat_seek(&fat, file, 0, LIBRESD_SEEK_END);
+    while (err == LIBRESD_OK && libresd_fat_size(file) < size) {
+        uint32_t n = size - libresd_fat_size(file);
+    
+        if (n > sizeof(zeros)) n = sizeof(zeros);
+        err = libresd_fat_write(&fat, file, zeros, n, NULL);
+    }
+    return err;
+}
+
+/* Set a file's length, zero-extending it (caller holds the lock) */
+static libresd_err_t resize(libresd_file_t *file, off_t size) {
+    libresd_err_t err;
+    
+    if (size < 0 || size > (off_t)UINT32_MAX) return LIBRESD_ERR_INVALID_PARAM;
+    if ((uint32_t)size > libresd_fat_size(file)) return zero_fill(file, (uint32_t)size);
+    
+    err = libresd_fat_seek(&fat, file, (int32_t)size, LIBRESD_SEEK_SET);
+    if (err != LIBRESD_OK) return err;
+    return libresd_fat_truncate(&fat, file);
+}
+
+/*============================================================================
+ * FUSE OPERATIONS
+ *============================================================================*/
+
+static void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    (void)conn;
+    cfg->use_ino = 0;
+    cfg->nullpath_ok = 0;
+    return NULL;
+}
+
+static void fs_destroy(void *private_data) {
+    (void)private_data;
+    pthread_mutex_lock(&lock);
+    libresd_fat_sync(&fat);
+    libresd_fat_update_fsinfo(&fat);
+    libresd_fat_unmount(&fat);
+    if (!libresd_hal_image_close()) fprintf(stderr, "libresd-fuse: image write error\n");
+    pthread_mutex_unlock(&lock);
+}
+
+static int fs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    libresd_fileinfo_t info;
+    uint64_t t;
+    int ret = 0;
+    
+    (void)fi;
+    memset(st, 0, sizeof(*st));
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    
+    if (is_stats(path)) {
+        char text[STATS_MAX];
+    
+        pthread_mutex_lock(&lock);
+        st->st_size = (off_t)stats_render(text, sizeof(text));
+        pthread_mutex_unlock(&lock);
+        st->st_mode = S_IFREG | 0644;
+        st->st_nlink = 1;
+        return 0;
+    }
+    if (strcmp(path, "/") == 0) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        return 0;
+    }
+    
+    t = op_begin();
+    ret = to_errno(libresd_fat_stat(&fat, path, &info));
+    if (ret == 0) {
+        info.size = live_size(&info);
+        if (info.attr & LIBRESD_ATTR_DIRECTORY) {
+            st->st_mode = S_IFDIR | 0755;
+            st->st_nlink = 2;
+        } else {
+            st->st_mode = S_IFREG | ((info.attr & LIBRESD_ATTR_READ_ONLY) ? 0444 : 0644);
+            st->st_nlink = 1;
+            st->st_size = info.size;
+        }
+        st->st_blksize = (blksize_t)fat.cluster_size;
+        st->st_blocks = (blkcnt_t)((info.size + fat.cluster_size - 1) / fat.cluster_size *
+                                   (fat.cluster_size / 512));
+        st->st_mtime = to_time(&info.modified);
+        st->st_ctime = to_time(&info.created);
+        st->st_atime = info.accessed.year ? to_time(&info.accessed) : st->st_mtime;
+    }
+    return op_end(OP_GETATTR, t, ret, 0);
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                      struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    libresd_dir_t dir;
+    libresd_fileinfo_t info;
+    libresd_err_t err;
+    uint64_t t;
+
+    (void)offset;
+    (void)fi;
+    (void)flags;
+
+    t = op_begin();
+    err = libresd_fat_opendir(&fat, &dir, path);
+    if (err != LIBRESD_OK) return op_end(OP_READDIR, t, to_errno(err), 0);
+
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    if (strcmp(path, "/") == 0) filler(buf, STATS_NAME, NULL, 0, 0);
+
+    while ((err = libresd_fat_readdir(&fat, &dir, &info)) == LIBRESD_OK) {
+        if (strcmp(info.name, ".") == 0 || strcmp(info.name, "..") == 0) continue;
+        if (filler(buf, info.name, NULL, 0, 0)) break;
+    }
+    libresd_fat_closedir(&dir);
+
+    return op_end(OP_READDIR, t, (err == LIBRESD_OK || err == LIBRESD_ERR_EOF) ? 0 :
+                  to_errno(err), 0);
+}
+
+/* Open or create a file; op tells which is being counted */
+static int open_file(const char *path, struct fuse_file_info *fi, uint8_t mode, op_t op) {
+    handle_t *h;
+    uint64_t t;
+    int ret;
+    
+    h = calloc(1, sizeof(*h));
+    if (!h) return -ENOMEM;
+    
+    if (is_stats(path)) {
+        h->is_stats = true;
+        pthread_mutex_lock(&lock);
+        if (fi->flags & O_TRUNC) stats_reset();
+        h->len = stats_render(h->text, sizeof(h->text));
+        pthread_mutex_unlock(&lock);
+        fi->direct_io = 1;              /* Its size changes on every read */
+        fi->fh = (uint64_t)(uintptr_t)h;
+        return 0;
+    }
+    
+    switch (fi->flags & O_ACCMODE) {
+        case O_RDONLY: mode |= LIBRESD_READ; break;
+        case O_WRONLY: mode |= LIBRESD_WRITE; break;
+        default:       mode |= LIBRESD_READ | LIBRESD_WRITE; break;
+    }
+    if (fi->flags & O_TRUNC) mode |= LIBRESD_TRUNCATE;
+    if (fi->flags & O_EXCL) mode |= LIBRESD_EXCL;
+    
+    t = op_begin();
+    ret = to_errno(libresd_fat_open(&fat, &h->file, path, mode));
+    if (ret == 0) {
+        h->next = handles;
+        handles = h;
+    }
+    op_end(op, t, ret, 0);
+    
+    if (ret != 0) {
+        free(h);
+        return ret;
+    }
+    fi->fh = (uint64_t)(uintptr_t)h;
+    return 0;
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi) {
+    return open_file(path, fi, 0, OP_OPEN);
+}
+
+static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    (void)mode;
+    return open_file(path, fi, LIBRESD_CREATE, OP_CREATE);
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi) {
+    handle_t *h = (handle_t *)(uintptr_t)fi->fh;
+    libresd_err_t err = LIBRESD_OK;
+    uint32_t got = 0;
+    uint64_t t;
+
+    (void)path;
+    if (h->is_stats) {
+        if (offset >= (off_t)h->len) return 0;
+        if (size > h->len - (size_t)offset) size = h->len - (size_t)offset;
+        memcpy(buf, h->text + offset, size);
+        return (int)size;
+    }
+
+    t = op_begin();
+    if (offset < (off_t)libresd_fat_size(&h->file)) {
+        if (libresd_fat_tell(&h->file) != (uint32_t)offset) {
+            err = libresd_fat_seek(&fat, &h->file, (int32_t)offset, LIBRESD_SEEK_SET);
+        }
+        if (err == LIBRESD_OK) err = libresd_fat_read(&fat, &h->file, buf, (uint32_t)size, &got);
+        if (err == LIBRESD_ERR_EOF) err = LIBRESD_OK;
+    }
+    return op_end(OP_READ, t, err == LIBRESD_OK ? (int)got : to_errno(err), got);
+}
+
+static int fs_write(const char *path, const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi) {
+    handle_t *h = (handle_t *)(uintptr_t)fi->fh;
+    libresd_err_t err = LIBRESD_OK;
+    uint32_t put = 0;
+    uint64_t t;
+
+    (void)path;
+    if (h->is_stats) {
+        pthread_mutex_lock(&lock);
+        stats_reset();
+        pthread_mutex_unlock(&lock);
+        return (int)size;
+    }
+    if (offset + (off_t)size > (off_t)UINT32_MAX) return -EFBIG;
+
+    t = op_begin();
+    if (offset > (off_t)libresd_fat_size(&h->file)) {
+        err = zero_fill(&h->file, (uint32_t)offset);   /* Sparse write: fill the hole */
+    } else if (libresd_fat_tell(&h->file) != (uint32_t)offset) {
+        err = libresd_fat_seek(&fat, &h->file, (int32_t)offset, LIBRESD_SEEK_SET);
+    }
+    if (err == LIBRESD_OK) err = libresd_fat_write(&fat, &h->file, buf, (uint32_t)size, &put);
+    return op_end(OP_WRITE, t, err == LIBRESD_OK ? (int)put : to_errno(err), put);
+}
+
+static int fs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    handle_t *h = fi ? (handle_t *)(uintptr_t)fi->fh : NULL;
+    libresd_file_t file;
+    libresd_err_t err;
+    uint64_t t;
+    
+    if (is_stats(path) || (h && h->is_stats)) {
+        pthread_mutex_lock(&lock);
+        if (size == 0) stats_reset();
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    
+    t = op_begin();
+    if (h) {
+        err = resize(&h->file, size);
+    } else {
+        err = libresd_fat_open(&fat, &file, path, LIBRESD_WRITE);
+        if (err == LIBRESD_OK) {
+            err = resize(&file, size);
+            if (libresd_fat_close(&fat, &file) != LIBRESD_OK && err == LIBRESD_OK) {
+                err = LIBRESD_ERR_WRITE;
+            }
+        }
+    }
+    return op_end(OP_TRUNCATE, t, to_errno(err), 0);
+}
+
+static int fs_flush(const char *path, struct fuse_file_info *fi) {
+    handle_t *h = (handle_t *)(uintptr_t)fi->fh;
+    uint64_t t;
+    
+    (void)path;
+    if (h->is_stats || !(h->file.mode & LIBRESD_WRITE)) return 0;
+    
+    t = op_begin();
+    return op_end(OP_FLUSH, t, to_errno(libresd_fat_flush(&fat, &h->file)), 0);
+}
+
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    handle_t *h = (handle_t *)(uintptr_t)fi->fh;
+    uint64_t t;
+    
+    (void)path;
+    (void)datasync;
+    if (h->is_stats || !(h->file.mode & LIBRESD_WRITE)) return 0;
+    
+    t = op_begin();
+    return op_end(OP_FSYNC, t, to_errno(libresd_fat_checkpoint(&fat, &h->file)), 0);
+}
+
+static int fs_release(const char *path, struct fuse_file_info *fi) {
+    handle_t *h = (handle_t *)(uintptr_t)fi->fh;
+    uint64_t t;
+    int ret = 0;
+    
+    (void)path;
+    if (!h->is_stats) {
+        handle_t **p;
+    
+        t = op_begin();
+        for (p = &handles; *p; p = &(*p)->next) {
+            if (*p == h) {
+                *p = h->next;
+                break;
+            }
+        }
+        ret = op_end(OP_RELEASE, t, to_errno(libresd_fat_close(&fat, &h->file)), 0);
+    }
+    free(h);
+    return ret;
+}
+
+static int fs_unlink(const char *path) {
+    uint64_t t;
+    
+    if (is_stats(path)) return -EPERM;
+    t = op_begin();
+    return op_end(OP_UNLINK, t, to_errno(libresd_fat_unlink(&fat, path)), 0);
+}
+
+static int fs_mkdir(const char *path, mode_t mode) {
+    uint64_t t;
+    
+    (void)mode;
+    t = op_begin();
+    return op_end(OP_MKDIR, t, to_errno(libresd_fat_mkdir(&fat, path)), 0);
+}
+
+static int fs_rmdir(const char *path) {
+    uint64_t t;
+    
+    t = op_begin();
+    return op_end(OP_RMDIR, t, to_errno(libresd_fat_rmdir(&fat, path)), 0);
+}
+
+/* Rename onto the entry's own name in another case, via a free temporary
+ * name so nothing is deleted (caller holds the lock) */
+static libresd_err_t rename_in_place(const char *from, const char *to) {
+    const char *slash = strrchr(to, '/');
+    int dir_len = slash ? (int)(slash - to) : 0;
+    char tmp[LIBRESD_MAX_PATH];
+    libresd_err_t err;
+    unsigned int n;
+    
+    if (strcmp(from, to) == 0) return LIBRESD_OK;
+    
+    for (n = 0; n < 100000; n++) {
+        if (snprintf(tmp, sizeof(tmp), "%.*s/~RN%05u.TMP", dir_len, to, n) >=
+            (int)sizeof(tmp)) {
+            return LIBRESD_ERR_PATH_TOO_LONG;
+        }
+        if (!libresd_fat_exists(&fat, tmp)) break;
+    }
+    
+    err = libresd_fat_rename(&fat, from, tmp);
+    if (err != LIBRESD_OK) return err;
+    err = libresd_fat_rename(&fat, tmp, to);
+    if (err != LIBRESD_OK) libresd_fat_rename(&fat, tmp, from);
+    return err;
+}
+
+static int fs_rename(const char *from, const char *to, unsigned int flags) {
+    libresd_fileinfo_t src, dst;
+    libresd_err_t err;
+    uint64_t t;
+    
+    if (is_stats(from) || is_stats(to)) return -EPERM;
+    if (flags & ~(unsigned int)RENAME_NOREPLACE) return -EINVAL;
+    
+    t = op_begin();
+    err = libresd_fat_stat(&fat, from, &src);
+    if (err != LIBRESD_OK) return op_end(OP_RENAME, t, to_errno(err), 0);
+    
+    /* POSIX rename replaces an existing file (rsync and editors rely on it) */
+    err = libresd_fat_stat(&fat, to, &dst);
+    if (err == LIBRESD_OK) {
+        if (dst.dir_sector == src.dir_sector && dst.dir_offset == src.dir_offset) {
+            err = rename_in_place(from, to);
+            return op_end(OP_RENAME, t, to_errno(err), 0);
+        }
+        if (flags & RENAME_NOREPLACE) {
+            err = LIBRESD_ERR_EXISTS;
+        } else if (!(src.attr & LIBRESD_ATTR_DIRECTORY) && (dst.attr & LIBRESD_ATTR_DIRECTORY)) {
+            err = LIBRESD_ERR_NOT_FILE;
+        } else if ((src.attr & LIBRESD_ATTR_DIRECTORY) && !(dst.attr & LIBRESD_ATTR_DIRECTORY)) {
+            err = LIBRESD_ERR_NOT_DIR;
+        } else if (dst.attr & LIBRESD_ATTR_DIRECTORY) {
+            err = libresd_fat_rmdir(&fat, to);
+        } else {
+            err = libresd_fat_unlink(&fat, to);
+        }
+    } else if (err == LIBRESD_ERR_NOT_FOUND) {
+        err = LIBRESD_OK;
+    }
+    if (err == LIBRESD_OK) err = libresd_fat_rename(&fat, from, to);
+    return op_end(OP_RENAME, t, to_errno(err), 0);
+}
+
+static int fs_statfs(const char *path, struct statvfs *st) {
+    uint64_t t;
+    
+    (void)path;
+    memset(st, 0, sizeof(*st));
+    
+    t = op_begin();
+    st->f_bsize = fat.cluster_size;
+    st->f_frsize = fat.cluster_size;
+    st->f_blocks = fat.cluster_count;
+    st->f_bfree = libresd_fat_get_free(&fat) / fat.cluster_size;
+    st->f_bavail = st->f_bfree;
+    st->f_namemax = LIBRESD_ENABLE_LFN ? 255 : 12;
+    return op_end(OP_STATFS, t, 0, 0);
+}
+
+/* FAT has no owners or permission bits, and these keep cp -a and rsync -a going */
+static int fs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    (void)path;
+    (void)mode;
+    (void)fi;
+    return 0;
+}
+
+static int fs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+    (void)path;
+    (void)uid;
+    (void)gid;
+    (void)fi;
+    return 0;
+}
+
+static int fs_utimens(const char *path, const struct timespec tv[2],
+                      struct fuse_file_info *fi) {
+    (void)path;
+    (void)tv;
+    (void)fi;
+    return 0;
+}
+
+static const struct fuse_operations ops = {
+    .init       = fs_init,
+    .destroy    = fs_destroy,
+    .getattr    = fs_getattr,
+    .readdir    = fs_readdir,
+    .open       = fs_open,
+    .create     = fs_create,
+    .read       = fs_read,
+    .write      = fs_write,
+    .truncate   = fs_truncate,
+    .flush      = fs_flush,
+    .fsync      = fs_fsync,
+    .release    = fs_release,
+    .unlink     = fs_unlink,
+    .mkdir      = fs_mkdir,
+    .rmdir      = fs_rmdir,
+    .rename     = fs_rename,
+    .statfs     = fs_statfs,
+    .chmod      = fs_chmod,
+    .chown      = fs_chown,
+    .utimens    = fs_utimens,
+};
+
+/*============================================================================
+ * MAIN
+ *============================================================================*/
+
+int main(int argc, char **argv) {
+    const char *image;
+    libresd_err_t err;
+    int i;
+    
+    if (argc < 3 || argv[1][0] == '-') {
+        fprintf(stderr, "Usage: libresd-fuse IMAGE MOUNTPOINT [FUSE options]\n");
+        return 2;
+    }
+    image = argv[1];
+    
+    /* Mount before FUSE daemonizes, so errors reach the terminal */
+    if (!libresd_hal_image_open(image, 0)) {
+        fprintf(stderr, "libresd-fuse: %s: cannot open (size must be a multiple of 512 KB)\n",
+                image);
+        return 1;
+    }
+    err = libresd_sd_init(&sd, 25000000);
+    if (err == LIBRESD_OK) err = libresd_fat_mount(&fat, &sd);
+    if (err != LIBRESD_OK) {
+        fprintf(stderr, "libresd-fuse: %s: mount failed (error %d)\n", image, (int)err);
+        libresd_hal_image_close();
+        return 1;
+    }
+    stats_reset();                      /* Start the counters after the mount */
+    
+    /* FUSE sees the arguments without the image */
+    for (i = 1; i < argc - 1; i++) argv[i] = argv[i + 1];
+    return fuse_main(argc - 1, argv, &ops, NULL);
+}
@@ -0,0 +1,347 @@
+/**
+ * @file libresd_hal_image.c
+ * @brief LibreSD HAL Implementation over a disk image file (POSIX hosts)
+ *
+ * Every byte the driver clocks out goes through a small SD card state
+ * machine: command frames are collected and answered from a response
+ * queue, read data is queued a block at a time (as a card streams it for
+ * CMD18 until CMD12), and written blocks are stored when their CRC bytes
+ * arrive.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+
+#include "libresd_hal_image.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*============================================================================
+ * CARD STATE
+ *============================================================================*/
+
+typedef enum {
+    CARD_IDLE,                          /* Waiting for a command */
+    CARD_READ_MULTI,                    /* Streaming blocks until CMD12 */
+    CARD_WRITE_TOKEN,                   /* Waiting for a data token */
+    CARD_WRITE_DATA                     /* Collecting a block and its CRC */
+} card_state_t;
+
+static int image_fd = -1;
+static uint64_t image_size;
+static bool image_failed;
+static bool selected;
+
+static card_state_t state = CARD_IDLE;
+static bool multi_write;
+static bool app_cmd;
+static uint32_t block;                  /* Next block to read or write */
+static libresd_hal_image_stats_t stats;
+
+static uint8_t frame[6];                /* Command being received */
+static uint32_t frame_len;
+
+static uint8_t queue[3 + 512 + 2 + 16]; /* Response bytes to clock out */
+static uint32_t queue_head, queue_len;
+
+static uint8_t data[512 + 2];           /* Block being written, with CRC */
+static uint32_t data_len;
+
+/*============================================================================
+ * HELPERS
+ *============================================================================*/
+
+static void push(uint8_t b) {
+    queue[(queue_head + queue_len++) % sizeof(queue)] = b;
+}
+
+static bool pop(uint8_t *b) {
+    if (queue_len == 0) return false;
+    *b = queue[queue_head];
+    queue_head = (queue_head + 1) % sizeof(queue);
+    queue_len--;
+    return true;
+}
+
+static void push_block(const uint8_t *buf, uint32_t len) {
+    uint32_t i;
+    
+    push(0xFF);
+    push(0xFE);                         /* Start block token */
+    for (i = 0; i < len; i++) push(buf[i]);
+    push(0xFF);                         /* CRC, unchecked */
+    push(0xFF);
+}
+
+static void queue_sector(uint32_t lba) {
+    uint8_t buf[512];
+    uint64_t off = (uint64_t)lba * 512;
+    
+    stats.blocks_read++;
+    memset(buf, 0, sizeof(buf));
+    if (off + 512 <= image_size) {
+        if (pread(image_fd, buf, 512, (off_t)off) != 512) image_failed = true;
+    }
+    push_block(buf, 512);
+}
+
+static void store_sector(uint32_t lba) {
+    uint64_t off = (uint64_t)lba * 512;
+    
+    stats.blocks_written++;
+    if (off + 512 > image_size || pwrite(image_fd, data, 512, (off_t)off) != 512) {
+        image_failed = true;
+    }
+}
+
+static void command(void) {
+    uint8_t cmd = frame[0] & 0x3F;
+    uint32_t arg = ((uint32_t)frame[1] << 24) | ((uint32_t)frame[2] << 16) |
+                   ((uint32_t)frame[3] << 8) | frame[4];
+    bool was_app = app_cmd;
+    
+    queue_head = queue_len = 0;
+    push(0xFF);                         /* NCR */
+    app_cmd = false;
+    stats.commands++;
+    
+    if (was_app) {                      /* ACMD41, ACMD23: accept */
+        push(0x00);
+        return;
+    }
+    
+    switch (cmd) {
+        case 0:
+            state = CARD_IDLE;
+            push(0x01);
+            break;
+        case 8:                         /* Echo the check pattern */
+            push(0x01);
+            push(0x00); push(0x00); push(0x01); push(0xAA);
+            break;
+        case 9: {                       /* CSD version 2.0 */
+            uint8_t csd[16];
+            uint32_t c_size = (uint32_t)(image_size / (512 * 1024)) - 1;
+    
+            memset(csd, 0, sizeof(csd));
+            csd[0] = 0x40;
+            csd[7] = (c_size >> 16) & 0x3F;
+            csd[8] = (c_size >> 8) & 0xFF;
+            csd[9] = c_size & 0xFF;
+            push(0x00);
+            push_block(csd, sizeof(csd));
+            break;
+        }
+        case 10: {
+            uint8_t cid[16];
+    
+            memset(cid, 0, sizeof(cid));
+            memcpy(cid + 3, "IMAGE", 5);
+            push(0x00);
+            push_block(cid, sizeof(cid));
+            break;
+        }
+        case 12:
+            state = CARD_IDLE;
+            push(0xFF);                 /* Stuff byte */
+            push(0x00);
+            break;
+        case 17:
+            stats.read_commands++;
+            push(0x00);
+            queue_sector(arg);
+            break;
+        case 18:
+            stats.read_commands++;
+            push(0x00);
+            block = arg;
+            queue_sector(block++);
+            state = CARD_READ_MULTI;
+            break;
+        case 24:
+        case 25:
+            stats.write_commands++;
+            push(0x00);
+            block = arg;
+            multi_write = (cmd == 25);
+            state = CARD_WRITE_TOKEN;
+            break;
+        case 55:
+            push(0x00);
+            app_cmd = true;
+            break;
+        case 58:                        /* OCR: powered up, CCS (block addressing) */
+            push(0x00);
+            push(0xC0); push(0xFF); push(0x80); push(0x00);
+            break;
+        case 16:
+        case 32:
+        case 33:
+        case 38:
+            push(0x00);
+            break;
+        default:
+            push(0x04);                 /* Illegal command */
+            break;
+    }
+}
+
+static uint8_t exchange(uint8_t tx) {
+    uint8_t rx = 0xFF;
+    
+    if (!selected) return 0xFF;
+    
+    /* Command frames start with 01xxxxxx outside of data phases */
+    if (frame_len > 0 || (state != CARD_WRITE_DATA && state != CARD_WRITE_TOKEN &&
+                          (tx & 0xC0) == 0x40)) {
+        frame[frame_len++] = tx;
+        if (frame_len == sizeof(frame)) {
+            frame_len = 0;
+            command();
+        }
+        return 0xFF;
+    }
+    
+    switch (state) {
+        case CARD_WRITE_TOKEN:
+            pop(&rx);                   /* Drain what is left of R1 */
+            if (tx == 0xFE || tx == 0xFC) {
+                data_len = 0;
+                state = CARD_WRITE_DATA;
+            } else if (tx == 0xFD && multi_write) {
+                state = CARD_IDLE;      /* Stop tran: not busy */
+                queue_head = queue_len = 0;
+                push(0x00);
+                push(0xFF);
+            } else if ((tx & 0xC0) == 0x40) {
+                frame[frame_len++] = tx;
+            }
+            return rx;
+    
+        case CARD_WRITE_DATA:
+            data[data_len++] = tx;
+            if (data_len == sizeof(data)) {
+                store_sector(block++);
+                queue_head = queue_len = 0;
+                push(0xE5);             /* Data accepted */
+                push(0x00);             /* One busy byte */
+                push(0xFF);
+                state = multi_write ? CARD_WRITE_TOKEN : CARD_IDLE;
+            }
+            return 0xFF;
+    
+        default:
+            if (pop(&rx)) return rx;
+            if (state == CARD_READ_MULTI) {
+                queue_sector(block++);
+                pop(&rx);
+            }
+            return rx;
+    }
+}
+
+/*============================================================================
+ * IMAGE FILE
+ *============================================================================*/
+
+bool libresd_hal_image_open(const char *path, uint64_t size) {
+    struct stat st;
+    
+    image_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (image_fd < 0) return false;
+    
+    if (size != 0 && ftruncate(image_fd, (off_t)size) != 0) {
+        close(image_fd);
+        image_fd = -1;
+        return false;
+    }
+    if (fstat(image_fd, &st) != 0 || st.st_size < 1024 * 1024) {
+        close(image_fd);
+        image_fd = -1;
+        return false;
+    }
+    
+    image_size = (uint64_t)st.st_size & ~(uint64_t)(512 * 1024 - 1);
+    image_failed = false;
+    state = CARD_IDLE;
+    frame_len = 0;
+    queue_head = queue_len = 0;
+    memset(&stats, 0, sizeof(stats));
+    return true;
+}
+
+bool libresd_hal_image_close(void) {
+    bool ok = !image_failed;
+    
+    if (image_fd < 0) return false;
+    if (fsync(image_fd) != 0) ok = false;
+    if (close(image_fd) != 0) ok = false;
+    image_fd = -1;
+    return ok;
+}
+
+void libresd_hal_image_get_stats(libresd_hal_image_stats_t *out) {
+    if (out) *out = stats;
+}
+
+void libresd_hal_image_reset_stats(void) {
+    memset(&stats, 0, sizeof(stats));
+}
+
+/*============================================================================
+ * HAL INTERFACE
+ *============================================================================*/
+
+void libresd_hal_spi_init(uint32_t speed_hz) {
+    (void)speed_hz;
+}
+
+uint8_t libresd_hal_spi_transfer(uint8_t tx_byte) {
+    return exchange(tx_byte);
+}
+
+void libresd_hal_spi_transfer_bulk(const uint8_t *tx, uint8_t *rx, uint32_t len) {
+    uint32_t i;
+    
+    for (i = 0; i < len; i++) {
+        uint8_t b = exchange(tx ? tx[i] : 0xFF);
+        if (rx) rx[i] = b;
+    }
+}
+
+void libresd_hal_cs_low(void) {
+    selected = true;
+}
+
+void libresd_hal_cs_high(void) {
+    selected = false;
+    frame_len = 0;
+}
+
+void libresd_hal_delay_ms(uint32_t ms) {
+    (void)ms;                           /* The image is always ready */
+}
+
+uint32_t libresd_hal_get_ms(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void libresd_hal_get_datetime(libresd_datetime_t *dt) {
+    time_t now = time(NULL);
+    struct tm tm;
+    
+    if (!dt) return;
+    localtime_r(&now, &tm);
+    dt->year = (uint16_t)(tm.tm_year + 1900);
+    dt->month = (uint8_t)(tm.tm_mon + 1);
+    dt->day = (uint8_t)tm.tm_mday;
+    dt->hour = (uint8_t)tm.tm_hour;
+    dt->minute = (uint8_t)tm.tm_min;
+    dt->second = (uint8_t)tm.tm_sec;
+}
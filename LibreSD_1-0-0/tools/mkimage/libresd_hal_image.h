@@ -0,0 +1,63 @@
+/**
+ * @file libresd_hal_image.h
+ * @brief LibreSD HAL backed by a disk image file (host builds)
+ *
+ * Emulates an SDHC card in SPI mode on top of a regular file, so the
+ * unmodified library (SD driver included) can build and check card images
+ * on a PC. Only the commands the driver issues are implemented; CRCs are
+ * not checked.
+ *
+ * The image size must be a multiple of 512 KB (the CSD capacity unit).
+ */
+
+#ifndef LIBRESD_HAL_IMAGE_H
+#define LIBRESD_HAL_IMAGE_H
+
+#include "libresd_hal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Card traffic seen by the emulated card
+ */
+typedef struct {
+    uint64_t        commands;           /**< Command frames received */
+    uint64_t        read_commands;      /**< CMD17 and CMD18 */
+    uint64_t        write_commands;     /**< CMD24 and CMD25 */
+    uint64_t        blocks_read;        /**< Blocks sent to the host */
+    uint64_t        blocks_written;     /**< Blocks stored */
+} libresd_hal_image_stats_t;
+
+/**
+ * @brief Attach the emulated card to an image file
+ *
+ * @param path Image file
+ * @param size Bytes to create or resize it to (0 = use the file as is)
+ * @return true on success
+ */
+bool libresd_hal_image_open(const char *path, uint64_t size);
+
+/**
+ * @brief Flush and detach the image
+ *
+ * @return true if every write reached the file
+ */
+bool libresd_hal_image_close(void);
+
+/**
+ * @brief Get the traffic counters (since open or the last reset)
+ */
+void libresd_hal_image_get_stats(libresd_hal_image_stats_t *stats);
+
+/**
+ * @brief Zero the traffic counters
+ */
+void libresd_hal_image_reset_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBRESD_HAL_IMAGE_H */
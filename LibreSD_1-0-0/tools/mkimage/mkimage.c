@@ -0,0 +1,703 @@
+/**
+ * @file mkimage.c
+ * @brief Build a FAT card image from a directory tree (host tool)
+ *
+ * Usage: libresd-mkimage -o IMAGE -s SIZE [options] SOURCE_DIR
+ *
+ * The image is formatted and filled through the library itself, over the
+ * image-file HAL, so what the firmware later mounts is exactly what the
+ * library writes. The layout is planned for reading:
+ *
+ *   - directories come first, each presized for its entries so it is one
+ *     contiguous run and never needs to grow
+ *   - files follow in access-list order (then tree order), each in one
+ *     contiguous run placed right after the previous one
+ *   - files of at least one AU start on an AU boundary
+ *   - the FAT32 FSInfo sector carries the final free count and hint
+ *
+ * Reader threads load source files ahead of the writer into a ring of
+ * chunk buffers; the writer stores them in placement order.
+ *
+ * Names that are not 8.3 get long file name entries (as the library writes
+ * them), unless LFN support is configured out. Names that only differ in
+ * case clash, as they would on the card.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+
+#include "libresd.h"
+#include "libresd_hal_image.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE          (1024 * 1024)   /* Bytes per reader job */
+#define DEFAULT_THREADS     4
+#define DEFAULT_AU          (4 * 1024 * 1024)
+#define NOT_LISTED          INT_MAX
+
+/*============================================================================
+ * SOURCE TREE
+ *============================================================================*/
+
+/**
+ * @brief One file or directory of the source tree
+ */
+typedef struct {
+    char           *src;                /* Host path */
+    char           *dst;                /* Image path */
+    uint64_t        size;
+    bool            is_dir;
+    uint32_t        entries;            /* Directories: entries it will hold */
+    uint32_t        longest;            /* Directories: largest entry set of a child */
+    int             order;              /* Access list line (NOT_LISTED = none) */
+    uint32_t        seq;                /* Tree order */
+    uint32_t        target;             /* Planned first cluster */
+} node_t;
+
+static node_t *nodes;
+static uint32_t node_count, node_cap;
+static bool quiet;
+
+static void die(const char *fmt, ...) {
+    va_list ap;
+    
+    va_start(ap, fmt);
+    fprintf(stderr, "libresd-mkimage: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+static void note(const char *fmt, ...) {
+    va_list ap;
+    
+    if (quiet) return;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+static char *dup_printf(const char *fmt, ...) {
+    va_list ap;
+    char *s;
+    int n;
+    
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    s = malloc((size_t)n + 1);
+    if (!s) die("out of memory");
+    va_start(ap, fmt);
+    vsnprintf(s, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    return s;
+}
+
+/**
+ * @brief Name fits an 8.3 directory entry as is
+ */
+static bool valid_83(const char *name) {
+    const char *dot = strchr(name, '.');
+    size_t base = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+    const char *p;
+    
+    if (base == 0 || base > 8 || ext > 3 || (dot && (ext == 0 || strchr(dot + 1, '.')))) {
+        return false;
+    }
+    for (p = name; *p; p++) {
+        if (p == dot) continue;
+        if (!isalnum((unsigned char)*p) && !strchr("!#$%&'()-@^_`{}~", *p)) return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Directory entries name takes, 0 if the library would refuse it
+ */
+static uint32_t name_entries(const char *name) {
+    size_t len = strlen(name);
+    const char *p;
+    
+    if (valid_83(name)) return 1;
+#if LIBRESD_ENABLE_LFN
+    if (len >= LIBRESD_MAX_FILENAME || name[len - 1] == '.' || name[len - 1] == ' ') return 0;
+    for (p = name; *p; p++) {
+        if ((unsigned char)*p < 0x20 || (unsigned char)*p >= 0x7F) return 0;
+        if (strchr("\"*/:<>?\\|", *p)) return 0;
+    }
+    return 1 + (uint32_t)(len + 12) / 13;
+#else
+    (void)len;
+    (void)p;
+    return 0;
+#endif
+}
+
+static uint32_t add_node(const char *src, const char *dst, uint64_t size, bool is_dir) {
+    node_t *n;
+    
+    if (node_count == node_cap) {
+        node_cap = node_cap ? node_cap * 2 : 256;
+        nodes = realloc(nodes, node_cap * sizeof(node_t));
+        if (!nodes) die("out of memory");
+    }
+    n = &nodes[node_count];
+    memset(n, 0, sizeof(*n));
+    n->src = dup_printf("%s", src);
+    n->dst = dup_printf("%s", dst);
+    n->size = size;
+    n->is_dir = is_dir;
+    n->entries = is_dir ? 2 : 0;        /* "." and ".." */
+    n->order = NOT_LISTED;
+    n->seq = node_count;
+    return node_count++;
+}
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int cmp_str_nocase(const void *a, const void *b) {
+    return strcasecmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief Add a directory's contents, sorted by name, depth first
+ *
+ * @param longest Output: largest entry set among the contents
+ * @return Entries the directory needs
+ */
+static uint32_t scan(const char *src, const char *dst, uint32_t *longest) {
+    DIR *d = opendir(src);
+    struct dirent *de;
+    char **names = NULL;
+    size_t count = 0, cap = 0, i;
+    uint32_t entries = 0, set;
+    
+    *longest = 1;
+    if (!d) die("%s: %s", src, strerror(errno));
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 32;
+            names = realloc(names, cap * sizeof(char *));
+            if (!names) die("out of memory");
+        }
+        names[count++] = dup_printf("%s", de->d_name);
+    }
+    closedir(d);
+    if (count > 1) qsort(names, count, sizeof(char *), cmp_str);
+    
+    for (i = 0; i < count; i++) {
+        char *s = dup_printf("%s/%s", src, names[i]);
+        char *t = dup_printf("%s/%s", strcmp(dst, "/") == 0 ? "" : dst, names[i]);
+        struct stat st;
+    
+        set = name_entries(names[i]);
+        if (stat(s, &st) != 0) die("%s: %s", s, strerror(errno));
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            note("skipping %s (not a regular file)\n", s);
+        } else if (set == 0) {
+            die("%s: name not allowed on the card", s);
+        } else if (strlen(t) >= LIBRESD_MAX_PATH) {
+            die("%s: path too long", s);
+        } else if (S_ISDIR(st.st_mode)) {
+            uint32_t idx = add_node(s, t, 0, true);
+    
+            nodes[idx].entries += scan(s, t, &nodes[idx].longest);
+            entries += set;
+        } else {
+            if ((uint64_t)st.st_size > 0xFFFFFFFFULL) die("%s: larger than 4 GB", s);
+            add_node(s, t, (uint64_t)st.st_size, false);
+            entries += set;
+        }
+        if (set > *longest) *longest = set;
+        free(s);
+        free(t);
+        free(names[i]);
+    }
+    free(names);
+    return entries;
+}
+
+/**
+ * @brief Reject names that only differ in case
+ */
+static void check_duplicates(void) {
+    char **names = malloc((node_count + 1) * sizeof(char *));
+    uint32_t i;
+    
+    if (!names) die("out of memory");
+    for (i = 0; i < node_count; i++) names[i] = nodes[i].dst;
+    qsort(names, node_count, sizeof(char *), cmp_str_nocase);
+    for (i = 1; i < node_count; i++) {
+        if (strcasecmp(names[i - 1], names[i]) == 0) die("%s: name clash in the image", names[i]);
+    }
+    free(names);
+}
+
+/**
+ * @brief Number the files named in the access list, one path per line
+ */
+static void read_access_list(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[LIBRESD_MAX_PATH + 2];
+    int lineno = 0;
+    
+    if (!f) die("%s: %s", path, strerror(errno));
+    while (fgets(line, sizeof(line), f)) {
+        char want[LIBRESD_MAX_PATH + 2];
+        char *p = line, *end;
+        uint32_t i;
+    
+        lineno++;
+        while (isspace((unsigned char)*p)) p++;
+        end = p + strlen(p);
+        while (end > p && isspace((unsigned char)end[-1])) *--end = '\0';
+        if (*p == '\0' || *p == '#') continue;
+    
+        snprintf(want, sizeof(want), "%s%s", *p == '/' ? "" : "/", p);
+    
+        for (i = 0; i < node_count; i++) {
+            if (!nodes[i].is_dir && strcasecmp(nodes[i].dst, want) == 0) break;
+        }
+        if (i == node_count) {
+            note("%s:%d: %s is not in the tree\n", path, lineno, want);
+        } else if (nodes[i].order == NOT_LISTED) {
+            nodes[i].order = lineno;
+        }
+    }
+    fclose(f);
+}
+
+static int cmp_placement(const void *a, const void *b) {
+    const node_t *x = &nodes[*(const uint32_t *)a];
+    const node_t *y = &nodes[*(const uint32_t *)b];
+    
+    if (x->order != y->order) return x->order < y->order ? -1 : 1;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+/*============================================================================
+ * READER THREADS
+ *============================================================================*/
+
+/**
+ * @brief A piece of a source file
+ */
+typedef struct {
+    uint32_t        node;
+    uint64_t        offset;
+    uint32_t        len;
+} job_t;
+
+typedef enum { SLOT_EMPTY, SLOT_FILLING, SLOT_READY } slot_state_t;
+
+/**
+ * @brief Ring buffer entry, holding job seq % slot_count
+ */
+typedef struct {
+    slot_state_t    state;
+    uint32_t        seq;
+    bool            failed;
+    uint8_t        *buf;
+} slot_t;
+
+static job_t *jobs;
+static uint32_t job_count;
+static uint32_t next_job;
+static uint32_t consumed;               /* Jobs the writer has released */
+static slot_t *slots;
+static uint32_t slot_count;
+static bool aborting;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+
+static bool read_job(const job_t *j, uint8_t *buf) {
+    int fd = open(nodes[j->node].src, O_RDONLY);
+    uint32_t done = 0;
+    
+    if (fd < 0) return false;
+    while (done < j->len) {
+        ssize_t n = pread(fd, buf + done, j->len - done, (off_t)(j->offset + done));
+    
+        if (n <= 0) break;
+        done += (uint32_t)n;
+    }
+    close(fd);
+    return done == j->len;
+}
+
+static void *reader(void *arg) {
+    (void)arg;
+    
+    for (;;) {
+        uint32_t seq;
+        slot_t *s;
+        bool ok;
+    
+        pthread_mutex_lock(&ring_lock);
+        if (next_job == job_count || aborting) {
+            pthread_mutex_unlock(&ring_lock);
+            return NULL;
+        }
+        seq = next_job++;
+        s = &slots[seq % slot_count];
+        /* The slot still holds an older job until the writer is done with it;
+         * waiting on the count, not the state, keeps a later job that maps to
+         * the same slot from taking it first */
+        while (seq >= consumed + slot_count && !aborting) pthread_cond_wait(&ring_cond, &ring_lock);
+        if (aborting) {
+            pthread_mutex_unlock(&ring_lock);
+            return NULL;
+        }
+        s->state = SLOT_FILLING;
+        s->seq = seq;
+        pthread_mutex_unlock(&ring_lock);
+    
+        ok = read_job(&jobs[seq], s->buf);
+    
+        pthread_mutex_lock(&ring_lock);
+        s->failed = !ok;
+        s->state = SLOT_READY;
+        pthread_cond_broadcast(&ring_cond);
+        pthread_mutex_unlock(&ring_lock);
+    }
+}
+
+static slot_t *wait_job(uint32_t seq) {
+    slot_t *s = &slots[seq % slot_count];
+    
+    pthread_mutex_lock(&ring_lock);
+    while (!(s->state == SLOT_READY && s->seq == seq)) pthread_cond_wait(&ring_cond, &ring_lock);
+    pthread_mutex_unlock(&ring_lock);
+    return s;
+}
+
+static void release_job(slot_t *s) {
+    pthread_mutex_lock(&ring_lock);
+    s->state = SLOT_EMPTY;
+    consumed++;
+    pthread_cond_broadcast(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static void stop_readers(void) {
+    pthread_mutex_lock(&ring_lock);
+    aborting = true;
+    pthread_cond_broadcast(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+}
+
+/*============================================================================
+ * IMAGE
+ *============================================================================*/
+
+static libresd_sd_t sd;
+static libresd_fat_t fat;
+
+static uint32_t div_up(uint64_t a, uint32_t b) {
+    return (uint32_t)((a + b - 1) / b);
+}
+
+static void zero_clusters(uint32_t first, uint32_t count) {
+    static uint8_t zero[64 * 1024];
+    uint32_t sector = libresd_fat_cluster_to_sector(&fat, first);
+    uint32_t left = count * fat.sectors_per_cluster;
+    
+    while (left > 0) {
+        uint32_t n = left < sizeof(zero) / 512 ? left : sizeof(zero) / 512;
+    
+        if (libresd_sd_write_sectors(&sd, sector, zero, n) != LIBRESD_OK) die("write failed");
+        sector += n;
+        left -= n;
+    }
+}
+
+/**
+ * @brief Grow the fresh FAT32 root to hold its entries without chaining
+ *        (subdirectories are presized by libresd_fat_mkdir_ex)
+ */
+static void presize_dir(uint32_t first, uint32_t entries) {
+    uint32_t need = div_up((uint64_t)entries * 32, fat.cluster_size);
+    uint32_t extra;
+    
+    if (need <= 1) return;
+    extra = need - 1;
+    if (libresd_fat_alloc_contiguous(&fat, first, extra) != first + 1) {
+        die("no room to presize a directory");
+    }
+    zero_clusters(first + 1, extra);
+}
+
+/**
+ * @brief Entries to reserve so the sets fit: a long name set is never split
+ *        across clusters, so each cluster may leave up to longest - 1 unused
+ */
+static uint32_t dir_reserve(uint32_t entries, uint32_t longest) {
+    uint32_t per = fat.cluster_size / 32;
+    
+    if (longest <= 1 || longest > per) return entries;
+    return div_up(entries, per - (longest - 1)) * per;
+}
+
+/**
+ * @brief First cluster at or after c whose sector starts an AU
+ */
+static uint32_t align_cluster(uint32_t c, uint32_t au_sectors) {
+    while ((libresd_fat_cluster_to_sector(&fat, c) - (fat.fat_start_sector - fat.reserved_sectors))
+           % au_sectors != 0) {
+        c++;
+    }
+    return c;
+}
+
+static void usage(void) {
+    printf("Usage: libresd-mkimage -o IMAGE -s SIZE [options] SOURCE_DIR\n"
+           "  -o IMAGE     image file to write\n"
+           "  -s SIZE      image size (K, M or G suffix; rounded up to 1 MB)\n"
+           "  -l LABEL     volume label\n"
+           "  -a FILE      access list: image paths in the order they are read\n"
+           "  -c BYTES     cluster size (default: by size, as the SD formatter)\n"
+           "  -u BYTES     allocation unit for alignment (default 4M)\n"
+           "  -t TYPE      fat12, fat16 or fat32 (default: by cluster count)\n"
+           "  -S BYTES     logical sector size, 512 to 4096 (default 512)\n"
+           "  -n           no partition table\n"
+           "  -j N         reader threads (default %d)\n"
+           "  -k           run a consistency check on the result\n"
+           "  -q           quiet\n", DEFAULT_THREADS);
+}
+
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 0);
+    
+    switch (toupper((unsigned char)*end)) {
+        case 'G': v *= 1024;    /* fall through */
+        case 'M': v *= 1024;    /* fall through */
+        case 'K': v *= 1024; end++; break;
+        case '\0': break;
+        default: die("bad size: %s", s);
+    }
+    if (*end) die("bad size: %s", s);
+    return v;
+}
+
+int main(int argc, char **argv) {
+    const char *image = NULL, *access = NULL, *src;
+    uint64_t size = 0, au = DEFAULT_AU, bytes = 0;
+    uint32_t threads = DEFAULT_THREADS, files = 0, dirs = 0, fragmented = 0, misplaced = 0;
+    uint32_t *order, i, j, root_entries, root_longest, cursor, au_sectors, seq;
+    libresd_format_t fmt;
+    pthread_t *pool;
+    bool check = false;
+    int opt;
+    
+    memset(&fmt, 0, sizeof(fmt));
+    while ((opt = getopt(argc, argv, "o:s:l:a:c:u:t:S:nj:kqh")) != -1) {
+        switch (opt) {
+            case 'o': image = optarg; break;
+            case 's': size = parse_size(optarg); break;
+            case 'l': fmt.label = optarg; break;
+            case 'a': access = optarg; break;
+            case 'c': fmt.cluster_size = (uint32_t)parse_size(optarg); break;
+            case 'u': au = parse_size(optarg); break;
+            case 't':
+                if (strcmp(optarg, "fat12") == 0) fmt.fs_type = LIBRESD_FS_FAT12;
+                else if (strcmp(optarg, "fat16") == 0) fmt.fs_type = LIBRESD_FS_FAT16;
+                else if (strcmp(optarg, "fat32") == 0) fmt.fs_type = LIBRESD_FS_FAT32;
+                else die("bad type: %s", optarg);
+                break;
+            case 'S': fmt.sector_size = (uint16_t)parse_size(optarg); break;
+            case 'n': fmt.no_partition = true; break;
+            case 'j': threads = (uint32_t)atoi(optarg); break;
+            case 'k': check = true; break;
+            case 'q': quiet = true; break;
+            case 'h': usage(); return 0;
+            default: usage(); return 2;
+        }
+    }
+    if (!image || size == 0 || optind != argc - 1) {
+        usage();
+        return 2;
+    }
+    if (au < 512 || au % 512 || (au & (au - 1))) die("bad allocation unit");
+    if (threads == 0) threads = 1;
+    src = argv[optind];
+    size = (size + 1024 * 1024 - 1) & ~(uint64_t)(1024 * 1024 - 1);
+    fmt.align = (uint32_t)au;
+    au_sectors = (uint32_t)(au / 512);
+    
+    /* Tree and placement order */
+    root_entries = 1 + scan(src, "/", &root_longest);   /* Entries plus the volume label */
+    check_duplicates();
+    if (access) read_access_list(access);
+    
+    order = malloc((node_count + 1) * sizeof(uint32_t));
+    if (!order) die("out of memory");
+    for (i = j = 0; i < node_count; i++) {
+        if (!nodes[i].is_dir) order[j++] = i;
+    }
+    files = j;
+    dirs = node_count - files;
+    qsort(order, files, sizeof(uint32_t), cmp_placement);
+    fmt.root_entries = (uint16_t)(root_entries < 512 ? 512 : (root_entries + 15) & ~15U);
+    
+    /* Format and mount the image */
+    unlink(image);
+    if (!libresd_hal_image_open(image, size)) die("%s: cannot create", image);
+    if (libresd_sd_init(&sd, 25000000) != LIBRESD_OK) die("image HAL failed");
+    if (libresd_fat_format_ex(&sd, &fmt) != LIBRESD_OK) die("cannot format: size and options do not fit");
+    if (libresd_fat_mount(&fat, &sd) != LIBRESD_OK) die("cannot mount the fresh image");
+    if (fat.fs_type != LIBRESD_FS_FAT32 && root_entries > fat.root_entry_count) {
+        die("too many entries in the root directory");
+    }
+    note("%s: %s, %lu clusters of %lu bytes\n", image,
+         fat.fs_type == LIBRESD_FS_FAT12 ? "FAT12" :
+         fat.fs_type == LIBRESD_FS_FAT16 ? "FAT16" : "FAT32",
+         (unsigned long)fat.cluster_count, (unsigned long)fat.cluster_size);
+    
+    /* Directories first, packed behind the root, each in one run */
+    fat.last_alloc_cluster = 2;
+    if (fat.fs_type == LIBRESD_FS_FAT32) {
+        presize_dir(fat.root_cluster, dir_reserve(root_entries, root_longest));
+    }
+    for (i = 0; i < node_count; i++) {
+        if (!nodes[i].is_dir) continue;
+        if (libresd_fat_mkdir_ex(&fat, nodes[i].dst,
+                                 dir_reserve(nodes[i].entries, nodes[i].longest) - 2) !=
+            LIBRESD_OK) {
+            die("%s: cannot create directory", nodes[i].dst);
+        }
+    }
+    
+    /* Plan each file's run */
+    cursor = fat.last_alloc_cluster + 1;
+    for (i = 0; i < files; i++) {
+        node_t *n = &nodes[order[i]];
+    
+        if (n->size == 0) continue;
+        if (n->size >= au) cursor = align_cluster(cursor, au_sectors);
+        n->target = cursor;
+        cursor += div_up(n->size, fat.cluster_size);
+        if (cursor > fat.cluster_count + 2) die("image too small for the tree");
+    }
+    
+    /* Reader jobs in placement order */
+    for (i = 0; i < files; i++) job_count += div_up(nodes[order[i]].size, CHUNK_SIZE);
+    jobs = calloc(job_count + 1, sizeof(job_t));
+    slot_count = threads * 2;
+    slots = calloc(slot_count, sizeof(slot_t));
+    pool = calloc(threads, sizeof(pthread_t));
+    if (!jobs || !slots || !pool) die("out of memory");
+    for (i = 0, seq = 0; i < files; i++) {
+        node_t *n = &nodes[order[i]];
+        uint64_t off;
+    
+        for (off = 0; off < n->size; off += CHUNK_SIZE) {
+            jobs[seq].node = order[i];
+            jobs[seq].offset = off;
+            jobs[seq].len = (uint32_t)(n->size - off < CHUNK_SIZE ? n->size - off : CHUNK_SIZE);
+            seq++;
+        }
+    }
+    for (i = 0; i < slot_count; i++) {
+        slots[i].buf = malloc(CHUNK_SIZE);
+        if (!slots[i].buf) die("out of memory");
+    }
+    for (i = 0; i < threads; i++) pthread_create(&pool[i], NULL, reader, NULL);
+    
+    /* Write the files */
+    for (i = 0, seq = 0; i < files; i++) {
+        node_t *n = &nodes[order[i]];
+        libresd_file_t f;
+        uint32_t runs = 0;
+    
+        if (n->target) fat.last_alloc_cluster = n->target - 1;
+        if (libresd_fat_open(&fat, &f, n->dst, LIBRESD_WRITE | LIBRESD_CREATE | LIBRESD_TRUNCATE)
+            != LIBRESD_OK) {
+            stop_readers();
+            die("%s: cannot create", n->dst);
+        }
+        if (n->size > 0 && libresd_fat_preallocate(&fat, &f, (uint32_t)n->size) != LIBRESD_OK) {
+            stop_readers();
+            die("%s: no space", n->dst);
+        }
+    
+        for (; seq < job_count && jobs[seq].node == order[i]; seq++) {
+            slot_t *s = wait_job(seq);
+            uint32_t written;
+    
+            if (s->failed) {
+                stop_readers();
+                die("%s: read error", n->src);
+            }
+            if (libresd_fat_write(&fat, &f, s->buf, jobs[seq].len, &written) != LIBRESD_OK ||
+                written != jobs[seq].len) {
+                stop_readers();
+                die("%s: write failed", n->dst);
+            }
+            release_job(s);
+        }
+    
+        if (n->size > 0) {
+            if (f.first_cluster != n->target) misplaced++;
+            libresd_fat_chain_extents(&fat, f.first_cluster, div_up(n->size, 512), NULL, 0, &runs);
+            if (runs > 1) fragmented++;
+        }
+        if (libresd_fat_close(&fat, &f) != LIBRESD_OK) die("%s: close failed", n->dst);
+        bytes += n->size;
+    }
+    for (i = 0; i < threads; i++) pthread_join(pool[i], NULL);
+    free(pool);
+    free(order);
+    
+    /* Free count for FSInfo: the allocator tracked it from the format on */
+    if (fat.free_clusters == 0xFFFFFFFF) libresd_fat_get_free(&fat);
+    if (libresd_fat_sync(&fat) != LIBRESD_OK || libresd_fat_update_fsinfo(&fat) != LIBRESD_OK) {
+        die("cannot finish the FAT");
+    }
+    
+    note("%lu files (%llu bytes), %lu directories, %lu clusters free\n",
+         (unsigned long)files, (unsigned long long)bytes, (unsigned long)dirs,
+         (unsigned long)fat.free_clusters);
+    if (fragmented || misplaced) {
+        note("warning: %lu files fragmented, %lu not where planned\n",
+             (unsigned long)fragmented, (unsigned long)misplaced);
+    }
+    
+#if LIBRESD_ENABLE_CHECK
+    if (check) {
+        static uint8_t work[256 * 1024];
+        libresd_check_t r;
+    
+        if (libresd_fat_check(&fat, 0, work, sizeof(work), &r) != LIBRESD_OK ||
+            r.lost_clusters || r.cross_links || r.bad_chains || r.size_mismatches ||
+            (r.fsinfo_free != 0xFFFFFFFF && r.fsinfo_free != r.free_clusters)) {
+            die("consistency check failed");
+        }
+        note("check: clean\n");
+    }
+#else
+    (void)check;
+#endif
+    
+    libresd_fat_unmount(&fat);
+    if (!libresd_hal_image_close()) die("%s: write error", image);
+    return 0;
+}
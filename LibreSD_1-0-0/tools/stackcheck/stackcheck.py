@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""
+Worst-case stack depth of the LibreSD public calls.
+
+Compile the library with GCC's call graph dump (GCC 10 or later), then
+point this script at the .ci files (or at the objects they sit next to):
+
+    gcc -Os -fcallgraph-info=su -Iinclude -c src/*.c
+    python3 tools/stackcheck/stackcheck.py *.ci
+    python3 tools/stackcheck/stackcheck.py --limit 1024 *.ci
+    python3 tools/stackcheck/stackcheck.py --markdown *.ci > table.md
+
+Use the target's compiler and flags for real numbers (arm-none-eabi-gcc
+-mcpu=cortex-m0plus -Os for the RP2040); the host compiler gives a close
+upper bound for 32-bit targets. Each libresd_* function is listed with the
+deepest chain under it. HAL functions, libc and calls through function
+pointers (shell callbacks, sinks) are outside the graph and count as 0;
+add what your port's HAL and callbacks use. With --limit, exits 1 if any
+call exceeds it. tests/CMakeLists.txt runs it that way under CTest.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+NODE = re.compile(r'node: \{ title: "([^"]+)" label: "([^"]*)"')
+EDGE = re.compile(r'edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"')
+SIZE = re.compile(r'\\n(\d+) bytes \((\w+(?:,\w+)?)\)')
+
+
+def graph_file(path):
+    """GCC writes the graph of x.o to x.ci"""
+    root, ext = os.path.splitext(path)
+    return root + ".ci" if ext in (".o", ".obj") else path
+
+
+def load(paths):
+    frame, kind, calls = {}, {}, {}
+    for path in paths:
+        with open(graph_file(path)) as f:
+            for line in f:
+                m = NODE.search(line)
+                if m:
+                    s = SIZE.search(m.group(2))
+                    if s:
+                        frame[m.group(1)] = int(s.group(1))
+                        kind[m.group(1)] = s.group(2)
+                    continue
+                m = EDGE.search(line)
+                if m:
+                    calls.setdefault(m.group(1), set()).add(m.group(2))
+    return frame, kind, calls
+
+
+def depth(fn, frame, calls, memo, active):
+    """Deepest stack under fn and the chain that reaches it"""
+    if fn in memo:
+        return memo[fn]
+    if fn in active:
+        return 0, [fn + " (recursion)"]
+    active.add(fn)
+    best, chain = 0, []
+    for callee in calls.get(fn, ()):
+        d, c = depth(callee, frame, calls, memo, active)
+        if d > best:
+            best, chain = d, c
+    active.discard(fn)
+    memo[fn] = (frame.get(fn, 0) + best, [fn] + chain)
+    return memo[fn]
+
+
+def short(name):
+    return name.rsplit(":", 1)[-1]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("ci", nargs="+", help=".ci files from -fcallgraph-info=su, or their objects")
+    ap.add_argument("--limit", type=int, help="fail if any public call needs more bytes")
+    ap.add_argument("--chain", action="store_true", help="show the deepest call chain")
+    ap.add_argument("--markdown", action="store_true", help="print a table, deepest first")
+    args = ap.parse_args()
+
+    frame, kind, calls = load(args.ci)
+    memo = {}
+    worst = 0
+    public = sorted(f for f in frame if f.startswith("libresd_"))
+    if args.markdown:
+        print("| Call | Bytes |")
+        print("|------|------:|")
+        for d, fn in sorted(((-depth(f, frame, calls, memo, set())[0], f) for f in public)):
+            print("| `%s` | %d |" % (fn, -d))
+        return 0
+
+    for fn in public:
+        d, chain = depth(fn, frame, calls, memo, set())
+        worst = max(worst, d)
+        flag = "" if kind[fn] == "static" else "  (" + kind[fn] + ")"
+        over = "  OVER" if args.limit and d > args.limit else ""
+        print("%6d  %s%s%s" % (d, fn, flag, over))
+        if args.chain:
+            print("        " + " > ".join(short(c) for c in chain if c in frame))
+
+    if args.limit and worst > args.limit:
+        print("worst case %d bytes exceeds the %d byte limit" % (worst, args.limit))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())